@@ -0,0 +1,384 @@
+/**
+ * @file announcer.c
+ * @brief Implementation file for announcing a torrent to all of its trackers at once in C.
+*/
+#include "announcer.h"
+#include "peer.h"
+#include "log.h"
+#include "metrics.h"
+
+// the number of slots the set of seen peers starts with, a power of two.
+#define ANNOUNCER_SEEN_MIN_CAPACITY 64
+
+/**
+ * @brief start an announce to a single tracker.
+ * @param announcer The announcer
+ * @param tracker The tracker, idle
+ * @param now The current time, from peer_now
+ * @return void
+*/
+void announcer_start_tracker(Announcer *announcer, AnnouncerTracker *tracker, double now);
+
+/**
+ * @brief handle an announce that completed, successfully or not.
+ * @param announcer The announcer
+ * @param tracker The tracker
+ * @param error Why the transfer failed, NULL if it went through
+ * @return void
+*/
+void announcer_finish_tracker(Announcer *announcer, AnnouncerTracker *tracker, const char *error);
+
+/**
+ * @brief move the udp announces in flight along, or only find out how long they may be waited on.
+ * @param announcer The announcer
+ * @param now The current time, from peer_now
+ * @param timeout_ms The longest the caller means to wait, lowered to the earliest retransmit
+ * @param advance Whether to advance the announces, or only fill in the sockets to wait on
+ * @return unsigned the number of sockets to wait on, in announcer->waits
+*/
+unsigned announcer_poll_udp(Announcer *announcer, double now, int *timeout_ms, bool advance);
+
+/**
+ * @brief get what the next announce to a tracker reports.
+ * @param announcer The announcer
+ * @param tracker The tracker
+ * @return AnnounceStats the stats of the transfer, with the started event until the tracker answered once
+*/
+AnnounceStats announcer_stats(Announcer *announcer, AnnouncerTracker *tracker);
+
+/**
+ * @brief hash the address of a peer, for the set of seen peers.
+ * @param peer The peer, its unused bytes zeroed
+ * @return size_t the hash
+*/
+size_t announcer_hash_peer(const Peer *peer);
+
+/**
+ * @brief add a peer to the list unless it is already in it.
+ * @param announcer The announcer
+ * @param peer The peer
+ * @return int 0 if it was added or already known, -1 if memory ran out
+*/
+int announcer_add_peer(Announcer *announcer, const Peer *peer);
+
+/**
+ * @brief grow the set of seen peers to a new capacity and put every known peer back in.
+ * @param announcer The announcer
+ * @param capacity The new capacity, a power of two
+ * @return int 0, or -1 if memory ran out
+*/
+int announcer_grow_seen(Announcer *announcer, size_t capacity);
+
+Announcer *announcer_new(Torrent *torrent)
+{
+    Announcer *announcer = calloc(1, sizeof(Announcer));
+    if (announcer == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for announcer\n");
+        return NULL;
+    }
+    announcer->torrent = torrent;
+    announcer->stats.left = torrent->file->file_size;
+    announcer->count = torrent->tracker_count;
+    announcer->trackers = calloc(announcer->count > 0 ? announcer->count : 1, sizeof(AnnouncerTracker));
+    announcer->waits = calloc(announcer->count > 0 ? announcer->count : 1, sizeof(struct curl_waitfd));
+    announcer->multi = curl_multi_init();
+    announcer->share = curl_share_init();
+    if (announcer->trackers == NULL || announcer->waits == NULL || announcer->multi == NULL || announcer->share == NULL ||
+        announcer_grow_seen(announcer, ANNOUNCER_SEEN_MIN_CAPACITY) != 0)
+    {
+        fprintf(stderr, "ERR: failed to set up announcer\n");
+        announcer_free(announcer);
+        return NULL;
+    }
+
+    // every easy handle in the multi already shares its connections, the share handle adds what
+    // outlives a single transfer. the announcer is single threaded, so nothing needs locking.
+    curl_share_setopt(announcer->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(announcer->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    for (size_t i = 0; i < announcer->count; i++)
+    {
+        AnnouncerTracker *tracker = &announcer->trackers[i];
+        tracker->tracker = &torrent->trackers[i];
+        tracker->udp.socket = -1;
+        if (udp_tracker_is_udp((const char *)tracker->tracker->url->chars, tracker->tracker->url->size))
+        {
+            tracker->over_udp = true;
+            continue;
+        }
+
+        tracker->easy = curl_easy_init();
+        if (tracker->easy == NULL || announce_template_init(&tracker->url, torrent, tracker->tracker->url) != 0)
+        {
+            fprintf(stderr, "ERR: failed to set up announcer\n");
+            announcer_free(announcer);
+            return NULL;
+        }
+        curl_easy_setopt(tracker->easy, CURLOPT_SHARE, announcer->share);
+        curl_easy_setopt(tracker->easy, CURLOPT_WRITEFUNCTION, tracker_response_write);
+        curl_easy_setopt(tracker->easy, CURLOPT_TIMEOUT, (long)ANNOUNCER_TIMEOUT);
+        curl_easy_setopt(tracker->easy, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(tracker->easy, CURLOPT_PRIVATE, tracker);
+    }
+    return announcer;
+}
+
+void announcer_free(Announcer *announcer)
+{
+    for (size_t i = 0; announcer->trackers != NULL && i < announcer->count; i++)
+    {
+        AnnouncerTracker *tracker = &announcer->trackers[i];
+        if (tracker->response != NULL)
+        {
+            if (!tracker->over_udp)
+                curl_multi_remove_handle(announcer->multi, tracker->easy);
+            tracker_response_free(tracker->response);
+        }
+        if (tracker->easy != NULL)
+            curl_easy_cleanup(tracker->easy);
+        announce_template_free(&tracker->url);
+        udp_tracker_close(&tracker->udp);
+    }
+    // the easy handles must be gone before the handles they were added to or shared with.
+    if (announcer->multi != NULL)
+        curl_multi_cleanup(announcer->multi);
+    if (announcer->share != NULL)
+        curl_share_cleanup(announcer->share);
+    free(announcer->trackers);
+    free(announcer->waits);
+    free(announcer->peers);
+    free(announcer->seen);
+    free(announcer);
+}
+
+void announcer_start(Announcer *announcer)
+{
+    double now = peer_now();
+    for (size_t i = 0; i < announcer->count; i++)
+    {
+        AnnouncerTracker *tracker = &announcer->trackers[i];
+        if (tracker->response == NULL && tracker->next_announce <= now)
+            announcer_start_tracker(announcer, tracker, now);
+    }
+}
+
+void announcer_start_tracker(Announcer *announcer, AnnouncerTracker *tracker, double now)
+{
+    // a tracker that cannot even be asked is asked again later, like one that failed.
+    tracker->next_announce = now + ANNOUNCER_RETRY_INTERVAL;
+    tracker->started_at = now;
+    if (tracker->over_udp)
+    {
+        BString *url = tracker->tracker->url;
+        // the socket stays open across re-announces, so the connection id can be reused.
+        if (tracker->udp.socket < 0 && udp_tracker_open(&tracker->udp, (const char *)url->chars, url->size) != UDP_TRACKER_SUCCESS)
+            return;
+        tracker->response = tracker_response_new();
+        if (tracker->response == NULL)
+            return;
+        AnnounceStats stats = announcer_stats(announcer, tracker);
+        int result = udp_tracker_announce(&tracker->udp, announcer->torrent, &stats, tracker->response, now);
+        if (result != UDP_TRACKER_PENDING)
+        {
+            log_printf(LOG_WARN, "ERR: failed to start announce to %.*s: %s\n", (int)url->size, url->chars, udp_tracker_strerror(result));
+            tracker_response_free(tracker->response);
+            tracker->response = NULL;
+            return;
+        }
+        announcer->running++;
+        return;
+    }
+
+    tracker->response = tracker_response_new();
+    if (tracker->response == NULL)
+        return;
+
+    // curl keeps its own copy of the url, so the template is free to be filled again.
+    AnnounceStats stats = announcer_stats(announcer, tracker);
+    curl_easy_setopt(tracker->easy, CURLOPT_URL, announce_template_fill(&tracker->url, &stats));
+    curl_easy_setopt(tracker->easy, CURLOPT_WRITEDATA, tracker->response);
+    if (curl_multi_add_handle(announcer->multi, tracker->easy) != CURLM_OK)
+    {
+        log_printf(LOG_WARN, "ERR: failed to start announce to %.*s\n", (int)tracker->tracker->url->size, tracker->tracker->url->chars);
+        tracker_response_free(tracker->response);
+        tracker->response = NULL;
+        return;
+    }
+    announcer->running++;
+}
+
+AnnounceStats announcer_stats(Announcer *announcer, AnnouncerTracker *tracker)
+{
+    AnnounceStats stats = announcer->stats;
+    stats.event = tracker->started ? TRACKER_EVENT_NONE : TRACKER_EVENT_STARTED;
+    return stats;
+}
+
+size_t announcer_poll(Announcer *announcer, int timeout_ms)
+{
+    if (announcer->running == 0)
+        return 0;
+
+    int running;
+    curl_multi_perform(announcer->multi, &running);
+    unsigned waits = announcer_poll_udp(announcer, peer_now(), &timeout_ms, false);
+    if (timeout_ms > 0 && (running > 0 || waits > 0))
+    {
+        curl_multi_poll(announcer->multi, announcer->waits, waits, timeout_ms, NULL);
+        curl_multi_perform(announcer->multi, &running);
+    }
+
+    CURLMsg *msg;
+    int left;
+    while ((msg = curl_multi_info_read(announcer->multi, &left)) != NULL)
+    {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        AnnouncerTracker *tracker;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&tracker);
+        CURLcode result = msg->data.result;
+        curl_multi_remove_handle(announcer->multi, msg->easy_handle);
+        announcer_finish_tracker(announcer, tracker, result != CURLE_OK ? curl_easy_strerror(result) : NULL);
+    }
+    announcer_poll_udp(announcer, peer_now(), &timeout_ms, true);
+    return announcer->running;
+}
+
+unsigned announcer_poll_udp(Announcer *announcer, double now, int *timeout_ms, bool advance)
+{
+    unsigned waits = 0;
+    for (size_t i = 0; i < announcer->count; i++)
+    {
+        AnnouncerTracker *tracker = &announcer->trackers[i];
+        if (!tracker->over_udp || tracker->response == NULL)
+            continue;
+
+        if (advance)
+        {
+            int result = udp_tracker_advance(&tracker->udp, now);
+            if (result != UDP_TRACKER_PENDING)
+                announcer_finish_tracker(announcer, tracker, result != UDP_TRACKER_SUCCESS ? udp_tracker_strerror(result) : NULL);
+            continue;
+        }
+
+        // a retransmit is due at the deadline whether or not anything arrives.
+        int until = tracker->udp.deadline > now ? (int)((tracker->udp.deadline - now) * 1000) + 1 : 0;
+        if (until < *timeout_ms)
+            *timeout_ms = until;
+        announcer->waits[waits].fd = tracker->udp.socket;
+        announcer->waits[waits].events = CURL_WAIT_POLLIN;
+        announcer->waits[waits].revents = 0;
+        waits++;
+    }
+    return waits;
+}
+
+void announcer_finish_tracker(Announcer *announcer, AnnouncerTracker *tracker, const char *error)
+{
+    Tracker_Response *response = tracker->response;
+    tracker->response = NULL;
+    announcer->running--;
+
+    double now = peer_now();
+    tracker->ok = error == NULL && response->ok;
+    metrics_count(tracker->ok ? METRIC_ANNOUNCES : METRIC_ANNOUNCE_FAILURES, 1);
+    if (!tracker->ok)
+    {
+        log_printf(LOG_WARN, "ERR: announce to %.*s failed: %s\n", (int)tracker->tracker->url->size,
+                tracker->tracker->url->chars, error != NULL ? error : "bad response");
+        tracker->next_announce = now + ANNOUNCER_RETRY_INTERVAL;
+        tracker_response_free(response);
+        return;
+    }
+
+    tracker->started = true;
+    metrics_record_seconds(METRIC_ANNOUNCE_TIME, now - tracker->started_at);
+    long interval = response->parsed.interval > 0 ? response->parsed.interval : ANNOUNCER_DEFAULT_INTERVAL;
+    tracker->next_announce = now + (interval < ANNOUNCER_MIN_INTERVAL ? ANNOUNCER_MIN_INTERVAL : interval);
+    for (size_t i = 0; i < response->parsed.peers_count; i++)
+    {
+        if (announcer_add_peer(announcer, &response->parsed.peers[i]) != 0)
+            break;
+    }
+    tracker_response_free(response);
+}
+
+size_t announcer_wait(Announcer *announcer, bool all)
+{
+    announcer_start(announcer);
+    while (announcer->running > 0 && (all || announcer->peers_count == 0))
+    {
+        announcer_poll(announcer, 1000);
+    }
+    return announcer->peers_count;
+}
+
+size_t announcer_hash_peer(const Peer *peer)
+{
+    // FNV-1a over the whole address, the parser zeroes what the address family does not use.
+    const unsigned char *bytes = (const unsigned char *)peer;
+    size_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < sizeof(Peer); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int announcer_add_peer(Announcer *announcer, const Peer *peer)
+{
+    size_t mask = announcer->seen_capacity - 1;
+    size_t slot = announcer_hash_peer(peer) & mask;
+    while (announcer->seen[slot] != 0)
+    {
+        if (memcmp(&announcer->peers[announcer->seen[slot] - 1], peer, sizeof(Peer)) == 0)
+            return 0;
+        slot = (slot + 1) & mask;
+    }
+
+    if (announcer->peers_count == announcer->peers_capacity)
+    {
+        size_t capacity = announcer->peers_capacity == 0 ? ANNOUNCER_SEEN_MIN_CAPACITY / 2 : announcer->peers_capacity * 2;
+        Peer *peers = realloc(announcer->peers, capacity * sizeof(Peer));
+        if (peers == NULL)
+        {
+            fprintf(stderr, "ERR: failed to allocate memory for peers\n");
+            return -1;
+        }
+        announcer->peers = peers;
+        announcer->peers_capacity = capacity;
+    }
+    announcer->peers[announcer->peers_count++] = *peer;
+    announcer->seen[slot] = announcer->peers_count;
+
+    // the set is kept at most half full, so probes stay short.
+    if (announcer->peers_count * 2 > announcer->seen_capacity)
+        return announcer_grow_seen(announcer, announcer->seen_capacity * 2);
+    return 0;
+}
+
+int announcer_grow_seen(Announcer *announcer, size_t capacity)
+{
+    size_t *seen = calloc(capacity, sizeof(size_t));
+    if (seen == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for peers\n");
+        return -1;
+    }
+
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < announcer->peers_count; i++)
+    {
+        size_t slot = announcer_hash_peer(&announcer->peers[i]) & mask;
+        while (seen[slot] != 0)
+            slot = (slot + 1) & mask;
+        seen[slot] = i + 1;
+    }
+    free(announcer->seen);
+    announcer->seen = seen;
+    announcer->seen_capacity = capacity;
+    return 0;
+}
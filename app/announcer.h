@@ -0,0 +1,100 @@
+#ifndef ANNOUNCER_H
+#define ANNOUNCER_H
+
+/**
+ * @file announcer.h
+ * @brief Header file for announcing a torrent to all of its trackers at once in C.
+ * Every tracker of every announce-list tier is announced to in parallel through one curl multi
+ * handle, which keeps their connections alive, and a share handle keeps DNS answers and TLS
+ * sessions across the re-announces each tracker asks for. The peers of every response are merged into one list
+ * without duplicates as the responses arrive. udp:// trackers are announced to over UDP (BEP 15)
+ * from the same poll, their sockets are waited on alongside the transfers of the multi handle.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <curl/curl.h>
+#include "network.h"
+#include "torrent.h"
+#include "udp_tracker.h"
+
+// how long a single announce may take, in seconds.
+#define ANNOUNCER_TIMEOUT 15
+
+// how long to wait before announcing again to a tracker that failed, in seconds.
+#define ANNOUNCER_RETRY_INTERVAL 60
+
+// the re-announce interval of a tracker that does not give one, in seconds.
+#define ANNOUNCER_DEFAULT_INTERVAL 1800
+
+// the smallest re-announce interval honoured, whatever a tracker asks for, in seconds.
+#define ANNOUNCER_MIN_INTERVAL 30
+
+// one tracker and its announce in flight, if any.
+typedef struct {
+    const TorrentTracker *tracker; // the tracker, from the torrent.
+    CURL *easy;                 // the transfer, reused by every announce to this tracker. NULL over udp.
+    AnnounceTemplate url;       // the announce url, built once. unused over udp.
+    bool over_udp;              // announced to over udp rather than http.
+    UdpTracker udp;             // the udp exchange, its socket opened on the first announce.
+    Tracker_Response *response; // what the announce in flight received so far, NULL while idle.
+    double next_announce;       // when to announce again, from peer_now.
+    double started_at;          // when the last announce was started, from peer_now.
+    bool ok;                    // whether the last announce succeeded.
+    bool started;               // whether the tracker answered an announce yet, the first one carries the started event.
+} AnnouncerTracker;
+
+typedef struct {
+    Torrent *torrent;
+    CURLM *multi;               // drives every announce at once.
+    CURLSH *share;              // the DNS cache and TLS sessions of every announce.
+    AnnouncerTracker *trackers; // one for each tracker of the torrent.
+    size_t count;               // the number of trackers.
+    size_t running;             // the number of announces in flight.
+    AnnounceStats stats;        // what every announce reports, kept up to date by the download. the event is ignored.
+    struct curl_waitfd *waits;  // the udp sockets to wait on in curl_multi_poll, room for every tracker.
+    Peer *peers;                // every peer heard of, first come first.
+    size_t peers_count;
+    size_t peers_capacity;
+    size_t *seen;               // an open addressing set of the peers, as index + 1 (0 is empty).
+    size_t seen_capacity;       // the number of slots in seen, a power of two.
+} Announcer;
+
+/**
+ * @brief Create an announcer for every tracker of a torrent, nothing is announced yet.
+ * @param torrent The torrent, it must outlive the announcer
+ * @return Announcer* the announcer, or NULL on error
+*/
+Announcer *announcer_new(Torrent *torrent);
+
+/**
+ * @brief Free an announcer, cancelling the announces in flight.
+ * @param announcer The announcer
+ * @return void
+*/
+void announcer_free(Announcer *announcer);
+
+/**
+ * @brief Start an announce at every tracker that is due and has none in flight. It does not wait.
+ * @param announcer The announcer
+ * @return void
+*/
+void announcer_start(Announcer *announcer);
+
+/**
+ * @brief Move the announces in flight along and merge the peers of every one that completed.
+ * @param announcer The announcer
+ * @param timeout_ms How long to wait for a transfer to make progress, 0 to only do what is ready
+ * @return size_t the number of announces still in flight
+*/
+size_t announcer_poll(Announcer *announcer, int timeout_ms);
+
+/**
+ * @brief Announce to every tracker and wait on the responses.
+ * @param announcer The announcer
+ * @param all Whether to wait on every tracker, or only until the first peers are known
+ * @return size_t the number of peers known
+*/
+size_t announcer_wait(Announcer *announcer, bool all);
+
+#endif
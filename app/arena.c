@@ -0,0 +1,119 @@
+/**
+ * @file arena.c
+ * @brief Implementation file for a bump pointer arena allocator in C.
+ */
+
+#include "arena.h"
+
+// every allocation is aligned for the strictest fundamental type.
+#define ARENA_ALIGNMENT _Alignof(max_align_t)
+#define ARENA_ALIGN_UP(n) (((n) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+ArenaChunk *arena_chunk_new(size_t capacity);
+
+ArenaChunk *arena_chunk_new(size_t capacity) {
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk));
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->data = malloc(capacity);
+    if (chunk->data == NULL) {
+        free(chunk);
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    return chunk;
+}
+
+Arena *arena_new(size_t chunk_size) {
+    Arena *arena = malloc(sizeof(Arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->chunk_size = chunk_size == 0 ? ARENA_DEFAULT_CHUNK_SIZE : chunk_size;
+    arena->head = arena_chunk_new(arena->chunk_size);
+    if (arena->head == NULL) {
+        free(arena);
+        return NULL;
+    }
+
+    arena->current = arena->head;
+    arena->last = NULL;
+    return arena;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size_t aligned = ARENA_ALIGN_UP(size == 0 ? 1 : size);
+
+    // walk forward through chunks kept from before a reset until one has room.
+    while (arena->current->capacity - arena->current->used < aligned) {
+        ArenaChunk *next = arena->current->next;
+        if (next == NULL || next->capacity < aligned) {
+            size_t capacity = aligned > arena->chunk_size ? aligned : arena->chunk_size;
+            ArenaChunk *chunk = arena_chunk_new(capacity);
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->next = next;
+            arena->current->next = chunk;
+            next = chunk;
+        }
+        arena->current = next;
+        arena->current->used = 0;
+    }
+
+    void *ptr = arena->current->data + arena->current->used;
+    arena->current->used += aligned;
+    arena->last = ptr;
+    return ptr;
+}
+
+void *arena_realloc(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (ptr == NULL) {
+        return arena_alloc(arena, new_size);
+    }
+
+    if (new_size <= old_size) {
+        return ptr;
+    }
+
+    // the last allocation sits at the top of the current chunk and can simply be bumped further.
+    if (ptr == arena->last) {
+        ArenaChunk *chunk = arena->current;
+        size_t offset = (unsigned char *)ptr - chunk->data;
+        size_t aligned = ARENA_ALIGN_UP(new_size);
+        if (chunk->capacity - offset >= aligned) {
+            chunk->used = offset + aligned;
+            return ptr;
+        }
+    }
+
+    void *grown = arena_alloc(arena, new_size);
+    if (grown == NULL) {
+        return NULL;
+    }
+    memcpy(grown, ptr, old_size);
+    return grown;
+}
+
+void arena_reset(Arena *arena) {
+    arena->current = arena->head;
+    arena->head->used = 0;
+    arena->last = NULL;
+}
+
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk->data);
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
@@ -0,0 +1,80 @@
+/**
+ * @file arena.h
+ * @brief Header file for a bump pointer arena allocator in C. Everything allocated from an arena is
+ * released at once by resetting or freeing the arena, individual allocations are never freed.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+// default size of each chunk of memory the arena grabs from the heap.
+#define ARENA_DEFAULT_CHUNK_SIZE 4096
+
+// a single contiguous chunk of memory handed out by the arena.
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    size_t capacity;
+    size_t used;
+    unsigned char *data;
+} ArenaChunk;
+
+// a bump pointer arena made of a list of chunks. chunks are kept across resets so a reused arena
+// stops touching the heap once it has grown to its working size.
+typedef struct
+{
+    ArenaChunk *head;     // the first chunk in the list.
+    ArenaChunk *current;  // the chunk allocations are currently bumped from.
+    size_t chunk_size;    // the minimum size of a new chunk.
+    void *last;           // the most recent allocation, it can be grown in place.
+} Arena;
+
+/**
+ * @brief Create a new Arena object
+ * 
+ * @param chunk_size The minimum size of each chunk, 0 selects ARENA_DEFAULT_CHUNK_SIZE
+ * @return Arena* A pointer to the newly created Arena or NULL if memory allocation failed
+ */
+Arena *arena_new(size_t chunk_size);
+
+/**
+ * @brief Allocate memory from the arena. The memory is suitably aligned for any type and stays
+ * valid until the arena is reset or freed.
+ * 
+ * @param arena The arena to allocate from
+ * @param size The number of bytes to allocate
+ * @return void* A pointer to the allocated memory or NULL if memory allocation failed
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/**
+ * @brief Grow an allocation made from the arena. The most recent allocation is grown in place when
+ * its chunk has room, anything else is copied into a new allocation and the old one is abandoned.
+ * 
+ * @param arena The arena the allocation belongs to
+ * @param ptr The allocation to grow, or NULL to allocate
+ * @param old_size The current size of the allocation
+ * @param new_size The requested size of the allocation
+ * @return void* A pointer to the grown allocation or NULL if memory allocation failed
+ */
+void *arena_realloc(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * @brief Release every allocation made from the arena at once. The chunks are kept for reuse.
+ * 
+ * @param arena The arena to reset
+ */
+void arena_reset(Arena *arena);
+
+/**
+ * @brief Free the arena and every chunk it owns
+ * 
+ * @param arena The arena to free
+ */
+void arena_free(Arena *arena);
+
+#endif
@@ -0,0 +1,453 @@
+/**
+ * @file batch.c
+ * @brief Implementation file for inspecting many torrent files at once in C.
+ * Each thread writes its lines into its own buffer and only takes the lock of the output to
+ * write a full buffer out, so the threads do not contend on every torrent.
+*/
+#include "batch.h"
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "torrent.h"
+
+// the state shared by the threads of a batch.
+typedef struct {
+    const BatchList *list;
+    FILE *out;
+    pthread_mutex_t lock;   // held while a buffer is written to out.
+    _Atomic size_t next;    // the first torrent of the next claim.
+    _Atomic size_t failed;  // the number of torrents that did not parse.
+} Batch;
+
+// the lines a thread has not written out yet.
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    bool failed;            // the buffer could not grow, what did not fit is lost.
+} BatchOutput;
+
+/**
+ * @brief the entry point of a batch thread, inspecting claims of torrents until all are claimed.
+ * @param arg The Batch
+ * @return NULL
+*/
+void *batch_worker(void *arg);
+
+/**
+ * @brief parse a torrent and write its line.
+ * @param batch The batch
+ * @param path The path of the torrent
+ * @param output The buffer of the thread
+ * @return void
+*/
+void batch_inspect(Batch *batch, const char *path, BatchOutput *output);
+
+/**
+ * @brief write what a thread gathered to the output.
+ * @param batch The batch
+ * @param output The buffer of the thread, emptied
+ * @return void
+*/
+void batch_flush(Batch *batch, BatchOutput *output);
+
+/**
+ * @brief append bytes to a buffer.
+ * @param output The buffer
+ * @param data The bytes
+ * @param size The number of bytes
+ * @return void
+*/
+void batch_append(BatchOutput *output, const char *data, size_t size);
+
+/**
+ * @brief append a JSON string, quoted and escaped. Torrents need not be UTF-8, a byte that does not
+ * start a valid UTF-8 sequence is escaped as the code point of the same value, \u0080 to \u00ff.
+ * @param output The buffer
+ * @param data The string, it need not be NUL terminated
+ * @param size The size of the string
+ * @return void
+*/
+void batch_append_string(BatchOutput *output, const char *data, size_t size);
+
+/**
+ * @brief the length of the UTF-8 sequence at the start of some bytes, rejecting overlong forms,
+ * surrogates and code points past U+10FFFF as JSON parsers do.
+ * @param data The bytes, the first is at least 0x80
+ * @param size The number of bytes
+ * @return size_t the length of the sequence, 0 if it is not valid UTF-8
+*/
+size_t batch_utf8_length(const unsigned char *data, size_t size);
+
+/**
+ * @brief add a path to a list, copying it into the arena.
+ * @param list The list
+ * @param path The path
+ * @param size The size of the path
+ * @return int BATCH_SUCCESS, or BATCH_ERR_MEMORY
+*/
+int batch_list_push(BatchList *list, const char *path, size_t size);
+
+/**
+ * @brief add every torrent below a directory, searching it all the way down. Symbolic links to
+ * directories are not followed, so a link loop cannot trap the walk.
+ * @param list The list
+ * @param directory The directory
+ * @return int BATCH_SUCCESS, BATCH_ERR_IO or BATCH_ERR_MEMORY
+*/
+int batch_list_walk(BatchList *list, const char *directory);
+
+/**
+ * @brief add every line of a file as a path, blank lines skipped.
+ * @param list The list
+ * @param file The file
+ * @return int BATCH_SUCCESS, or BATCH_ERR_MEMORY
+*/
+int batch_list_read(BatchList *list, FILE *file);
+
+int batch_list_init(BatchList *list)
+{
+    list->paths = NULL;
+    list->count = 0;
+    list->capacity = 0;
+    list->arena = arena_new(0);
+    if (list->arena == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for torrent list\n");
+        return BATCH_ERR_MEMORY;
+    }
+    return BATCH_SUCCESS;
+}
+
+void batch_list_free(BatchList *list)
+{
+    free(list->paths);
+    arena_free(list->arena);
+    list->paths = NULL;
+    list->arena = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+int batch_list_add(BatchList *list, const char *path)
+{
+    if (strcmp(path, "-") == 0)
+        return batch_list_read(list, stdin);
+
+    if (path[0] == '@')
+    {
+        FILE *file = fopen(path + 1, "r");
+        if (file == NULL)
+        {
+            fprintf(stderr, "ERR: unable to open torrent list at: %s\n", path + 1);
+            return BATCH_ERR_IO;
+        }
+        int result = batch_list_read(list, file);
+        fclose(file);
+        return result;
+    }
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        return batch_list_walk(list, path);
+    return batch_list_push(list, path, strlen(path));
+}
+
+int batch_list_push(BatchList *list, const char *path, size_t size)
+{
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity > 0 ? list->capacity * 2 : 256;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+        if (paths == NULL)
+        {
+            fprintf(stderr, "ERR: failed to allocate memory for torrent list\n");
+            return BATCH_ERR_MEMORY;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+
+    char *copy = arena_alloc(list->arena, size + 1);
+    if (copy == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for torrent list\n");
+        return BATCH_ERR_MEMORY;
+    }
+    memcpy(copy, path, size);
+    copy[size] = '\0';
+    list->paths[list->count++] = copy;
+    return BATCH_SUCCESS;
+}
+
+int batch_list_walk(BatchList *list, const char *directory)
+{
+    DIR *dir = opendir(directory);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "ERR: unable to open directory at: %s\n", directory);
+        return BATCH_ERR_IO;
+    }
+
+    size_t directory_length = strlen(directory);
+    size_t suffix_length = strlen(BATCH_TORRENT_SUFFIX);
+    int result = BATCH_SUCCESS;
+    struct dirent *entry;
+    while (result != BATCH_ERR_MEMORY && (entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        size_t name_length = strlen(entry->d_name);
+        size_t size = directory_length + 1 + name_length;
+        char *path = malloc(size + 1);
+        if (path == NULL)
+        {
+            fprintf(stderr, "ERR: failed to allocate memory for torrent list\n");
+            result = BATCH_ERR_MEMORY;
+            break;
+        }
+        snprintf(path, size + 1, "%s/%s", directory, entry->d_name);
+
+        // file systems that do not fill in d_type need a stat, which tells a link apart too.
+        unsigned char type = entry->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN && lstat(path, &st) == 0)
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+
+        if (type == DT_DIR)
+        {
+            // a subdirectory that cannot be read is reported and skipped, the rest is still walked.
+            if (batch_list_walk(list, path) == BATCH_ERR_MEMORY)
+                result = BATCH_ERR_MEMORY;
+        }
+        else if (name_length >= suffix_length && strcmp(entry->d_name + name_length - suffix_length, BATCH_TORRENT_SUFFIX) == 0)
+        {
+            result = batch_list_push(list, path, size);
+        }
+        free(path);
+    }
+    closedir(dir);
+    return result;
+}
+
+int batch_list_read(BatchList *list, FILE *file)
+{
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int result = BATCH_SUCCESS;
+    while (result == BATCH_SUCCESS && (length = getline(&line, &capacity, file)) >= 0)
+    {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            length--;
+        if (length > 0)
+            result = batch_list_push(list, line, length);
+    }
+    free(line);
+    return result;
+}
+
+size_t torrent_batch_info(const BatchList *list, FILE *out)
+{
+    Batch batch = { .list = list, .out = out };
+    atomic_init(&batch.next, 0);
+    atomic_init(&batch.failed, 0);
+    pthread_mutex_init(&batch.lock, NULL);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t wanted = cores > 1 ? cores : 1;
+    if (wanted > BATCH_MAX_THREADS)
+        wanted = BATCH_MAX_THREADS;
+    size_t claims = (list->count + BATCH_CLAIM - 1) / BATCH_CLAIM;
+    if (wanted > claims)
+        wanted = claims > 0 ? claims : 1;
+
+    // the calling thread works too, the others help it.
+    pthread_t threads[BATCH_MAX_THREADS];
+    size_t started = 0;
+    while (started + 1 < wanted && pthread_create(&threads[started], NULL, batch_worker, &batch) == 0)
+    {
+        started++;
+    }
+    batch_worker(&batch);
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&batch.lock);
+    fflush(out);
+    return atomic_load(&batch.failed);
+}
+
+void *batch_worker(void *arg)
+{
+    Batch *batch = arg;
+    const BatchList *list = batch->list;
+    BatchOutput output = { 0 };
+    while (true)
+    {
+        size_t first = atomic_fetch_add(&batch->next, BATCH_CLAIM);
+        if (first >= list->count)
+            break;
+
+        size_t last = list->count - first < BATCH_CLAIM ? list->count : first + BATCH_CLAIM;
+        for (size_t i = first; i < last; i++)
+        {
+            batch_inspect(batch, list->paths[i], &output);
+            if (output.size >= BATCH_OUTPUT_BUFFER)
+                batch_flush(batch, &output);
+        }
+    }
+    batch_flush(batch, &output);
+    free(output.data);
+    return NULL;
+}
+
+void batch_inspect(Batch *batch, const char *path, BatchOutput *output)
+{
+    char number[32];
+    batch_append(output, "{\"path\":", 8);
+    batch_append_string(output, path, strlen(path));
+
+    Torrent *torrent = torrent_open(path);
+    if (torrent == NULL)
+    {
+        atomic_fetch_add(&batch->failed, 1);
+        batch_append(output, ",\"error\":\"unable to parse torrent\"}\n", 36);
+        return;
+    }
+
+    TorrentFile *file = torrent->file;
+    static const char hex[] = "0123456789abcdef";
+    char info_hash[2 * SHA_DIGEST_LENGTH];
+    for (size_t i = 0; i < SHA_DIGEST_LENGTH; i++)
+    {
+        info_hash[2 * i] = hex[torrent->info_hash[i] >> 4];
+        info_hash[2 * i + 1] = hex[torrent->info_hash[i] & 0xf];
+    }
+    batch_append(output, ",\"info_hash\":\"", 14);
+    batch_append(output, info_hash, sizeof(info_hash));
+    batch_append(output, "\",\"name\":", 9);
+    batch_append_string(output, file->name, strlen(file->name));
+
+    int length = snprintf(number, sizeof(number), ",\"length\":%zu", file->file_size);
+    batch_append(output, number, length);
+    length = snprintf(number, sizeof(number), ",\"piece_length\":%zu", file->piece_length);
+    batch_append(output, number, length);
+    length = snprintf(number, sizeof(number), ",\"pieces\":%zu", file->num_pieces);
+    batch_append(output, number, length);
+    length = snprintf(number, sizeof(number), ",\"files\":%zu", file->file_count);
+    batch_append(output, number, length);
+
+    batch_append(output, ",\"trackers\":[", 13);
+    for (size_t i = 0; i < torrent->tracker_count; i++)
+    {
+        BString *url = torrent->trackers[i].url;
+        if (i > 0)
+            batch_append(output, ",", 1);
+        batch_append_string(output, (const char *)url->chars, url->size);
+    }
+    batch_append(output, "]}\n", 3);
+    torrent_free(torrent);
+}
+
+void batch_flush(Batch *batch, BatchOutput *output)
+{
+    if (output->size == 0)
+        return;
+    pthread_mutex_lock(&batch->lock);
+    fwrite(output->data, 1, output->size, batch->out);
+    pthread_mutex_unlock(&batch->lock);
+    output->size = 0;
+}
+
+void batch_append(BatchOutput *output, const char *data, size_t size)
+{
+    if (output->size + size > output->capacity)
+    {
+        size_t capacity = output->capacity > 0 ? output->capacity : BATCH_OUTPUT_BUFFER;
+        while (capacity < output->size + size)
+            capacity *= 2;
+        char *grown = realloc(output->data, capacity);
+        if (grown == NULL)
+        {
+            if (!output->failed)
+                fprintf(stderr, "ERR: failed to allocate memory for batch output\n");
+            output->failed = true;
+            return;
+        }
+        output->data = grown;
+        output->capacity = capacity;
+    }
+    memcpy(output->data + output->size, data, size);
+    output->size += size;
+}
+
+void batch_append_string(BatchOutput *output, const char *data, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    batch_append(output, "\"", 1);
+
+    // runs of bytes that need no escape are appended at once.
+    size_t plain = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned char c = data[i];
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\')
+            continue;
+        size_t length = c >= 0x80 ? batch_utf8_length((const unsigned char *)data + i, size - i) : 0;
+        if (length > 0)
+        {
+            i += length - 1;
+            continue;
+        }
+
+        batch_append(output, data + plain, i - plain);
+        plain = i + 1;
+        if (c == '"' || c == '\\')
+        {
+            char escaped[2] = { '\\', (char)c };
+            batch_append(output, escaped, 2);
+        }
+        else
+        {
+            char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            batch_append(output, escaped, 6);
+        }
+    }
+    batch_append(output, data + plain, size - plain);
+    batch_append(output, "\"", 1);
+}
+
+size_t batch_utf8_length(const unsigned char *data, size_t size)
+{
+    // the lead byte gives the length and the smallest code point that needs it.
+    size_t length;
+    uint32_t point;
+    uint32_t least;
+    if (data[0] >= 0xc0 && data[0] < 0xe0)
+        length = 2, point = data[0] & 0x1f, least = 0x80;
+    else if (data[0] >= 0xe0 && data[0] < 0xf0)
+        length = 3, point = data[0] & 0x0f, least = 0x800;
+    else if (data[0] >= 0xf0 && data[0] < 0xf8)
+        length = 4, point = data[0] & 0x07, least = 0x10000;
+    else
+        return 0;
+    if (length > size)
+        return 0;
+
+    for (size_t i = 1; i < length; i++)
+    {
+        if ((data[i] & 0xc0) != 0x80)
+            return 0;
+        point = point << 6 | (data[i] & 0x3f);
+    }
+    if (point < least || point > 0x10ffff || (point >= 0xd800 && point < 0xe000))
+        return 0;
+    return length;
+}
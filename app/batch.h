@@ -0,0 +1,72 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/**
+ * @file batch.h
+ * @brief Header file for inspecting many torrent files at once in C.
+ * The torrents are parsed and hashed on every core, each thread claiming BATCH_CLAIM of them at a time,
+ * and one JSON object per torrent is streamed out as they are done, in no particular order.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "arena.h"
+
+#define BATCH_SUCCESS 0
+#define BATCH_ERR_MEMORY -1
+#define BATCH_ERR_IO -2     // a directory or list of paths could not be read.
+
+// the most threads a batch parses on, whatever the number of cores.
+#define BATCH_MAX_THREADS 64
+
+// the number of torrents a thread takes at a time.
+#define BATCH_CLAIM 16
+
+// the output a thread gathers before it writes it out, so the threads rarely wait on each other.
+#define BATCH_OUTPUT_BUFFER 65536
+
+// what a directory is searched for.
+#define BATCH_TORRENT_SUFFIX ".torrent"
+
+// the paths of the torrents to inspect.
+typedef struct {
+    char **paths;       // the paths, their strings live in the arena.
+    size_t count;
+    size_t capacity;
+    Arena *arena;
+} BatchList;
+
+/**
+ * @brief Create an empty list of paths.
+ * @param list The list
+ * @return int BATCH_SUCCESS, or BATCH_ERR_MEMORY
+*/
+int batch_list_init(BatchList *list);
+
+/**
+ * @brief Free a list of paths.
+ * @param list The list
+ * @return void
+*/
+void batch_list_free(BatchList *list);
+
+/**
+ * @brief Add torrents to a list: every BATCH_TORRENT_SUFFIX file below a directory, every line of
+ * a file named with a leading '@' (or of stdin for "-"), or else the path itself.
+ * @param list The list
+ * @param path What to add
+ * @return int BATCH_SUCCESS, BATCH_ERR_IO or BATCH_ERR_MEMORY
+*/
+int batch_list_add(BatchList *list, const char *path);
+
+/**
+ * @brief Parse and hash every torrent of a list, writing a JSON line for each: its path, info hash,
+ * name, length, piece length, number of pieces and files, and trackers. A torrent that does not
+ * parse gets a line with its path and an error instead.
+ * @param list The torrents
+ * @param out Where the lines go
+ * @return size_t the number of torrents that did not parse
+*/
+size_t torrent_batch_info(const BatchList *list, FILE *out);
+
+#endif
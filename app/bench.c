@@ -0,0 +1,466 @@
+/**
+ * @file bench.c
+ * @brief Implementation file for measuring the bencode decoder and encoder in C.
+ * The synthetic inputs are generated in memory once, every operation is then repeated until it
+ * has run for BENCH_MIN_SECONDS and the mean of the runs is reported.
+*/
+#include "bench.h"
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "arena.h"
+#include "bencode.h"
+#include "bstring.h"
+#include "fileio.h"
+#include "network.h"
+
+// the number of hashes in the pieces blob, about a megabyte of them.
+#define BENCH_PIECES 52428
+
+// how deep each of the nested lists goes.
+#define BENCH_NESTED_DEPTH 64
+
+// the number of nested lists side by side.
+#define BENCH_NESTED_COUNT 4096
+
+// the number of keys of the large dictionary.
+#define BENCH_DICT_KEYS 50000
+
+// the elements of the short and of the long lists, the cost per byte should not change between them.
+#define BENCH_LIST_SHORT 10000
+#define BENCH_LIST_LONG 100000
+
+// a buffer an input is generated into.
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    bool failed;    // the buffer could not grow, the input is incomplete.
+} BenchBuffer;
+
+// an input to measure, generated or read from a torrent.
+typedef struct {
+    const char *name;
+    char *data;
+    size_t size;
+    FILE_CONTENT file;  // the torrent the data is of, or empty for a generated input.
+} BenchInput;
+
+// what is measured of an input.
+typedef enum {
+    BENCH_DECODE,           // decode onto the heap, copying every string.
+    BENCH_DECODE_BORROWED,  // decode onto the heap, every string a view of the input.
+    BENCH_DECODE_ARENA,     // decode into an arena, copying every string.
+    BENCH_ARENA_BORROWED,   // decode into an arena, every string a view of the input.
+    BENCH_ENCODE,           // encode the decoded tree again.
+    BENCH_HASH,             // hash the tree by encoding it again.
+    BENCH_HASH_SOURCE,      // hash the bytes the tree was decoded from.
+    BENCH_OPERATIONS
+} BenchOperation;
+
+// the name each operation is reported under.
+static const char *bench_operation_names[BENCH_OPERATIONS] = {
+    "decode", "decode_borrowed", "decode_arena", "arena_borrowed", "encode", "hash", "hash_source",
+};
+
+// what an operation needs besides the input, set up once before it is timed.
+typedef struct {
+    const BenchInput *input;
+    Arena *arena;
+    Bencoded tree;      // the input decoded with views onto the heap.
+    char *encoded;      // room for the input encoded again.
+    bool ok;            // every run so far succeeded.
+} BenchContext;
+
+/**
+ * @brief the current time of a monotonic clock.
+ * @return double the time, in seconds
+*/
+double bench_now(void);
+
+/**
+ * @brief append bytes to a buffer, growing it as needed.
+ * @param buf The buffer
+ * @param bytes The bytes
+ * @param n The number of bytes
+ * @return void
+*/
+void bench_append(BenchBuffer *buf, const void *bytes, size_t n);
+
+/**
+ * @brief append formatted text to a buffer.
+ * @param buf The buffer
+ * @param format The printf format
+ * @return void
+*/
+void bench_appendf(BenchBuffer *buf, const char *format, ...);
+
+/**
+ * @brief generate a torrent like dictionary around a large pieces blob.
+ * @param buf The buffer
+ * @return void
+*/
+void bench_generate_pieces(BenchBuffer *buf);
+
+/**
+ * @brief generate a list of many deeply nested lists.
+ * @param buf The buffer
+ * @return void
+*/
+void bench_generate_nested(BenchBuffer *buf);
+
+/**
+ * @brief generate a dictionary of many sorted keys.
+ * @param buf The buffer
+ * @param keys The number of keys
+ * @return void
+*/
+void bench_generate_dict(BenchBuffer *buf, size_t keys);
+
+/**
+ * @brief generate a list of integers of every width.
+ * @param buf The buffer
+ * @param count The number of integers
+ * @return void
+*/
+void bench_generate_ints(BenchBuffer *buf, size_t count);
+
+/**
+ * @brief generate a list of short strings.
+ * @param buf The buffer
+ * @param count The number of strings
+ * @return void
+*/
+void bench_generate_strings(BenchBuffer *buf, size_t count);
+
+/**
+ * @brief run an operation once.
+ * @param ctx The context
+ * @param op The operation
+ * @return void
+*/
+void bench_run(BenchContext *ctx, BenchOperation op);
+
+/**
+ * @brief time every operation on an input and write a line for each.
+ * @param input The input
+ * @param out Where the lines go
+ * @return int BENCH_SUCCESS, BENCH_ERR_IO if the input does not decode, or BENCH_ERR_MEMORY
+*/
+int bench_input(const BenchInput *input, FILE *out);
+
+/**
+ * @brief time looking up every key of a dictionary, if the input is one.
+ * @param input The input
+ * @param tree The input decoded
+ * @param out Where the line goes
+ * @return int BENCH_SUCCESS, or BENCH_ERR_MEMORY
+*/
+int bench_lookups(const BenchInput *input, Bencoded *tree, FILE *out);
+
+double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_append(BenchBuffer *buf, const void *bytes, size_t n)
+{
+    if (buf->failed)
+        return;
+    if (buf->size + n > buf->capacity)
+    {
+        size_t capacity = buf->capacity == 0 ? 4096 : buf->capacity;
+        while (capacity < buf->size + n)
+            capacity *= 2;
+        char *data = realloc(buf->data, capacity);
+        if (data == NULL)
+        {
+            buf->failed = true;
+            return;
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, bytes, n);
+    buf->size += n;
+}
+
+void bench_appendf(BenchBuffer *buf, const char *format, ...)
+{
+    char text[128];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    bench_append(buf, text, n < (int)sizeof(text) ? (size_t)n : sizeof(text) - 1);
+}
+
+void bench_generate_pieces(BenchBuffer *buf)
+{
+    bench_appendf(buf, "d6:lengthi%zue4:name9:bench.bin12:piece lengthi262144e6:pieces%zu:",
+                  (size_t)BENCH_PIECES * 262144, (size_t)BENCH_PIECES * 20);
+
+    // random bytes, so the blob holds every delimiter the decoder looks for.
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < (size_t)BENCH_PIECES * 20; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        unsigned char byte = (unsigned char)state;
+        bench_append(buf, &byte, 1);
+    }
+    bench_append(buf, "e", 1);
+}
+
+void bench_generate_nested(BenchBuffer *buf)
+{
+    bench_append(buf, "l", 1);
+    for (size_t i = 0; i < BENCH_NESTED_COUNT; i++)
+    {
+        for (size_t d = 0; d < BENCH_NESTED_DEPTH; d++)
+            bench_append(buf, "l", 1);
+        bench_appendf(buf, "i%zue", i);
+        for (size_t d = 0; d < BENCH_NESTED_DEPTH; d++)
+            bench_append(buf, "e", 1);
+    }
+    bench_append(buf, "e", 1);
+}
+
+void bench_generate_dict(BenchBuffer *buf, size_t keys)
+{
+    // zero padded, so the keys come out in ascending order.
+    bench_append(buf, "d", 1);
+    for (size_t i = 0; i < keys; i++)
+        bench_appendf(buf, "9:key%06zui%zue", i, i * 7919);
+    bench_append(buf, "e", 1);
+}
+
+void bench_generate_ints(BenchBuffer *buf, size_t count)
+{
+    bench_append(buf, "l", 1);
+    long long value = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        bench_appendf(buf, "i%llde", i % 2 == 0 ? value : -value);
+        value = value > 1000000000000000LL ? 1 : value * 31 + 7;
+    }
+    bench_append(buf, "e", 1);
+}
+
+void bench_generate_strings(BenchBuffer *buf, size_t count)
+{
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    bench_append(buf, "l", 1);
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t length = 1 + i % 16;
+        bench_appendf(buf, "%zu:", length);
+        for (size_t c = 0; c < length; c++)
+            bench_append(buf, &letters[(i + c) % (sizeof(letters) - 1)], 1);
+    }
+    bench_append(buf, "e", 1);
+}
+
+void bench_run(BenchContext *ctx, BenchOperation op)
+{
+    const BenchInput *input = ctx->input;
+    Bencoded tree;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    switch (op)
+    {
+    case BENCH_DECODE:
+    case BENCH_DECODE_BORROWED:
+        if ((op == BENCH_DECODE ? decode_bencode : decode_bencode_borrowed)(&tree, input->data, input->size, NULL) != PARSER_SUCCESS)
+        {
+            ctx->ok = false;
+            return;
+        }
+        free_bencoded_inner(tree);
+        break;
+    case BENCH_DECODE_ARENA:
+    case BENCH_ARENA_BORROWED:
+        if ((op == BENCH_DECODE_ARENA ? decode_bencode : decode_bencode_borrowed)(&tree, input->data, input->size, ctx->arena) != PARSER_SUCCESS)
+            ctx->ok = false;
+        arena_reset(ctx->arena);
+        break;
+    case BENCH_ENCODE:
+        encode_bencode(&ctx->tree, ctx->encoded);
+        break;
+    case BENCH_HASH:
+        if (!hash_bencoded(hash, &ctx->tree))
+            ctx->ok = false;
+        break;
+    case BENCH_HASH_SOURCE:
+        hash_bencoded_source(hash, &ctx->tree, input->data);
+        break;
+    default:
+        break;
+    }
+}
+
+int bench_input(const BenchInput *input, FILE *out)
+{
+    BenchContext ctx = {.input = input, .ok = true};
+    if (decode_bencode_borrowed(&ctx.tree, input->data, input->size, NULL) != PARSER_SUCCESS)
+    {
+        fprintf(stderr, "ERR: %s does not decode, it is not measured\n", input->name);
+        return BENCH_ERR_IO;
+    }
+
+    // encode_bencode terminates what it writes.
+    ctx.encoded = malloc(ctx.tree.encoded_length + 1);
+    ctx.arena = arena_new(0);
+    if (ctx.encoded == NULL || ctx.arena == NULL)
+    {
+        free(ctx.encoded);
+        arena_free(ctx.arena);
+        free_bencoded_inner(ctx.tree);
+        return BENCH_ERR_MEMORY;
+    }
+
+    for (BenchOperation op = 0; op < BENCH_OPERATIONS && ctx.ok; op++)
+    {
+        // the first run warms up, and is the one the allocations are counted on.
+        size_t before = bencode_allocations();
+        bench_run(&ctx, op);
+        size_t allocations = bencode_allocations() - before;
+
+        size_t runs = 0;
+        double start = bench_now();
+        double elapsed;
+        do
+        {
+            bench_run(&ctx, op);
+            runs++;
+            elapsed = bench_now() - start;
+        } while (ctx.ok && (runs < BENCH_MIN_RUNS || elapsed < BENCH_MIN_SECONDS));
+
+        double seconds = elapsed / runs;
+        fprintf(out, "%-16s %-16s %9.4f ns/byte %9.1f MB/s %10zu allocs/parse\n", input->name,
+                bench_operation_names[op], seconds * 1e9 / input->size, input->size / seconds / 1e6, allocations);
+    }
+
+    int status = ctx.ok ? bench_lookups(input, &ctx.tree, out) : BENCH_ERR_IO;
+    if (!ctx.ok)
+        fprintf(stderr, "ERR: measuring %s failed\n", input->name);
+
+    free(ctx.encoded);
+    arena_free(ctx.arena);
+    free_bencoded_inner(ctx.tree);
+    return status;
+}
+
+int bench_lookups(const BenchInput *input, Bencoded *tree, FILE *out)
+{
+    if (tree->type != DICTIONARY)
+        return BENCH_SUCCESS;
+
+    // get_dict_key takes C strings, keys holding a NUL cannot be looked up that way.
+    BencodedDictionary *dict = &tree->data.dictionary;
+    char **keys = malloc(dict->size * sizeof(char *) + 1);
+    if (keys == NULL)
+        return BENCH_ERR_MEMORY;
+    size_t count = 0;
+    for (size_t i = 0; i < dict->size; i++)
+    {
+        BString *key = dict->elements[i].key;
+        if (memchr(key->chars, '\0', key->size) != NULL)
+            continue;
+        keys[count] = bstring_to_cstr(key);
+        if (keys[count] == NULL)
+            break;
+        count++;
+    }
+
+    size_t runs = 0;
+    size_t found = 0;
+    double start = bench_now();
+    double elapsed;
+    do
+    {
+        for (size_t i = 0; i < count; i++)
+            found += get_dict_key(tree, keys[i]) != NULL;
+        runs++;
+        elapsed = bench_now() - start;
+    } while (count > 0 && (runs < BENCH_MIN_RUNS || elapsed < BENCH_MIN_SECONDS));
+
+    if (count > 0)
+        fprintf(out, "%-16s %-16s %9.1f ns/key  %9zu keys\n", input->name, "lookup",
+                elapsed * 1e9 / (runs * count), found / runs);
+
+    for (size_t i = 0; i < count; i++)
+        free(keys[i]);
+    free(keys);
+    return BENCH_SUCCESS;
+}
+
+int bencode_bench(const char **torrent_paths, size_t count, FILE *out)
+{
+    // the synthetic inputs, each generated by a function of the buffer and an optional size.
+    struct {
+        const char *name;
+        void (*generate)(BenchBuffer *buf);
+        void (*generate_sized)(BenchBuffer *buf, size_t n);
+        size_t n;
+    } generated[] = {
+        {"pieces", bench_generate_pieces, NULL, 0},
+        {"nested", bench_generate_nested, NULL, 0},
+        {"dict", NULL, bench_generate_dict, BENCH_DICT_KEYS},
+        {"ints_short", NULL, bench_generate_ints, BENCH_LIST_SHORT},
+        {"ints_long", NULL, bench_generate_ints, BENCH_LIST_LONG},
+        {"strings_short", NULL, bench_generate_strings, BENCH_LIST_SHORT},
+        {"strings_long", NULL, bench_generate_strings, BENCH_LIST_LONG},
+    };
+    size_t generated_count = sizeof(generated) / sizeof(generated[0]);
+
+    int status = BENCH_SUCCESS;
+    for (size_t i = 0; i < generated_count + count && status != BENCH_ERR_MEMORY; i++)
+    {
+        BenchInput input = {0};
+        BenchBuffer buf = {0};
+        if (i < generated_count)
+        {
+            if (generated[i].generate != NULL)
+                generated[i].generate(&buf);
+            else
+                generated[i].generate_sized(&buf, generated[i].n);
+            if (buf.failed)
+            {
+                free(buf.data);
+                return BENCH_ERR_MEMORY;
+            }
+            input.name = generated[i].name;
+            input.data = buf.data;
+            input.size = buf.size;
+        }
+        else
+        {
+            const char *path = torrent_paths[i - generated_count];
+            input.file = map_file(path);
+            if (input.file.content == NULL)
+            {
+                status = BENCH_ERR_IO;
+                continue;
+            }
+
+            // the name of the torrent without its directory.
+            const char *slash = strrchr(path, '/');
+            input.name = slash != NULL ? slash + 1 : path;
+            input.data = input.file.content;
+            input.size = input.file.size;
+        }
+
+        int result = bench_input(&input, out);
+        if (result != BENCH_SUCCESS)
+            status = result;
+
+        free(buf.data);
+        unmap_file(&input.file);
+    }
+    return status;
+}
@@ -0,0 +1,35 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/**
+ * @file bench.h
+ * @brief Header file for measuring the bencode decoder and encoder in C.
+ * A synthetic corpus (a large pieces blob, deeply nested lists, a large dictionary, long lists of
+ * integers and of short strings at two sizes each, so a cost that grows faster than the input shows)
+ * and any torrents given are decoded, encoded, looked up and hashed over and over, and the time per
+ * byte and the heap allocations of a single parse are reported for each.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_SUCCESS 0
+#define BENCH_ERR_MEMORY -1
+#define BENCH_ERR_IO -2     // a torrent could not be read, or any input did not decode.
+
+// how long each measurement is repeated for at least, in seconds.
+#define BENCH_MIN_SECONDS 0.2
+
+// the fewest times each measurement is repeated, however long one takes.
+#define BENCH_MIN_RUNS 5
+
+/**
+ * @brief Measure every operation on the synthetic corpus and on the torrents given, writing one line
+ * per input and operation: the time per byte of input, the throughput and the heap allocations.
+ * @param torrent_paths The paths of real torrents to measure too
+ * @param count The number of paths
+ * @param out Where the results go
+ * @return int BENCH_SUCCESS, BENCH_ERR_IO or BENCH_ERR_MEMORY
+*/
+int bencode_bench(const char **torrent_paths, size_t count, FILE *out);
+
+#endif
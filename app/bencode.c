@@ -7,6 +7,9 @@
  * The decoded value is then printed to the console.
  */
 #include "bencode.h"
+#include <limits.h>
+#include "log.h"
+#include "metrics.h"
 
 // the address of the end of the source input.
 #define SOURCE_END(src) (src.origin + src.length)
@@ -17,6 +20,12 @@
 // whether the Parser is in an ok state.
 #define PARSER_OK(p) (p->state == PARSER_SUCCESS)
 
+// the number of elements a list or dictionary starts with before doubling.
+#define INITIAL_CAPACITY 8
+
+// the heap allocations the decoder made on this thread, see bencode_allocations.
+static _Thread_local size_t parser_heap_allocations = 0;
+
 
 typedef struct {
     const char *origin;
@@ -29,6 +38,12 @@ typedef struct Parser {
     Source src;
     // the current state of the parser.
     int state;
+    // whether decoded strings borrow from the source instead of copying it.
+    bool borrow;
+    // the arena every node is allocated from, or NULL to use the heap.
+    Arena *arena;
+    // the number of lists and dictionaries being decoded.
+    size_t depth;
 } Parser;
 
 //////////////////////////////////////////////////////////////////////////
@@ -39,9 +54,61 @@ typedef struct Parser {
  * @param p - the parser to initialize.
  * @param src - the source to parse.
  * @param length - the length of the source.
+ * @param borrow - whether decoded strings should be views into src rather than copies.
+ * @param arena - the arena to allocate the tree from, or NULL to use the heap.
  * @return void
 */
-void parser_init(Parser *p, const char *src, size_t length);
+void parser_init(Parser *p, const char *src, size_t length, bool borrow, Arena *arena);
+
+/**
+ * Allocates memory for the tree being decoded, from the parser's arena if it has one.
+ * @param p - the parser to allocate for.
+ * @param size - the number of bytes to allocate.
+ * @return a pointer to the memory, or NULL if out of memory.
+*/
+void *parser_alloc(Parser *p, size_t size);
+
+/**
+ * Grows memory previously returned by parser_alloc.
+ * @param p - the parser the memory belongs to.
+ * @param ptr - the memory to grow.
+ * @param old_size - the current size of the memory.
+ * @param new_size - the requested size of the memory.
+ * @return a pointer to the grown memory, or NULL if out of memory. ptr stays valid on failure.
+*/
+void *parser_realloc(Parser *p, void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * Creates the string for a decoded STRING node or key, honouring the parser's borrow and arena settings.
+ * @param p - the parser to create the string for.
+ * @param bytes - the string contents in the source.
+ * @param n - the length of the string.
+ * @return a pointer to the string, or NULL if out of memory.
+*/
+BString *parser_new_string(Parser *p, const char *bytes, size_t n);
+
+/**
+ * Frees a partially decoded list after an error. A no-op for arena backed parsers.
+ * @param p - the parser the list belongs to.
+ * @param elements - the elements decoded so far.
+ * @param length - the number of decoded elements.
+*/
+void parser_discard_list(Parser *p, Bencoded *elements, size_t length);
+
+/**
+ * Frees a partially decoded dictionary after an error. A no-op for arena backed parsers.
+ * @param p - the parser the dictionary belongs to.
+ * @param elements - the elements decoded so far.
+ * @param length - the number of decoded elements.
+*/
+void parser_discard_dict(Parser *p, BencodedDictElement *elements, size_t length);
+
+/**
+ * Frees a decoded value after an error. A no-op for arena backed parsers.
+ * @param p - the parser the value belongs to.
+ * @param b - the value to free.
+*/
+void parser_discard(Parser *p, Bencoded b);
 
 /**
  * Advances the parser by the given number of bytes.
@@ -77,11 +144,32 @@ void parser_set_position(Parser *p, char *position);
 void parser_set_error(Parser *p, int error);
 
 /**
- * Checks if a character is a digit.
- * @param c - the character to check.
- * @return true if the character is a digit, false otherwise.
+ * Reads the decimal number at the parser's position, never looking past the end of the source.
+ * The delimiter after a number has to follow its digits directly, so they are all that is read.
+ * @param p - the parser to read from, left on the first byte after the digits.
+ * @param limit - the largest value accepted.
+ * @param strict - whether a leading zero is rejected unless it is the only digit.
+ * @param value - set to the number read.
+ * @return PARSER_SUCCESS, PARSER_ERR_PARTIAL if the source ends within the digits, or PARSER_ERR_SYNTAX if there are none,
+ * a strict number has a leading zero or the number is over the limit.
+*/
+int parser_read_number(Parser *p, unsigned long limit, bool strict, unsigned long *value);
+
+/**
+ * Enters a list or dictionary, setting a syntax error if that nests it deeper than BENCODE_MAX_DEPTH.
+ * @param p - the parser entering the container, left one level deeper on success.
+ * @return true if the container may be decoded.
 */
-bool source_contains(Parser p, char c);
+bool parser_enter(Parser *p);
+
+/**
+ * Appends a decimal digit to a number, unless the result would be over a limit.
+ * @param value - the number, left unchanged on overflow.
+ * @param c - the digit.
+ * @param limit - the largest value accepted.
+ * @return true if the digit was appended, false on overflow.
+*/
+bool number_push_digit(unsigned long *value, char c, unsigned long limit);
 
 
 /**
@@ -134,6 +222,42 @@ void free_bencoded_dict_elements(BencodedDictElement *elements, size_t length);
 */
 void decode_bencode_inner(Parser *p, Bencoded *container);
 
+/**
+ * Compares two keys by their bytes, the order bencode requires dictionary keys to be sorted in.
+ * @param a - the first key.
+ * @param a_len - the length of the first key.
+ * @param b - the second key.
+ * @param b_len - the length of the second key.
+ * @return negative, zero or positive like memcmp.
+*/
+int key_cmp(const unsigned char *a, size_t a_len, const unsigned char *b, size_t b_len);
+
+/**
+ * Hashes a dictionary key for the dictionary index (FNV-1a).
+ * @param key - the key to hash.
+ * @param len - the length of the key.
+ * @return the hash of the key.
+*/
+uint32_t key_hash(const unsigned char *key, size_t len);
+
+/**
+ * Builds the hashed index of a decoded dictionary. Failing to allocate it is not an error,
+ * lookups just fall back to searching the elements.
+ * @param p - the parser the dictionary belongs to.
+ * @param dict - the dictionary to index.
+ * @return void
+*/
+void dict_build_index(Parser *p, BencodedDictionary *dict);
+
+/**
+ * Finds the element position of a key in a dictionary.
+ * @param dict - the dictionary to search.
+ * @param key - the key to search for.
+ * @param len - the length of the key.
+ * @return the position of the element, or -1 if the key is not present.
+*/
+long dict_find(BencodedDictionary *dict, const unsigned char *key, size_t len);
+
 /**
  * Decodes a bencoded string and stores it in the given container.
  * @param p - the source to decode.
@@ -167,6 +291,41 @@ void decode_bencoded_list(Parser *p, Bencoded *container);
 void decode_bencoded_dictionary(Parser *p, Bencoded *container);
 
 
+/**
+ * Moves a stream parser on after it has seen the end of a value. In a dictionary the values alternate
+ * between keys and what they map to, a key that is not a string is a syntax error once it ends.
+ * @param sp - the stream parser that finished a value.
+ * @param string - whether the value is a string.
+ * @return void
+*/
+void stream_parser_value_done(StreamParser *sp, bool string);
+
+/**
+ * Reads the bit of an open container of a stream parser.
+ * @param bits - the bits, dicts or keys.
+ * @param level - the container, 0 for the outermost.
+ * @return whether the bit is set.
+*/
+bool stream_level_get(const unsigned char *bits, size_t level);
+
+/**
+ * Sets or clears the bit of an open container of a stream parser.
+ * @param bits - the bits, dicts or keys.
+ * @param level - the container, 0 for the outermost.
+ * @param value - what the bit becomes.
+ * @return void
+*/
+void stream_level_set(unsigned char *bits, size_t level, bool value);
+
+/**
+ * Advances a stream parser by a single byte of input outside of a string body.
+ * @param sp - the stream parser to advance.
+ * @param c - the byte of input.
+ * @return void
+*/
+void stream_parser_step(StreamParser *sp, char c);
+
+
 /**
  * Encodes a bencoded string and stores it in the given target buffer.
  * @param b - the bencoded string to encode.
@@ -211,11 +370,85 @@ size_t route_bencode(Bencoded *b, char *target);
 /////////////////////////////////////////////////////////////////////////////
 ////////////////////////// Private Implementations //////////////////////////
 /////////////////////////////////////////////////////////////////////////////
-void parser_init(Parser *p, const char *src, size_t length) {
+void parser_init(Parser *p, const char *src, size_t length, bool borrow, Arena *arena) {
     p->src.origin = src;
     p->src.position = src;
     p->src.length = length;
     p->state = PARSER_SUCCESS;
+    p->borrow = borrow;
+    p->arena = arena;
+    p->depth = 0;
+}
+
+void *parser_alloc(Parser *p, size_t size) {
+    if (p->arena != NULL) {
+        return arena_alloc(p->arena, size);
+    }
+    parser_heap_allocations++;
+    return malloc(size);
+}
+
+void *parser_realloc(Parser *p, void *ptr, size_t old_size, size_t new_size) {
+    if (p->arena != NULL) {
+        return arena_realloc(p->arena, ptr, old_size, new_size);
+    }
+    parser_heap_allocations++;
+    return realloc(ptr, new_size);
+}
+
+BString *parser_new_string(Parser *p, const char *bytes, size_t n) {
+    if (p->arena == NULL) {
+        // a view is one allocation, a copy two: the string and its bytes.
+        if (p->borrow) {
+            parser_heap_allocations++;
+            return bstring_view((const unsigned char *)bytes, n);
+        }
+
+        parser_heap_allocations += 2;
+        BString *bstring = bstring_new(n);
+        if (bstring == NULL) {
+            return NULL;
+        }
+        bstring_append_bytes(bstring, (const unsigned char *)bytes, n);
+        return bstring;
+    }
+
+    // arena strings are always views, either of the source or of a copy the arena owns.
+    BString *bstring = arena_alloc(p->arena, sizeof(BString));
+    if (bstring == NULL) {
+        return NULL;
+    }
+
+    const char *chars = bytes;
+    if (!p->borrow) {
+        char *copy = arena_alloc(p->arena, n);
+        if (copy == NULL) {
+            return NULL;
+        }
+        memcpy(copy, bytes, n);
+        chars = copy;
+    }
+
+    bstring_view_init(bstring, (const unsigned char *)chars, n);
+    return bstring;
+}
+
+void parser_discard_list(Parser *p, Bencoded *elements, size_t length) {
+    if (p->arena == NULL) {
+        free_bencoded_list_elements(elements, length);
+    }
+}
+
+void parser_discard_dict(Parser *p, BencodedDictElement *elements, size_t length) {
+    if (p->arena == NULL) {
+        free_bencoded_dict_elements(elements, length);
+    }
+}
+
+void parser_discard(Parser *p, Bencoded b) {
+    if (p->arena == NULL) {
+        free_bencoded_inner(b);
+    }
 }
 
 void parser_advance(Parser *p, size_t nbytes) {
@@ -247,16 +480,49 @@ void parser_set_error(Parser *p, int error) {
     p->state = error;
 }
 
-bool source_contains(Parser p, char c) {
-    const char *tmp = p.src.position;
-    const char *end = SOURCE_END(p.src);
-    while (tmp < end) {
-        if (*tmp == c) {
-            return true;
+bool number_push_digit(unsigned long *value, char c, unsigned long limit) {
+    unsigned long digit = c - '0';
+    if (*value > (limit - digit) / 10) {
+        return false;
+    }
+    *value = *value * 10 + digit;
+    return true;
+}
+
+int parser_read_number(Parser *p, unsigned long limit, bool strict, unsigned long *value) {
+    const char *position = p->src.position;
+    const char *end = SOURCE_END(p->src);
+    if (position == end) {
+        return PARSER_ERR_PARTIAL;
+    }
+    if (!is_digit(*position)) {
+        return PARSER_ERR_SYNTAX;
+    }
+
+    *value = 0;
+    const char *start = position;
+    while (position < end && is_digit(*position)) {
+        if (!number_push_digit(value, *position, limit)) {
+            return PARSER_ERR_SYNTAX;
         }
-        tmp++;
+        position++;
+    }
+
+    if (strict && *start == '0' && position - start > 1) {
+        return PARSER_ERR_SYNTAX;
+    }
+    p->src.position = position;
+    return position == end ? PARSER_ERR_PARTIAL : PARSER_SUCCESS;
+}
+
+bool parser_enter(Parser *p) {
+    if (p->depth == BENCODE_MAX_DEPTH) {
+        log_printf(LOG_DEBUG, "bencoded value nested deeper than %d levels\n", BENCODE_MAX_DEPTH);
+        parser_set_error(p, PARSER_ERR_SYNTAX);
+        return false;
     }
-    return false;
+    p->depth++;
+    return true;
 }
 
 void print_source(Parser p, FILE* fd) {
@@ -294,46 +560,168 @@ void free_bencoded_dict_elements(BencodedDictElement *elements, size_t length)
     for (size_t i = 0; i < length; i++)
     {
         bstring_free(elements[i].key);
-        free_bencoded(elements[i].value);
+        free_bencoded_inner(elements[i].value);
     }
 
     free(elements);
 };
 
 
+int key_cmp(const unsigned char *a, size_t a_len, const unsigned char *b, size_t b_len)
+{
+    size_t n = a_len < b_len ? a_len : b_len;
+    int cmp = memcmp(a, b, n);
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+uint32_t key_hash(const unsigned char *key, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void dict_build_index(Parser *p, BencodedDictionary *dict)
+{
+    dict->index = NULL;
+    dict->index_capacity = 0;
+
+    if (BENCODE_DICT_INDEX_MIN_SIZE == 0 || dict->size < BENCODE_DICT_INDEX_MIN_SIZE || dict->size >= UINT32_MAX)
+    {
+        return;
+    }
+
+    // keep the table at most half full so probes stay short.
+    size_t capacity = 1;
+    while (capacity < dict->size * 2)
+    {
+        capacity *= 2;
+    }
+
+    uint32_t *index = parser_alloc(p, sizeof(uint32_t) * capacity);
+    if (index == NULL)
+    {
+        return;
+    }
+    memset(index, 0, sizeof(uint32_t) * capacity);
+
+    for (size_t i = 0; i < dict->size; i++)
+    {
+        BString *key = dict->elements[i].key;
+        size_t slot = key_hash(key->chars, key->size) & (capacity - 1);
+        while (index[slot] != 0)
+        {
+            // only the first of a repeated key is indexed, matching a linear search.
+            BString *other = dict->elements[index[slot] - 1].key;
+            if (key_cmp(key->chars, key->size, other->chars, other->size) == 0)
+            {
+                break;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (index[slot] == 0)
+        {
+            index[slot] = i + 1;
+        }
+    }
+
+    dict->index = index;
+    dict->index_capacity = capacity;
+}
+
+long dict_find(BencodedDictionary *dict, const unsigned char *key, size_t len)
+{
+    if (dict->index != NULL)
+    {
+        size_t slot = key_hash(key, len) & (dict->index_capacity - 1);
+        while (dict->index[slot] != 0)
+        {
+            size_t i = dict->index[slot] - 1;
+            BString *other = dict->elements[i].key;
+            if (key_cmp(key, len, other->chars, other->size) == 0)
+            {
+                return i;
+            }
+            slot = (slot + 1) & (dict->index_capacity - 1);
+        }
+        return -1;
+    }
+
+    if (dict->sorted)
+    {
+        size_t low = 0;
+        size_t high = dict->size;
+        while (low < high)
+        {
+            size_t mid = low + (high - low) / 2;
+            BString *other = dict->elements[mid].key;
+            int cmp = key_cmp(key, len, other->chars, other->size);
+            if (cmp == 0)
+            {
+                return mid;
+            }
+            if (cmp < 0)
+            {
+                high = mid;
+            }
+            else
+            {
+                low = mid + 1;
+            }
+        }
+        return -1;
+    }
+
+    for (size_t i = 0; i < dict->size; i++)
+    {
+        BString *other = dict->elements[i].key;
+        if (key_cmp(key, len, other->chars, other->size) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
 void decode_bencoded_string(Parser *p, Bencoded *container)
 {
-    if (!source_contains(*p, ':')) {
-        fprintf(stderr, "ERR: Invalid bencoded string, no colon found\n");
+    unsigned long encoded_length;
+    int result = parser_read_number(p, LONG_MAX, false, &encoded_length);
+    if (result == PARSER_ERR_PARTIAL) {
+        log_printf(LOG_DEBUG, "ERR: Invalid bencoded string, no colon found\n");
         parser_set_error(p, PARSER_ERR_PARTIAL);
         return;
     }
 
-    char *endptr;
-    long encoded_length = strtol(p->src.position, &endptr, 10);
-
-    if (*endptr != ':') {
-        fprintf(stderr, "ERR: Invalid bencoded string, found non-integer before colon\n");
+    if (result != PARSER_SUCCESS || *p->src.position != ':') {
+        log_printf(LOG_DEBUG, "ERR: Invalid bencoded string, found non-integer before colon\n");
         parser_set_error(p, PARSER_ERR_SYNTAX);
         return;
     }
 
-    parser_set_position(p, endptr + 1);
+    parser_skip(p); // skip the colon.
 
-    if (SOURCE_LEFT(p->src) < encoded_length) {
-        fprintf(stderr, "ERR: Invalid bencoded string, read would fall out of bounds\n");
+    if ((unsigned long)SOURCE_LEFT(p->src) < encoded_length) {
+        log_printf(LOG_DEBUG, "ERR: Invalid bencoded string, read would fall out of bounds\n");
         parser_set_error(p, PARSER_ERR_PARTIAL);
         return;
     }
 
-    BString *bstring = bstring_new(encoded_length);
+    BString *bstring = parser_new_string(p, p->src.position, encoded_length);
     if (bstring == NULL) {
-        fprintf(stderr, "ERR: Program out of heap memory (decoding string)\n");
+        log_printf(LOG_DEBUG, "ERR: Program out of heap memory (decoding string)\n");
         parser_set_error(p, PARSER_ERR_MEMORY);
         return;
     }
 
-    bstring_append_bytes(bstring, (unsigned const char *)p->src.position, encoded_length);
     container->data.string = bstring;
     parser_advance(p, encoded_length);
     return;
@@ -342,38 +730,50 @@ void decode_bencoded_string(Parser *p, Bencoded *container)
 
 void decode_bencoded_integer(Parser *p, Bencoded *container)
 {
-    if (!source_contains(*p, 'e'))
+    parser_skip(p); // skip the 'i' at the start.
+    bool negative = SOURCE_LEFT(p->src) > 0 && *p->src.position == '-';
+    if (negative)
+    {
+        parser_skip(p);
+
+        // a negative integer that starts with a zero is invalid however it goes on.
+        if (SOURCE_LEFT(p->src) > 0 && *p->src.position == '0')
+        {
+            log_printf(LOG_DEBUG, "ERR conversion of integer failed, negative zero\n");
+            parser_set_error(p, PARSER_ERR_SYNTAX);
+            return;
+        }
+    }
+
+    // the magnitude of LONG_MIN is one more than LONG_MAX.
+    unsigned long magnitude;
+    int result = parser_read_number(p, negative ? (unsigned long)LONG_MAX + 1 : LONG_MAX, true, &magnitude);
+    if (result == PARSER_ERR_PARTIAL)
     {
-        fprintf(stderr, "ERR: Invalid bencoded integer, no 'e' found\n");
+        log_printf(LOG_DEBUG, "ERR: Invalid bencoded integer, no 'e' found\n");
         parser_set_error(p, PARSER_ERR_PARTIAL);
         return;
     }
 
-    parser_skip(p); // skip the 'i' at the start.
-    char *endptr;
-    // plus one to skip the 'i' at the start.
-    long integer = strtol(p->src.position, &endptr, 10);
-    // this means that the integer was not a valid integer.
-    // either because there was no integer to convert, the integer was too long,
-    // or the integer was not followed by an 'e'.
-    if (endptr == p->src.position || *endptr != 'e')
-    {
-        fprintf(stderr, "ERR conversion of integer failed. coverting\n");
+    // there were no digits, a leading zero, too many digits, or the digits were not followed by an 'e'.
+    if (result != PARSER_SUCCESS || *p->src.position != 'e')
+    {
+        log_printf(LOG_DEBUG, "ERR conversion of integer failed. coverting\n");
         parser_set_error(p, PARSER_ERR_SYNTAX);
         return;
-    };
+    }
 
-    parser_set_position(p, endptr + 1); // skip the trailing 'e';
-    container->data.integer = integer;
+    parser_skip(p); // skip the trailing 'e';
+    container->data.integer = negative ? (long)(0 - magnitude) : (long)magnitude;
 }
 
 void decode_bencoded_list(Parser *p, Bencoded *container)
 {
-    size_t capacity = 64; // arbitrary default for now;
-    Bencoded *elements = malloc(sizeof(Bencoded) * capacity);
+    size_t capacity = INITIAL_CAPACITY;
+    Bencoded *elements = parser_alloc(p, sizeof(Bencoded) * capacity);
     if (elements == NULL)
     {
-        fprintf(stderr, "ERR heap out of memory, decoding list\n");
+        log_printf(LOG_DEBUG, "ERR heap out of memory, decoding list\n");
         parser_set_error(p, PARSER_ERR_MEMORY);
         return;
     }
@@ -382,24 +782,26 @@ void decode_bencoded_list(Parser *p, Bencoded *container)
     parser_skip(p); // skip the 'l' at the start.
     size_t list_size = 0;
 
-    while (*p->src.position != 'e')
+    while (SOURCE_LEFT(p->src) > 0 && *p->src.position != 'e')
     {
-        // get the number of bytes read next.
-        decode_bencode_inner(p, &elements[list_size++]);
+        // a failed element cleans up after itself, so it is only counted once decoded.
+        decode_bencode_inner(p, &elements[list_size]);
 
         if (!PARSER_OK(p))
         {
-            free_bencoded_list_elements(elements, list_size);
+            parser_discard_list(p, elements, list_size);
             return;
         }
 
+        list_size++;
+
         if (list_size == capacity)
         {
+            Bencoded *tmp = parser_realloc(p, elements, sizeof(Bencoded) * capacity, sizeof(Bencoded) * capacity * 2);
             capacity *= 2;
-            Bencoded *tmp = realloc(elements, sizeof(Bencoded) * capacity);
             if (tmp == NULL)
             {
-                free_bencoded_list_elements(elements, list_size);
+                parser_discard_list(p, elements, list_size);
                 parser_set_error(p, PARSER_ERR_MEMORY);
                 return;
             }
@@ -408,24 +810,31 @@ void decode_bencoded_list(Parser *p, Bencoded *container)
     }
 
     parser_skip(p); // skip the trailing 'e'
+    if (!PARSER_OK(p))
+    {
+        parser_discard_list(p, elements, list_size);
+        return;
+    }
+
     container->data.list.size = list_size;
     container->data.list.elements = elements;
 }
 
 void decode_bencoded_dictionary(Parser *p, Bencoded *container)
 {
-    size_t capacity = 64; // arbitrary default for now;
-    BencodedDictElement *elements = malloc(sizeof(BencodedDictElement) * capacity);
+    size_t capacity = INITIAL_CAPACITY;
+    BencodedDictElement *elements = parser_alloc(p, sizeof(BencodedDictElement) * capacity);
     if (elements == NULL)
     {
-        fprintf(stderr, "ERR heap out of memory, decoding dictionary\n");
+        log_printf(LOG_DEBUG, "ERR heap out of memory, decoding dictionary\n");
         parser_set_error(p, PARSER_ERR_MEMORY);
         return;
     }
 
     parser_skip(p); // skip the 'd' at the start.
     size_t size = 0;
-    while (*p->src.position != 'e')
+    bool sorted = true;
+    while (SOURCE_LEFT(p->src) > 0 && *p->src.position != 'e')
     {
         // the key container will be copied into the key because it is a known size.
         Bencoded key_container;
@@ -433,58 +842,51 @@ void decode_bencoded_dictionary(Parser *p, Bencoded *container)
 
         if (!PARSER_OK(p))
         {
-            free_bencoded_dict_elements(elements, size);
+            parser_discard_dict(p, elements, size);
             return;
         }
 
         else if (key_container.type != STRING)
         {
-            fprintf(stderr, "dictionary key is not a string");
+            log_printf(LOG_DEBUG, "dictionary key is not a string\n");
             parser_set_error(p, PARSER_ERR_SYNTAX);
-            free_bencoded_inner(key_container);
-            free_bencoded_dict_elements(elements, size);
+            parser_discard(p, key_container);
+            parser_discard_dict(p, elements, size);
             return;
         }
 
-        // this, however, is not known yet, so it must be heap alloc'd
-        Bencoded *value_container = get_bencoded();
-        if (value_container == NULL)
-        {
-            fprintf(stderr, "ERR could not allocate memory for bencoded container\n");
-            parser_set_error(p, PARSER_ERR_MEMORY);
-            free_bencoded_inner(key_container);
-            free_bencoded_dict_elements(elements, size);
-            return;
-        }
+        // the value is decoded straight into its slot, there is always room for one more element.
+        decode_bencode_inner(p, &elements[size].value);
 
-        decode_bencode_inner(p, value_container); 
-    
         if (!PARSER_OK(p))
         {
             // errno should be set elsewhere.
-            free_bencoded_inner(key_container);
-            free_bencoded(value_container);
-            free_bencoded_dict_elements(elements, size);
+            parser_discard(p, key_container);
+            parser_discard_dict(p, elements, size);
             return;
         }
 
-        // push the key and value into the dictionary.
-        elements[size].key = key_container.data.string;
-        // push the value into the dict.
-        elements[size].value = value_container;
+        // keep track of whether the keys arrive in order, as the spec says they must.
+        BString *key = key_container.data.string;
+        if (size > 0 && sorted)
+        {
+            BString *prev = elements[size - 1].key;
+            sorted = key_cmp(prev->chars, prev->size, key->chars, key->size) < 0;
+        }
+
+        // push the key into the dictionary.
+        elements[size].key = key;
         size++;
         // resize the dictionary if necessary.
         if (size == capacity)
         {
+            BencodedDictElement *tmp = parser_realloc(p, elements, sizeof(BencodedDictElement) * capacity, sizeof(BencodedDictElement) * capacity * 2);
             capacity *= 2;
-            BencodedDictElement *tmp = realloc(elements, sizeof(BencodedDictElement) * capacity);
             if (tmp == NULL)
             {
-                fprintf(stderr, "failed to resize the bencoded dictionary\n");
+                log_printf(LOG_DEBUG, "failed to resize the bencoded dictionary\n");
                 parser_set_error(p, PARSER_ERR_MEMORY);
-                free_bencoded_inner(key_container);
-                free_bencoded(value_container);
-                free_bencoded_dict_elements(elements, size);
+                parser_discard_dict(p, elements, size);
                 return;
             }
             elements = tmp;
@@ -492,8 +894,16 @@ void decode_bencoded_dictionary(Parser *p, Bencoded *container)
     }
 
     parser_skip(p); // skip the trailing 'e'
+    if (!PARSER_OK(p))
+    {
+        parser_discard_dict(p, elements, size);
+        return;
+    }
+
     container->data.dictionary.size = size;
     container->data.dictionary.elements = elements;
+    container->data.dictionary.sorted = sorted;
+    dict_build_index(p, &container->data.dictionary);
 }
 
 
@@ -504,6 +914,15 @@ void decode_bencode_inner(Parser *p, Bencoded *container)
         return;
     }
 
+    if (SOURCE_LEFT(p->src) == 0)
+    {
+        parser_set_error(p, PARSER_ERR_PARTIAL);
+        return;
+    }
+
+    // where this value starts in the source, together with encoded_length this is its raw span.
+    container->encoded_offset = p->src.position - p->src.origin;
+
     // string
     if (is_digit(p->src.position[0]))
     {
@@ -527,7 +946,12 @@ void decode_bencode_inner(Parser *p, Bencoded *container)
     {
         container->type = LIST;
         const char* start = p->src.position;
+        if (!parser_enter(p))
+        {
+            return;
+        }
         decode_bencoded_list(p, container);
+        p->depth--;
         container->encoded_length = p->src.position - start;
         return;
     }
@@ -536,7 +960,12 @@ void decode_bencode_inner(Parser *p, Bencoded *container)
     {
         container->type = DICTIONARY;
         const char* start = p->src.position;
+        if (!parser_enter(p))
+        {
+            return;
+        }
         decode_bencoded_dictionary(p, container);
+        p->depth--;
         container->encoded_length = p->src.position - start;
         return;
     }
@@ -550,6 +979,174 @@ void decode_bencode_inner(Parser *p, Bencoded *container)
 }
 
 
+void stream_parser_value_done(StreamParser *sp, bool string)
+{
+    if (sp->depth == 0)
+    {
+        sp->state = STREAM_DONE;
+        return;
+    }
+
+    sp->state = STREAM_VALUE;
+    size_t level = sp->depth - 1;
+    if (stream_level_get(sp->dicts, level))
+    {
+        bool key = stream_level_get(sp->keys, level);
+        if (key && !string)
+        {
+            sp->state = STREAM_ERROR;
+        }
+        stream_level_set(sp->keys, level, !key);
+    }
+}
+
+bool stream_level_get(const unsigned char *bits, size_t level)
+{
+    return bits[level / 8] & (1u << (level % 8));
+}
+
+void stream_level_set(unsigned char *bits, size_t level, bool value)
+{
+    if (value)
+    {
+        bits[level / 8] |= 1u << (level % 8);
+    }
+    else
+    {
+        bits[level / 8] &= ~(1u << (level % 8));
+    }
+}
+
+void stream_parser_step(StreamParser *sp, char c)
+{
+    switch (sp->state)
+    {
+        case STREAM_VALUE:
+        {
+            if (is_digit(c))
+            {
+                sp->state = STREAM_STRING_LENGTH;
+                sp->remaining = c - '0';
+            }
+            else if (is_bencoded_int(c))
+            {
+                sp->state = STREAM_INTEGER_START;
+                sp->remaining = 0;
+                sp->negative = false;
+            }
+            else if ((c == 'l' || c == 'd') && sp->depth < BENCODE_MAX_DEPTH)
+            {
+                stream_level_set(sp->dicts, sp->depth, c == 'd');
+                stream_level_set(sp->keys, sp->depth, true);
+                sp->depth++;
+            }
+            // a dictionary may only end where a key would start, as its last key has a value.
+            else if (c == 'e' && sp->depth > 0 &&
+                     (!stream_level_get(sp->dicts, sp->depth - 1) || stream_level_get(sp->keys, sp->depth - 1)))
+            {
+                sp->depth--;
+                stream_parser_value_done(sp, false);
+            }
+            else
+            {
+                sp->state = STREAM_ERROR;
+            }
+            break;
+        }
+
+        case STREAM_INTEGER_START:
+        case STREAM_INTEGER_SIGN:
+        {
+            // no leading zeros and no negative zero, as decode_bencode requires.
+            if (c == '-' && sp->state == STREAM_INTEGER_START)
+            {
+                sp->state = STREAM_INTEGER_SIGN;
+                sp->negative = true;
+            }
+            else if (c == '0')
+            {
+                sp->state = sp->negative ? STREAM_ERROR : STREAM_INTEGER_ZERO;
+            }
+            else if (is_digit(c))
+            {
+                sp->state = STREAM_INTEGER_DIGITS;
+                sp->remaining = c - '0';
+            }
+            else
+            {
+                sp->state = STREAM_ERROR;
+            }
+            break;
+        }
+
+        case STREAM_INTEGER_DIGITS:
+        {
+            // the magnitude of LONG_MIN is one more than LONG_MAX.
+            unsigned long magnitude = sp->remaining;
+            if (is_digit(c) && number_push_digit(&magnitude, c, sp->negative ? (unsigned long)LONG_MAX + 1 : LONG_MAX))
+            {
+                sp->remaining = magnitude;
+            }
+            else if (c == 'e')
+            {
+                stream_parser_value_done(sp, false);
+            }
+            else
+            {
+                sp->state = STREAM_ERROR;
+            }
+            break;
+        }
+
+        case STREAM_INTEGER_ZERO:
+        {
+            if (c == 'e')
+            {
+                stream_parser_value_done(sp, false);
+            }
+            else
+            {
+                sp->state = STREAM_ERROR;
+            }
+            break;
+        }
+
+        case STREAM_STRING_LENGTH:
+        {
+            if (is_digit(c))
+            {
+                // reject lengths that could not possibly be buffered, as decode_bencode does.
+                unsigned long length = sp->remaining;
+                if (!number_push_digit(&length, c, LONG_MAX))
+                {
+                    sp->state = STREAM_ERROR;
+                    break;
+                }
+                sp->remaining = length;
+            }
+            else if (c == ':')
+            {
+                sp->state = STREAM_STRING_BODY;
+                if (sp->remaining == 0)
+                {
+                    stream_parser_value_done(sp, true);
+                }
+            }
+            else
+            {
+                sp->state = STREAM_ERROR;
+            }
+            break;
+        }
+
+        default:
+        {
+            sp->state = STREAM_ERROR;
+            break;
+        }
+    }
+}
+
 size_t encode_string(Bencoded *b, char *target)
 {
     size_t nbytes = 0;
@@ -597,7 +1194,7 @@ size_t encode_dict(Bencoded *b, char *target)
         key.type = STRING;
         key.data.string = el.key;
         nbytes += route_bencode(&key, target + nbytes);
-        nbytes += route_bencode(el.value, target + nbytes);
+        nbytes += route_bencode(&b->data.dictionary.elements[i].value, target + nbytes);
     }
 
     target[nbytes++] = 'e';
@@ -637,7 +1234,7 @@ Bencoded *get_bencoded()
     Bencoded *bcode = malloc(sizeof(Bencoded));
     if (bcode == NULL)
     {
-        fprintf(stderr, "could not alloc memory for new bencode.");
+        log_printf(LOG_DEBUG, "could not alloc memory for new bencode.\n");
         return NULL;
     };
     return bcode;
@@ -658,6 +1255,7 @@ void free_bencoded_inner(Bencoded b)
     if (b.type == DICTIONARY)
     {
         free_bencoded_dict_elements(b.data.dictionary.elements, b.data.dictionary.size);
+        free(b.data.dictionary.index);
     }
 };
 
@@ -667,11 +1265,36 @@ void free_bencoded(Bencoded *b)
     free(b);
 };
 
-int decode_bencode(Bencoded *container, const char *bencoded_value, size_t stream_length)
+size_t bencode_allocations(void)
+{
+    return parser_heap_allocations;
+}
+
+int decode_bencode(Bencoded *container, const char *bencoded_value, size_t stream_length, Arena *arena)
 {
     Parser p; 
-    parser_init(&p, bencoded_value, stream_length);
+    parser_init(&p, bencoded_value, stream_length, false, arena);
+    uint64_t start = metrics_enabled ? metrics_now_ns() : 0;
+    decode_bencode_inner(&p, container);
+    if (metrics_enabled)
+    {
+        metrics_record(METRIC_DECODE_TIME, metrics_now_ns() - start);
+        metrics_count(METRIC_DECODES, 1);
+    }
+    return p.state;
+}
+
+int decode_bencode_borrowed(Bencoded *container, const char *bencoded_value, size_t stream_length, Arena *arena)
+{
+    Parser p;
+    parser_init(&p, bencoded_value, stream_length, true, arena);
+    uint64_t start = metrics_enabled ? metrics_now_ns() : 0;
     decode_bencode_inner(&p, container);
+    if (metrics_enabled)
+    {
+        metrics_record(METRIC_DECODE_TIME, metrics_now_ns() - start);
+        metrics_count(METRIC_DECODES, 1);
+    }
     return p.state;
 }
 
@@ -679,23 +1302,69 @@ Bencoded *get_dict_key(Bencoded *b, const char *search_str)
 {
     if (b->type != DICTIONARY)
     {
-        fprintf(stderr, "ERR: attempt to read key from none dictionary bencoded value");
+        log_printf(LOG_DEBUG, "ERR: attempt to read key from none dictionary bencoded value\n");
+        return NULL;
+    }
+
+    BencodedDictionary *dict = &b->data.dictionary;
+    long i = dict_find(dict, (const unsigned char *)search_str, strlen(search_str));
+    if (i < 0)
+    {
+        // not found
         return NULL;
     }
 
-    BencodedDictionary dict = b->data.dictionary;
-    // for now perform a linear search through the keys until we find one matching;
-    for (size_t i = 0; i < dict.size; i++)
+    return &dict->elements[i].value;
+}
+
+const char *bencoded_source_span(Bencoded *b, const char *source)
+{
+    return source + b->encoded_offset;
+}
+
+void stream_parser_init(StreamParser *sp)
+{
+    sp->state = STREAM_VALUE;
+    sp->depth = 0;
+    sp->remaining = 0;
+    sp->negative = false;
+    sp->consumed = 0;
+}
+
+int stream_parser_feed(StreamParser *sp, const char *chunk, size_t n)
+{
+    if (sp->state == STREAM_DONE && n > 0)
+    {
+        sp->state = STREAM_ERROR;
+    }
+
+    size_t i = 0;
+    while (i < n && sp->state != STREAM_DONE && sp->state != STREAM_ERROR)
     {
-        BencodedDictElement el = dict.elements[i];
-        if (bstring_cmp_cstr(el.key, search_str) == 0)
+        // string contents are skipped in bulk, which is what most of a large response is made of.
+        if (sp->state == STREAM_STRING_BODY)
         {
-            return el.value;
+            size_t left = n - i;
+            size_t skip = sp->remaining < left ? sp->remaining : left;
+            i += skip;
+            sp->remaining -= skip;
+            if (sp->remaining == 0)
+            {
+                stream_parser_value_done(sp, true);
+            }
+            continue;
         }
+
+        stream_parser_step(sp, chunk[i++]);
+    }
+
+    if (sp->state == STREAM_ERROR)
+    {
+        return PARSER_ERR_SYNTAX;
     }
 
-    // not found
-    return NULL;
+    sp->consumed += i;
+    return sp->state == STREAM_DONE ? PARSER_SUCCESS : PARSER_ERR_PARTIAL;
 }
 
 size_t encode_bencode(Bencoded *b, char *target)
@@ -747,7 +1416,7 @@ void print_bencoded(Bencoded b, FILE* fd, bool flush_output)
                 (int)b.data.dictionary.elements[i].key->size, 
                 b.data.dictionary.elements[i].key->chars);
 
-                print_bencoded(*b.data.dictionary.elements[i].value, fd, false);
+                print_bencoded(b.data.dictionary.elements[i].value, fd, false);
                 if (i != b.data.dictionary.size - 1)
                 {
                     fprintf(fd, ",");
@@ -8,7 +8,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "bstring.h"
+#include "arena.h"
 
 // Define custom error codes
 #define PARSER_SUCCESS 0
@@ -16,6 +18,14 @@
 #define PARSER_ERR_SYNTAX -2
 #define PARSER_ERR_MEMORY -3
 
+// dictionaries with at least this many keys get a hashed index built while decoding them,
+// smaller ones are searched directly. 0 disables the index entirely.
+#define BENCODE_DICT_INDEX_MIN_SIZE 16
+
+// the deepest lists and dictionaries may nest, deeper ones are a syntax error. the decoder recurses
+// once per level, this keeps a hostile input from overflowing the stack.
+#define BENCODE_MAX_DEPTH 256
+
 // Enumeration for Bencode types
 typedef enum
 {
@@ -28,6 +38,9 @@ typedef enum
 // Forward declaration of Bencoded
 typedef struct Bencoded Bencoded;
 
+// Forward declaration of a dictionary element, defined once Bencoded is complete.
+typedef struct BencodedDictElement BencodedDictElement;
+
 // Separate struct for list data
 typedef struct
 {
@@ -35,25 +48,22 @@ typedef struct
     Bencoded *elements;
 } BencodedList;
 
-// Separate struct for dictionary elements
-typedef struct
-{
-    BString *key;
-    Bencoded *value;
-} BencodedDictElement;
-
 // Separate struct for dictionary data
 typedef struct
 {
     size_t size;
     BencodedDictElement *elements;
+    bool sorted;           // keys are in strictly ascending byte order, as the spec requires, so they can be binary searched.
+    uint32_t *index;       // open addressing table of element positions + 1 (0 is empty), or NULL if there is none.
+    size_t index_capacity; // the number of slots in the index, always a power of two.
 } BencodedDictionary;
 
 // Bencoded struct from parsing a Bencoded string. The structs for creating a Bencoded string are separate.
 struct Bencoded
 {
     BType type;
-    long encoded_length;
+    long encoded_offset; // the offset of this value in the buffer it was decoded from.
+    long encoded_length; // the number of bytes this value takes up in that buffer.
     union
     {
         BString *string;
@@ -63,6 +73,43 @@ struct Bencoded
     } data;
 };
 
+// Separate struct for dictionary elements. The value is stored inline so a dictionary needs one
+// allocation for all of its elements rather than one per value.
+struct BencodedDictElement
+{
+    BString *key;
+    Bencoded value;
+};
+
+// The states of a StreamParser, see stream_parser_feed.
+typedef enum
+{
+    STREAM_VALUE,          // expecting the start of a value, or the 'e' closing a container.
+    STREAM_INTEGER_START,  // just read the 'i' of an integer.
+    STREAM_INTEGER_SIGN,   // just read the '-' of a negative integer.
+    STREAM_INTEGER_ZERO,   // read an integer that is 0, only its 'e' may follow.
+    STREAM_INTEGER_DIGITS, // reading the digits of an integer.
+    STREAM_STRING_LENGTH,  // reading the length prefix of a string.
+    STREAM_STRING_BODY,    // skipping over the contents of a string.
+    STREAM_DONE,           // a complete value has been seen.
+    STREAM_ERROR           // the input is not valid bencode.
+} StreamState;
+
+// A resumable parser that is fed a bencoded value chunk by chunk as it arrives (e.g. from the network).
+// It only looks at each new byte once, skipping string contents in bulk, and reports when the top level
+// value is complete. It checks what decode_bencode checks of the structure, a string for every key and a
+// value after it, so both agree on whether and where a value ends. The completed buffer can then be decoded in a single pass with decode_bencode.
+typedef struct
+{
+    StreamState state;
+    size_t depth;     // the number of lists and dictionaries currently open.
+    unsigned char dicts[BENCODE_MAX_DEPTH / 8]; // a bit per open container, set if it is a dictionary.
+    unsigned char keys[BENCODE_MAX_DEPTH / 8];  // a bit per open dictionary, set while it expects a key.
+    size_t remaining; // the string length or integer magnitude being read, or the string bytes left to skip.
+    bool negative;    // whether the integer being read is negative.
+    size_t consumed;  // the number of bytes consumed so far, the encoded length once done.
+} StreamParser;
+
 /**
  * Prints the given Bencoded data structure.
  * @param b The Bencoded data structure to print.
@@ -93,20 +140,75 @@ void free_bencoded(Bencoded *b);
 void free_bencoded_inner(Bencoded b);
 
 /**
- * Gets the Bencoded data structure at the given index in a list.
- * @param b The Bencoded data structure containing the list.
+ * Gets the value stored under a key in a dictionary.
+ * Uses the dictionary's hashed index when it has one, a binary search when its keys are sorted
+ * and a linear scan otherwise, so out of order input found in the wild is still handled.
+ * @param b The Bencoded data structure containing the dictionary.
  * @param search_str the string to search for in the dictionary
+ * @return the value, or NULL if the key is not present (the first one wins if a key is repeated).
 */
 Bencoded *get_dict_key(Bencoded *b, const char *search_str);
 
 /**
  * Decodes a Bencoded string into a Bencoded data structure.
+ * Nothing past stream_length is read, the input need not be NUL terminated. Integers must fit a long
+ * and be written as the spec requires, without leading zeros and with no negative zero.
+ * When an arena is given every node, element array and string of the tree is allocated from it.
+ * Such a tree must not be passed to free_bencoded / free_bencoded_inner, it is released all at once
+ * by arena_reset or arena_free. On error, anything already taken from the arena is simply abandoned.
  * @param container The Bencoded data structure to store the decoded data.
  * @param bencoded_value The Bencoded string to decode.
  * @param stream_length The length of the Bencoded string.
+ * @param arena The arena to allocate the tree from, or NULL to allocate it on the heap.
  * @return The size of the decoded data, or an error code less than 0; -1 for partial data, -2 for syntax error, -3 for memory error.
  */
-int decode_bencode(Bencoded *container, const char *bencoded_value, size_t stream_length);
+int decode_bencode(Bencoded *container, const char *bencoded_value, size_t stream_length, Arena *arena);
+
+/**
+ * Decodes a Bencoded string into a Bencoded data structure without copying any string data.
+ * Every STRING node and dictionary key is a borrowed view (see bstring_view) into bencoded_value,
+ * so the tree only allocates its nodes. The buffer must stay alive and unmodified until the tree
+ * has been released with free_bencoded / free_bencoded_inner, and no string in the tree may be appended to.
+ * @param container The Bencoded data structure to store the decoded data.
+ * @param bencoded_value The Bencoded string to decode, borrowed by the resulting tree.
+ * @param stream_length The length of the Bencoded string.
+ * @param arena The arena to allocate the nodes from, or NULL to allocate them on the heap, see decode_bencode.
+ * @return The same result codes as decode_bencode.
+ */
+int decode_bencode_borrowed(Bencoded *container, const char *bencoded_value, size_t stream_length, Arena *arena);
+
+/**
+ * The number of heap allocations the decoder has made on the calling thread, e.g. to count those
+ * of a single decode by taking the difference. What is taken from an arena is not counted.
+ * @return The number of allocations so far.
+ */
+size_t bencode_allocations(void);
+
+/**
+ * Initializes a stream parser to expect a single bencoded value.
+ * @param sp The stream parser to initialize.
+ */
+void stream_parser_init(StreamParser *sp);
+
+/**
+ * Feeds the next chunk of input to a stream parser. Only the new bytes are examined.
+ * Once the value is complete sp->consumed holds its encoded length. Bytes after the value are
+ * not consumed, and feeding a done parser any more bytes is a syntax error.
+ * @param sp The stream parser to feed.
+ * @param chunk The next bytes of input.
+ * @param n The number of bytes in chunk.
+ * @return PARSER_SUCCESS on the call that completes the value, PARSER_ERR_PARTIAL while more input is needed,
+ * PARSER_ERR_SYNTAX if the input is not valid bencode.
+ */
+int stream_parser_feed(StreamParser *sp, const char *chunk, size_t n);
+
+/**
+ * Gets the original bytes a decoded value was parsed from, see encoded_offset / encoded_length.
+ * @param b The decoded Bencoded value.
+ * @param source The buffer b was decoded from, it must still be alive and unmodified.
+ * @return A pointer to the first of b->encoded_length bytes in source.
+ */
+const char *bencoded_source_span(Bencoded *b, const char *source);
 
 /**
  * Encodes a Bencoded data structure into a Bencoded string.
@@ -0,0 +1,66 @@
+/**
+ * @file bitfield.c
+ * @brief Implementation file for a fixed size bit set in C.
+*/
+
+#include "bitfield.h"
+
+int bitfield_init(Bitfield *bf, size_t bits) {
+    bf->bits = bits;
+    // always allocate at least one byte so an empty set is still a valid allocation.
+    bf->bytes = calloc(BITFIELD_BYTES(bits) == 0 ? 1 : BITFIELD_BYTES(bits), 1);
+    if (bf->bytes == NULL) {
+        return BITFIELD_ERR_MEMORY;
+    }
+    return BITFIELD_SUCCESS;
+}
+
+void bitfield_wrap(Bitfield *bf, size_t bits, unsigned char *bytes) {
+    bf->bits = bits;
+    bf->bytes = bytes;
+    memset(bytes, 0, BITFIELD_BYTES(bits));
+}
+
+void bitfield_free(Bitfield *bf) {
+    free(bf->bytes);
+    bf->bytes = NULL;
+    bf->bits = 0;
+}
+
+bool bitfield_get(const Bitfield *bf, size_t i) {
+    return (bf->bytes[i / 8] >> (7 - i % 8)) & 1;
+}
+
+void bitfield_set(Bitfield *bf, size_t i) {
+    bf->bytes[i / 8] |= 1 << (7 - i % 8);
+}
+
+void bitfield_clear(Bitfield *bf, size_t i) {
+    bf->bytes[i / 8] &= ~(1 << (7 - i % 8));
+}
+
+void bitfield_clear_all(Bitfield *bf) {
+    memset(bf->bytes, 0, BITFIELD_BYTES(bf->bits));
+}
+
+size_t bitfield_count(const Bitfield *bf) {
+    size_t count = 0;
+    for (size_t i = 0; i < BITFIELD_BYTES(bf->bits); i++) {
+        count += __builtin_popcount(bf->bytes[i]);
+    }
+    return count;
+}
+
+long bitfield_first_clear(const Bitfield *bf) {
+    for (size_t i = 0; i < BITFIELD_BYTES(bf->bits); i++) {
+        if (bf->bytes[i] == 0xff) {
+            continue;
+        }
+        for (size_t bit = i * 8; bit < bf->bits && bit < i * 8 + 8; bit++) {
+            if (!bitfield_get(bf, bit)) {
+                return bit;
+            }
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file bitfield.h
+ * @brief Header file for a fixed size bit set in C. Bits are stored most significant bit first,
+ * which is the layout of the BITFIELD message in the peer wire protocol.
+*/
+
+#ifndef BITFIELD_H
+#define BITFIELD_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define BITFIELD_SUCCESS 0
+#define BITFIELD_ERR_MEMORY -1
+
+// the number of bytes needed to hold a number of bits.
+#define BITFIELD_BYTES(bits) (((bits) + 7) / 8)
+
+typedef struct
+{
+    size_t bits;          // the number of bits in the set.
+    unsigned char *bytes; // BITFIELD_BYTES(bits) bytes, spare bits in the last byte are always 0.
+} Bitfield;
+
+/**
+ * @brief Initialize a bit set with every bit cleared
+ * 
+ * @param bf The bit set to initialize
+ * @param bits The number of bits in the set
+ * @return int 0 if successful, -1 if memory allocation failed
+ */
+int bitfield_init(Bitfield *bf, size_t bits);
+
+/**
+ * @brief Initialize a bit set with every bit cleared over memory the caller owns. Such a set is
+ * not passed to bitfield_free, its memory goes wherever it came from
+ * 
+ * @param bf The bit set to initialize
+ * @param bits The number of bits in the set
+ * @param bytes BITFIELD_BYTES(bits) bytes for the bits
+ */
+void bitfield_wrap(Bitfield *bf, size_t bits, unsigned char *bytes);
+
+/**
+ * @brief Free the memory allocated for a bit set
+ * 
+ * @param bf The bit set to free
+ */
+void bitfield_free(Bitfield *bf);
+
+/**
+ * @brief Get a bit
+ * 
+ * @param bf The bit set
+ * @param i The index of the bit, must be less than bf->bits
+ * @return bool whether the bit is set
+ */
+bool bitfield_get(const Bitfield *bf, size_t i);
+
+/**
+ * @brief Set a bit
+ * 
+ * @param bf The bit set
+ * @param i The index of the bit, must be less than bf->bits
+ */
+void bitfield_set(Bitfield *bf, size_t i);
+
+/**
+ * @brief Clear a bit
+ * 
+ * @param bf The bit set
+ * @param i The index of the bit, must be less than bf->bits
+ */
+void bitfield_clear(Bitfield *bf, size_t i);
+
+/**
+ * @brief Clear every bit
+ * 
+ * @param bf The bit set
+ */
+void bitfield_clear_all(Bitfield *bf);
+
+/**
+ * @brief Count the bits that are set
+ * 
+ * @param bf The bit set
+ * @return size_t the number of set bits
+ */
+size_t bitfield_count(const Bitfield *bf);
+
+/**
+ * @brief Find the first bit that is not set
+ * 
+ * @param bf The bit set
+ * @return long the index of the first clear bit, or -1 if every bit is set
+ */
+long bitfield_first_clear(const Bitfield *bf);
+
+#endif
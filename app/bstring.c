@@ -10,6 +10,15 @@
 int bstring_resize(BString *bstr, size_t new_capacity);
 
 int bstring_resize(BString *bstr, size_t new_capacity) {
+    if (bstr->borrowed) {
+        return BSTRING_ERR_BORROWED;
+    }
+
+    // an empty string cannot grow by doubling.
+    if (bstr->capacity == 0) {
+        bstr->capacity = 1;
+    }
+
     while(bstr->capacity < new_capacity) {
         bstr->capacity *= 2;
     }
@@ -30,6 +39,7 @@ BString *bstring_new(size_t capacity) {
     }
     bstr->capacity = capacity;
     bstr->size = 0;
+    bstr->borrowed = false;
     bstr->chars = malloc(sizeof(unsigned char) * capacity);
     if (bstr->chars == NULL) {
         free(bstr);
@@ -39,8 +49,26 @@ BString *bstring_new(size_t capacity) {
     return bstr;
 }
 
+BString *bstring_view(const unsigned char *bytes, size_t size) {
+    BString *bstr = malloc(sizeof(BString));
+    if (bstr == NULL) {
+        return NULL;
+    }
+    bstring_view_init(bstr, bytes, size);
+    return bstr;
+}
+
+void bstring_view_init(BString *bstr, const unsigned char *bytes, size_t size) {
+    bstr->capacity = size;
+    bstr->size = size;
+    bstr->chars = (unsigned char *)bytes;
+    bstr->borrowed = true;
+}
+
 void bstring_free(BString *bstr) {
-    free(bstr->chars);
+    if (!bstr->borrowed) {
+        free(bstr->chars);
+    }
     free(bstr);
 }
 
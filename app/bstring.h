@@ -8,10 +8,12 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 // Define custom error codes
 #define BSTRING_SUCCESS 0
 #define BSTRING_ERR_MEMORY -1
+#define BSTRING_ERR_BORROWED -2
 
 // binary safe immutable string.
 typedef struct
@@ -19,6 +21,7 @@ typedef struct
     size_t capacity;
     size_t size;
     unsigned char *chars;
+    bool borrowed; // chars points into memory owned by someone else, it is never resized or freed.
 } BString;
 
 // a pop result indicating the success of the operation
@@ -43,6 +46,29 @@ typedef struct
  */
 BString *bstring_new(size_t capacity);
 
+/**
+ * @brief Create a BString that views an existing byte range instead of copying it.
+ * The view is read only, any append on it fails with BSTRING_ERR_BORROWED. The bytes
+ * must stay alive and unmodified for as long as the view is in use, bstring_free
+ * only releases the BString itself.
+ * 
+ * @param bytes The bytes to view
+ * @param size The number of bytes in the view
+ * @return BString* A pointer to the newly created view or NULL if memory allocation failed
+ */
+BString *bstring_view(const unsigned char *bytes, size_t size);
+
+/**
+ * @brief Initialize a caller provided BString as a view of an existing byte range, see bstring_view.
+ * Useful when the BString itself lives in memory the caller manages (e.g. an arena), such a view must
+ * not be passed to bstring_free.
+ * 
+ * @param bstr The BString to initialize
+ * @param bytes The bytes to view
+ * @param size The number of bytes in the view
+ */
+void bstring_view_init(BString *bstr, const unsigned char *bytes, size_t size);
+
 /**
  * @brief Free the memory allocated for a BString object
  * 
@@ -0,0 +1,1992 @@
+/**
+ * @file download.c
+ * @brief Implementation file for downloading a torrent from many peers at once in C.
+ * Every peer connection is a state machine (see PeerPhase) driven by a single epoll event loop,
+ * the Download is the state the connections share.
+*/
+#include "download.h"
+#include "log.h"
+#include "metrics.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+// what download_claim_piece returns when it has no piece to hand out.
+#define DOWNLOAD_NO_PIECE -1    // the peer has nothing we still need.
+#define DOWNLOAD_PIECES_BUSY -2 // everything the peer has that we need is being downloaded from others.
+
+// set once SIGINT or SIGTERM arrives while download_run runs, it then winds down as if every peer was gone.
+static volatile sig_atomic_t download_interrupted = 0;
+
+// a piece a peer is downloading, its blocks are requested in order and written to the output as they arrive.
+typedef struct {
+    Piece *piece;           // the piece being downloaded.
+    size_t next_block;      // the next block to request.
+} ActivePiece;
+
+// a block request sent to a peer that has not been answered yet.
+typedef struct {
+    ActivePiece *active;    // the piece the block is in.
+    size_t block;           // the index of the block in the piece.
+    double sent_at;         // when the request was sent, from peer_now.
+} InflightRequest;
+
+// a block a peer asked us for, it is sent once the blocks queued before it are.
+typedef struct {
+    uint32_t index;         // the index of the piece.
+    uint32_t begin;         // the offset of the block in the piece.
+    uint32_t length;        // the size of the block.
+} UploadRequest;
+
+// a finished piece waiting on the hasher. it outlives the session that downloaded it.
+typedef struct {
+    HashJob job;            // the job, its owner points back here.
+    Piece *piece;           // the piece, still claimed until the result is in.
+    size_t peer;            // the index of the peer the piece came from.
+    unsigned char *copy;    // the piece copied out of the files it runs across, NULL if it is hashed in place.
+} PendingPiece;
+
+// a connection to a single peer.
+typedef struct PeerSession {
+    Download *dl;
+    Peer_State state;
+    PeerMessage msg;
+    PeerPipeline pipeline;
+    // every active piece but the last has all of its blocks requested, so each holds at least one
+    // request in flight and there can be at most one more active piece than requests.
+    ActivePiece active[PEER_MAX_QUEUE_DEPTH + 1];
+    size_t active_count;
+    InflightRequest inflight[PEER_MAX_QUEUE_DEPTH];
+    size_t inflight_count;
+    UploadRequest uploads[DOWNLOAD_MAX_UPLOAD_REQUESTS]; // the blocks the peer asked for, oldest first.
+    size_t upload_count;
+    bool starved;           // the peer is idle only because everything it has is claimed by others, or has joined that it can.
+    double last_activity;   // when the peer last sent us anything.
+    double connected_at;    // when the handshake was done, 0 until it is.
+    size_t received;        // the payload bytes of the blocks the peer sent that we asked for.
+} PeerSession;
+
+/**
+ * @brief hand out the next piece a peer should download.
+ * @param dl The download
+ * @param state The state of the peer
+ * @return long the index of the claimed piece, DOWNLOAD_NO_PIECE or DOWNLOAD_PIECES_BUSY
+*/
+long download_claim_piece(Download *dl, Peer_State *state);
+
+/**
+ * @brief whether every piece still to download is claimed, so idle peers should join in on them.
+ * @param dl The download
+ * @return bool whether the download is in endgame
+*/
+bool download_in_endgame(Download *dl);
+
+/**
+ * @brief let go of a hold on the state of a piece, giving the piece back once nobody holds it.
+ * @param dl The download
+ * @param piece The piece
+ * @param verified Whether the piece was downloaded and verified
+ * @return void
+*/
+void download_unhold_piece(Download *dl, Piece *piece, bool verified);
+
+/**
+ * @brief give a claimed piece back, marking it as verified or handing it to another peer.
+ * @param dl The download
+ * @param index The index of the piece
+ * @param verified Whether the piece was downloaded and verified
+ * @return void
+*/
+void download_release_piece(Download *dl, size_t index, bool verified);
+
+/**
+ * @brief where a piece starts in the output file.
+ * @param dl The download
+ * @param index The index of the piece
+ * @return off_t the offset of the piece
+*/
+off_t download_piece_offset(Download *dl, size_t index);
+
+/**
+ * @brief handle a verified piece coming back from the hasher, marking it as had or handing it back.
+ * @param dl The download
+ * @param pending The piece
+ * @return void
+*/
+void download_piece_verified(Download *dl, PendingPiece *pending);
+
+/**
+ * @brief announce to the trackers that are due, and add the peers they answer with to the
+ * peers still to be tried.
+ * @param dl The download
+ * @return void
+*/
+void download_take_peers(Download *dl);
+
+/**
+ * @brief tell every connected peer that a piece is verified, so they may ask us for it.
+ * @param dl The download
+ * @param index The index of the piece
+ * @return void
+*/
+void download_broadcast_have(Download *dl, size_t index);
+
+/**
+ * @brief whether the session in a slot may be unchoked, it has to be connected and interested.
+ * @param dl The download
+ * @param slot The session slot
+ * @return bool whether the session may be unchoked
+*/
+bool download_may_unchoke(Download *dl, size_t slot);
+
+/**
+ * @brief choose the peers to upload to again, tit for tat: the DOWNLOAD_UPLOAD_SLOTS - 1 interested
+ * peers we download from the fastest, plus one more in turn every DOWNLOAD_OPTIMISTIC_ROUNDS rechokes.
+ * @param dl The download
+ * @param now The current time, from peer_now
+ * @return void
+*/
+void download_rechoke(Download *dl, double now);
+
+/**
+ * @brief note an interrupt for download_run to stop at.
+ * @param signal The signal
+ * @return void
+*/
+void download_interrupt(int signal);
+
+/**
+ * @brief read the resume file of a whole file download and check it against the files of the output.
+ * @param dl The download, its resume path set
+ * @param output_path The path of the output
+ * @param stale Set for each file that is not as it was when the resume file was saved
+ * @return bool true if the output is to be kept, false if there is no resume file that fits it
+*/
+bool download_load_resume(Download *dl, const char *output_path, bool *stale);
+
+/**
+ * @brief hash again, on every core, the pieces had that lie in a file that changed since the
+ * resume file was saved, and forget the half downloaded pieces in one.
+ * @param dl The download, its storage open and have set from the resume file
+ * @param stale For each file, whether it changed
+ * @return void
+*/
+void download_recheck_stale(Download *dl, const bool *stale);
+
+/**
+ * @brief take every result of the hasher during download_recheck_stale, waiting for one if need be.
+ * @param dl The download
+ * @return size_t the number of results taken
+*/
+size_t download_take_rechecked(Download *dl);
+
+/**
+ * @brief tell whether any of a piece lies in one of a set of files.
+ * @param dl The download
+ * @param index The index of the piece
+ * @param files For each file, whether it is in the set
+ * @return bool true if the piece overlaps a file of the set
+*/
+bool download_piece_in(Download *dl, size_t index, const bool *files);
+
+/**
+ * @brief save the pieces had and the blocks of the pieces half downloaded to the resume file.
+ * The output is synced first, so everything the file lists is on disk.
+ * @param dl The download
+ * @return int DOWNLOAD_SUCCESS, or DOWNLOAD_ERR_IO
+*/
+int download_save_resume(Download *dl);
+
+/**
+ * @brief write a stats line, see metrics_write_stats.
+ * @param snapshot Room for a snapshot
+ * @param previous The counters of the previous line, replaced with the current ones
+ * @param since When the previous line was written, set to now
+ * @param now The current time, from peer_now
+ * @return void
+*/
+void download_write_stats(MetricsSnapshot *snapshot, uint64_t *previous, double *since, double now);
+
+/**
+ * @brief start a non-blocking connection to a peer and register it with the event loop.
+ * @param dl The download
+ * @param epoll_fd The event loop
+ * @param peer The peer to connect to
+ * @return PeerSession* the new session, or NULL if the connection could not be started
+*/
+PeerSession *session_open(Download *dl, int epoll_fd, Peer *peer);
+
+/**
+ * @brief take over a connection that is handshaken or still being opened, e.g. one from
+ * peer_connect_batch, and register it with the event loop.
+ * @param dl The download
+ * @param epoll_fd The event loop
+ * @param state The state of the connection, it is moved into the session
+ * @return PeerSession* the new session, or NULL on error (the state is freed)
+*/
+PeerSession *session_adopt(Download *dl, int epoll_fd, Peer_State *state);
+
+/**
+ * @brief the connection of a session finished its handshake, tell the peer we are interested.
+ * @param session The session
+ * @return int PEER_SUCCESS, or PEER_ERR_MEMORY if the message could not be queued
+*/
+int session_connected(PeerSession *session);
+
+/**
+ * @brief close a session, handing back the pieces it was downloading.
+ * @param session The session to close
+ * @return void
+*/
+void session_close(PeerSession *session);
+
+/**
+ * @brief advance a session's state machine after the event loop reported its socket ready.
+ * On failure the session is marked PEER_CLOSED, it is closed once the batch of events is handled.
+ * @param session The session
+ * @param events The epoll events of the socket
+ * @return void
+*/
+void session_handle(PeerSession *session, uint32_t events);
+
+/**
+ * @brief read and handle everything a connected session's peer sent, until the socket would block.
+ * Block payloads that have not fully arrived are received straight into the output file.
+ * @param session The session
+ * @param readable Whether the socket was reported readable, if not only what is buffered is handled
+ * @return int PEER_SUCCESS, or an error code less than 0 if the session should be closed
+*/
+int session_receive(PeerSession *session, bool readable);
+
+/**
+ * @brief handle every complete message in a session's input buffer, and start receiving the block
+ * at the front of it into place if its payload is still on its way.
+ * @param session The session
+ * @return int PEER_SUCCESS, or an error code less than 0 if the session should be closed
+*/
+int session_parse(PeerSession *session);
+
+/**
+ * @brief queue a block a session's peer asked for. Requests while the peer is choked, for pieces we
+ * do not have, or past the end of a piece are ignored.
+ * @param session The session
+ * @param msg The REQUEST message
+ * @return int PEER_SUCCESS, or PEER_ERR_PROTOCOL if the message is malformed
+*/
+int session_queue_upload(PeerSession *session, PeerMessage *msg);
+
+/**
+ * @brief take a block a session's peer no longer wants off its queue, unless it is already being sent.
+ * @param session The session
+ * @param msg The CANCEL message
+ * @return int PEER_SUCCESS, or PEER_ERR_PROTOCOL if the message is malformed
+*/
+int session_cancel_upload(PeerSession *session, PeerMessage *msg);
+
+/**
+ * @brief send the blocks a session's peer asked for, one after the other, until the socket would block.
+ * @param session The session
+ * @return int PEER_SUCCESS, or an error code less than 0 if the session should be closed
+*/
+int session_serve(PeerSession *session);
+
+/**
+ * @brief queue a block that runs across files as a whole PIECE message, copied into the output
+ * buffer rather than sent with sendfile.
+ * @param session The session
+ * @param request The block
+ * @param offset Where the block is in the storage
+ * @return int PEER_SUCCESS, or PEER_ERR_MEMORY
+*/
+int session_queue_copy(PeerSession *session, UploadRequest *request, off_t offset);
+
+/**
+ * @brief choke or unchoke a session's peer, a choked peer's queued requests are thrown away.
+ * @param session The session
+ * @param choke Whether to choke the peer
+ * @return int PEER_SUCCESS, or PEER_ERR_MEMORY if the message could not be queued
+*/
+int session_set_choking(PeerSession *session, bool choke);
+
+/**
+ * @brief top up the requests of a connected session and send whatever is queued.
+ * @param session The session
+ * @return int PEER_SUCCESS, or an error code less than 0 if the session should be closed
+*/
+int session_advance(PeerSession *session);
+
+/**
+ * @brief whether a session has gone quiet for longer than DOWNLOAD_PEER_TIMEOUT while we wait on it.
+ * @param session The session
+ * @param now The current time, from peer_now
+ * @return bool whether the session timed out
+*/
+bool session_timed_out(PeerSession *session, double now);
+
+/**
+ * @brief keep the peer's request queue at its pipeline depth, claiming new pieces as needed.
+ * @param session The peer session
+ * @return int PEER_SUCCESS, or an error code less than 0 if a request could not be queued
+*/
+int session_fill_requests(PeerSession *session);
+
+/**
+ * @brief start downloading a newly claimed piece.
+ * @param session The peer session
+ * @param index The index of the piece
+ * @return ActivePiece* the active piece, or NULL on error
+*/
+ActivePiece *session_start_piece(PeerSession *session, size_t index);
+
+/**
+ * @brief find the request a block answers.
+ * @param session The peer session
+ * @param index The index of the piece
+ * @param begin The offset of the block in the piece
+ * @param length The size of the block
+ * @return InflightRequest* the request, or NULL if we did not ask for the block or no longer wait on it
+*/
+InflightRequest *session_find_request(PeerSession *session, uint32_t index, uint32_t begin, size_t length);
+
+/**
+ * @brief handle a complete PIECE message from the input buffer, writing its block to the output.
+ * The write may only be queued, the payload stays in the input buffer until the session is flushed.
+ * @param session The peer session
+ * @return int PEER_SUCCESS, or PEER_ERR_IO if the block could not be written
+*/
+int session_receive_block(PeerSession *session);
+
+/**
+ * @brief a block is in the output file, account for it and finish its piece once every block is in.
+ * @param session The peer session
+ * @param request The request the block answers
+ * @return int PEER_SUCCESS, or an error code less than 0 if a finished piece could not be handed on
+*/
+int session_block_arrived(PeerSession *session, InflightRequest *request);
+
+/**
+ * @brief hand a piece whose blocks have all arrived to the hasher, and stop tracking it in the session.
+ * The piece is hashed where it landed in the output, so its queued writes are flushed first.
+ * @param session The peer session
+ * @param active The finished piece
+ * @return int PEER_SUCCESS, PEER_ERR_IO or PEER_ERR_MEMORY
+*/
+int session_finish_piece(PeerSession *session, ActivePiece *active);
+
+/**
+ * @brief join in on a piece other sessions are downloading, in endgame.
+ * @param session The peer session
+ * @return ActivePiece* the active piece, or NULL if the peer has nothing it could join
+*/
+ActivePiece *session_join_piece(PeerSession *session);
+
+/**
+ * @brief a block arrived from one session, cancel it at every other session racing for it.
+ * @param session The session the block came from
+ * @param piece The piece
+ * @param block The index of the block
+ * @return void
+*/
+void session_cancel_elsewhere(PeerSession *session, Piece *piece, size_t block);
+
+/**
+ * @brief cancel a block requested from a session's peer, forgetting its piece if nothing is left
+ * for the session to do on it.
+ * @param session The peer session
+ * @param active The piece the block is in
+ * @param block The index of the block
+ * @return void
+*/
+void session_cancel_block(PeerSession *session, ActivePiece *active, size_t block);
+
+/**
+ * @brief another session finished a piece this one was racing for, cancel what is left of it and forget it.
+ * @param session The peer session
+ * @param active The piece
+ * @return void
+*/
+void session_abandon_piece(PeerSession *session, ActivePiece *active);
+
+/**
+ * @brief apply a message to a session's peer state, keeping the availability of pieces in step
+ * with the BITFIELD and HAVE messages of the peer.
+ * @param session The peer session
+ * @param msg The message
+ * @return int PEER_SUCCESS, or PEER_ERR_PROTOCOL
+*/
+int session_apply(PeerSession *session, PeerMessage *msg);
+
+/**
+ * @brief stop tracking an active piece and hand it back to be downloaded by another peer.
+ * @param session The peer session
+ * @param active The piece to drop
+ * @return void
+*/
+void session_drop_piece(PeerSession *session, ActivePiece *active);
+
+/**
+ * @brief stop tracking an active piece in the session, the piece itself is left alone.
+ * @param session The peer session
+ * @param active The piece to forget
+ * @return void
+*/
+void session_forget_piece(PeerSession *session, ActivePiece *active);
+
+/**
+ * @brief hand back every active piece and forget every request, the peer will not answer them.
+ * @param session The peer session
+ * @return void
+*/
+void session_drop_all(PeerSession *session);
+
+Download *download_new(Torrent *torrent, const char *output_path, bool single_piece)
+{
+    Download *dl = malloc(sizeof(Download));
+    if (dl == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for download\n");
+        return NULL;
+    }
+
+    TorrentFile *file = torrent->file;
+    dl->torrent = torrent;
+    dl->single_piece = single_piece;
+    dl->remaining = 0;
+    dl->left = 0;
+    dl->downloaded = 0;
+    dl->peers = NULL;
+    dl->peers_count = 0;
+    dl->announcer = NULL;
+    dl->next_peer = 0;
+    dl->changed = false;
+    dl->verifying = 0;
+    dl->failures = NULL;
+    dl->claimed_count = 0;
+    dl->sessions = NULL;
+    dl->next_rechoke = 0;
+    dl->rechokes = 0;
+    dl->optimistic = DOWNLOAD_MAX_PEERS;
+    dl->uploaded = 0;
+    dl->resume_path = NULL;
+    dl->next_resume = 0;
+    dl->unsaved = false;
+    pool_init(&dl->pieces, piece_footprint(file));
+    pool_init(&dl->pending, sizeof(PendingPiece));
+
+    dl->downloading = calloc(file->num_pieces > 0 ? file->num_pieces : 1, sizeof(Piece *));
+    if (dl->downloading == NULL ||
+        bitfield_init(&dl->wanted, file->num_pieces) != BITFIELD_SUCCESS ||
+        bitfield_init(&dl->have, file->num_pieces) != BITFIELD_SUCCESS ||
+        bitfield_init(&dl->claimed, file->num_pieces) != BITFIELD_SUCCESS ||
+        resume_init(&dl->resume, file) != RESUME_SUCCESS)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for download state\n");
+        free(dl->downloading);
+        bitfield_free(&dl->wanted);
+        bitfield_free(&dl->have);
+        bitfield_free(&dl->claimed);
+        free(dl);
+        return NULL;
+    }
+
+    // a single piece is not worth resuming, it is downloaded again from the start.
+    bool keep = false;
+    bool *stale = NULL;
+    if (!single_piece)
+    {
+        size_t path_length = strlen(output_path);
+        dl->resume_path = malloc(path_length + sizeof(DOWNLOAD_RESUME_SUFFIX));
+        stale = calloc(file->file_count > 0 ? file->file_count : 1, sizeof(bool));
+        if (dl->resume_path == NULL || stale == NULL)
+        {
+            fprintf(stderr, "ERR: failed to allocate memory for download state\n");
+            free(stale);
+            free(dl->resume_path);
+            resume_free(&dl->resume);
+            free(dl->downloading);
+            bitfield_free(&dl->wanted);
+            bitfield_free(&dl->have);
+            bitfield_free(&dl->claimed);
+            free(dl);
+            return NULL;
+        }
+        memcpy(dl->resume_path, output_path, path_length);
+        memcpy(dl->resume_path + path_length, DOWNLOAD_RESUME_SUFFIX, sizeof(DOWNLOAD_RESUME_SUFFIX));
+        keep = download_load_resume(dl, output_path, stale);
+    }
+
+    // size the whole file up front, blocks land at their offset in any order.
+    // a single piece is sized once it is known which one it is, and always goes in a single file.
+    if (file->multi_file && !single_piece)
+        dl->storage = storage_open_files(output_path, file, keep);
+    else
+        dl->storage = storage_open(output_path, single_piece ? 0 : (off_t)file->file_size, keep);
+    if (dl->storage == NULL)
+    {
+        free(stale);
+        free(dl->resume_path);
+        resume_free(&dl->resume);
+        free(dl->downloading);
+        bitfield_free(&dl->wanted);
+        bitfield_free(&dl->have);
+        bitfield_free(&dl->claimed);
+        free(dl);
+        return NULL;
+    }
+
+    dl->hasher = hasher_new();
+    if (dl->hasher == NULL)
+    {
+        storage_close(dl->storage);
+        free(stale);
+        free(dl->resume_path);
+        resume_free(&dl->resume);
+        free(dl->downloading);
+        bitfield_free(&dl->wanted);
+        bitfield_free(&dl->have);
+        bitfield_free(&dl->claimed);
+        free(dl);
+        return NULL;
+    }
+
+    if (keep)
+    {
+        memcpy(dl->have.bytes, dl->resume.have.bytes, BITFIELD_BYTES(file->num_pieces));
+        download_recheck_stale(dl, stale);
+    }
+    free(stale);
+    return dl;
+}
+
+bool download_load_resume(Download *dl, const char *output_path, bool *stale)
+{
+    TorrentFile *file = dl->torrent->file;
+    if (resume_load(dl->resume_path, dl->torrent, &dl->resume) != RESUME_SUCCESS)
+        return false;
+
+    // a file that is gone means the output was moved or deleted, it is started over. a file that
+    // is there but not as it was only has its own pieces hashed again.
+    struct stat *stats = malloc(file->file_count * sizeof(struct stat));
+    bool keep = stats != NULL && storage_stat_files(output_path, file->multi_file ? file : NULL, stats) == STORAGE_SUCCESS;
+    for (size_t i = 0; keep && i < file->file_count; i++)
+    {
+        stale[i] = !resume_stamp_matches(&dl->resume.stamps[i], &stats[i]);
+    }
+    free(stats);
+
+    if (!keep)
+        resume_clear(&dl->resume);
+    return keep;
+}
+
+bool download_piece_in(Download *dl, size_t index, const bool *files)
+{
+    TorrentFile *file = dl->torrent->file;
+    size_t offset = index * file->piece_length;
+    size_t last = torrent_file_find(file, offset + torrent_file_piece_size(file, index) - 1);
+    for (size_t f = torrent_file_find(file, offset); f <= last; f++)
+    {
+        if (files[f])
+            return true;
+    }
+    return false;
+}
+
+void download_recheck_stale(Download *dl, const bool *stale)
+{
+    TorrentFile *file = dl->torrent->file;
+    Bitfield dropped;
+    for (size_t i = 0; i < dl->resume.partial_count;)
+    {
+        // taking a piece moves the last one into its place, which is looked at next.
+        size_t index = dl->resume.partials[i].index;
+        if (download_piece_in(dl, index, stale) && resume_take_partial(&dl->resume, index, &dropped))
+            bitfield_free(&dropped);
+        else
+            i++;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < file->num_pieces; i++)
+    {
+        if (bitfield_get(&dl->have, i) && download_piece_in(dl, i, stale))
+            count++;
+    }
+    if (count == 0)
+        return;
+
+    HashJob *jobs = malloc(count * sizeof(HashJob));
+    size_t submitted = 0;
+    size_t outstanding = 0;
+    for (size_t i = 0; i < file->num_pieces; i++)
+    {
+        if (!bitfield_get(&dl->have, i) || !download_piece_in(dl, i, stale))
+            continue;
+
+        // without room for the jobs, or for the copy of a piece that runs across files, the piece
+        // is downloaded again rather than trusted.
+        size_t size = torrent_file_piece_size(file, i);
+        off_t offset = download_piece_offset(dl, i);
+        const unsigned char *data = storage_view(dl->storage, offset, size);
+        unsigned char *copy = NULL;
+        if (jobs != NULL && data == NULL && (copy = malloc(size)) != NULL)
+        {
+            storage_read(dl->storage, offset, copy, size);
+            data = copy;
+        }
+        if (jobs == NULL || data == NULL)
+        {
+            bitfield_clear(&dl->have, i);
+            continue;
+        }
+
+        // the piece a result is for follows from its expected hash, the owner is the copy to free.
+        HashJob *job = &jobs[submitted++];
+        *job = (HashJob){
+            .data = data,
+            .size = size,
+            .expected = file->piece_hashes + i * SHA_DIGEST_LENGTH,
+            .owner = copy,
+        };
+        while (hasher_submit(dl->hasher, job) != HASHER_SUCCESS)
+        {
+            outstanding -= download_take_rechecked(dl);
+        }
+        outstanding++;
+    }
+    while (outstanding > 0)
+    {
+        outstanding -= download_take_rechecked(dl);
+    }
+    free(jobs);
+}
+
+size_t download_take_rechecked(Download *dl)
+{
+    TorrentFile *file = dl->torrent->file;
+    hasher_wait(dl->hasher);
+    size_t taken = 0;
+    HashJob *job;
+    while ((job = hasher_poll(dl->hasher)) != NULL)
+    {
+        if (!job->ok)
+            bitfield_clear(&dl->have, (job->expected - file->piece_hashes) / SHA_DIGEST_LENGTH);
+        free(job->owner);
+        taken++;
+    }
+    return taken;
+}
+
+int download_save_resume(Download *dl)
+{
+    TorrentFile *file = dl->torrent->file;
+    ResumeState state;
+    struct stat *stats = malloc(file->file_count * sizeof(struct stat));
+    if (stats == NULL || resume_init(&state, file) != RESUME_SUCCESS)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for resume file\n");
+        free(stats);
+        return DOWNLOAD_ERR_IO;
+    }
+
+    // the files are stamped once every block the resume file lists is on disk. one written after
+    // changes the stamp, and only that file is hashed again on restart.
+    int result = DOWNLOAD_SUCCESS;
+    if (storage_sync(dl->storage) != STORAGE_SUCCESS || storage_stat(dl->storage, stats) != STORAGE_SUCCESS)
+        result = DOWNLOAD_ERR_IO;
+    for (size_t i = 0; result == DOWNLOAD_SUCCESS && i < file->file_count; i++)
+    {
+        resume_stamp(&state.stamps[i], &stats[i]);
+    }
+    memcpy(state.have.bytes, dl->have.bytes, BITFIELD_BYTES(file->num_pieces));
+
+    // a piece with every block in is waiting on the hasher, it is downloaded again if the result
+    // does not make it into a later save.
+    for (size_t i = 0; result == DOWNLOAD_SUCCESS && i < file->num_pieces; i++)
+    {
+        Piece *piece = dl->downloading[i];
+        if (piece != NULL && piece->blocks_received > 0 && piece->blocks_received < piece->block_count &&
+            resume_add_partial(&state, i, &piece->received) != RESUME_SUCCESS)
+            result = DOWNLOAD_ERR_IO;
+    }
+    for (size_t i = 0; result == DOWNLOAD_SUCCESS && i < dl->resume.partial_count; i++)
+    {
+        ResumePartial *partial = &dl->resume.partials[i];
+        if (resume_add_partial(&state, partial->index, &partial->received) != RESUME_SUCCESS)
+            result = DOWNLOAD_ERR_IO;
+    }
+
+    if (result == DOWNLOAD_SUCCESS && resume_save(dl->resume_path, dl->torrent, &state) != RESUME_SUCCESS)
+        result = DOWNLOAD_ERR_IO;
+    resume_free(&state);
+    free(stats);
+    dl->unsaved = result != DOWNLOAD_SUCCESS;
+    return result;
+}
+
+int download_want_piece(Download *dl, size_t index)
+{
+    if (dl->single_piece && storage_resize(dl->storage, torrent_file_piece_size(dl->torrent->file, index)) != STORAGE_SUCCESS)
+        return DOWNLOAD_ERR_IO;
+
+    if (!bitfield_get(&dl->wanted, index))
+    {
+        bitfield_set(&dl->wanted, index);
+        // a piece the resume file vouches for is had already.
+        if (!bitfield_get(&dl->have, index))
+        {
+            dl->remaining++;
+            dl->left += torrent_file_piece_size(dl->torrent->file, index);
+        }
+    }
+    return DOWNLOAD_SUCCESS;
+}
+
+void download_want_all(Download *dl)
+{
+    for (size_t i = 0; i < dl->wanted.bits; i++)
+    {
+        download_want_piece(dl, i);
+    }
+}
+
+void download_free(Download *dl)
+{
+    hasher_free(dl->hasher);
+    storage_close(dl->storage);
+    pool_free(&dl->pieces);
+    pool_free(&dl->pending);
+    free(dl->downloading);
+    bitfield_free(&dl->wanted);
+    bitfield_free(&dl->have);
+    bitfield_free(&dl->claimed);
+    resume_free(&dl->resume);
+    free(dl->resume_path);
+    free(dl);
+}
+
+int download_run(Download *dl, Announcer *announcer)
+{
+    dl->announcer = announcer;
+    dl->peers_count = 0;
+    dl->next_peer = 0;
+
+    dl->peers = malloc(DOWNLOAD_MAX_KNOWN_PEERS * sizeof(Peer));
+    dl->failures = calloc(DOWNLOAD_MAX_KNOWN_PEERS, sizeof(size_t));
+    if (dl->peers == NULL || dl->failures == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for peers\n");
+        free(dl->peers);
+        free(dl->failures);
+        dl->peers = NULL;
+        dl->failures = NULL;
+        return DOWNLOAD_ERR_INCOMPLETE;
+    }
+    download_take_peers(dl);
+    Peer *peers = dl->peers;
+    size_t peers_count = dl->peers_count;
+
+    // every open session counts at most once towards the availability of a piece.
+    if (picker_init(&dl->picker, dl->wanted.bits, DOWNLOAD_MAX_PEERS) != PICKER_SUCCESS)
+    {
+        free(dl->failures);
+        free(dl->peers);
+        dl->failures = NULL;
+        dl->peers = NULL;
+        return DOWNLOAD_ERR_INCOMPLETE;
+    }
+    for (size_t i = 0; i < dl->wanted.bits; i++)
+    {
+        if (!bitfield_get(&dl->wanted, i) || bitfield_get(&dl->have, i))
+            picker_retire(&dl->picker, i);
+    }
+
+    // reserve enough piece state for every peer we may download from at once to keep its initial
+    // queue full: the pieces its requests span, plus the next one. falling short is not fatal, the
+    // pools grow as they run out.
+    size_t slots = peers_count < DOWNLOAD_MAX_PEERS ? peers_count : DOWNLOAD_MAX_PEERS;
+    size_t piece_blocks = dl->torrent->file->piece_length / DEFAULT_BLOCK_SIZE;
+    if (piece_blocks == 0)
+        piece_blocks = 1;
+    size_t per_peer = (PEER_INITIAL_QUEUE_DEPTH + piece_blocks - 1) / piece_blocks + 1;
+    pool_reserve(&dl->pieces, slots * per_peer);
+    pool_reserve(&dl->pending, slots);
+
+    // a peer that goes away while a block is sent to it must fail the send, not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+
+    // an interrupt stops the loop rather than the process, so the resume file still gets the
+    // blocks of the pieces in flight.
+    struct sigaction interrupt = { .sa_handler = download_interrupt };
+    struct sigaction previous_int;
+    struct sigaction previous_term;
+    download_interrupted = 0;
+    sigemptyset(&interrupt.sa_mask);
+    sigaction(SIGINT, &interrupt, &previous_int);
+    sigaction(SIGTERM, &interrupt, &previous_term);
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        fprintf(stderr, "ERR: failed to create event loop\n");
+        picker_free(&dl->picker);
+        free(dl->failures);
+        free(dl->peers);
+        dl->failures = NULL;
+        dl->peers = NULL;
+        return DOWNLOAD_ERR_INCOMPLETE;
+    }
+
+    // results from the hasher wake the loop like any peer does. the hasher's event is level
+    // triggered, it stays ready until every result is taken.
+    struct epoll_event hasher_event = { .events = EPOLLIN, .data.ptr = dl->hasher };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, hasher_fd(dl->hasher), &hasher_event) < 0)
+    {
+        fprintf(stderr, "ERR: failed to register hasher with the event loop\n");
+        close(epoll_fd);
+        picker_free(&dl->picker);
+        free(dl->failures);
+        free(dl->peers);
+        dl->failures = NULL;
+        dl->peers = NULL;
+        return DOWNLOAD_ERR_INCOMPLETE;
+    }
+
+    // metrics clients are answered from the loop too, a download without them goes on all the same.
+    MetricsServer *metrics_server = metrics_port() > 0 ? metrics_server_new(metrics_port()) : NULL;
+    struct epoll_event metrics_event = { .events = EPOLLIN, .data.ptr = metrics_server };
+    if (metrics_server != NULL && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, metrics_server_fd(metrics_server), &metrics_event) < 0)
+    {
+        metrics_server_free(metrics_server);
+        metrics_server = NULL;
+    }
+    double stats_interval = metrics_stats_interval();
+    MetricsSnapshot *snapshot = stats_interval > 0 ? malloc(sizeof(MetricsSnapshot)) : NULL;
+    uint64_t stats_counters[METRIC_COUNTERS] = { 0 };
+    double stats_at = peer_now();
+
+    PeerSession *sessions[DOWNLOAD_MAX_PEERS] = { 0 };
+    dl->sessions = sessions;
+    dl->next_rechoke = peer_now() + DOWNLOAD_RECHOKE_INTERVAL;
+    dl->next_resume = peer_now() + DOWNLOAD_RESUME_INTERVAL;
+    struct epoll_event events[DOWNLOAD_MAX_PEERS];
+
+    // fan out to the first peers all at once and start as soon as a few are ready,
+    // the connections still in progress are carried over to the event loop.
+    Peer_State batch[PEER_CONNECT_CONCURRENCY];
+    size_t started;
+    peer_connect_batch(dl->torrent, peers, peers_count, &dl->next_peer, DOWNLOAD_INITIAL_PEERS, batch, &started);
+    for (size_t i = 0; i < started; i++)
+    {
+        sessions[i] = session_adopt(dl, epoll_fd, &batch[i]);
+    }
+
+    while (dl->remaining > 0 && !download_interrupted)
+    {
+        size_t open = 0;
+        size_t connecting = 0;
+        for (size_t i = 0; i < DOWNLOAD_MAX_PEERS; i++)
+        {
+            if (sessions[i] == NULL)
+                continue;
+            open++;
+            if (sessions[i]->state.phase != PEER_CONNECTED)
+                connecting++;
+        }
+
+        // keep the slots busy while there are untried peers, without opening too many at once.
+        for (size_t i = 0; i < DOWNLOAD_MAX_PEERS && connecting < PEER_CONNECT_CONCURRENCY; i++)
+        {
+            if (sessions[i] != NULL)
+                continue;
+
+            while (sessions[i] == NULL && dl->next_peer < dl->peers_count)
+            {
+                sessions[i] = session_open(dl, epoll_fd, &dl->peers[dl->next_peer++]);
+            }
+            if (sessions[i] == NULL)
+                break;
+            open++;
+            connecting++;
+        }
+        metrics_set(METRIC_PEERS, open);
+        metrics_set(METRIC_PEERS_CONNECTING, connecting);
+        metrics_set(METRIC_PIECES_LEFT, dl->remaining);
+        metrics_set(METRIC_HASH_QUEUED, dl->verifying);
+        metrics_set(METRIC_PIECE_POOL_HIGH_WATER, dl->pieces.high_water);
+        metrics_set(METRIC_PENDING_POOL_HIGH_WATER, dl->pending.high_water);
+
+        // with no peer left, pieces the hasher is still verifying or a tracker still answering may yet
+        // complete the download.
+        if (open == 0 && dl->verifying == 0 && (announcer == NULL || announcer->running == 0))
+            break;
+
+        int ready = epoll_wait(epoll_fd, events, DOWNLOAD_MAX_PEERS, DOWNLOAD_TICK_MS);
+        if (ready < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "ERR: failed to wait for peer events\n");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.ptr == dl->hasher)
+            {
+                HashJob *job;
+                while ((job = hasher_poll(dl->hasher)) != NULL)
+                {
+                    download_piece_verified(dl, job->owner);
+                }
+                continue;
+            }
+            if (metrics_server != NULL && events[i].data.ptr == metrics_server)
+            {
+                metrics_server_serve(metrics_server);
+                continue;
+            }
+            session_handle(events[i].data.ptr, events[i].events);
+        }
+
+        download_take_peers(dl);
+
+        // sessions are only freed here, after the batch, as a later event may still point at them.
+        double now = peer_now();
+        if (now >= dl->next_rechoke)
+            download_rechoke(dl, now);
+        if (snapshot != NULL && now - stats_at >= stats_interval)
+            download_write_stats(snapshot, stats_counters, &stats_at, now);
+        if (dl->resume_path != NULL && now >= dl->next_resume)
+        {
+            if (dl->unsaved)
+                download_save_resume(dl);
+            dl->next_resume = now + DOWNLOAD_RESUME_INTERVAL;
+        }
+        bool changed = dl->changed;
+        dl->changed = false;
+        for (size_t i = 0; i < DOWNLOAD_MAX_PEERS; i++)
+        {
+            PeerSession *session = sessions[i];
+            if (session == NULL)
+                continue;
+
+            // a piece came free, peers that had nothing to do may take it.
+            if (changed && session->starved && session->state.phase == PEER_CONNECTED &&
+                session_advance(session) != PEER_SUCCESS)
+                session->state.phase = PEER_CLOSED;
+
+            // messages queued for a peer while handling others (HAVE, CANCEL, CHOKE) wait until
+            // here, so a burst of them goes out in one write.
+            if (session->state.phase == PEER_CONNECTED && peer_flush(&session->state) != PEER_SUCCESS)
+                session->state.phase = PEER_CLOSED;
+
+            if (session->state.phase == PEER_CLOSED || session_timed_out(session, now))
+            {
+                session_close(session);
+                sessions[i] = NULL;
+            }
+        }
+    }
+
+    // the pieces still being verified are being read by the workers, wait them out. the sessions
+    // stay open until the resume file is saved, with them go the blocks of the pieces they hold.
+    while (dl->verifying > 0)
+    {
+        hasher_wait(dl->hasher);
+        HashJob *job;
+        while ((job = hasher_poll(dl->hasher)) != NULL)
+        {
+            download_piece_verified(dl, job->owner);
+        }
+    }
+    if (dl->resume_path != NULL)
+        download_save_resume(dl);
+
+    for (size_t i = 0; i < DOWNLOAD_MAX_PEERS; i++)
+    {
+        if (sessions[i] != NULL)
+            session_close(sessions[i]);
+        sessions[i] = NULL;
+    }
+
+    // the last line covers the end of the download, however short.
+    if (snapshot != NULL)
+    {
+        metrics_set(METRIC_PEERS, 0);
+        metrics_set(METRIC_PEERS_CONNECTING, 0);
+        metrics_set(METRIC_PIECES_LEFT, dl->remaining);
+        metrics_set(METRIC_HASH_QUEUED, 0);
+        metrics_set(METRIC_PIECE_POOL_HIGH_WATER, dl->pieces.high_water);
+        metrics_set(METRIC_PENDING_POOL_HIGH_WATER, dl->pending.high_water);
+        download_write_stats(snapshot, stats_counters, &stats_at, peer_now());
+    }
+    free(snapshot);
+    metrics_server_free(metrics_server);
+
+    close(epoll_fd);
+    sigaction(SIGINT, &previous_int, NULL);
+    sigaction(SIGTERM, &previous_term, NULL);
+    picker_free(&dl->picker);
+    dl->sessions = NULL;
+    free(dl->failures);
+    free(dl->peers);
+    dl->failures = NULL;
+    dl->peers = NULL;
+    dl->announcer = NULL;
+
+    // what the pools should be reserved to, each next to what it was reserved to.
+    log_printf(LOG_INFO, "Pools: at most %zu of %zu pieces downloading, %zu of %zu waiting on the hasher\n",
+               dl->pieces.high_water, dl->pieces.capacity, dl->pending.high_water, dl->pending.capacity);
+    return dl->remaining == 0 ? DOWNLOAD_SUCCESS : DOWNLOAD_ERR_INCOMPLETE;
+}
+
+void download_write_stats(MetricsSnapshot *snapshot, uint64_t *previous, double *since, double now)
+{
+    metrics_snapshot(snapshot);
+    metrics_write_stats(stderr, snapshot, previous, now - *since);
+    memcpy(previous, snapshot->counters, sizeof(snapshot->counters));
+    *since = now;
+}
+
+void download_interrupt(int signal)
+{
+    (void)signal;
+    download_interrupted = 1;
+}
+
+long download_claim_piece(Download *dl, Peer_State *state)
+{
+    // pieces that are had or not wanted are retired from the picker.
+    bool busy;
+    long index = picker_rarest(&dl->picker, &state->pieces, &dl->claimed, &busy);
+    if (index == PICKER_NO_PIECE)
+        return busy ? DOWNLOAD_PIECES_BUSY : DOWNLOAD_NO_PIECE;
+
+    bitfield_set(&dl->claimed, index);
+    dl->claimed_count++;
+    // the last piece was just handed out, idle peers may join in now.
+    if (download_in_endgame(dl))
+        dl->changed = true;
+    return index;
+}
+
+bool download_in_endgame(Download *dl)
+{
+    return dl->claimed_count == dl->remaining;
+}
+
+void download_unhold_piece(Download *dl, Piece *piece, bool verified)
+{
+    if (--piece->holders > 0)
+        return;
+
+    // the blocks of a piece given up on are on disk, whoever takes it next starts from them. one
+    // that failed verification has every block and is downloaded again from the start.
+    dl->downloading[piece->index] = NULL;
+    if (!verified && piece->blocks_received > 0 && piece->blocks_received < piece->block_count)
+        resume_add_partial(&dl->resume, piece->index, &piece->received);
+    download_release_piece(dl, piece->index, verified);
+    pool_put(&dl->pieces, piece);
+}
+
+void download_release_piece(Download *dl, size_t index, bool verified)
+{
+    bitfield_clear(&dl->claimed, index);
+    dl->claimed_count--;
+    if (verified && !bitfield_get(&dl->have, index))
+    {
+        bitfield_set(&dl->have, index);
+        dl->remaining--;
+        size_t size = torrent_file_piece_size(dl->torrent->file, index);
+        dl->left -= size;
+        dl->downloaded += size;
+        picker_retire(&dl->picker, index);
+    }
+    dl->changed = true;
+}
+
+void download_piece_verified(Download *dl, PendingPiece *pending)
+{
+    dl->verifying--;
+    bool verified = pending->job.ok;
+    metrics_count(verified ? METRIC_PIECES_VERIFIED : METRIC_PIECES_FAILED, 1);
+    if (!verified)
+    {
+        log_printf(LOG_WARN, "ERR: piece %zu from peer failed verification\n", pending->piece->index);
+        dl->failures[pending->peer]++;
+    }
+
+    // a piece that failed is left on disk, the next peer to download it writes over it.
+    size_t index = pending->piece->index;
+    download_unhold_piece(dl, pending->piece, verified);
+    free(pending->copy);
+    pool_put(&dl->pending, pending);
+    if (verified)
+        download_broadcast_have(dl, index);
+}
+
+void download_take_peers(Download *dl)
+{
+    Announcer *announcer = dl->announcer;
+    if (announcer == NULL)
+        return;
+
+    // the announces run alongside the peers, so nothing here waits.
+    announcer->stats.uploaded = dl->uploaded;
+    announcer->stats.downloaded = dl->downloaded;
+    announcer->stats.left = dl->left;
+    announcer_start(announcer);
+    announcer_poll(announcer, 0);
+
+    // the announcer never lists a peer twice, so whatever it has past what was taken is new.
+    while (dl->peers_count < announcer->peers_count && dl->peers_count < DOWNLOAD_MAX_KNOWN_PEERS)
+    {
+        dl->peers[dl->peers_count] = announcer->peers[dl->peers_count];
+        dl->peers_count++;
+    }
+}
+
+void download_broadcast_have(Download *dl, size_t index)
+{
+    unsigned char payload[4];
+    peer_write_u32(payload, index);
+    for (size_t i = 0; i < DOWNLOAD_MAX_PEERS; i++)
+    {
+        PeerSession *session = dl->sessions[i];
+        if (session == NULL || session->state.phase != PEER_CONNECTED)
+            continue;
+        if (peer_queue_message(&session->state, HAVE, payload, sizeof(payload)) != PEER_SUCCESS)
+            session->state.phase = PEER_CLOSED;
+    }
+}
+
+bool download_may_unchoke(Download *dl, size_t slot)
+{
+    PeerSession *session = dl->sessions[slot];
+    return session != NULL && session->state.phase == PEER_CONNECTED && session->state.peer_interested;
+}
+
+void download_rechoke(Download *dl, double now)
+{
+    dl->next_rechoke = now + DOWNLOAD_RECHOKE_INTERVAL;
+    bool unchoke[DOWNLOAD_MAX_PEERS] = { false };
+
+    // the regular slots go to the peers that give us the most, measured by their download rate.
+    for (size_t slot = 0; slot + 1 < DOWNLOAD_UPLOAD_SLOTS; slot++)
+    {
+        size_t best = DOWNLOAD_MAX_PEERS;
+        for (size_t i = 0; i < DOWNLOAD_MAX_PEERS; i++)
+        {
+            if (!download_may_unchoke(dl, i) || unchoke[i])
+                continue;
+            if (best == DOWNLOAD_MAX_PEERS || dl->sessions[i]->pipeline.rate > dl->sessions[best]->pipeline.rate)
+                best = i;
+        }
+        if (best == DOWNLOAD_MAX_PEERS)
+            break;
+        unchoke[best] = true;
+    }
+
+    // the optimistic slot goes round the other peers, it moves on early if its peer went away or
+    // earned a regular slot.
+    bool rotate = dl->rechokes++ % DOWNLOAD_OPTIMISTIC_ROUNDS == 0 || dl->optimistic == DOWNLOAD_MAX_PEERS ||
+        !download_may_unchoke(dl, dl->optimistic) || unchoke[dl->optimistic];
+    if (rotate)
+    {
+        size_t from = dl->optimistic;
+        dl->optimistic = DOWNLOAD_MAX_PEERS;
+        for (size_t step = 1; step <= DOWNLOAD_MAX_PEERS; step++)
+        {
+            size_t i = (from + step) % DOWNLOAD_MAX_PEERS;
+            if (download_may_unchoke(dl, i) && !unchoke[i])
+            {
+                dl->optimistic = i;
+                break;
+            }
+        }
+    }
+    if (dl->optimistic != DOWNLOAD_MAX_PEERS)
+        unchoke[dl->optimistic] = true;
+
+    for (size_t i = 0; i < DOWNLOAD_MAX_PEERS; i++)
+    {
+        PeerSession *session = dl->sessions[i];
+        if (session == NULL || session->state.phase != PEER_CONNECTED)
+            continue;
+        if (session_set_choking(session, !unchoke[i]) != PEER_SUCCESS)
+            session->state.phase = PEER_CLOSED;
+    }
+}
+
+off_t download_piece_offset(Download *dl, size_t index)
+{
+    return dl->single_piece ? 0 : (off_t)index * dl->torrent->file->piece_length;
+}
+
+PeerSession *session_open(Download *dl, int epoll_fd, Peer *peer)
+{
+    Peer_State state;
+    if (peer_state_init(&state, peer, dl->torrent->file->num_pieces) != PEER_SUCCESS)
+        return NULL;
+
+    if (peer_start_connect(&state, peer_now()) != PEER_SUCCESS)
+    {
+        peer_state_free(&state);
+        return NULL;
+    }
+
+    return session_adopt(dl, epoll_fd, &state);
+}
+
+PeerSession *session_adopt(Download *dl, int epoll_fd, Peer_State *state)
+{
+    PeerSession *session = malloc(sizeof(PeerSession));
+    if (session == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for peer session\n");
+        peer_state_free(state);
+        return NULL;
+    }
+    session->dl = dl;
+    session->state = *state;
+    session->active_count = 0;
+    session->inflight_count = 0;
+    session->starved = false;
+    session->upload_count = 0;
+    session->connected_at = 0;
+    session->received = 0;
+
+    if (peer_message_init(&session->msg) != PEER_SUCCESS)
+    {
+        peer_state_free(&session->state);
+        free(session);
+        return NULL;
+    }
+
+    // edge triggered: an event is only reported when the socket becomes ready, so every handler
+    // reads and writes until the socket would block.
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = session,
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session->state.socket, &event) < 0)
+    {
+        fprintf(stderr, "ERR: failed to register peer with the event loop\n");
+        session_close(session);
+        return NULL;
+    }
+
+    double now = peer_now();
+    peer_pipeline_init(&session->pipeline, now);
+    session->last_activity = now;
+    if (session->state.phase == PEER_CONNECTED)
+        session->connected_at = now;
+
+    // a handshaken connection may already hold the peer's first messages.
+    if (session->state.phase == PEER_CONNECTED)
+    {
+        if (session_connected(session) != PEER_SUCCESS)
+            session->state.phase = PEER_CLOSED;
+        else
+            session_handle(session, 0);
+    }
+    return session;
+}
+
+int session_connected(PeerSession *session)
+{
+    // a peer only asks for what it knows we have.
+    Bitfield *have = &session->dl->have;
+    if (bitfield_count(have) > 0 &&
+        peer_queue_message(&session->state, BITFIELD, have->bytes, BITFIELD_BYTES(have->bits)) != PEER_SUCCESS)
+        return PEER_ERR_MEMORY;
+
+    if (peer_queue_message(&session->state, INTERESTED, NULL, 0) != PEER_SUCCESS)
+        return PEER_ERR_MEMORY;
+
+    session->state.am_interested = true;
+    return PEER_SUCCESS;
+}
+
+void session_close(PeerSession *session)
+{
+    double connected_for = session->connected_at > 0 ? peer_now() - session->connected_at : 0;
+    if (session->received > 0 && connected_for > 0)
+        metrics_record(METRIC_PEER_THROUGHPUT, (uint64_t)(session->received / connected_for));
+
+    // closing the socket also takes it out of the event loop.
+    session_drop_all(session);
+    picker_count_peer(&session->dl->picker, &session->state.pieces, false);
+    peer_message_free(&session->msg);
+    peer_state_free(&session->state);
+    free(session);
+}
+
+void session_handle(PeerSession *session, uint32_t events)
+{
+    Peer_State *state = &session->state;
+    if (state->phase == PEER_CLOSED)
+        return;
+
+    bool readable = events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+    if (readable)
+        session->last_activity = peer_now();
+
+    if (state->phase != PEER_CONNECTED)
+    {
+        int result = peer_advance_handshake(state, session->dl->torrent, events, peer_now());
+        if (result == PEER_INCOMPLETE)
+            return;
+
+        if (result != PEER_SUCCESS || session_connected(session) != PEER_SUCCESS)
+        {
+            state->phase = PEER_CLOSED;
+            return;
+        }
+        // the handshake drained the socket, what followed it is in the input buffer.
+        session->connected_at = peer_now();
+        readable = false;
+    }
+
+    int result = session_receive(session, readable);
+
+    // the payloads of the blocks just written live in the input buffer, they must be on disk before
+    // the next receive reuses it. one flush per read writes all of them in a single system call.
+    if (storage_flush(session->dl->storage) != STORAGE_SUCCESS ||
+        result != PEER_SUCCESS || session_advance(session) != PEER_SUCCESS)
+        state->phase = PEER_CLOSED;
+}
+
+int session_receive(PeerSession *session, bool readable)
+{
+    Peer_State *state = &session->state;
+    while (true)
+    {
+        int result = session_parse(session);
+        if (result != PEER_SUCCESS || !readable)
+            return result;
+
+        // the blocks just queued for the output still point into the input buffer, they must be
+        // written out before the next read moves or reuses it.
+        Storage *storage = session->dl->storage;
+        if (storage->queued_count > 0 && storage_flush(storage) != STORAGE_SUCCESS)
+            return PEER_ERR_IO;
+
+        if (state->sink.length > 0)
+        {
+            result = peer_sink_receive(state);
+            if (result == PEER_SUCCESS && state->sink.data != NULL)
+            {
+                // a payload still written into place is one we wait on, see session_forget_piece.
+                InflightRequest *request = session_find_request(session, state->sink.index, state->sink.begin, state->sink.received);
+                if (request != NULL)
+                    result = session_block_arrived(session, request);
+            }
+        }
+        else
+        {
+            result = peer_receive_some(state, session->inflight_count > 0);
+        }
+
+        // the socket is drained.
+        if (result == PEER_INCOMPLETE)
+            return PEER_SUCCESS;
+        if (result != PEER_SUCCESS)
+            return result;
+    }
+}
+
+int session_parse(PeerSession *session)
+{
+    Peer_State *state = &session->state;
+    PeerMessage *msg = &session->msg;
+    int result;
+    while ((result = peer_parse_message(state, msg)) == PEER_SUCCESS)
+    {
+        if (session_apply(session, msg) != PEER_SUCCESS)
+            return PEER_ERR_PROTOCOL;
+        if (msg->keep_alive)
+            continue;
+
+        if (msg->id == PIECE)
+            result = session_receive_block(session);
+        else if (msg->id == REQUEST)
+            result = session_queue_upload(session, msg);
+        else if (msg->id == CANCEL)
+            result = session_cancel_upload(session, msg);
+        if (result != PEER_SUCCESS)
+            return result;
+
+        // a peer that turns interested while an upload slot is free has it right away, rather
+        // than at the next rechoke.
+        if (msg->id == INTERESTED && state->am_choking)
+        {
+            size_t unchoked = 0;
+            for (size_t i = 0; i < DOWNLOAD_MAX_PEERS; i++)
+            {
+                PeerSession *other = session->dl->sessions[i];
+                unchoked += other != NULL && other->state.phase == PEER_CONNECTED && !other->state.am_choking;
+            }
+            if (unchoked < DOWNLOAD_UPLOAD_SLOTS && session_set_choking(session, false) != PEER_SUCCESS)
+                return PEER_ERR_MEMORY;
+        }
+    }
+    if (result != PEER_INCOMPLETE)
+        return result;
+
+    // the payload of a block still on its way skips the input buffer. one we do not wait on is
+    // thrown away as it arrives.
+    uint32_t index, begin;
+    size_t length;
+    if (state->sink.length == 0 && peer_peek_piece(state, &index, &begin, &length) == PEER_SUCCESS)
+    {
+        Download *dl = session->dl;
+        unsigned char *data = NULL;
+        if (session_find_request(session, index, begin, length) != NULL)
+        {
+            // a block that runs across two files is received through the input buffer and
+            // written in parts, see session_receive_block.
+            data = storage_region(dl->storage, download_piece_offset(dl, index) + begin, length);
+            if (data == NULL)
+                return PEER_SUCCESS;
+        }
+        peer_sink_start(state, data);
+    }
+    return PEER_SUCCESS;
+}
+
+int session_apply(PeerSession *session, PeerMessage *msg)
+{
+    Peer_State *state = &session->state;
+    Picker *picker = &session->dl->picker;
+    if (msg->keep_alive || (msg->id != BITFIELD && msg->id != HAVE))
+        return peer_state_apply(state, msg);
+
+    // a bitfield replaces whatever the peer announced before.
+    if (msg->id == BITFIELD)
+    {
+        picker_count_peer(picker, &state->pieces, false);
+        int result = peer_state_apply(state, msg);
+        picker_count_peer(picker, &state->pieces, true);
+        return result;
+    }
+
+    // a HAVE only counts for a piece the peer did not announce yet.
+    bool had = msg->payload->size == 4 && peer_read_u32(msg->payload->chars) < state->pieces.bits &&
+        bitfield_get(&state->pieces, peer_read_u32(msg->payload->chars));
+    int result = peer_state_apply(state, msg);
+    if (result == PEER_SUCCESS && !had)
+        picker_increment(picker, peer_read_u32(msg->payload->chars));
+    return result;
+}
+
+int session_queue_upload(PeerSession *session, PeerMessage *msg)
+{
+    if (msg->payload->size != PEER_REQUEST_LENGTH)
+        return PEER_ERR_PROTOCOL;
+
+    Download *dl = session->dl;
+    uint32_t index = peer_read_u32(msg->payload->chars);
+    uint32_t begin = peer_read_u32(msg->payload->chars + 4);
+    uint32_t length = peer_read_u32(msg->payload->chars + 8);
+    if (session->state.am_choking || session->upload_count == DOWNLOAD_MAX_UPLOAD_REQUESTS ||
+        index >= dl->have.bits || !bitfield_get(&dl->have, index) ||
+        length == 0 || length > DOWNLOAD_MAX_REQUEST_LENGTH ||
+        (uint64_t)begin + length > torrent_file_piece_size(dl->torrent->file, index))
+        return PEER_SUCCESS;
+
+    session->uploads[session->upload_count++] = (UploadRequest){ index, begin, length };
+    return PEER_SUCCESS;
+}
+
+int session_cancel_upload(PeerSession *session, PeerMessage *msg)
+{
+    if (msg->payload->size != PEER_REQUEST_LENGTH)
+        return PEER_ERR_PROTOCOL;
+
+    uint32_t index = peer_read_u32(msg->payload->chars);
+    uint32_t begin = peer_read_u32(msg->payload->chars + 4);
+    uint32_t length = peer_read_u32(msg->payload->chars + 8);
+    for (size_t i = 0; i < session->upload_count; i++)
+    {
+        UploadRequest *request = &session->uploads[i];
+        if (request->index == index && request->begin == begin && request->length == length)
+        {
+            memmove(request, request + 1, (session->upload_count - i - 1) * sizeof(UploadRequest));
+            session->upload_count--;
+            break;
+        }
+    }
+    return PEER_SUCCESS;
+}
+
+int session_serve(PeerSession *session)
+{
+    Peer_State *state = &session->state;
+    Download *dl = session->dl;
+    size_t served = 0;
+    while (served < session->upload_count)
+    {
+        // a block goes out only once the one before it is sent.
+        if (!peer_upload_idle(state) && peer_flush(state) != PEER_SUCCESS)
+            return PEER_ERR_IO;
+        if (!peer_upload_idle(state))
+            break;
+
+        UploadRequest *request = &session->uploads[served++];
+        off_t offset = download_piece_offset(dl, request->index) + request->begin;
+        int fd;
+        off_t file_offset;
+        int result = storage_locate(dl->storage, offset, request->length, &fd, &file_offset)
+            ? peer_queue_block(state, fd, file_offset, request->index, request->begin, request->length)
+            : session_queue_copy(session, request, offset);
+        if (result != PEER_SUCCESS)
+            return PEER_ERR_MEMORY;
+        dl->uploaded += request->length;
+        metrics_count(METRIC_UPLOADED_BYTES, request->length);
+    }
+
+    memmove(session->uploads, session->uploads + served, (session->upload_count - served) * sizeof(UploadRequest));
+    session->upload_count -= served;
+    return PEER_SUCCESS;
+}
+
+int session_queue_copy(PeerSession *session, UploadRequest *request, off_t offset)
+{
+    size_t size = PEER_PIECE_HEADER_LENGTH + request->length;
+    unsigned char *payload = malloc(size);
+    if (payload == NULL)
+        return PEER_ERR_MEMORY;
+
+    peer_write_u32(payload, request->index);
+    peer_write_u32(payload + 4, request->begin);
+    storage_read(session->dl->storage, offset, payload + PEER_PIECE_HEADER_LENGTH, request->length);
+    int result = peer_queue_message(&session->state, PIECE, payload, size);
+    free(payload);
+    return result;
+}
+
+int session_set_choking(PeerSession *session, bool choke)
+{
+    Peer_State *state = &session->state;
+    if (state->am_choking == choke)
+        return PEER_SUCCESS;
+
+    if (peer_queue_message(state, choke ? CHOKE : UNCHOKE, NULL, 0) != PEER_SUCCESS)
+        return PEER_ERR_MEMORY;
+
+    // the block being sent still goes out whole, the rest is dropped as the peer expects.
+    state->am_choking = choke;
+    if (choke)
+        session->upload_count = 0;
+    return PEER_SUCCESS;
+}
+
+int session_advance(PeerSession *session)
+{
+    Peer_State *state = &session->state;
+    if (session->dl->failures[session->state.peer_info - session->dl->peers] >= DOWNLOAD_MAX_PEER_FAILURES)
+        return PEER_ERR_PROTOCOL;
+
+    if (state->peer_choking)
+    {
+        // a choking peer discards the requests it has not answered yet.
+        session_drop_all(session);
+    }
+    else
+    {
+        int result = session_fill_requests(session);
+        if (result != PEER_SUCCESS)
+            return result;
+
+        // the peer has nothing left that we need, nor wants anything from us.
+        if (session->inflight_count == 0 && !session->starved && !state->peer_interested)
+            return PEER_ERR_IO;
+    }
+
+    if (session_serve(session) != PEER_SUCCESS)
+        return PEER_ERR_IO;
+    return peer_flush(state);
+}
+
+bool session_timed_out(PeerSession *session, double now)
+{
+    if (session->state.phase != PEER_CONNECTED)
+    {
+        bool expired = peer_stage_expired(&session->state, now);
+        if (expired)
+            metrics_count(METRIC_CONNECT_FAILURES, 1);
+        return expired;
+    }
+
+    // a peer we have nothing to ask of owes us nothing.
+    bool waiting = session->state.peer_choking || session->inflight_count > 0;
+    return waiting && now - session->last_activity > DOWNLOAD_PEER_TIMEOUT;
+}
+
+int session_fill_requests(PeerSession *session)
+{
+    Peer_State *state = &session->state;
+    session->starved = false;
+    while (session->inflight_count < session->pipeline.depth)
+    {
+        // only the newest active piece can have blocks left to request. a piece shared in endgame
+        // skips the blocks that others delivered already.
+        ActivePiece *active = NULL;
+        if (session->active_count > 0)
+        {
+            active = &session->active[session->active_count - 1];
+            while (active->next_block < active->piece->block_count &&
+                   bitfield_get(&active->piece->received, active->next_block))
+                active->next_block++;
+            if (active->next_block == active->piece->block_count)
+                active = NULL;
+        }
+
+        if (active == NULL)
+        {
+            long index = download_claim_piece(session->dl, state);
+            if (index >= 0)
+            {
+                active = session_start_piece(session, index);
+                if (active == NULL)
+                    return PEER_ERR_MEMORY;
+            }
+            else if (index == DOWNLOAD_PIECES_BUSY && download_in_endgame(session->dl))
+            {
+                active = session_join_piece(session);
+            }
+
+            if (active == NULL)
+            {
+                session->starved = index == DOWNLOAD_PIECES_BUSY && session->inflight_count == 0;
+                return PEER_SUCCESS;
+            }
+            continue;
+        }
+
+        Block block = piece_block(active->piece, active->next_block);
+        if (peer_queue_request(state, REQUEST, active->piece->index, block.offset, block.size) != PEER_SUCCESS)
+            return PEER_ERR_MEMORY;
+
+        bitfield_set(&active->piece->requested, active->next_block);
+        session->inflight[session->inflight_count++] = (InflightRequest){
+            .active = active,
+            .block = active->next_block,
+            .sent_at = peer_now(),
+        };
+        active->next_block++;
+    }
+    return PEER_SUCCESS;
+}
+
+ActivePiece *session_start_piece(PeerSession *session, size_t index)
+{
+    Download *dl = session->dl;
+    void *memory = pool_get(&dl->pieces);
+    if (memory == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for piece %zu\n", index);
+        download_release_piece(dl, index, false);
+        return NULL;
+    }
+
+    Piece *piece = piece_place(memory, dl->torrent->file, index);
+    piece->holders = 1;
+    dl->downloading[index] = piece;
+
+    // the blocks of the piece already on disk, from the resume file or a peer that went away, are
+    // not requested again.
+    Bitfield restored;
+    if (resume_take_partial(&dl->resume, index, &restored))
+    {
+        memcpy(piece->received.bytes, restored.bytes, BITFIELD_BYTES(piece->block_count));
+        piece->blocks_received = bitfield_count(&piece->received);
+        bitfield_free(&restored);
+    }
+
+    ActivePiece *active = &session->active[session->active_count++];
+    active->piece = piece;
+    active->next_block = 0;
+    return active;
+}
+
+InflightRequest *session_find_request(PeerSession *session, uint32_t index, uint32_t begin, size_t length)
+{
+    for (size_t i = 0; i < session->inflight_count; i++)
+    {
+        InflightRequest *request = &session->inflight[i];
+        Block block = piece_block(request->active->piece, request->block);
+        if (request->active->piece->index == index && block.offset == begin && block.size == length)
+            return request;
+    }
+    return NULL;
+}
+
+int session_receive_block(PeerSession *session)
+{
+    BString *payload = session->msg.payload;
+    if (payload->size < PEER_PIECE_HEADER_LENGTH)
+        return PEER_SUCCESS;
+
+    uint32_t index = peer_read_u32(payload->chars);
+    uint32_t begin = peer_read_u32(payload->chars + 4);
+    size_t length = payload->size - PEER_PIECE_HEADER_LENGTH;
+
+    // blocks we did not ask for, or no longer wait on, are ignored.
+    InflightRequest *request = session_find_request(session, index, begin, length);
+    if (request == NULL)
+        return PEER_SUCCESS;
+
+    off_t offset = download_piece_offset(session->dl, index) + begin;
+    if (storage_write(session->dl->storage, offset, (const unsigned char *)payload->chars + PEER_PIECE_HEADER_LENGTH, length) != STORAGE_SUCCESS)
+        return PEER_ERR_IO;
+
+    return session_block_arrived(session, request);
+}
+
+int session_block_arrived(PeerSession *session, InflightRequest *request)
+{
+    ActivePiece *active = request->active;
+    Piece *piece = active->piece;
+    size_t block = request->block;
+    size_t length = piece_block(piece, block).size;
+    double now = peer_now();
+    peer_pipeline_sample(&session->pipeline, now, now - request->sent_at, length);
+    session->received += length;
+    metrics_record_seconds(METRIC_REQUEST_RTT, now - request->sent_at);
+    metrics_count(METRIC_DOWNLOADED_BYTES, length);
+    metrics_count(METRIC_BLOCKS, 1);
+    *request = session->inflight[--session->inflight_count];
+
+    // in endgame another peer may have delivered the block while this one was on its way.
+    if (bitfield_get(&piece->received, block))
+        return PEER_SUCCESS;
+
+    bitfield_set(&piece->received, block);
+    piece->blocks_received++;
+    session->dl->unsaved = true;
+    if (piece->holders > 1)
+        session_cancel_elsewhere(session, piece, block);
+
+    if (piece->blocks_received == piece->block_count)
+        return session_finish_piece(session, active);
+    return PEER_SUCCESS;
+}
+
+int session_finish_piece(PeerSession *session, ActivePiece *active)
+{
+    Download *dl = session->dl;
+    if (storage_flush(dl->storage) != STORAGE_SUCCESS)
+    {
+        session_drop_piece(session, active);
+        return PEER_ERR_IO;
+    }
+
+    PendingPiece *pending = pool_get(&dl->pending);
+    if (pending == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for piece verification\n");
+        session_drop_piece(session, active);
+        return PEER_ERR_MEMORY;
+    }
+
+    // the others racing for the piece in endgame let go of it, the hold of this session passes to the
+    // pending piece.
+    Piece *piece = active->piece;
+    for (size_t i = 0; piece->holders > 1 && i < DOWNLOAD_MAX_PEERS; i++)
+    {
+        PeerSession *other = dl->sessions[i];
+        if (other == NULL || other == session)
+            continue;
+        for (size_t a = 0; a < other->active_count; a++)
+        {
+            if (other->active[a].piece == piece)
+            {
+                session_abandon_piece(other, &other->active[a]);
+                break;
+            }
+        }
+    }
+
+    // the piece stays claimed while it is verified, it is released once the result is in. a piece
+    // that runs across files is hashed from a copy, there is no one mapping that holds all of it.
+    off_t offset = download_piece_offset(dl, piece->index);
+    const unsigned char *data = storage_view(dl->storage, offset, piece->size);
+    pending->copy = NULL;
+    if (data == NULL)
+    {
+        pending->copy = malloc(piece->size);
+        if (pending->copy == NULL)
+        {
+            fprintf(stderr, "ERR: failed to allocate memory for piece verification\n");
+            pool_put(&dl->pending, pending);
+            session_drop_piece(session, active);
+            return PEER_ERR_MEMORY;
+        }
+        storage_read(dl->storage, offset, pending->copy, piece->size);
+        data = pending->copy;
+    }
+
+    pending->piece = piece;
+    pending->peer = session->state.peer_info - dl->peers;
+    pending->job = (HashJob){
+        .data = data,
+        .size = pending->piece->size,
+        .expected = pending->piece->hash,
+        .owner = pending,
+    };
+    session_forget_piece(session, active);
+
+    dl->verifying++;
+    if (hasher_submit(dl->hasher, &pending->job) != HASHER_SUCCESS)
+    {
+        // the workers are far behind, verify here rather than hold the piece.
+        hasher_verify(&pending->job);
+        download_piece_verified(dl, pending);
+    }
+    return PEER_SUCCESS;
+}
+
+void session_drop_piece(PeerSession *session, ActivePiece *active)
+{
+    // the piece is forgotten first, that still looks at it.
+    Piece *piece = active->piece;
+    session_forget_piece(session, active);
+    download_unhold_piece(session->dl, piece, false);
+}
+
+ActivePiece *session_join_piece(PeerSession *session)
+{
+    Download *dl = session->dl;
+    Piece *best = NULL;
+    for (size_t index = 0; index < dl->torrent->file->num_pieces; index++)
+    {
+        Piece *piece = dl->downloading[index];
+        if (piece == NULL || piece->blocks_received == piece->block_count ||
+            !bitfield_get(&session->state.pieces, index))
+            continue;
+
+        bool held = false;
+        for (size_t a = 0; a < session->active_count && !held; a++)
+            held = session->active[a].piece == piece;
+
+        // spread out over the pieces, the one with the fewest peers on it first.
+        if (!held && (best == NULL || piece->holders < best->holders))
+            best = piece;
+    }
+    if (best == NULL)
+        return NULL;
+
+    best->holders++;
+    ActivePiece *active = &session->active[session->active_count++];
+    active->piece = best;
+    active->next_block = 0;
+    return active;
+}
+
+void session_cancel_elsewhere(PeerSession *session, Piece *piece, size_t block)
+{
+    Download *dl = session->dl;
+    for (size_t i = 0; i < DOWNLOAD_MAX_PEERS; i++)
+    {
+        PeerSession *other = dl->sessions[i];
+        if (other == NULL || other == session)
+            continue;
+        for (size_t r = 0; r < other->inflight_count; r++)
+        {
+            if (other->inflight[r].active->piece == piece && other->inflight[r].block == block)
+            {
+                session_cancel_block(other, other->inflight[r].active, block);
+                break;
+            }
+        }
+    }
+}
+
+void session_cancel_block(PeerSession *session, ActivePiece *active, size_t block)
+{
+    Peer_State *state = &session->state;
+    Piece *piece = active->piece;
+    Block cancelled = piece_block(piece, block);
+    if (state->sink.length > 0 && state->sink.index == piece->index && state->sink.begin == cancelled.offset)
+        peer_sink_discard(state);
+
+    bool pending = false;
+    for (size_t r = 0; r < session->inflight_count; r++)
+    {
+        if (session->inflight[r].active != active)
+            continue;
+        if (session->inflight[r].block == block)
+            session->inflight[r--] = session->inflight[--session->inflight_count];
+        else
+            pending = true;
+    }
+
+    if (peer_queue_request(state, CANCEL, piece->index, cancelled.offset, cancelled.size) != PEER_SUCCESS)
+        state->phase = PEER_CLOSED;
+
+    // a piece with nothing in flight and nothing left to request is of no more use to the session.
+    size_t next = active->next_block;
+    while (next < piece->block_count && bitfield_get(&piece->received, next))
+        next++;
+    if (!pending && next == piece->block_count)
+    {
+        session_forget_piece(session, active);
+        download_unhold_piece(session->dl, piece, false);
+    }
+}
+
+void session_abandon_piece(PeerSession *session, ActivePiece *active)
+{
+    Peer_State *state = &session->state;
+    Piece *piece = active->piece;
+    for (size_t r = 0; r < session->inflight_count; r++)
+    {
+        if (session->inflight[r].active != active)
+            continue;
+        Block block = piece_block(piece, session->inflight[r].block);
+        if (peer_queue_request(state, CANCEL, piece->index, block.offset, block.size) != PEER_SUCCESS)
+            state->phase = PEER_CLOSED;
+    }
+
+    // forgetting the piece takes its requests and a block of it still being received with it.
+    session_forget_piece(session, active);
+    download_unhold_piece(session->dl, piece, false);
+}
+
+void session_forget_piece(PeerSession *session, ActivePiece *active)
+{
+    // keep the active pieces in the order they were claimed, so the newest stays last,
+    // and point the requests of the pieces that moved at their new place.
+    // a block of the piece that is still being received is thrown away from here on.
+    PeerSink *sink = &session->state.sink;
+    if (sink->length > 0 && sink->index == active->piece->index)
+        peer_sink_discard(&session->state);
+
+    size_t at = active - session->active;
+    memmove(active, active + 1, (session->active_count - at - 1) * sizeof(ActivePiece));
+    session->active_count--;
+
+    for (size_t i = 0; i < session->inflight_count; i++)
+    {
+        if (session->inflight[i].active == active)
+        {
+            // a piece given up on while still waiting on blocks takes its requests with it.
+            session->inflight[i--] = session->inflight[--session->inflight_count];
+        }
+        else if (session->inflight[i].active > active)
+        {
+            session->inflight[i].active--;
+        }
+    }
+}
+
+void session_drop_all(PeerSession *session)
+{
+    session->inflight_count = 0;
+    while (session->active_count > 0)
+    {
+        session_drop_piece(session, &session->active[session->active_count - 1]);
+    }
+}
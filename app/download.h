@@ -0,0 +1,162 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+/**
+ * @file download.h
+ * @brief Header file for downloading a torrent from many peers at once in C.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "bitfield.h"
+#include "network.h"
+#include "torrent.h"
+#include "peer.h"
+#include "hasher.h"
+#include "storage.h"
+#include "pool.h"
+#include "picker.h"
+#include "announcer.h"
+#include "resume.h"
+
+// the number of peers downloaded from at the same time.
+#define DOWNLOAD_MAX_PEERS 128
+
+// the most peers a download keeps track of, the trackers may know of more. the list never moves,
+// so connections can point into it.
+#define DOWNLOAD_MAX_KNOWN_PEERS 4096
+
+// the number of handshaken peers the download waits for before it starts requesting pieces.
+// connections still in progress carry over into the download, so there is no use waiting for more.
+#define DOWNLOAD_INITIAL_PEERS 1
+
+// how long the event loop sleeps at most before checking for timed out peers, in milliseconds.
+#define DOWNLOAD_TICK_MS 1000
+
+// how long a peer may stay silent before its connection is given up on, in seconds.
+#define DOWNLOAD_PEER_TIMEOUT 30
+
+// the number of pieces a peer may fail to verify before it is disconnected.
+#define DOWNLOAD_MAX_PEER_FAILURES 3
+
+// the number of peers uploaded to at the same time, one of them unchoked optimistically.
+#define DOWNLOAD_UPLOAD_SLOTS 4
+
+// how often the peers uploaded to are chosen again, in seconds.
+#define DOWNLOAD_RECHOKE_INTERVAL 10
+
+// the optimistic unchoke moves on to another peer every this many rechokes.
+#define DOWNLOAD_OPTIMISTIC_ROUNDS 3
+
+// the block requests of a peer that are queued at once, more are ignored until some are served.
+#define DOWNLOAD_MAX_UPLOAD_REQUESTS 64
+
+// the largest block a peer may request, larger requests are ignored.
+#define DOWNLOAD_MAX_REQUEST_LENGTH (8 * DEFAULT_BLOCK_SIZE)
+
+// what is appended to the output path for the path of the resume file.
+#define DOWNLOAD_RESUME_SUFFIX ".resume"
+
+// how often what the download has is saved to its resume file while it runs, in seconds.
+#define DOWNLOAD_RESUME_INTERVAL 30
+
+#define DOWNLOAD_SUCCESS 0
+#define DOWNLOAD_ERR_INCOMPLETE -1
+#define DOWNLOAD_ERR_IO -2
+
+struct PeerSession;
+
+// a download shared by every peer connection. pieces are handed out rarest first so no two peers
+// download the same piece, and a piece a peer gives up on goes back to be handed to another.
+// once every piece left is handed out the download is in endgame: idle peers join in on the
+// pieces others are downloading, and whoever delivers a block first has it cancelled at the rest.
+// the pieces that are verified are uploaded to the peers that ask, tit for tat: the peers we
+// download from the fastest are unchoked, plus one optimistically so new peers get a chance.
+// the connections are all driven by a single epoll event loop, see download_run.
+// what is verified and half downloaded is saved to a resume file next to the output as it goes,
+// so a download started again over the same output picks up where it stopped.
+typedef struct {
+    Torrent *torrent;       // the torrent being downloaded.
+    Storage *storage;       // the output file, blocks are written to it as they arrive.
+    bool single_piece;      // the output holds a single piece at offset 0 rather than the whole file.
+    Bitfield wanted;        // the pieces to download.
+    Bitfield have;          // the pieces that are downloaded and verified.
+    Bitfield claimed;       // the pieces a peer is currently downloading or that are being verified.
+    size_t claimed_count;   // the number of claimed pieces.
+    Piece **downloading;    // for each claimed piece, its state, shared by every session working on it.
+    Picker picker;          // orders the pieces still to download by availability, while download_run runs.
+    size_t remaining;       // the number of wanted pieces that are not verified yet.
+    size_t left;            // the bytes of the wanted pieces that are not verified yet.
+    size_t downloaded;      // the bytes of the pieces verified, what the trackers are told.
+    Peer *peers;            // the peers to download from, room for DOWNLOAD_MAX_KNOWN_PEERS while download_run runs.
+    size_t peers_count;     // the number of peers.
+    Announcer *announcer;   // where more peers come from as the trackers are announced to again.
+    size_t next_peer;       // the next peer to connect to.
+    bool changed;           // a piece was finished or handed back since idle peers last looked for work.
+    Hasher *hasher;         // verifies finished pieces off the event loop.
+    size_t verifying;       // the number of pieces waiting on the hasher.
+    size_t *failures;       // for each peer, the number of its pieces that failed verification.
+    Pool pieces;            // the state of the pieces being downloaded, see piece_place.
+    Pool pending;           // the PendingPiece of each piece waiting on the hasher.
+    struct PeerSession **sessions; // the session slots of download_run, to reach every holder of a shared piece.
+    double next_rechoke;    // when the peers uploaded to are chosen again, from peer_now.
+    size_t rechokes;        // the number of times the peers uploaded to were chosen.
+    size_t optimistic;      // the session slot that is unchoked optimistically, DOWNLOAD_MAX_PEERS if none.
+    size_t uploaded;        // the number of payload bytes uploaded to peers.
+    char *resume_path;      // the resume file, the output path with DOWNLOAD_RESUME_SUFFIX. NULL for a single piece.
+    ResumeState resume;     // the half downloaded pieces nobody is downloading, from the resume file or a peer that went away.
+    double next_resume;     // when the resume file is saved next, from peer_now.
+    bool unsaved;           // blocks arrived since the resume file was last saved.
+} Download;
+
+/**
+ * @brief Create a new download writing to an output file. Nothing is wanted until
+ * download_want_piece or download_want_all is called.
+ * A whole file download whose resume file matches the output keeps the output and has the pieces
+ * it lists, only those in a file modified since it was saved are hashed again. Otherwise the
+ * output is created empty.
+ * @param torrent The torrent to download
+ * @param output_path The path of the file to write
+ * @param single_piece Whether the output is a single piece (written at offset 0) or the whole file
+ * @return Download* A pointer to the new download, or NULL on error
+*/
+Download *download_new(Torrent *torrent, const char *output_path, bool single_piece);
+
+/**
+ * @brief Mark a single piece as wanted. A single piece download sizes its output to the piece.
+ * @param dl The download
+ * @param index The index of the piece
+ * @return int DOWNLOAD_SUCCESS, or DOWNLOAD_ERR_IO if the output could not be sized
+*/
+int download_want_piece(Download *dl, size_t index);
+
+/**
+ * @brief Mark every piece of the torrent as wanted.
+ * @param dl The download
+ * @return void
+*/
+void download_want_all(Download *dl);
+
+/**
+ * @brief Download every wanted piece, from up to DOWNLOAD_MAX_PEERS of the given peers at a time.
+ * Every socket is non-blocking and owned by one edge triggered epoll loop on the calling thread,
+ * so a slow peer only ever holds up its own pieces.
+ * The trackers are announced to again as often as they ask from the same loop, and the peers they
+ * answer with join the ones still to be tried.
+ * Blocks until every wanted piece is verified and written, every peer has been tried, or SIGINT or
+ * SIGTERM arrives. The resume file is saved every DOWNLOAD_RESUME_INTERVAL seconds and once more
+ * before it returns.
+ * @param dl The download
+ * @param announcer The announcer of the torrent, its peers so far are tried first
+ * @return int DOWNLOAD_SUCCESS, or DOWNLOAD_ERR_INCOMPLETE if some wanted pieces could not be downloaded
+*/
+int download_run(Download *dl, Announcer *announcer);
+
+/**
+ * @brief Free a download and close its output file.
+ * @param dl The download
+ * @return void
+*/
+void download_free(Download *dl);
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * @file fileio.c
+ * @brief Implementation file for loading files into memory in C.
+*/
+#include "fileio.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// the size of each read when a file has to be loaded into the heap.
+#define READ_CHUNK_SIZE 65536
+
+FILE_CONTENT read_fd(int fd);
+
+FILE_CONTENT read_fd(int fd)
+{
+    FILE_CONTENT content = {0};
+    size_t capacity = READ_CHUNK_SIZE;
+    char *data = malloc(capacity);
+    if (data == NULL)
+    {
+        fprintf(stderr, "ERR: failed to alloc buffer for file contents\n");
+        return content;
+    }
+
+    size_t size = 0;
+    while (true)
+    {
+        if (size == capacity)
+        {
+            char *tmp = realloc(data, capacity * 2);
+            if (tmp == NULL)
+            {
+                fprintf(stderr, "ERR: failed to grow buffer for file contents\n");
+                free(data);
+                return content;
+            }
+            data = tmp;
+            capacity *= 2;
+        }
+
+        ssize_t nbytes = read(fd, data + size, capacity - size);
+        if (nbytes < 0)
+        {
+            fprintf(stderr, "ERR: failed to read file contents\n");
+            free(data);
+            return content;
+        }
+
+        if (nbytes == 0)
+            break;
+
+        size += nbytes;
+    }
+
+    content.size = size;
+    content.content = data;
+    content.mapped = false;
+    return content;
+}
+
+FILE_CONTENT map_file(const char *path)
+{
+    FILE_CONTENT content = {0};
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "unable to open file at: %s\n", path);
+        return content;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "ERR: unable to stat file at: %s\n", path);
+        close(fd);
+        return content;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            // the whole file is about to be parsed, start paging it in now.
+            madvise(data, st.st_size, MADV_WILLNEED);
+            close(fd);
+            content.size = st.st_size;
+            content.content = data;
+            content.mapped = true;
+            return content;
+        }
+    }
+
+    content = read_fd(fd);
+    close(fd);
+    return content;
+}
+
+void unmap_file(FILE_CONTENT *file)
+{
+    if (file->content != NULL)
+    {
+        if (file->mapped)
+            munmap(file->content, file->size);
+        else
+            free(file->content);
+    }
+
+    file->content = NULL;
+    file->size = 0;
+    file->mapped = false;
+}
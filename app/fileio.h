@@ -0,0 +1,35 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+/**
+ * @file fileio.h
+ * @brief Header file for loading files into memory in C.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// the contents of a file loaded into memory, either mapped straight from the page cache or read into the heap.
+typedef struct {
+    size_t size;
+    char *content;
+    bool mapped; // content is a read only mapping rather than a heap buffer.
+} FILE_CONTENT;
+
+/**
+ * @brief Load a file into memory. Regular files are memory mapped read only, so nothing is copied
+ * and the pages are shared with the page cache. Anything that cannot be mapped (pipes, empty files...)
+ * is read into a heap buffer instead. The content is not NUL terminated.
+ * @param path The path of the file to load
+ * @return the file contents, content is NULL if the file could not be loaded
+*/
+FILE_CONTENT map_file(const char *path);
+
+/**
+ * @brief Release the memory behind a loaded file, whichever way it was loaded.
+ * @param file The file contents to release, reset to empty afterwards
+ * @return void
+*/
+void unmap_file(FILE_CONTENT *file);
+
+#endif
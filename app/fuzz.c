@@ -0,0 +1,492 @@
+/**
+ * @file fuzz.c
+ * @brief Implementation file for fuzzing the bencode decoder and encoder in C.
+ * The generator writes canonical bencode directly (dictionary keys sorted and unique, integers
+ * without leading zeros) so that an undamaged input can be held to encoding back byte for byte.
+ * The damage is biased towards the bytes bencode is made of, which reach the decoder's error paths
+ * far more often than random bytes would.
+ *
+ * A libFuzzer build needs only the decoder besides this file:
+ *   clang -g -O1 -fsanitize=fuzzer,address,undefined -DBENCODE_LIBFUZZER app/fuzz.c app/bencode.c app/bstring.c app/arena.c app/log.c app/metrics.c
+*/
+#include "fuzz.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "arena.h"
+#include "bencode.h"
+
+// what an input failed, if anything.
+typedef enum {
+    FUZZ_OK,
+    FUZZ_MODES,         // the four ways of decoding gave different results.
+    FUZZ_LENGTH,        // a value claims to be longer than its input.
+    FUZZ_ENCODINGS,     // the four trees encode differently.
+    FUZZ_IDEMPOTENT,    // an encoding does not decode and encode again to itself.
+    FUZZ_STREAM,        // the stream parser and the decoder disagree.
+    FUZZ_ROUND_TRIP,    // canonical input does not encode back to itself.
+    FUZZ_CHECKS
+} FuzzCheck;
+
+// the name each check is reported under.
+static const char *fuzz_check_names[FUZZ_CHECKS] = {
+    "ok", "decode modes disagree", "length past input", "encodings differ",
+    "encoding not idempotent", "stream parser disagrees", "round trip differs",
+};
+
+// inputs that once broke a check, checked on every run before the random ones.
+static const char *fuzz_regressions[] = {
+    "di1ei2ee",     // an integer key, the stream parser framed it.
+    "d3:fooe",      // a key without a value, likewise.
+    "dli1eei2ee",   // a list key.
+    "di1",          // a non-string key cut short, partial for both.
+    "i-0",          // a negative zero cut short, the decoder waited for more.
+};
+
+// the bytes damage is mostly made of.
+static const char fuzz_alphabet[] = "ilde:0123456789-";
+
+// the state of a run, its buffers sized for the largest input.
+typedef struct {
+    uint64_t rng;                               // xorshift64* state, never 0.
+    Arena *arena;
+    char input[FUZZ_MAX_INPUT];
+    size_t size;
+    char encoded[4][2 * FUZZ_MAX_INPUT + 1];    // each decode encoded, an encoding is never longer than its input.
+    char again[2 * FUZZ_MAX_INPUT + 1];         // the first encoding decoded and encoded again.
+} Fuzz;
+
+/**
+ * @brief check an input, counting its result and writing it out if it is among the first failures.
+ * @param fuzz The state, its input is what is checked
+ * @param canonical Whether the input is canonical bencode
+ * @param label What the input is reported as, e.g. "input 12"
+ * @param counts The results so far, by check
+ * @param failures The failures so far, advanced on failure
+ * @param out Where a failure is written
+ * @return void
+*/
+void fuzz_run_one(Fuzz *fuzz, bool canonical, const char *label, size_t *counts, size_t *failures, FILE *out);
+
+/**
+ * @brief the next random number.
+ * @param fuzz The state
+ * @return uint64_t the number
+*/
+uint64_t fuzz_next(Fuzz *fuzz);
+
+/**
+ * @brief a random number below a bound.
+ * @param fuzz The state
+ * @param bound The bound, more than 0
+ * @return size_t the number
+*/
+size_t fuzz_below(Fuzz *fuzz, size_t bound);
+
+/**
+ * @brief append bytes to the input, as many as fit.
+ * @param fuzz The state
+ * @param bytes The bytes
+ * @param n The number of bytes
+ * @return void
+*/
+void fuzz_append(Fuzz *fuzz, const void *bytes, size_t n);
+
+/**
+ * @brief append a random string, its length prefix included.
+ * @param fuzz The state
+ * @return void
+*/
+void fuzz_generate_string(Fuzz *fuzz);
+
+/**
+ * @brief append a random canonical value.
+ * @param fuzz The state
+ * @param depth How deep the value is nested
+ * @return void
+*/
+void fuzz_generate(Fuzz *fuzz, size_t depth);
+
+/**
+ * @brief damage the input at random a few times.
+ * @param fuzz The state
+ * @return void
+*/
+void fuzz_mutate(Fuzz *fuzz);
+
+/**
+ * @brief decode an input in every way and check all of them.
+ * @param fuzz The state
+ * @param data The input
+ * @param n The length of the input, at most FUZZ_MAX_INPUT
+ * @param canonical Whether the input is undamaged generated bencode
+ * @return FuzzCheck the first check that failed, or FUZZ_OK
+*/
+FuzzCheck fuzz_check(Fuzz *fuzz, const char *data, size_t n, bool canonical);
+
+/**
+ * @brief feed an input to a stream parser in random chunks until it is done with it.
+ * @param fuzz The state
+ * @param data The input
+ * @param n The length of the input
+ * @param consumed Set to the length of the value, if it completes
+ * @return int PARSER_SUCCESS, PARSER_ERR_PARTIAL or PARSER_ERR_SYNTAX
+*/
+int fuzz_stream(Fuzz *fuzz, const char *data, size_t n, size_t *consumed);
+
+/**
+ * @brief create the state of a run.
+ * @param seed The seed
+ * @return Fuzz* the state, or NULL on error
+*/
+Fuzz *fuzz_new(uint64_t seed);
+
+/**
+ * @brief free the state of a run.
+ * @param fuzz The state
+ * @return void
+*/
+void fuzz_free(Fuzz *fuzz);
+
+uint64_t fuzz_next(Fuzz *fuzz)
+{
+    fuzz->rng ^= fuzz->rng >> 12;
+    fuzz->rng ^= fuzz->rng << 25;
+    fuzz->rng ^= fuzz->rng >> 27;
+    return fuzz->rng * 2685821657736338717ULL;
+}
+
+size_t fuzz_below(Fuzz *fuzz, size_t bound)
+{
+    return (size_t)(fuzz_next(fuzz) % bound);
+}
+
+void fuzz_append(Fuzz *fuzz, const void *bytes, size_t n)
+{
+    size_t room = FUZZ_MAX_INPUT - fuzz->size;
+    n = n < room ? n : room;
+    memcpy(fuzz->input + fuzz->size, bytes, n);
+    fuzz->size += n;
+}
+
+void fuzz_generate_string(Fuzz *fuzz)
+{
+    // mostly short, every byte value appears in them, delimiters and NULs included.
+    char bytes[64];
+    size_t length = fuzz_below(fuzz, fuzz_below(fuzz, 8) == 0 ? sizeof(bytes) : 12);
+    for (size_t i = 0; i < length; i++)
+        bytes[i] = (char)fuzz_next(fuzz);
+
+    char prefix[24];
+    int n = snprintf(prefix, sizeof(prefix), "%zu:", length);
+    fuzz_append(fuzz, prefix, n);
+    fuzz_append(fuzz, bytes, length);
+}
+
+void fuzz_generate(Fuzz *fuzz, size_t depth)
+{
+    // past the target size or depth only scalars come out, so every generated input is complete.
+    bool scalar = depth >= FUZZ_MAX_DEPTH || fuzz->size >= FUZZ_TARGET_INPUT;
+    switch (fuzz_below(fuzz, scalar ? 2 : 4))
+    {
+    case 0:
+    {
+        // mostly small integers, sometimes ones at the edges of a long.
+        char text[32];
+        long value;
+        switch (fuzz_below(fuzz, 4))
+        {
+        case 0:
+            value = (long)fuzz_next(fuzz);
+            break;
+        case 1:
+            value = fuzz_below(fuzz, 2) ? 9223372036854775807L : -9223372036854775807L - 1;
+            break;
+        default:
+            value = (long)fuzz_below(fuzz, 2001) - 1000;
+            break;
+        }
+        int n = snprintf(text, sizeof(text), "i%lde", value);
+        fuzz_append(fuzz, text, n);
+        break;
+    }
+    case 1:
+        fuzz_generate_string(fuzz);
+        break;
+    case 2:
+    {
+        fuzz_append(fuzz, "l", 1);
+        size_t count = fuzz_below(fuzz, FUZZ_MAX_ELEMENTS + 1);
+        for (size_t i = 0; i < count; i++)
+            fuzz_generate(fuzz, depth + 1);
+        fuzz_append(fuzz, "e", 1);
+        break;
+    }
+    default:
+    {
+        // each key one letter repeated, every letter later than the one before, so they are sorted and unique.
+        fuzz_append(fuzz, "d", 1);
+        size_t count = fuzz_below(fuzz, FUZZ_MAX_ELEMENTS + 1);
+        char key = 'a' + fuzz_below(fuzz, 4);
+        for (size_t i = 0; i < count && key <= 'z'; i++)
+        {
+            size_t length = 1 + fuzz_below(fuzz, 3);
+            char prefix[24];
+            int n = snprintf(prefix, sizeof(prefix), "%zu:", length);
+            fuzz_append(fuzz, prefix, n);
+            fuzz_append(fuzz, &key, 1);
+            for (size_t c = 1; c < length; c++)
+                fuzz_append(fuzz, &key, 1);
+            fuzz_generate(fuzz, depth + 1);
+            key += 1 + fuzz_below(fuzz, 3);
+        }
+        fuzz_append(fuzz, "e", 1);
+        break;
+    }
+    }
+}
+
+void fuzz_mutate(Fuzz *fuzz)
+{
+    size_t mutations = 1 + fuzz_below(fuzz, 4);
+    for (size_t m = 0; m < mutations && fuzz->size > 0; m++)
+    {
+        size_t at = fuzz_below(fuzz, fuzz->size);
+        char byte = fuzz_below(fuzz, 4) == 0 ? (char)fuzz_next(fuzz) : fuzz_alphabet[fuzz_below(fuzz, sizeof(fuzz_alphabet) - 1)];
+        switch (fuzz_below(fuzz, 5))
+        {
+        case 0: // replace a byte.
+            fuzz->input[at] = byte;
+            break;
+        case 1: // insert a byte.
+            if (fuzz->size < FUZZ_MAX_INPUT)
+            {
+                memmove(fuzz->input + at + 1, fuzz->input + at, fuzz->size - at);
+                fuzz->input[at] = byte;
+                fuzz->size++;
+            }
+            break;
+        case 2: // delete a few bytes.
+        {
+            size_t n = 1 + fuzz_below(fuzz, 4);
+            n = n < fuzz->size - at ? n : fuzz->size - at;
+            memmove(fuzz->input + at, fuzz->input + at + n, fuzz->size - at - n);
+            fuzz->size -= n;
+            break;
+        }
+        case 3: // cut the input short.
+            fuzz->size = at;
+            break;
+        default: // repeat a run of bytes.
+        {
+            size_t n = 1 + fuzz_below(fuzz, 16);
+            n = n < fuzz->size - at ? n : fuzz->size - at;
+            if (fuzz->size + n <= FUZZ_MAX_INPUT)
+            {
+                memmove(fuzz->input + at + n, fuzz->input + at, fuzz->size - at);
+                fuzz->size += n;
+            }
+            break;
+        }
+        }
+    }
+}
+
+int fuzz_stream(Fuzz *fuzz, const char *data, size_t n, size_t *consumed)
+{
+    StreamParser sp;
+    stream_parser_init(&sp);
+    int result = PARSER_ERR_PARTIAL;
+    size_t offset = 0;
+    while (offset < n && result == PARSER_ERR_PARTIAL)
+    {
+        // the value is done with the chunk that completes it, what is after it is not fed.
+        size_t chunk = 1 + fuzz_below(fuzz, 16);
+        chunk = chunk < n - offset ? chunk : n - offset;
+        result = stream_parser_feed(&sp, data + offset, chunk);
+        offset += chunk;
+    }
+    *consumed = sp.consumed;
+    return result;
+}
+
+FuzzCheck fuzz_check(Fuzz *fuzz, const char *data, size_t n, bool canonical)
+{
+    Bencoded trees[4];
+    int results[4];
+    results[0] = decode_bencode(&trees[0], data, n, NULL);
+    results[1] = decode_bencode_borrowed(&trees[1], data, n, NULL);
+    results[2] = decode_bencode(&trees[2], data, n, fuzz->arena);
+    results[3] = decode_bencode_borrowed(&trees[3], data, n, fuzz->arena);
+
+    FuzzCheck failed = FUZZ_OK;
+    for (size_t i = 1; i < 4; i++)
+    {
+        if (results[i] != results[0])
+            failed = FUZZ_MODES;
+    }
+
+    size_t sizes[4] = {0};
+    for (size_t i = 0; i < 4 && failed == FUZZ_OK && results[0] == PARSER_SUCCESS; i++)
+    {
+        if (trees[i].encoded_offset != 0 || (size_t)trees[i].encoded_length > n)
+            failed = FUZZ_LENGTH;
+        else
+            sizes[i] = encode_bencode(&trees[i], fuzz->encoded[i]);
+        if (failed == FUZZ_OK && (sizes[i] != sizes[0] || memcmp(fuzz->encoded[i], fuzz->encoded[0], sizes[0]) != 0))
+            failed = FUZZ_ENCODINGS;
+    }
+
+    if (failed == FUZZ_OK && results[0] == PARSER_SUCCESS)
+    {
+        Bencoded again;
+        if (decode_bencode(&again, fuzz->encoded[0], sizes[0], NULL) != PARSER_SUCCESS)
+        {
+            failed = FUZZ_IDEMPOTENT;
+        }
+        else
+        {
+            size_t size = encode_bencode(&again, fuzz->again);
+            if ((size_t)again.encoded_length != sizes[0] || size != sizes[0] || memcmp(fuzz->again, fuzz->encoded[0], size) != 0)
+                failed = FUZZ_IDEMPOTENT;
+            free_bencoded_inner(again);
+        }
+    }
+
+    if (failed == FUZZ_OK && results[0] != PARSER_ERR_MEMORY)
+    {
+        // both see the same value end at the same byte, or both see it unfinished, or both reject it.
+        size_t consumed;
+        int streamed = fuzz_stream(fuzz, data, n, &consumed);
+        if (streamed != results[0] || (streamed == PARSER_SUCCESS && consumed != (size_t)trees[0].encoded_length))
+            failed = FUZZ_STREAM;
+    }
+
+    if (failed == FUZZ_OK && canonical && (results[0] != PARSER_SUCCESS || sizes[0] != n || memcmp(fuzz->encoded[0], data, n) != 0))
+        failed = FUZZ_ROUND_TRIP;
+
+    // a failed decode frees what it made, only the trees that succeeded are left.
+    if (results[0] == PARSER_SUCCESS)
+        free_bencoded_inner(trees[0]);
+    if (results[1] == PARSER_SUCCESS)
+        free_bencoded_inner(trees[1]);
+    arena_reset(fuzz->arena);
+    return failed;
+}
+
+Fuzz *fuzz_new(uint64_t seed)
+{
+    Fuzz *fuzz = malloc(sizeof(Fuzz));
+    if (fuzz == NULL)
+        return NULL;
+    fuzz->arena = arena_new(0);
+    if (fuzz->arena == NULL)
+    {
+        free(fuzz);
+        return NULL;
+    }
+    fuzz->rng = seed != 0 ? seed : 0x9e3779b97f4a7c15ULL;
+    fuzz->size = 0;
+    return fuzz;
+}
+
+void fuzz_free(Fuzz *fuzz)
+{
+    if (fuzz == NULL)
+        return;
+    arena_free(fuzz->arena);
+    free(fuzz);
+}
+
+void fuzz_run_one(Fuzz *fuzz, bool canonical, const char *label, size_t *counts, size_t *failures, FILE *out)
+{
+    FuzzCheck check = fuzz_check(fuzz, fuzz->input, fuzz->size, canonical);
+    counts[check]++;
+    if (check == FUZZ_OK || (*failures)++ >= FUZZ_MAX_REPORTS)
+        return;
+
+    fprintf(out, "FAIL %s, %s of %zu bytes: ", fuzz_check_names[check], label, fuzz->size);
+    for (size_t b = 0; b < fuzz->size && b < 64; b++)
+        fprintf(out, "%02x", (unsigned char)fuzz->input[b]);
+    fprintf(out, "%s\n", fuzz->size > 64 ? "..." : "");
+}
+
+size_t bencode_fuzz(size_t iterations, uint64_t seed, FILE *out)
+{
+    Fuzz *fuzz = fuzz_new(seed);
+    if (fuzz == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for fuzzing\n");
+        return iterations;
+    }
+
+    // the decoder reports every error it meets, which is most inputs here.
+    fflush(stderr);
+    int saved_stderr = dup(STDERR_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (saved_stderr >= 0 && devnull >= 0)
+        dup2(devnull, STDERR_FILENO);
+
+    size_t counts[FUZZ_CHECKS] = {0};
+    size_t failures = 0;
+    size_t regressions = sizeof(fuzz_regressions) / sizeof(fuzz_regressions[0]);
+    char label[32];
+    for (size_t i = 0; i < regressions; i++)
+    {
+        fuzz->size = strlen(fuzz_regressions[i]);
+        memcpy(fuzz->input, fuzz_regressions[i], fuzz->size);
+        snprintf(label, sizeof(label), "regression %zu", i);
+        fuzz_run_one(fuzz, false, label, counts, &failures, out);
+    }
+
+    size_t canonical_count = 0;
+    for (size_t i = 0; i < iterations; i++)
+    {
+        fuzz->size = 0;
+        fuzz_generate(fuzz, 0);
+        bool canonical = fuzz_below(fuzz, 4) == 0;
+        if (!canonical)
+            fuzz_mutate(fuzz);
+        canonical_count += canonical;
+        snprintf(label, sizeof(label), "input %zu", i);
+        fuzz_run_one(fuzz, canonical, label, counts, &failures, out);
+    }
+
+    if (saved_stderr >= 0 && devnull >= 0)
+        dup2(saved_stderr, STDERR_FILENO);
+    if (saved_stderr >= 0)
+        close(saved_stderr);
+    if (devnull >= 0)
+        close(devnull);
+
+    fprintf(out, "Checked %zu inputs (%zu undamaged) with seed %llu and %zu regressions, %zu failed\n",
+            iterations, canonical_count, (unsigned long long)seed, regressions, failures);
+    for (FuzzCheck check = FUZZ_OK + 1; check < FUZZ_CHECKS; check++)
+    {
+        if (counts[check] > 0)
+            fprintf(out, "  %s: %zu\n", fuzz_check_names[check], counts[check]);
+    }
+
+    fuzz_free(fuzz);
+    return failures;
+}
+
+#ifdef BENCODE_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static Fuzz *fuzz = NULL;
+    if (fuzz == NULL)
+        fuzz = fuzz_new(1);
+    if (fuzz == NULL || size > FUZZ_MAX_INPUT)
+        return 0;
+
+    // libFuzzer finds what crashes, an input that breaks a check is made to crash.
+    FuzzCheck check = fuzz_check(fuzz, (const char *)data, size, false);
+    if (check != FUZZ_OK)
+    {
+        fprintf(stderr, "FAIL %s\n", fuzz_check_names[check]);
+        abort();
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,43 @@
+#ifndef FUZZ_H
+#define FUZZ_H
+
+/**
+ * @file fuzz.h
+ * @brief Header file for fuzzing the bencode decoder and encoder in C.
+ * Random canonical bencode is generated and most of it then damaged at random, and every input is
+ * checked against what must hold whatever it is: the four ways of decoding it agree, a decoded value
+ * encodes the same way each time and decodes again to itself, the stream parser agrees with the decoder
+ * on where and whether the value ends, and canonical input encodes back to exactly the bytes it came from.
+ * Built with -DBENCODE_LIBFUZZER fuzz.c also provides the entry point of libFuzzer, checking every input it is given.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// the largest input checked, longer ones are skipped.
+#define FUZZ_MAX_INPUT 8192
+
+// how large a generated input grows before only scalars are generated, closing what is open.
+#define FUZZ_TARGET_INPUT 2048
+
+// how deep generated lists and dictionaries nest.
+#define FUZZ_MAX_DEPTH 6
+
+// the most elements a generated list or dictionary has.
+#define FUZZ_MAX_ELEMENTS 5
+
+// the number of failing inputs written out in full, the rest are only counted.
+#define FUZZ_MAX_REPORTS 8
+
+/**
+ * @brief Check the inputs that once broke a check and a number of random ones, writing out the first few that fail and a summary.
+ * The decoder reports every syntax error on stderr, it is silenced for the duration.
+ * @param iterations The number of inputs
+ * @param seed The seed of the inputs, the same seed checks the same inputs
+ * @param out Where the failures and the summary go
+ * @return size_t the number of inputs that failed a check
+*/
+size_t bencode_fuzz(size_t iterations, uint64_t seed, FILE *out);
+
+#endif
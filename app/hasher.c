@@ -0,0 +1,276 @@
+/**
+ * @file hasher.c
+ * @brief Implementation file for a pool of threads verifying piece hashes off the network thread in C.
+ * The queues are the bounded MPMC ring of Dmitry Vyukov: each slot carries a sequence number, a
+ * producer may fill a slot once its sequence equals the position being written, a consumer may
+ * empty it once the sequence is one past that position.
+*/
+#include "hasher.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+/**
+ * @brief reset a queue so every slot is free.
+ * @param queue The queue
+ * @return void
+*/
+void hash_queue_init(HashQueue *queue);
+
+/**
+ * @brief append a job to a queue.
+ * @param queue The queue
+ * @param job The job
+ * @return bool whether the job was queued, false if the queue is full
+*/
+bool hash_queue_push(HashQueue *queue, HashJob *job);
+
+/**
+ * @brief take the oldest job off a queue.
+ * @param queue The queue
+ * @return HashJob* the job, or NULL if the queue is empty
+*/
+HashJob *hash_queue_pop(HashQueue *queue);
+
+/**
+ * @brief the entry point of a worker thread, verifying jobs until the pool stops.
+ * @param arg The Hasher
+ * @return NULL
+*/
+void *hasher_worker(void *arg);
+
+void hash_queue_init(HashQueue *queue)
+{
+    for (size_t i = 0; i < HASHER_QUEUE_CAPACITY; i++)
+    {
+        atomic_store_explicit(&queue->slots[i].sequence, i, memory_order_relaxed);
+        queue->slots[i].job = NULL;
+    }
+    atomic_store_explicit(&queue->enqueue_at, 0, memory_order_relaxed);
+    atomic_store_explicit(&queue->dequeue_at, 0, memory_order_relaxed);
+}
+
+bool hash_queue_push(HashQueue *queue, HashJob *job)
+{
+    size_t at = atomic_load_explicit(&queue->enqueue_at, memory_order_relaxed);
+    HashQueueSlot *slot;
+    while (true)
+    {
+        slot = &queue->slots[at & (HASHER_QUEUE_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)at;
+        if (diff == 0)
+        {
+            // the slot is free, try to take the position. a failed exchange reloads `at`.
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_at, &at, at + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // the slot still holds the job from a lap ago.
+            return false;
+        }
+        else
+        {
+            at = atomic_load_explicit(&queue->enqueue_at, memory_order_relaxed);
+        }
+    }
+
+    slot->job = job;
+    atomic_store_explicit(&slot->sequence, at + 1, memory_order_release);
+    return true;
+}
+
+HashJob *hash_queue_pop(HashQueue *queue)
+{
+    size_t at = atomic_load_explicit(&queue->dequeue_at, memory_order_relaxed);
+    HashQueueSlot *slot;
+    while (true)
+    {
+        slot = &queue->slots[at & (HASHER_QUEUE_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(at + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_at, &at, at + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // nothing was written to the slot yet.
+            return NULL;
+        }
+        else
+        {
+            at = atomic_load_explicit(&queue->dequeue_at, memory_order_relaxed);
+        }
+    }
+
+    HashJob *job = slot->job;
+    // free the slot for the producer one lap ahead.
+    atomic_store_explicit(&slot->sequence, at + HASHER_QUEUE_CAPACITY, memory_order_release);
+    return job;
+}
+
+Hasher *hasher_new(void)
+{
+    // rounded up to the alignment, as aligned_alloc requires.
+    size_t size = (sizeof(Hasher) + 63) / 64 * 64;
+    Hasher *hasher = aligned_alloc(64, size);
+    if (hasher == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for hasher\n");
+        return NULL;
+    }
+
+    hash_queue_init(&hasher->jobs);
+    hash_queue_init(&hasher->results);
+    atomic_store(&hasher->stopping, false);
+    hasher->outstanding = 0;
+    hasher->workers_count = 0;
+
+    hasher->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hasher->event_fd < 0)
+    {
+        fprintf(stderr, "ERR: failed to create hasher event\n");
+        free(hasher);
+        return NULL;
+    }
+
+    if (sem_init(&hasher->pending, 0, 0) != 0)
+    {
+        fprintf(stderr, "ERR: failed to create hasher semaphore\n");
+        close(hasher->event_fd);
+        free(hasher);
+        return NULL;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t wanted = cores > 1 ? cores - 1 : 1;
+    if (wanted > HASHER_MAX_WORKERS)
+        wanted = HASHER_MAX_WORKERS;
+
+    while (hasher->workers_count < wanted)
+    {
+        if (pthread_create(&hasher->workers[hasher->workers_count], NULL, hasher_worker, hasher) != 0)
+            break;
+        hasher->workers_count++;
+    }
+
+    if (hasher->workers_count == 0)
+    {
+        fprintf(stderr, "ERR: failed to start hasher workers\n");
+        sem_destroy(&hasher->pending);
+        close(hasher->event_fd);
+        free(hasher);
+        return NULL;
+    }
+
+    return hasher;
+}
+
+void hasher_free(Hasher *hasher)
+{
+    atomic_store(&hasher->stopping, true);
+    for (size_t i = 0; i < hasher->workers_count; i++)
+    {
+        sem_post(&hasher->pending);
+    }
+    for (size_t i = 0; i < hasher->workers_count; i++)
+    {
+        pthread_join(hasher->workers[i], NULL);
+    }
+
+    sem_destroy(&hasher->pending);
+    close(hasher->event_fd);
+    free(hasher);
+}
+
+int hasher_submit(Hasher *hasher, HashJob *job)
+{
+    // bounding what is outstanding, not just what is queued, means the results queue never fills up.
+    if (hasher->outstanding == HASHER_QUEUE_CAPACITY || !hash_queue_push(&hasher->jobs, job))
+        return HASHER_ERR_FULL;
+
+    metrics_record(METRIC_HASH_QUEUE_DEPTH, hasher->outstanding);
+    hasher->outstanding++;
+    sem_post(&hasher->pending);
+    return HASHER_SUCCESS;
+}
+
+HashJob *hasher_poll(Hasher *hasher)
+{
+    HashJob *job = hash_queue_pop(&hasher->results);
+    if (job == NULL)
+    {
+        // reset the event before looking again: a result pushed after the reset signals it anew,
+        // one pushed before it is seen by the second look.
+        uint64_t count;
+        if (read(hasher->event_fd, &count, sizeof(count)) < 0)
+            count = 0;
+        job = hash_queue_pop(&hasher->results);
+    }
+
+    if (job != NULL)
+        hasher->outstanding--;
+    return job;
+}
+
+void hasher_wait(Hasher *hasher)
+{
+    if (hasher->outstanding == 0)
+        return;
+
+    struct pollfd fd = { .fd = hasher->event_fd, .events = POLLIN };
+    poll(&fd, 1, -1);
+}
+
+int hasher_fd(Hasher *hasher)
+{
+    return hasher->event_fd;
+}
+
+void hasher_verify(HashJob *job)
+{
+    uint64_t start = metrics_enabled ? metrics_now_ns() : 0;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(job->data, job->size, hash);
+    job->ok = memcmp(hash, job->expected, SHA_DIGEST_LENGTH) == 0;
+    if (metrics_enabled)
+        metrics_record(METRIC_HASH_TIME, metrics_now_ns() - start);
+}
+
+void *hasher_worker(void *arg)
+{
+    Hasher *hasher = arg;
+    while (true)
+    {
+        while (sem_wait(&hasher->pending) != 0)
+            ;
+
+        if (atomic_load(&hasher->stopping))
+            break;
+
+        // every post follows a completed push, so a job is there. should a pop ever lose a race
+        // anyway the post is handed on rather than dropped.
+        HashJob *job = hash_queue_pop(&hasher->jobs);
+        if (job == NULL)
+        {
+            sem_post(&hasher->pending);
+            continue;
+        }
+
+        hasher_verify(job);
+
+        // the results queue has room, hasher_submit keeps what is outstanding within its capacity.
+        hash_queue_push(&hasher->results, job);
+        uint64_t one = 1;
+        if (write(hasher->event_fd, &one, sizeof(one)) < 0)
+            fprintf(stderr, "ERR: failed to signal a hash result\n");
+    }
+    return NULL;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file hasher.h
+ * @brief Header file for a pool of threads verifying piece hashes off the network thread in C.
+ * Jobs and results travel over bounded lock-free queues, and an eventfd tells the submitting
+ * thread's event loop when results are waiting.
+*/
+
+#ifndef HASHER_H
+#define HASHER_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <openssl/sha.h>
+
+#define HASHER_SUCCESS 0
+#define HASHER_ERR_FULL -1
+
+// the most jobs that can be queued or in progress at once, a power of two.
+#define HASHER_QUEUE_CAPACITY 1024
+
+// the most worker threads a pool starts, whatever the number of cores.
+#define HASHER_MAX_WORKERS 32
+
+// a piece to verify. the data and expected hash must stay alive until the job comes back.
+typedef struct {
+    const unsigned char *data;      // the contents of the piece.
+    size_t size;                    // the size of the piece.
+    const unsigned char *expected;  // the SHA1 the piece must hash to.
+    void *owner;                    // anything the submitter needs to handle the result.
+    bool ok;                        // set by the worker, whether the piece hashed to expected.
+} HashJob;
+
+// a slot of a HashQueue, its sequence tells producers and consumers whose turn it is.
+typedef struct {
+    _Atomic size_t sequence;
+    HashJob *job;
+} HashQueueSlot;
+
+// a bounded multi-producer multi-consumer queue that never takes a lock,
+// the head and tail live on their own cache lines so producers and consumers do not contend.
+typedef struct {
+    HashQueueSlot slots[HASHER_QUEUE_CAPACITY];
+    _Alignas(64) _Atomic size_t enqueue_at;
+    _Alignas(64) _Atomic size_t dequeue_at;
+} HashQueue;
+
+typedef struct {
+    HashQueue jobs;             // jobs waiting for a worker.
+    HashQueue results;          // jobs a worker is done with.
+    sem_t pending;              // counts the jobs waiting, idle workers sleep on it.
+    _Atomic bool stopping;      // tells the workers to exit.
+    pthread_t workers[HASHER_MAX_WORKERS];
+    size_t workers_count;
+    int event_fd;               // readable while results are waiting.
+    size_t outstanding;         // jobs submitted whose result was not taken yet, owned by the submitting thread.
+} Hasher;
+
+/**
+ * @brief Start a pool with one worker per core (leaving one for the network thread), at least one.
+ * @return Hasher* A pointer to the new pool, or NULL on error
+*/
+Hasher *hasher_new(void);
+
+/**
+ * @brief Stop the workers and free the pool. Jobs still queued are dropped, the caller owns them.
+ * @param hasher The pool
+ * @return void
+*/
+void hasher_free(Hasher *hasher);
+
+/**
+ * @brief Queue a piece for verification. Only one thread may submit to, and take results from, a pool.
+ * @param hasher The pool
+ * @param job The job, it is handed back by hasher_poll once verified
+ * @return int HASHER_SUCCESS, or HASHER_ERR_FULL if HASHER_QUEUE_CAPACITY jobs are outstanding
+*/
+int hasher_submit(Hasher *hasher, HashJob *job);
+
+/**
+ * @brief Take the next verified job, without blocking.
+ * @param hasher The pool
+ * @return HashJob* the job, or NULL if no result is waiting
+*/
+HashJob *hasher_poll(Hasher *hasher);
+
+/**
+ * @brief Block until a result is waiting or nothing is outstanding.
+ * @param hasher The pool
+ * @return void
+*/
+void hasher_wait(Hasher *hasher);
+
+/**
+ * @brief The file descriptor to watch for results, e.g. with epoll. It reads as ready while
+ * results are waiting, and is reset by hasher_poll.
+ * @param hasher The pool
+ * @return int the file descriptor
+*/
+int hasher_fd(Hasher *hasher);
+
+/**
+ * @brief Verify a job on the calling thread, for when the pool is full.
+ * @param job The job to verify, its ok flag is set
+ * @return void
+*/
+void hasher_verify(HashJob *job);
+
+#endif
@@ -0,0 +1,30 @@
+/**
+ * @file log.c
+ * @brief Implementation file for leveled logging to stderr in C.
+*/
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+LogLevel log_level = LOG_WARN;
+
+void log_init(void)
+{
+    const char *name = getenv(LOG_ENV);
+    if (name != NULL && !log_set_level(name))
+        fprintf(stderr, "ERR: %s is not a log level, expected error, warn, info or debug\n", name);
+}
+
+bool log_set_level(const char *name)
+{
+    static const char *names[] = { "error", "warn", "info", "debug" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (strcmp(name, names[i]) == 0)
+        {
+            log_level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,46 @@
+#ifndef LOG_H
+#define LOG_H
+
+/**
+ * @file log.h
+ * @brief Header file for leveled logging to stderr in C.
+ * A message below the level set is skipped before its arguments are formatted, so the messages
+ * left on hot paths cost a compare when they are off. The level comes from LOG_ENV, e.g.
+ * BITTORRENT_LOG=debug, and is LOG_WARN otherwise.
+*/
+#include <stdio.h>
+#include <stdbool.h>
+
+// the environment variable the level is read from.
+#define LOG_ENV "BITTORRENT_LOG"
+
+typedef enum {
+    LOG_ERROR,  // something failed that the user asked for.
+    LOG_WARN,   // something failed that the program works around, a tracker or a piece.
+    LOG_INFO,   // what the program is doing, once per peer or announce.
+    LOG_DEBUG   // why an input was rejected, once per message.
+} LogLevel;
+
+// the most verbose level written, read on every message so it is a variable rather than a call.
+extern LogLevel log_level;
+
+// whether a message of a level is written.
+#define log_enabled(level) ((level) <= log_level)
+
+// write a message to stderr if its level is enabled, the arguments are only evaluated if it is.
+#define log_printf(level, ...) do { if (log_enabled(level)) fprintf(stderr, __VA_ARGS__); } while (0)
+
+/**
+ * @brief Set the level from LOG_ENV, if it names one.
+ * @return void
+*/
+void log_init(void);
+
+/**
+ * @brief Set the level by name, one of error, warn, info or debug.
+ * @param name The name of the level
+ * @return bool true, or false if the name is not a level
+*/
+bool log_set_level(const char *name);
+
+#endif
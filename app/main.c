@@ -10,18 +10,22 @@
 #include "bstring.h"
 #include "network.h"
 #include "torrent.h"
+#include "download.h"
+#include "recheck.h"
+#include "announcer.h"
+#include "udp_tracker.h"
+#include "peer.h"
+#include "batch.h"
+#include "bench.h"
+#include "fuzz.h"
+#include "log.h"
+#include "metrics.h"
 #include <stdlib.h>
 
-typedef struct {
-    size_t size;
-    char *content;
-} FILE_CONTENT;
-
 // print functions
-void print_tracker_url(Bencoded announce);
-void print_info(Bencoded info);
+void print_torrent_meta(Torrent *torrent);
 void print_hex(unsigned char *data, size_t size);
-FILE_CONTENT read_file(const char *path);
+int download_from_tracker(Download *dl, Torrent *torrent);
 
 void print_hex(unsigned char *data, size_t size)
 {
@@ -31,172 +35,62 @@ void print_hex(unsigned char *data, size_t size)
     }
 }
 
-void print_torrent_meta(Bencoded torrent)
-{
-    if (torrent.type != DICTIONARY)
-    {
-        fprintf(stderr, "ERR: parse error, expected dictionary, but recevied something else");
-        exit(1);
-    }
-
-    Bencoded *announce = get_dict_key(&torrent, "announce");
-    if (announce == NULL)
-    {
-        fprintf(stderr, "ERR: 'announce' key not found in torrent meta");
-        return;
-    }
-    print_tracker_url(*announce);
-
-    Bencoded *info = get_dict_key(&torrent, "info");
-    if (info == NULL)
-    {
-        fprintf(stderr, "ERR: 'info' key not found in torrent meta");
-        return;
-    }
-    print_info(*info);
-    return;
-}
-
-void print_tracker_url(Bencoded announce)
+void print_torrent_meta(Torrent *torrent)
 {
-    if (announce.type != STRING)
-    {
-        fprintf(stderr, "ERR: announce key is expected to be a string.");
-        return;
-    }
-
-    printf("Tracker URL: %.*s\n", (int)announce.data.string->size, announce.data.string->chars);
-}
-
-void print_info(Bencoded info)
-{
-    if (info.type != DICTIONARY)
-    {
-        fprintf(stderr, "ERR: info key is expected to be a dict.");
-        return;
-    }
-
-    Bencoded *length = get_dict_key(&info, "length");
-    if (length == NULL)
-    {
-        fprintf(stderr, "ERR: length key not found in info dict.");
-        return;
-    }
-
-    if (length->type != INTEGER)
-    {
-        fprintf(stderr, "ERR: length key inside info expected to be an integer.");
-        return;
-    }
-
-    printf("Length: %li\n", length->data.integer);
-
-    // print the info hash
-    char hash[SHA_DIGEST_LENGTH];
-    if (!hash_bencoded((unsigned char *)hash, &info))
-    {
-        fprintf(stderr, "ERR: failed to hash bencoded info");
-        return;
-    }
+    TorrentFile *file = torrent->file;
+    printf("Tracker URL: %.*s\n", (int)torrent->announce->size, torrent->announce->chars);
+    printf("Length: %zu\n", file->file_size);
 
     printf("Info Hash: ");
-    print_hex((unsigned char *)hash, SHA_DIGEST_LENGTH);
+    print_hex(torrent->info_hash, SHA_DIGEST_LENGTH);
     printf("\n");
 
-    // print piece length
-    Bencoded *piece_length = get_dict_key(&info, "piece length");
-    if (piece_length == NULL)
-    {
-        fprintf(stderr, "ERR: piece length key not found in info dict.");
-        return;
-    }
-
-    if (piece_length->type != INTEGER)
-    {
-        fprintf(stderr, "ERR: piece length key inside info expected to be an integer.");
-        return;
-    }
-
-    printf("Piece Length: %li\n", piece_length->data.integer);
-
-    // print the pieces
-    Bencoded *pieces = get_dict_key(&info, "pieces");
-    if (pieces == NULL)
-    {
-        fprintf(stderr, "ERR: pieces key not found in info dict.");
-        return;
-    }
-
-    if (pieces->type != STRING)
-    {
-        fprintf(stderr, "ERR: pieces key inside info expected to be a string.");
-        return;
-    }
-
-    if (pieces->data.string->size % SHA_DIGEST_LENGTH != 0)
-    {
-        fprintf(stderr, "ERR: pieces key inside info has invalid length.");
-        return;
-    }
-
+    printf("Piece Length: %zu\n", file->piece_length);
     printf("Piece Hashes:\n");
 
-    for(size_t i = 0; i < pieces->data.string->size; i += SHA_DIGEST_LENGTH)
+    for (size_t i = 0; i < file->num_pieces; i++)
     {
-        print_hex((unsigned char *)pieces->data.string->chars + i, SHA_DIGEST_LENGTH);
+        print_hex((unsigned char *)torrent_file_piece_hash(file, i), SHA_DIGEST_LENGTH);
         printf("\n");
     }
 }
 
-FILE_CONTENT read_file(const char *path)
+/**
+ * @brief Main function to decode a Bencoded string and print the decoded value.
+ * @param argc The number of command-line arguments.
+ * @param argv An array of command-line arguments.
+ * @return 0 if successful, 1 if there was an error.
+ */
+int download_from_tracker(Download *dl, Torrent *torrent)
 {
-    FILE_CONTENT content = {0};
-
-    FILE *file = fopen(path, "r");
-    if (file == NULL)
-    {
-        fprintf(stderr, "unable to open file at: %s\n", path);
-        return content;
-    }
-
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    char *data = malloc(size + 1);
-    if (data == NULL)
-    {
-        fprintf(stderr, "ERR: failed to alloc buffer for file contents");
-        return content; // NULL;
-    }
+    Announcer *announcer = announcer_new(torrent);
+    if (announcer == NULL)
+        return DOWNLOAD_ERR_INCOMPLETE;
+    announcer->stats.left = dl->left;
 
-    long nbytes = fread(data, sizeof(char), size, file);
-    if (nbytes != size)
+    // the download starts as soon as any tracker answers, the others join in as they do.
+    if (announcer_wait(announcer, false) == 0)
     {
-        fprintf(stderr, "ERR: number of bytes read differs from file size.");
-        return content; // NULL;
+        fprintf(stderr, "ERR: failed to get tracker response\n");
+        announcer_free(announcer);
+        return DOWNLOAD_ERR_INCOMPLETE;
     }
 
-    content.size = size;
-    content.content = data;
-    fclose(file);
-
-    return content;
+    int result = download_run(dl, announcer);
+    announcer_free(announcer);
+    return result;
 }
 
-/**
- * @brief Main function to decode a Bencoded string and print the decoded value.
- * @param argc The number of command-line arguments.
- * @param argv An array of command-line arguments.
- * @return 0 if successful, 1 if there was an error.
- */
 int main(int argc, char *argv[])
 {
     // Disable output buffering
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
+    log_init();
+    metrics_init();
 
-    if (argc < 3)
+    // bench and fuzz are the only commands that run without arguments.
+    if (argc < 2 || (argc < 3 && strcmp(argv[1], "bench") != 0 && strcmp(argv[1], "fuzz") != 0))
     {
         fprintf(stderr, "Usage: your_bittorrent.sh <command> <args>\n");
         return 1;
@@ -209,7 +103,7 @@ int main(int argc, char *argv[])
         const char *encoded_str = argv[2];
         size_t len = strlen(encoded_str);
         Bencoded container;
-        int result = decode_bencode(&container, encoded_str, len);
+        int result = decode_bencode_borrowed(&container, encoded_str, len, NULL);
         if (result != PARSER_SUCCESS)
         {
             fprintf(stderr, "ERR: failed to decode bencoded value\n");
@@ -222,54 +116,64 @@ int main(int argc, char *argv[])
     else if (strcmp(command, "info") == 0)
     {
         const char *torrent_path = argv[2];
-        FILE_CONTENT file_contents = read_file(torrent_path);
-        if (file_contents.content == NULL || file_contents.size == 0)
+        Torrent *torrent = torrent_open(torrent_path);
+        if (torrent == NULL)
         {
             return 1;
         }
-        Bencoded container;
-        int result = decode_bencode(&container, file_contents.content, file_contents.size);
-        if (result != PARSER_SUCCESS)
-        {
-            fprintf(stderr, "ERR: failed to decode bencoded string\n");
+        print_torrent_meta(torrent);
+        torrent_free(torrent);
+    }
+
+    else if (strcmp(command, "batch_info") == 0)
+    {
+        // one process for any number of torrents, a JSON line comes out for each.
+        BatchList list;
+        if (batch_list_init(&list) != BATCH_SUCCESS)
             return 1;
+        for (int i = 2; i < argc; i++)
+        {
+            if (batch_list_add(&list, argv[i]) == BATCH_ERR_MEMORY)
+            {
+                batch_list_free(&list);
+                return 1;
+            }
         }
-        print_torrent_meta(container);
-        free_bencoded_inner(container);
+
+        // stdout is unbuffered, the workers write it in whole buffers of lines.
+        size_t failed = torrent_batch_info(&list, stdout);
+        fprintf(stderr, "Inspected %zu torrents, %zu failed\n", list.count, failed);
+        batch_list_free(&list);
+        return failed == 0 ? 0 : 1;
     }
 
     else if (strcmp(command, "peers") == 0)
     {
         const char *torrent_path = argv[2];
-        FILE_CONTENT file_contents = read_file(torrent_path);
-        if (file_contents.content == NULL || file_contents.size == 0)
-        {
-            fprintf(stderr, "ERR: failed to read file contents\n");
-            fprintf(stderr, "torrent path %s\n", torrent_path);
-            return 1;
-        }
-        Bencoded container;
-        int result = decode_bencode(&container, file_contents.content, file_contents.size);
-        if (result != PARSER_SUCCESS)
+        Torrent *torrent = torrent_open(torrent_path);
+        if (torrent == NULL)
         {
-            fprintf(stderr, "ERR: failed to decode bencoded string\n");
             return 1;
         }
 
-        Tracker_Response *res = get_tracker_response(&container);
-
-        if (!res->ok)
+        Announcer *announcer = announcer_new(torrent);
+        if (announcer == NULL || announcer_wait(announcer, true) == 0)
         {
             fprintf(stderr, "ERR: failed to get tracker response\n");
-            free_bencoded_inner(container);
-            tracker_response_free(res);
+            if (announcer != NULL)
+                announcer_free(announcer);
+            torrent_free(torrent);
             return 1;
         }
 
-        for (int i = 0; i < res->parsed.peers_count; i++)
+        char address[PEER_ADDRESS_MAX_LENGTH];
+        for (size_t i = 0; i < announcer->peers_count; i++)
         {
-            printf("%.*s:%d\n", (int)res->parsed.peers[i].ip->size, res->parsed.peers[i].ip->chars, res->parsed.peers[i].port);
+            printf("%s\n", format_peer_address(&announcer->peers[i], address, sizeof(address)));
         }
+
+        announcer_free(announcer);
+        torrent_free(torrent);
     }
 
     else if (strcmp(command, "handshake") == 0)
@@ -283,19 +187,9 @@ int main(int argc, char *argv[])
         const char *torrent_path = argv[2];
         const char *peer_addr = argv[3];
 
-        FILE_CONTENT file_contents = read_file(torrent_path);
-        if (file_contents.content == NULL || file_contents.size == 0)
-        {
-            fprintf(stderr, "ERR: failed to read file contents\n");
-            fprintf(stderr, "torrent path %s\n", torrent_path);
-            return 1;
-        }
-
-        Bencoded container;
-        int result = decode_bencode(&container, file_contents.content, file_contents.size);
-        if (result != PARSER_SUCCESS)
+        Torrent *torrent = torrent_open(torrent_path);
+        if (torrent == NULL)
         {
-            fprintf(stderr, "ERR: failed to decode bencoded string\n");
             return 1;
         }
 
@@ -304,23 +198,18 @@ int main(int argc, char *argv[])
         if (socket < 0)
         {
             fprintf(stderr, "ERR: failed to connect to peer\n");
-            free_bencoded_inner(container);
+            torrent_free(torrent);
             return 1;
         }
 
         fprintf(stderr, "Connected to peer\n");
 
-        BString *msg = bstring_new(1024);
-        // todo this should likely be put in a struct so we can reuse it later in the protocol.
-        BString *info_hash = get_info_hash(&container);
-
-        Peer_Header_BitTorrent *header = handshake(socket, info_hash->chars, (unsigned char *)"00112233445566778899");
+        Peer_Header_BitTorrent *header = handshake(socket, torrent, (unsigned char *)CLIENT_PEER_ID);
 
         if (header == NULL)
         {
             fprintf(stderr, "ERR: failed to connect with client at %s\n", peer_addr);
-            free_bencoded_inner(container);
-            bstring_free(msg);
+            torrent_free(torrent);
             return 1;
         }
 
@@ -328,39 +217,265 @@ int main(int argc, char *argv[])
         print_hex((unsigned char *)header->peer_id, 20);
         printf("\n");
 
-        free_bencoded_inner(container);
+        free(header);
+        close(socket);
+        torrent_free(torrent);
     }
 
     else if (strcmp(command, "download_piece") == 0)
     {
-        if (argc < 5)
+        if (argc < 6)
         {
             fprintf(stderr, "Usage: your_bittorrent.sh download_piece -o <output_path> <torrent_path> <piece_index>\n");
             return 1;
         }
 
+        const char *output_path = argv[3];
         const char *torrent_path = argv[4];
         const char *piece_index_str = argv[5];
 
         fprintf(stderr, "Downloading piece %s from torrent %s\n", piece_index_str, torrent_path);
 
-        FILE_CONTENT file_contents = read_file(torrent_path);
-        if (file_contents.content == NULL || file_contents.size == 0)
+        Torrent *torrent = torrent_open(torrent_path);
+        if (torrent == NULL)
         {
-            fprintf(stderr, "ERR: failed to read file contents\n");
-            fprintf(stderr, "torrent path %s\n", torrent_path);
+            fprintf(stderr, "ERR: failed to parse torrent file\n");
+            return 1;
+        }
+
+        char *end;
+        long piece_index = strtol(piece_index_str, &end, 10);
+        if (*end != '\0' || piece_index < 0 || (size_t)piece_index >= torrent->file->num_pieces)
+        {
+            fprintf(stderr, "ERR: invalid piece index: %s\n", piece_index_str);
+            torrent_free(torrent);
+            return 1;
+        }
+
+        Download *dl = download_new(torrent, output_path, true);
+        if (dl == NULL)
+        {
+            torrent_free(torrent);
+            return 1;
+        }
+
+        if (download_want_piece(dl, piece_index) != DOWNLOAD_SUCCESS)
+        {
+            download_free(dl);
+            torrent_free(torrent);
+            return 1;
+        }
+
+        int result = download_from_tracker(dl, torrent);
+        download_free(dl);
+        torrent_free(torrent);
+
+        if (result != DOWNLOAD_SUCCESS)
+        {
+            fprintf(stderr, "ERR: failed to download piece %ld\n", piece_index);
+            return 1;
+        }
+
+        printf("Piece %ld downloaded to %s.\n", piece_index, output_path);
+    }
+
+    else if (strcmp(command, "download") == 0)
+    {
+        if (argc < 5)
+        {
+            fprintf(stderr, "Usage: your_bittorrent.sh download -o <output_path> <torrent_path>\n");
+            return 1;
+        }
+
+        const char *output_path = argv[3];
+        const char *torrent_path = argv[4];
+
+        Torrent *torrent = torrent_open(torrent_path);
+        if (torrent == NULL)
+        {
+            fprintf(stderr, "ERR: failed to parse torrent file\n");
+            return 1;
+        }
+
+        Download *dl = download_new(torrent, output_path, false);
+        if (dl == NULL)
+        {
+            torrent_free(torrent);
+            return 1;
+        }
+
+        download_want_all(dl);
+        int result = download_from_tracker(dl, torrent);
+        download_free(dl);
+        torrent_free(torrent);
+
+        if (result != DOWNLOAD_SUCCESS)
+        {
+            fprintf(stderr, "ERR: failed to download %s\n", torrent_path);
+            return 1;
+        }
+
+        printf("Downloaded %s to %s.\n", torrent_path, output_path);
+    }
+
+    else if (strcmp(command, "recheck") == 0)
+    {
+        if (argc < 4)
+        {
+            fprintf(stderr, "Usage: your_bittorrent.sh recheck <torrent_path> <data_path>\n");
             return 1;
         }
 
-        TorrentFile *torrent = torrent_file_new(file_contents.content, file_contents.size);
+        const char *torrent_path = argv[2];
+        const char *data_path = argv[3];
+
+        Torrent *torrent = torrent_open(torrent_path);
         if (torrent == NULL)
         {
             fprintf(stderr, "ERR: failed to parse torrent file\n");
             return 1;
         }
 
-        print_torrent_file(stdout, torrent);
-        torrent_file_free(torrent);
+        // opening the storage would create a missing file and resize one of the wrong size, so they
+        // are looked at first and the data is left as it is.
+        TorrentFile *file = torrent->file;
+        const TorrentFile *layout = file->multi_file ? file : NULL;
+        struct stat *stats = malloc(file->file_count * sizeof(struct stat));
+        if (stats == NULL || storage_stat_files(data_path, layout, stats) != STORAGE_SUCCESS)
+        {
+            fprintf(stderr, "ERR: unable to read data at: %s\n", data_path);
+            free(stats);
+            torrent_free(torrent);
+            return 1;
+        }
+        for (size_t i = 0; i < file->file_count; i++)
+        {
+            if ((size_t)stats[i].st_size != file->files[i].length)
+            {
+                fprintf(stderr, "ERR: %s is %lld bytes, the torrent gives it %zu\n", layout != NULL ? file->files[i].path : data_path, (long long)stats[i].st_size, file->files[i].length);
+                free(stats);
+                torrent_free(torrent);
+                return 1;
+            }
+        }
+        free(stats);
+
+        Storage *storage = layout != NULL ? storage_open_files(data_path, layout, true) : storage_open(data_path, (off_t)file->file_size, true);
+        if (storage == NULL)
+        {
+            fprintf(stderr, "ERR: unable to read data at: %s\n", data_path);
+            torrent_free(torrent);
+            return 1;
+        }
+
+        Bitfield have;
+        if (bitfield_init(&have, torrent->file->num_pieces) != BITFIELD_SUCCESS)
+        {
+            fprintf(stderr, "ERR: failed to allocate memory for recheck\n");
+            storage_close(storage);
+            torrent_free(torrent);
+            return 1;
+        }
+
+        fprintf(stderr, "Rechecking %s with %s\n", data_path, sha1_mb_backend_name(sha1_mb_backend()));
+        size_t passed = torrent_recheck(file, storage, &have);
+
+        for (size_t i = 0; i < torrent->file->num_pieces; i++)
+        {
+            if (!bitfield_get(&have, i))
+                printf("Piece %zu failed\n", i);
+        }
+        printf("%zu/%zu pieces OK\n", passed, torrent->file->num_pieces);
+
+        bool complete = passed == torrent->file->num_pieces;
+        bitfield_free(&have);
+        storage_close(storage);
+        torrent_free(torrent);
+        return complete ? 0 : 1;
+    }
+
+    else if (strcmp(command, "scrape") == 0)
+    {
+        if (argc < 3)
+        {
+            fprintf(stderr, "Usage: your_bittorrent.sh scrape <torrent_path>...\n");
+            return 1;
+        }
+
+        // every torrent is scraped at the udp trackers of the first, in as few requests as fit.
+        size_t count = argc - 2;
+        Torrent **torrents = calloc(count, sizeof(Torrent *));
+        unsigned char *hashes = malloc(count * SHA_DIGEST_LENGTH);
+        UdpScrape *scrapes = malloc(count * sizeof(UdpScrape));
+        int status = torrents != NULL && hashes != NULL && scrapes != NULL ? 0 : 1;
+        for (size_t i = 0; status == 0 && i < count; i++)
+        {
+            torrents[i] = torrent_open(argv[i + 2]);
+            if (torrents[i] == NULL)
+                status = 1;
+            else
+                memcpy(hashes + i * SHA_DIGEST_LENGTH, torrents[i]->info_hash, SHA_DIGEST_LENGTH);
+        }
+
+        size_t scraped = 0;
+        for (size_t t = 0; status == 0 && t < torrents[0]->tracker_count; t++)
+        {
+            BString *url = torrents[0]->trackers[t].url;
+            if (!udp_tracker_is_udp((const char *)url->chars, url->size))
+                continue;
+
+            UdpTracker tracker;
+            int result = udp_tracker_open(&tracker, (const char *)url->chars, url->size);
+            if (result == UDP_TRACKER_SUCCESS)
+            {
+                result = udp_tracker_scrape(&tracker, hashes, count, scrapes, peer_now());
+                if (result == UDP_TRACKER_PENDING)
+                    result = udp_tracker_wait(&tracker);
+            }
+            udp_tracker_close(&tracker);
+            if (result != UDP_TRACKER_SUCCESS)
+            {
+                fprintf(stderr, "ERR: scrape of %.*s failed: %s\n", (int)url->size, url->chars, udp_tracker_strerror(result));
+                continue;
+            }
+
+            printf("Tracker URL: %.*s\n", (int)url->size, url->chars);
+            for (size_t i = 0; i < count; i++)
+            {
+                print_hex(hashes + i * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH);
+                printf(" seeders: %u completed: %u leechers: %u\n", scrapes[i].seeders, scrapes[i].completed, scrapes[i].leechers);
+            }
+            scraped++;
+        }
+
+        if (status == 0 && scraped == 0)
+        {
+            fprintf(stderr, "ERR: no udp tracker could be scraped\n");
+            status = 1;
+        }
+        for (size_t i = 0; torrents != NULL && i < count; i++)
+        {
+            if (torrents[i] != NULL)
+                torrent_free(torrents[i]);
+        }
+        free(torrents);
+        free(hashes);
+        free(scrapes);
+        return status;
+    }
+
+    else if (strcmp(command, "bench") == 0)
+    {
+        // the synthetic corpus, then every torrent given.
+        int result = bencode_bench((const char **)argv + 2, argc - 2, stdout);
+        return result == BENCH_SUCCESS ? 0 : 1;
+    }
+
+    else if (strcmp(command, "fuzz") == 0)
+    {
+        size_t iterations = argc > 2 ? strtoull(argv[2], NULL, 10) : 100000;
+        uint64_t seed = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+        return bencode_fuzz(iterations, seed, stdout) == 0 ? 0 : 1;
     }
 
     else
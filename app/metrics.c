@@ -0,0 +1,574 @@
+/**
+ * @file metrics.c
+ * @brief Implementation file for counters and latency histograms of a running download in C.
+ * A shard is only ever written by its own thread, so a record is a relaxed load and store with no
+ * lock prefix. A snapshot reads the shards with relaxed loads, it may miss what is being recorded
+ * at that moment but never sees a torn value. Shards outlive their threads, what a worker
+ * recorded is still counted once it exits.
+*/
+// for accept4.
+#define _GNU_SOURCE
+#include "metrics.h"
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// what a thread recorded.
+typedef struct MetricsShard {
+    _Atomic uint64_t counters[METRIC_COUNTERS];
+    _Atomic uint64_t buckets[METRIC_HISTOGRAMS][METRICS_BUCKETS];
+    _Atomic uint64_t sums[METRIC_HISTOGRAMS];
+    struct MetricsShard *next;  // the shard of the thread that recorded before this one.
+} MetricsShard;
+
+// how a metric is exported.
+typedef struct {
+    const char *name;
+    const char *help;
+} MetricInfo;
+
+// how a histogram is exported, and the powers of two its Prometheus buckets end at.
+typedef struct {
+    const char *name;
+    const char *help;
+    double scale;       // what a value is divided by to get the unit of the name.
+    int low_bits;       // the first bucket ends at 2^low_bits.
+    int high_bits;      // the last bucket before +Inf ends at 2^high_bits.
+} MetricHistogramInfo;
+
+static const MetricInfo metrics_counter_info[METRIC_COUNTERS] = {
+    {"bittorrent_downloaded_bytes_total", "Payload bytes received in blocks."},
+    {"bittorrent_uploaded_bytes_total", "Payload bytes sent in blocks."},
+    {"bittorrent_blocks_total", "Blocks received."},
+    {"bittorrent_pieces_verified_total", "Pieces that matched their hash."},
+    {"bittorrent_pieces_failed_total", "Pieces that did not match their hash."},
+    {"bittorrent_connects_total", "Connections to peers that were established."},
+    {"bittorrent_connect_failures_total", "Connections to peers that failed before the handshake was done."},
+    {"bittorrent_handshakes_total", "Handshakes with peers that were completed."},
+    {"bittorrent_announces_total", "Announces a tracker answered."},
+    {"bittorrent_announce_failures_total", "Announces that failed."},
+    {"bittorrent_decodes_total", "Bencoded values decoded."},
+    {"bittorrent_disk_written_bytes_total", "Bytes written to the output."},
+};
+
+static const MetricHistogramInfo metrics_histogram_info[METRIC_HISTOGRAMS] = {
+    {"bittorrent_peer_throughput_bytes_per_second", "What a peer sent over its connection, measured when it is closed.", 1, 10, 30},
+    {"bittorrent_request_rtt_seconds", "Time between requesting a block and receiving it.", 1e9, 14, 35},
+    {"bittorrent_connect_seconds", "Time to establish a connection to a peer.", 1e9, 14, 33},
+    {"bittorrent_handshake_seconds", "Time between a connection being established and its handshake being done.", 1e9, 14, 33},
+    {"bittorrent_announce_seconds", "Time for a tracker to answer an announce.", 1e9, 16, 35},
+    {"bittorrent_decode_seconds", "Time to decode a bencoded value.", 1e9, 8, 30},
+    {"bittorrent_hash_queue_depth", "Pieces waiting on the hasher as another one is submitted.", 1, 0, 10},
+    {"bittorrent_hash_seconds", "Time to hash a piece.", 1e9, 12, 32},
+    {"bittorrent_disk_write_seconds", "Time to write out the blocks queued for the output, or to sync it.", 1e9, 10, 32},
+};
+
+static const MetricInfo metrics_gauge_info[METRIC_GAUGES] = {
+    {"bittorrent_peers", "Connections to peers that are open."},
+    {"bittorrent_peers_connecting", "Connections to peers still connecting or handshaking."},
+    {"bittorrent_pieces_left", "Pieces still to download."},
+    {"bittorrent_hash_queued", "Pieces waiting on the hasher."},
+    {"bittorrent_piece_pool_high_water", "Most pieces being downloaded at once."},
+    {"bittorrent_pending_pool_high_water", "Most pieces waiting on the hasher at once."},
+};
+
+bool metrics_enabled = false;
+
+static double metrics_interval = 0;
+static int metrics_listen_port = 0;
+static _Atomic int64_t metrics_gauges[METRIC_GAUGES];
+
+// every shard, newest first, and the lock taken to add one.
+static MetricsShard *metrics_shards = NULL;
+static pthread_mutex_t metrics_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local MetricsShard *metrics_shard = NULL;
+
+/**
+ * @brief the shard of the calling thread, created on its first record.
+ * @return MetricsShard* the shard, or NULL if it could not be allocated
+*/
+MetricsShard *metrics_thread_shard(void);
+
+/**
+ * @brief add to a value only the calling thread writes.
+ * @param value The value
+ * @param n What to add
+ * @return void
+*/
+void metrics_add(_Atomic uint64_t *value, uint64_t n);
+
+/**
+ * @brief the bucket of a histogram a value falls in.
+ * @param value The value
+ * @return size_t the index of the bucket
+*/
+size_t metrics_bucket(uint64_t value);
+
+/**
+ * @brief the smallest value of a bucket.
+ * @param bucket The index of the bucket
+ * @return uint64_t the value
+*/
+uint64_t metrics_bucket_low(size_t bucket);
+
+/**
+ * @brief write a time in nanoseconds with the unit that suits it.
+ * @param text Where the time is written
+ * @param size The size of text
+ * @param ns The time
+ * @return const char* text
+*/
+const char *metrics_format_time(char *text, size_t size, uint64_t ns);
+
+/**
+ * @brief accept every waiting client into a free slot, turning away those there is no slot for.
+ * @param server The server
+ * @param now The current time, from metrics_now_ns
+ * @return void
+*/
+void metrics_server_accept(MetricsServer *server, uint64_t now);
+
+/**
+ * @brief read what a client sent and write what of its answer fits, closing it once it is answered.
+ * @param server The server
+ * @param client The client
+ * @return void
+*/
+void metrics_client_advance(MetricsServer *server, MetricsClient *client);
+
+/**
+ * @brief build the answer of a client whose request is read.
+ * @param client The client
+ * @return int 0, or -1 if there is no memory for it
+*/
+int metrics_client_respond(MetricsClient *client);
+
+/**
+ * @brief close a client and free its slot.
+ * @param server The server
+ * @param client The client
+ * @return void
+*/
+void metrics_client_close(MetricsServer *server, MetricsClient *client);
+
+void metrics_init(void)
+{
+    const char *interval = getenv(METRICS_STATS_ENV);
+    if (interval != NULL)
+        metrics_interval = atof(interval);
+    if (metrics_interval < 0)
+        metrics_interval = 0;
+
+    const char *port = getenv(METRICS_PORT_ENV);
+    if (port != NULL)
+        metrics_listen_port = atoi(port);
+    if (metrics_listen_port < 0 || metrics_listen_port > 65535)
+        metrics_listen_port = 0;
+
+    metrics_enabled = metrics_interval > 0 || metrics_listen_port > 0;
+}
+
+double metrics_stats_interval(void)
+{
+    return metrics_interval;
+}
+
+int metrics_port(void)
+{
+    return metrics_listen_port;
+}
+
+MetricsShard *metrics_thread_shard(void)
+{
+    if (metrics_shard != NULL)
+        return metrics_shard;
+
+    MetricsShard *shard = calloc(1, sizeof(MetricsShard));
+    if (shard == NULL)
+        return NULL;
+    pthread_mutex_lock(&metrics_shards_lock);
+    shard->next = metrics_shards;
+    metrics_shards = shard;
+    pthread_mutex_unlock(&metrics_shards_lock);
+    metrics_shard = shard;
+    return shard;
+}
+
+void metrics_add(_Atomic uint64_t *value, uint64_t n)
+{
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+size_t metrics_bucket(uint64_t value)
+{
+    if (value < METRICS_SUB_BUCKETS)
+        return value;
+    if (value >> METRICS_MAX_BITS)
+        return METRICS_BUCKETS - 1;
+
+    // the power of two the value is in, and where in it, from its top METRICS_SUB_BUCKET_BITS + 1 bits.
+    int exponent = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (exponent - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (size_t)(exponent - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+uint64_t metrics_bucket_low(size_t bucket)
+{
+    if (bucket < METRICS_SUB_BUCKETS)
+        return bucket;
+    int exponent = (int)(bucket / METRICS_SUB_BUCKETS) + METRICS_SUB_BUCKET_BITS - 1;
+    uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+    return (METRICS_SUB_BUCKETS + sub) << (exponent - METRICS_SUB_BUCKET_BITS);
+}
+
+void metrics_count(MetricCounter counter, uint64_t n)
+{
+    if (!metrics_enabled)
+        return;
+    MetricsShard *shard = metrics_thread_shard();
+    if (shard != NULL)
+        metrics_add(&shard->counters[counter], n);
+}
+
+void metrics_record(MetricHistogram histogram, uint64_t value)
+{
+    if (!metrics_enabled)
+        return;
+    MetricsShard *shard = metrics_thread_shard();
+    if (shard == NULL)
+        return;
+    metrics_add(&shard->buckets[histogram][metrics_bucket(value)], 1);
+    metrics_add(&shard->sums[histogram], value);
+}
+
+void metrics_record_seconds(MetricHistogram histogram, double seconds)
+{
+    metrics_record(histogram, seconds > 0 ? (uint64_t)(seconds * 1e9) : 0);
+}
+
+void metrics_set(MetricGauge gauge, int64_t value)
+{
+    atomic_store_explicit(&metrics_gauges[gauge], value, memory_order_relaxed);
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_snapshot(MetricsSnapshot *snapshot)
+{
+    memset(snapshot, 0, sizeof(MetricsSnapshot));
+
+    // shards are only ever added in front, the list from the head taken here is stable.
+    pthread_mutex_lock(&metrics_shards_lock);
+    MetricsShard *shard = metrics_shards;
+    pthread_mutex_unlock(&metrics_shards_lock);
+    for (; shard != NULL; shard = shard->next)
+    {
+        for (size_t c = 0; c < METRIC_COUNTERS; c++)
+            snapshot->counters[c] += atomic_load_explicit(&shard->counters[c], memory_order_relaxed);
+        for (size_t h = 0; h < METRIC_HISTOGRAMS; h++)
+        {
+            for (size_t b = 0; b < METRICS_BUCKETS; b++)
+            {
+                uint64_t count = atomic_load_explicit(&shard->buckets[h][b], memory_order_relaxed);
+                snapshot->buckets[h][b] += count;
+                snapshot->counts[h] += count;
+            }
+            snapshot->sums[h] += atomic_load_explicit(&shard->sums[h], memory_order_relaxed);
+        }
+    }
+    for (size_t g = 0; g < METRIC_GAUGES; g++)
+        snapshot->gauges[g] = atomic_load_explicit(&metrics_gauges[g], memory_order_relaxed);
+}
+
+uint64_t metrics_quantile(const MetricsSnapshot *snapshot, MetricHistogram histogram, double q)
+{
+    uint64_t total = snapshot->counts[histogram];
+    if (total == 0)
+        return 0;
+
+    // the rank of the value, counted from 1, and the bucket it falls in.
+    uint64_t rank = (uint64_t)(q * total);
+    rank = rank < 1 ? 1 : rank > total ? total : rank;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < METRICS_BUCKETS; b++)
+    {
+        seen += snapshot->buckets[histogram][b];
+        if (seen >= rank)
+        {
+            // the middle of the bucket, the last one has no end.
+            uint64_t low = metrics_bucket_low(b);
+            uint64_t high = b + 1 < METRICS_BUCKETS ? metrics_bucket_low(b + 1) : low + 1;
+            return low + (high - low) / 2;
+        }
+    }
+    return 0;
+}
+
+const char *metrics_format_time(char *text, size_t size, uint64_t ns)
+{
+    if (ns < 1000)
+        snprintf(text, size, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000)
+        snprintf(text, size, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(text, size, "%.1fms", ns / 1e6);
+    else
+        snprintf(text, size, "%.2fs", ns / 1e9);
+    return text;
+}
+
+void metrics_write_stats(FILE *out, const MetricsSnapshot *snapshot, const uint64_t *previous, double seconds)
+{
+    double down = (snapshot->counters[METRIC_DOWNLOADED_BYTES] - previous[METRIC_DOWNLOADED_BYTES]) / (seconds > 0 ? seconds : 1);
+    double up = (snapshot->counters[METRIC_UPLOADED_BYTES] - previous[METRIC_UPLOADED_BYTES]) / (seconds > 0 ? seconds : 1);
+
+    char rtt50[16], rtt99[16], connect50[16], handshake50[16], announce50[16], disk99[16], decode50[16];
+    fprintf(out, "stats: down %.2f MiB/s, up %.2f MiB/s, peers %lld (%lld connecting), pieces left %lld, hash queue %lld (p99 %llu), "
+            "rtt p50 %s p99 %s, connect p50 %s, handshake p50 %s, announce p50 %s, disk write p99 %s, decode p50 %s\n",
+            down / (1 << 20), up / (1 << 20),
+            (long long)snapshot->gauges[METRIC_PEERS], (long long)snapshot->gauges[METRIC_PEERS_CONNECTING],
+            (long long)snapshot->gauges[METRIC_PIECES_LEFT], (long long)snapshot->gauges[METRIC_HASH_QUEUED],
+            (unsigned long long)metrics_quantile(snapshot, METRIC_HASH_QUEUE_DEPTH, 0.99),
+            metrics_format_time(rtt50, sizeof(rtt50), metrics_quantile(snapshot, METRIC_REQUEST_RTT, 0.5)),
+            metrics_format_time(rtt99, sizeof(rtt99), metrics_quantile(snapshot, METRIC_REQUEST_RTT, 0.99)),
+            metrics_format_time(connect50, sizeof(connect50), metrics_quantile(snapshot, METRIC_CONNECT_TIME, 0.5)),
+            metrics_format_time(handshake50, sizeof(handshake50), metrics_quantile(snapshot, METRIC_HANDSHAKE_TIME, 0.5)),
+            metrics_format_time(announce50, sizeof(announce50), metrics_quantile(snapshot, METRIC_ANNOUNCE_TIME, 0.5)),
+            metrics_format_time(disk99, sizeof(disk99), metrics_quantile(snapshot, METRIC_DISK_WRITE_TIME, 0.99)),
+            metrics_format_time(decode50, sizeof(decode50), metrics_quantile(snapshot, METRIC_DECODE_TIME, 0.5)));
+}
+
+void metrics_write_prometheus(FILE *out, const MetricsSnapshot *snapshot)
+{
+    for (size_t c = 0; c < METRIC_COUNTERS; c++)
+    {
+        const MetricInfo *info = &metrics_counter_info[c];
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", info->name, info->help, info->name, info->name,
+                (unsigned long long)snapshot->counters[c]);
+    }
+
+    for (size_t g = 0; g < METRIC_GAUGES; g++)
+    {
+        const MetricInfo *info = &metrics_gauge_info[g];
+        fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", info->name, info->help, info->name, info->name,
+                (long long)snapshot->gauges[g]);
+    }
+
+    // every power of two is a bucket boundary, so the count of the values below each of them is exact.
+    // le is inclusive, so each bucket is labelled with the largest value below the power of two.
+    for (size_t h = 0; h < METRIC_HISTOGRAMS; h++)
+    {
+        const MetricHistogramInfo *info = &metrics_histogram_info[h];
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", info->name, info->help, info->name);
+        uint64_t cumulative = 0;
+        size_t b = 0;
+        for (int bits = info->low_bits; bits <= info->high_bits; bits++)
+        {
+            size_t end = metrics_bucket((uint64_t)1 << bits);
+            while (b < end)
+                cumulative += snapshot->buckets[h][b++];
+            fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", info->name, (((uint64_t)1 << bits) - 1) / info->scale, (unsigned long long)cumulative);
+        }
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n", info->name,
+                (unsigned long long)snapshot->counts[h], info->name, snapshot->sums[h] / info->scale,
+                info->name, (unsigned long long)snapshot->counts[h]);
+    }
+}
+
+MetricsServer *metrics_server_new(int port)
+{
+    MetricsServer *server = malloc(sizeof(MetricsServer));
+    if (server == NULL)
+        return NULL;
+    for (size_t i = 0; i < METRICS_MAX_CLIENTS; i++)
+        server->clients[i].fd = -1;
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    int reuse = 1;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    // the listening socket is told apart from the clients by a pointer no client has.
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = server };
+    if (server->epoll_fd < 0 || server->listen_fd < 0 ||
+        setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server->listen_fd, 8) < 0 ||
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event) < 0)
+    {
+        fprintf(stderr, "ERR: failed to serve metrics on port %d\n", port);
+        metrics_server_free(server);
+        return NULL;
+    }
+    return server;
+}
+
+void metrics_server_free(MetricsServer *server)
+{
+    if (server == NULL)
+        return;
+    for (size_t i = 0; i < METRICS_MAX_CLIENTS; i++)
+    {
+        if (server->clients[i].fd >= 0)
+            metrics_client_close(server, &server->clients[i]);
+    }
+    if (server->listen_fd >= 0)
+        close(server->listen_fd);
+    if (server->epoll_fd >= 0)
+        close(server->epoll_fd);
+    free(server);
+}
+
+int metrics_server_fd(MetricsServer *server)
+{
+    return server->epoll_fd;
+}
+
+void metrics_server_serve(MetricsServer *server)
+{
+    struct epoll_event events[METRICS_MAX_CLIENTS + 1];
+    int ready = epoll_wait(server->epoll_fd, events, METRICS_MAX_CLIENTS + 1, 0);
+    uint64_t now = metrics_now_ns();
+    for (int i = 0; i < ready; i++)
+    {
+        if (events[i].data.ptr == server)
+            metrics_server_accept(server, now);
+        else
+            metrics_client_advance(server, events[i].data.ptr);
+    }
+
+    // checked whenever anything happens, a client that stalls only keeps its slot until then.
+    for (size_t i = 0; i < METRICS_MAX_CLIENTS; i++)
+    {
+        if (server->clients[i].fd >= 0 && now >= server->clients[i].deadline)
+            metrics_client_close(server, &server->clients[i]);
+    }
+}
+
+void metrics_server_accept(MetricsServer *server, uint64_t now)
+{
+    int fd;
+    while ((fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        MetricsClient *client = NULL;
+        for (size_t i = 0; i < METRICS_MAX_CLIENTS && client == NULL; i++)
+        {
+            if (server->clients[i].fd < 0 || now >= server->clients[i].deadline)
+                client = &server->clients[i];
+        }
+        if (client != NULL && client->fd >= 0)
+            metrics_client_close(server, client);
+
+        struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET };
+        event.data.ptr = client;
+        if (client == NULL || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->deadline = now + (uint64_t)METRICS_CLIENT_TIMEOUT * 1000000000;
+        client->received = 0;
+        client->request[0] = '\0';
+        client->response = NULL;
+        client->size = 0;
+        client->sent = 0;
+
+        // a client usually sends its request along with connecting.
+        metrics_client_advance(server, client);
+    }
+}
+
+void metrics_client_advance(MetricsServer *server, MetricsClient *client)
+{
+    // the request is read to its blank line, so closing the socket does not reset it, and otherwise ignored.
+    while (client->response == NULL)
+    {
+        bool complete = client->received == sizeof(client->request) - 1 ||
+                        strstr(client->request, "\r\n\r\n") != NULL || strstr(client->request, "\n\n") != NULL;
+        if (complete)
+        {
+            if (metrics_client_respond(client) < 0)
+            {
+                metrics_client_close(server, client);
+                return;
+            }
+            break;
+        }
+
+        ssize_t n = recv(client->fd, client->request + client->received, sizeof(client->request) - 1 - client->received, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0)
+        {
+            metrics_client_close(server, client);
+            return;
+        }
+        client->received += n;
+        client->request[client->received] = '\0';
+    }
+
+    while (client->sent < client->size)
+    {
+        ssize_t n = send(client->fd, client->response + client->sent, client->size - client->sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0)
+            break;
+        client->sent += n;
+    }
+    metrics_client_close(server, client);
+}
+
+int metrics_client_respond(MetricsClient *client)
+{
+    MetricsSnapshot *snapshot = malloc(sizeof(MetricsSnapshot));
+    char *body = NULL;
+    size_t size = 0;
+    FILE *out = snapshot != NULL ? open_memstream(&body, &size) : NULL;
+    if (out == NULL)
+    {
+        free(snapshot);
+        return -1;
+    }
+    metrics_snapshot(snapshot);
+    metrics_write_prometheus(out, snapshot);
+    fclose(out);
+    free(snapshot);
+
+    char header[128];
+    int length = snprintf(header, sizeof(header),
+                          "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", size);
+    client->response = body != NULL ? malloc(length + size) : NULL;
+    if (client->response == NULL)
+    {
+        free(body);
+        return -1;
+    }
+    memcpy(client->response, header, length);
+    memcpy(client->response + length, body, size);
+    free(body);
+    client->size = length + size;
+    client->sent = 0;
+    return 0;
+}
+
+void metrics_client_close(MetricsServer *server, MetricsClient *client)
+{
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    free(client->response);
+    client->fd = -1;
+    client->response = NULL;
+}
@@ -0,0 +1,240 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/**
+ * @file metrics.h
+ * @brief Header file for counters and latency histograms of a running download in C.
+ * Every thread records into its own shard, created the first time it records anything, so the
+ * hot paths never share a cache line or take a lock. A snapshot sums the shards of every thread.
+ * Histograms are log-linear like HdrHistogram: each power of two is split into METRICS_SUB_BUCKETS
+ * buckets, so any value is known to within 1/METRICS_SUB_BUCKETS of itself whatever its magnitude.
+ * Nothing is recorded unless METRICS_STATS_ENV or METRICS_PORT_ENV is set, a download then writes
+ * a stats line every so many seconds, or serves the metrics in the Prometheus text format.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// the environment variable holding the seconds between stats lines.
+#define METRICS_STATS_ENV "BITTORRENT_STATS"
+
+// the environment variable holding the port metrics are served on, on the loopback interface.
+#define METRICS_PORT_ENV "BITTORRENT_METRICS_PORT"
+
+// the buckets of a power of two in a histogram, the relative precision of its values.
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+
+// the values a histogram holds are below 2^METRICS_MAX_BITS, larger ones are counted as the largest.
+#define METRICS_MAX_BITS 48
+
+// the buckets of a histogram: one each below METRICS_SUB_BUCKETS, then METRICS_SUB_BUCKETS per power of two.
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+
+// the largest request read from a metrics client before it is answered.
+#define METRICS_REQUEST_MAX 4096
+
+// how long a metrics client may take to send its request and read the answer, in seconds.
+#define METRICS_CLIENT_TIMEOUT 1
+
+// the metrics clients answered at once, another one is turned away until one is done.
+#define METRICS_MAX_CLIENTS 4
+
+// what is counted.
+typedef enum {
+    METRIC_DOWNLOADED_BYTES,    // payload bytes received in blocks.
+    METRIC_UPLOADED_BYTES,      // payload bytes sent in blocks.
+    METRIC_BLOCKS,              // blocks received.
+    METRIC_PIECES_VERIFIED,     // pieces that hashed to what the torrent says.
+    METRIC_PIECES_FAILED,       // pieces that did not.
+    METRIC_CONNECTS,            // connections that were established.
+    METRIC_CONNECT_FAILURES,    // connections that failed or timed out before the handshake was done.
+    METRIC_HANDSHAKES,          // handshakes that were completed.
+    METRIC_ANNOUNCES,           // announces that a tracker answered.
+    METRIC_ANNOUNCE_FAILURES,   // announces that failed.
+    METRIC_DECODES,             // bencoded values decoded.
+    METRIC_DISK_BYTES,          // bytes written to the output, blocks received straight into it are not.
+    METRIC_COUNTERS
+} MetricCounter;
+
+// what is measured, each into a histogram. times are in nanoseconds.
+typedef enum {
+    METRIC_PEER_THROUGHPUT,     // what a peer sent, in bytes per second, measured when it is closed.
+    METRIC_REQUEST_RTT,         // between requesting a block and receiving it.
+    METRIC_CONNECT_TIME,        // between starting a connect and it completing.
+    METRIC_HANDSHAKE_TIME,      // between a connect completing and the handshake being done.
+    METRIC_ANNOUNCE_TIME,       // between starting an announce and the tracker answering.
+    METRIC_DECODE_TIME,         // decoding a bencoded value.
+    METRIC_HASH_QUEUE_DEPTH,    // the pieces waiting on the hasher as another one is submitted.
+    METRIC_HASH_TIME,           // hashing a piece, on a worker of the hasher.
+    METRIC_DISK_WRITE_TIME,     // writing out the blocks queued for the output, or syncing it.
+    METRIC_HISTOGRAMS
+} MetricHistogram;
+
+// what is set to its current value rather than counted, by the download thread.
+typedef enum {
+    METRIC_PEERS,               // the connections that are open.
+    METRIC_PEERS_CONNECTING,    // the connections still connecting or handshaking.
+    METRIC_PIECES_LEFT,         // the pieces still to download.
+    METRIC_HASH_QUEUED,         // the pieces waiting on the hasher.
+    METRIC_PIECE_POOL_HIGH_WATER,   // the most pieces being downloaded at once, see Download.pieces.
+    METRIC_PENDING_POOL_HIGH_WATER, // the most pieces waiting on the hasher at once, see Download.pending.
+    METRIC_GAUGES
+} MetricGauge;
+
+// what every thread recorded, summed.
+typedef struct {
+    uint64_t counters[METRIC_COUNTERS];
+    uint64_t buckets[METRIC_HISTOGRAMS][METRICS_BUCKETS];
+    uint64_t counts[METRIC_HISTOGRAMS];     // the values recorded into each histogram.
+    uint64_t sums[METRIC_HISTOGRAMS];       // their sum.
+    int64_t gauges[METRIC_GAUGES];
+} MetricsSnapshot;
+
+// a metrics client, read from and written to as its socket allows.
+typedef struct {
+    int fd;                             // -1 if the slot is free.
+    uint64_t deadline;                  // when it is dropped, from metrics_now_ns.
+    char request[METRICS_REQUEST_MAX];  // what it sent so far, NUL terminated.
+    size_t received;
+    char *response;                     // the answer, NULL until the request is read.
+    size_t size;
+    size_t sent;
+} MetricsClient;
+
+// serves the metrics on the loopback interface without ever blocking. the listening socket and the
+// clients are watched by an epoll instance of their own, whose descriptor the download's event loop
+// watches in turn, so a slow client costs the loop nothing.
+typedef struct {
+    int epoll_fd;
+    int listen_fd;
+    MetricsClient clients[METRICS_MAX_CLIENTS];
+} MetricsServer;
+
+// whether anything is recorded, read on every record so it is a variable rather than a call.
+// callers check it before measuring what they would record, e.g. before reading the clock.
+extern bool metrics_enabled;
+
+/**
+ * @brief Enable the metrics if METRICS_STATS_ENV or METRICS_PORT_ENV asks for them.
+ * @return void
+*/
+void metrics_init(void);
+
+/**
+ * @brief The seconds between stats lines.
+ * @return double the interval, 0 if no stats line is written
+*/
+double metrics_stats_interval(void);
+
+/**
+ * @brief The port metrics are served on.
+ * @return int the port, 0 if they are not served
+*/
+int metrics_port(void);
+
+/**
+ * @brief Add to a counter.
+ * @param counter The counter
+ * @param n What to add
+ * @return void
+*/
+void metrics_count(MetricCounter counter, uint64_t n);
+
+/**
+ * @brief Record a value into a histogram.
+ * @param histogram The histogram
+ * @param value The value
+ * @return void
+*/
+void metrics_record(MetricHistogram histogram, uint64_t value);
+
+/**
+ * @brief Record a time into a histogram of nanoseconds.
+ * @param histogram The histogram
+ * @param seconds The time, in seconds, e.g. the difference of two peer_now
+ * @return void
+*/
+void metrics_record_seconds(MetricHistogram histogram, double seconds);
+
+/**
+ * @brief Set a gauge.
+ * @param gauge The gauge
+ * @param value Its current value
+ * @return void
+*/
+void metrics_set(MetricGauge gauge, int64_t value);
+
+/**
+ * @brief The current time of a monotonic clock, to measure what is recorded.
+ * @return uint64_t the time, in nanoseconds
+*/
+uint64_t metrics_now_ns(void);
+
+/**
+ * @brief Sum what every thread recorded so far.
+ * @param snapshot Filled with the sums
+ * @return void
+*/
+void metrics_snapshot(MetricsSnapshot *snapshot);
+
+/**
+ * @brief Estimate a quantile of a histogram.
+ * @param snapshot The snapshot
+ * @param histogram The histogram
+ * @param q The quantile, between 0 and 1
+ * @return uint64_t the value, within its bucket. 0 if nothing was recorded
+*/
+uint64_t metrics_quantile(const MetricsSnapshot *snapshot, MetricHistogram histogram, double q);
+
+/**
+ * @brief Write a single line: the transfer rates since the previous line, the gauges and the
+ * median and tail of the latencies.
+ * @param out Where the line goes
+ * @param snapshot What was recorded so far
+ * @param previous The counters of the snapshot of the previous line
+ * @param seconds The seconds since the previous line
+ * @return void
+*/
+void metrics_write_stats(FILE *out, const MetricsSnapshot *snapshot, const uint64_t *previous, double seconds);
+
+/**
+ * @brief Write every metric in the Prometheus text exposition format.
+ * @param out Where the metrics go
+ * @param snapshot What was recorded so far
+ * @return void
+*/
+void metrics_write_prometheus(FILE *out, const MetricsSnapshot *snapshot);
+
+/**
+ * @brief Listen for metrics clients on the loopback interface.
+ * @param port The port
+ * @return MetricsServer* the server, or NULL on error
+*/
+MetricsServer *metrics_server_new(int port);
+
+/**
+ * @brief Close the server and every client it has.
+ * @param server The server, may be NULL
+ * @return void
+*/
+void metrics_server_free(MetricsServer *server);
+
+/**
+ * @brief The descriptor that is readable whenever the server has something to do, see metrics_server_serve.
+ * @param server The server
+ * @return int the descriptor
+*/
+int metrics_server_fd(MetricsServer *server);
+
+/**
+ * @brief Do what the server can without blocking: accept clients, read what they sent and answer
+ * the ones whose request is complete with the metrics, whatever they asked for. A client is given
+ * METRICS_CLIENT_TIMEOUT to send its request and read the answer.
+ * @param server The server
+ * @return void
+*/
+void metrics_server_serve(MetricsServer *server);
+
+#endif
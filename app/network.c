@@ -3,27 +3,26 @@
  * @brief Implementation file for network operations in C.
 */
 #include "network.h"
+#include "torrent.h"
+#include "log.h"
+#include <errno.h>
 
 bool tracker_response_has_failure(Bencoded *b);
 Bencoded *get_check_interval(Bencoded *b);
 Bencoded *get_check_peers(Bencoded *b);
 bool peers_list_is_valid(Bencoded *b);
-Peer *dyn_resize_peer_list(size_t *size, size_t *capacity, Peer *peers_list);
-void peers_list_free(Peer *peers_list, size_t count);
-void put_peers_in_tracker_res(Bencoded *src, Tracker_Response *dest);
+void put_peers_in_tracker_res(Bencoded *src, Bencoded *src6, Tracker_Response *dest);
 void handle_tracker_response(Bencoded *b, Tracker_Response *response_aggregator);
 bool hash_bencoded(unsigned char *hash, Bencoded *b);
-static size_t handle_data(void *contents, size_t size, size_t nmemb, void *userp);
-BString *get_announce_url(Bencoded *torrent);
+void hash_bencoded_source(unsigned char *hash, Bencoded *b, const char *source);
 URL *initialize_url(const char *tracker_url, size_t size);
-char *get_escaped_info_hash(Bencoded *torrent);
 int append_query_params(URL *url, char *info_hash);
-int append_length_param(URL *url, Bencoded *info);
 int parse_address(const char *address, char *ip, int *port);
 
 bool hash_bencoded(unsigned char *hash, Bencoded *b)
 {
-    char *buf = malloc(b->encoded_length);
+    // encode_bencode terminates what it writes.
+    char *buf = malloc(b->encoded_length + 1);
     if (buf == NULL)
     {
         fprintf(stderr, "ERR: failed to allocate memory for bencoded string");
@@ -35,7 +34,12 @@ bool hash_bencoded(unsigned char *hash, Bencoded *b)
     return true;
 }
 
-BString *get_info_hash(Bencoded *torrent)
+void hash_bencoded_source(unsigned char *hash, Bencoded *b, const char *source)
+{
+    SHA1((const unsigned char *)bencoded_source_span(b, source), b->encoded_length, hash);
+}
+
+BString *get_info_hash(Bencoded *torrent, const char *source)
 {
     Bencoded *info = get_dict_key(torrent, "info");
     if (info == NULL)
@@ -51,32 +55,12 @@ BString *get_info_hash(Bencoded *torrent)
         return NULL;
     }
 
-    if (!hash_bencoded(hash->chars, info))
-    {
-        fprintf(stderr, "ERR: failed to hash bencoded info\n");
-        return NULL;
-    }
-
+    hash_bencoded_source(hash->chars, info, source);
     hash->size = SHA_DIGEST_LENGTH;
 
     return hash;
 }
 
-BString *get_announce_url(Bencoded *torrent) {
-    Bencoded* announce = get_dict_key(torrent, "announce");
-    if (announce == NULL) {
-        fprintf(stderr, "ERR: 'announce' key not found in torrent meta");
-        return NULL;
-    }
-
-    if (announce->type != STRING) {
-        fprintf(stderr, "ERR: announce key is expected to be a string.");
-        return NULL;
-    }
-
-    return announce->data.string;
-}
-
 URL* initialize_url(const char* tracker_url, size_t size) {
     URL* url = url_new(tracker_url, size);
     if (url == NULL) {
@@ -86,34 +70,12 @@ URL* initialize_url(const char* tracker_url, size_t size) {
     return url;
 }
 
-char* get_escaped_info_hash(Bencoded *torrent) {
-    Bencoded* info = get_dict_key(torrent, "info");
-    if (info == NULL) {
-        fprintf(stderr, "ERR: 'info' key not found in torrent meta\n");
-        return NULL;
-    }
-
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    if (!hash_bencoded(hash, info)) {
-        fprintf(stderr, "ERR: failed to hash bencoded info\n");
-        return NULL;
-    }
-
-    char* escaped_hash = curl_easy_escape(NULL, (char*)hash, SHA_DIGEST_LENGTH);
-    if (escaped_hash == NULL) {
-        fprintf(stderr, "ERR: failed to escape hash\n");
-        return NULL;
-    }
-
-    return escaped_hash;
-}
-
 int append_query_params(URL* url, char* info_hash) {
+    char port[8];
+    snprintf(port, sizeof(port), "%d", CLIENT_PORT);
     if (url_append_query_param(url, "info_hash", info_hash) != URL_SUCCESS ||
-        url_append_query_param(url, "peer_id", "00112233445566778899") != URL_SUCCESS ||
-        url_append_query_param(url, "port", "6881") != URL_SUCCESS ||
-        url_append_query_param(url, "uploaded", "0") != URL_SUCCESS ||
-        url_append_query_param(url, "downloaded", "0") != URL_SUCCESS ||
+        url_append_query_param(url, "peer_id", CLIENT_PEER_ID) != URL_SUCCESS ||
+        url_append_query_param(url, "port", port) != URL_SUCCESS ||
         url_append_query_param(url, "compact", "1") != URL_SUCCESS) {
         fprintf(stderr, "ERR: failed to append query params\n");
         return -1;
@@ -121,57 +83,56 @@ int append_query_params(URL* url, char* info_hash) {
     return 0;
 }
 
-int append_length_param(URL* url, Bencoded* info) {
-    Bencoded* length = get_dict_key(info, "length");
-    if (length == NULL) {
-        fprintf(stderr, "ERR: 'length' key not found in info dict\n");
+int announce_template_init(AnnounceTemplate *template, Torrent *torrent, BString *announce)
+{
+    template->url = NULL;
+    URL *url = initialize_url((const char*)announce->chars, announce->size);
+    if (!url)
         return -1;
-    }
-
-    char length_str[20];
-    snprintf(length_str, sizeof(length_str), "%li", length->data.integer);
 
-    if (url_append_query_param(url, "left", length_str) != URL_SUCCESS) {
-        fprintf(stderr, "ERR: failed to append 'left' query param\n");
+    // a tracker url with a query of its own, e.g. a passkey, gets ours appended to it.
+    url->contains_query = memchr(announce->chars, '?', announce->size) != NULL;
+    if (append_query_params(url, torrent->escaped_info_hash) != 0) {
+        url_free(url);
         return -1;
     }
 
-    return 0;
-}
-
-Tracker_Response *get_tracker_response(Bencoded *torrent) {
-    BString *tracker_url = get_announce_url(torrent);
-    if (!tracker_url) 
-        return NULL;
-
-    URL *url = initialize_url((const char*)tracker_url->chars, tracker_url->size);
-    if (!url) 
-        return NULL;
-
-    char *escaped_hash = get_escaped_info_hash(torrent);
-    if (escaped_hash == NULL) {
+    template->static_length = url->data->size;
+    template->capacity = template->static_length + ANNOUNCE_TEMPLATE_TAIL;
+    template->url = malloc(template->capacity);
+    if (template->url == NULL) {
+        fprintf(stderr, "ERR: could not alloc memory for the announce url.\n");
         url_free(url);
-        return NULL;
+        return -1;
     }
+    memcpy(template->url, url->data->chars, template->static_length);
+    template->url[template->static_length] = '\0';
+    url_free(url);
+    return 0;
+}
 
-    if (append_query_params(url, escaped_hash) != 0) {
-        url_free(url);
-        curl_free(escaped_hash);
-        return NULL;
-    }
+const char *announce_template_fill(AnnounceTemplate *template, const AnnounceStats *stats)
+{
+    static const char *events[] = {"", "&event=completed", "&event=started", "&event=stopped"};
 
-    if (append_length_param(url, get_dict_key(torrent, "info")) != 0) {
-        url_free(url);
-        curl_free(escaped_hash);
-        return NULL;
-    }
+    // three 20 digit numbers, their keys and the longest event fit in ANNOUNCE_TEMPLATE_TAIL.
+    snprintf(template->url + template->static_length, ANNOUNCE_TEMPLATE_TAIL, "&uploaded=%zu&downloaded=%zu&left=%zu%s",
+             stats->uploaded, stats->downloaded, stats->left, events[stats->event]);
+    return template->url;
+}
 
+void announce_template_free(AnnounceTemplate *template)
+{
+    free(template->url);
+    template->url = NULL;
+}
 
+Tracker_Response *tracker_response_new(void)
+{
     Tracker_Response *response_aggregator = malloc(sizeof(Tracker_Response));
     if (response_aggregator == NULL)
     {
         fprintf(stderr, "ERR: could not alloc memory for response_aggregator.");
-        url_free(url);
         return NULL;
     }
 
@@ -179,66 +140,68 @@ Tracker_Response *get_tracker_response(Bencoded *torrent) {
     if (response_aggregator->data == NULL)
     {
         fprintf(stderr, "ERR: could not alloc memory for response_aggregator.data.");
-        url_free(url);
         free(response_aggregator);
         return NULL;
     }
 
-    CURL *curl = curl_easy_init();
-    CURLcode res;
-
-    if (curl)
+    response_aggregator->arena = arena_new(0);
+    if (response_aggregator->arena == NULL)
     {
-        char* url_str = bstring_to_cstr(url->data);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url_str);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, handle_data);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, response_aggregator);
-
-        res = curl_easy_perform(curl);
-
-        if (res != CURLE_OK || !response_aggregator->ok)
-        {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            url_free(url);
-            curl_easy_cleanup(curl);
-            bstring_free(response_aggregator->data);
-            free(response_aggregator);
-            return NULL;
-        }
-
-        url_free(url);
-        curl_easy_cleanup(curl);
-        return response_aggregator;
+        fprintf(stderr, "ERR: could not alloc memory for response_aggregator.arena.");
+        bstring_free(response_aggregator->data);
+        free(response_aggregator);
+        return NULL;
     }
 
-    return NULL;
+    response_aggregator->ok = false;
+    response_aggregator->parsed.interval = 0;
+    response_aggregator->parsed.peers = NULL;
+    response_aggregator->parsed.peers_count = 0;
+    stream_parser_init(&response_aggregator->stream);
+    return response_aggregator;
 }
 
-static size_t handle_data(void *contents, size_t size, size_t nmemb, void *userp)
+size_t tracker_response_write(void *contents, size_t size, size_t nmemb, void *userp)
 {
     size_t realsize = size * nmemb;
     Tracker_Response *mem = (Tracker_Response *)userp;
+
+    // the response has already been handled, anything after it is ignored.
+    if (mem->stream.state == STREAM_DONE)
+    {
+        return realsize;
+    }
+
     if (bstring_append_bytes(mem->data, contents, realsize) != BSTRING_SUCCESS)
     {
         fprintf(stderr, "ERR: failed to append data to response aggregator");
         return 0;
     }
 
-    Bencoded container;
-    int result = decode_bencode(&container, (const char*)mem->data->chars, mem->data->size);
+    // only the new bytes are scanned, the response is decoded once it is known to be complete.
+    int result = stream_parser_feed(&mem->stream, contents, realsize);
+    if (result == PARSER_ERR_PARTIAL)
+    {
+        return realsize;
+    }
+
     if (result != PARSER_SUCCESS)
     {
-        if (result == PARSER_ERR_MEMORY || result == PARSER_ERR_SYNTAX)
-        {
-            return 0;
-        }
+        log_printf(LOG_WARN, "ERR: tracker response is not valid bencode\n");
+        return 0;
+    }
 
-        return realsize;
+    // the tree only lives for this call, so it borrows the response and is backed by the arena.
+    Bencoded container;
+    result = decode_bencode_borrowed(&container, (const char*)mem->data->chars, mem->stream.consumed, mem->arena);
+    if (result != PARSER_SUCCESS)
+    {
+        arena_reset(mem->arena);
+        return 0;
     }
 
     handle_tracker_response(&container, mem);
-    free_bencoded_inner(container);
+    arena_reset(mem->arena);
     return realsize;
 }
 
@@ -247,13 +210,13 @@ Bencoded* get_check_interval(Bencoded *b)
     Bencoded *interval = get_dict_key(b, "interval");
     if (interval == NULL)
     {
-        fprintf(stderr, "ERR: interval key not found in response");
+        log_printf(LOG_WARN, "ERR: interval key not found in response");
         return NULL;
     }
 
     if (!typeis(interval, INTEGER))
     {
-        fprintf(stderr, "ERR: interval key expected to be an integer");
+        log_printf(LOG_WARN, "ERR: interval key expected to be an integer");
         return NULL;
     }
 
@@ -265,13 +228,13 @@ Bencoded* get_check_peers(Bencoded *b)
     Bencoded *peers = get_dict_key(b, "peers");
     if (peers == NULL)
     {
-        fprintf(stderr, "ERR: peers key not found in response");
+        log_printf(LOG_WARN, "ERR: peers key not found in response");
         return NULL;
     }
 
     if (peers->type != STRING)
     {
-        fprintf(stderr, "ERR: peers key expected to be a string");
+        log_printf(LOG_WARN, "ERR: peers key expected to be a string");
         return NULL;
     }
 
@@ -287,67 +250,60 @@ bool tracker_response_has_failure(Bencoded *b)
 
     if (failure_reason->type != STRING)
     {
-        fprintf(stderr, "ERR: failure reason expected to be a string");
+        log_printf(LOG_WARN, "ERR: failure reason expected to be a string");
     }
     else 
     {
-        fprintf(stderr, "Failure Reason: %.*s\n", (int)failure_reason->data.string->size, failure_reason->data.string->chars);
+        log_printf(LOG_WARN, "Failure Reason: %.*s\n", (int)failure_reason->data.string->size, failure_reason->data.string->chars);
     }
   
 
     return true;
 }
-// specifically checks the length is divisible by 6
+// specifically checks the length is a whole number of compact peers
 bool peers_list_is_valid(Bencoded *b)
 {
-    return b->data.string->size % 6 == 0;
+    return b->data.string->size % COMPACT_PEER_V4_LENGTH == 0;
 }
 
-Peer *dyn_resize_peer_list(size_t *size, size_t *capacity, Peer *peers_list)
+size_t put_compact_peers(const unsigned char *raw, size_t size, IPType type, Peer *dest)
 {
-    size_t tmp_size = *size;
-    size_t tmp_capacity = *capacity;
-    if (tmp_size >= tmp_capacity)
+    size_t length = type == IPV4 ? COMPACT_PEER_V4_LENGTH : COMPACT_PEER_V6_LENGTH;
+    size_t count = size / length;
+    const unsigned char *at = raw;
+    for (size_t i = 0; i < count; i++, at += length)
     {
-        while (tmp_size >= tmp_capacity)
-            tmp_capacity *= 2;
-
-        Peer *new_peers_list = realloc(peers_list, sizeof(Peer) * tmp_capacity);
-        if (new_peers_list == NULL)
+        // the address and port are in network byte order on the wire, as the socket calls take them.
+        Peer *peer = &dest[i];
+        memset(peer, 0, sizeof(Peer));
+        peer->type = type;
+        if (type == IPV4)
         {
-            fprintf(stderr, "ERR: could not reallocate memory for peers list");
-            return NULL;
+            peer->addr.v4.sin_family = AF_INET;
+            memcpy(&peer->addr.v4.sin_addr, at, 4);
+            memcpy(&peer->addr.v4.sin_port, at + 4, 2);
+        }
+        else
+        {
+            peer->addr.v6.sin6_family = AF_INET6;
+            memcpy(&peer->addr.v6.sin6_addr, at, 16);
+            memcpy(&peer->addr.v6.sin6_port, at + 16, 2);
         }
-        *capacity = tmp_capacity;
-        return new_peers_list;
-    }
-
-    return peers_list;
-}
-
-void peers_list_free(Peer *peers_list, size_t count)
-{
-    for (size_t i = 0; i < count; i++)
-    {
-        bstring_free(peers_list[i].ip);
     }
-    free(peers_list);
+    return count;
 }
 
-
-void put_peers_in_tracker_res(Bencoded *src, Tracker_Response *dest)
+void put_peers_in_tracker_res(Bencoded *src, Bencoded *src6, Tracker_Response *dest)
 {
-
     BString *peers_raw = src->data.string;
-    if (peers_raw->size % 6 != 0)
-    {
-        fprintf(stderr, "ERR: invalid length for peers string");
-        dest->ok = false;
-        return;
-    }
+    BString *peers6_raw = src6 != NULL ? src6->data.string : NULL;
+
+    // the list is sized exactly once, every compact entry is one peer.
+    size_t count = peers_raw->size / COMPACT_PEER_V4_LENGTH;
+    if (peers6_raw != NULL)
+        count += peers6_raw->size / COMPACT_PEER_V6_LENGTH;
 
-    size_t capacity = 10;
-    Peer *peers_list = malloc(sizeof(Peer) * capacity);
+    Peer *peers_list = malloc(sizeof(Peer) * (count > 0 ? count : 1));
     if (peers_list == NULL)
     {
         fprintf(stderr, "ERR: could not allocate memory for peers list");
@@ -355,49 +311,10 @@ void put_peers_in_tracker_res(Bencoded *src, Tracker_Response *dest)
         return;
     }
 
-    size_t count = 0;
-    for (size_t i = 0; i < peers_raw->size; i += 6)
-    {
-        if ((peers_list = dyn_resize_peer_list(&count, &capacity, peers_list)) == NULL)
-        {
-            dest->ok = false;
-            peers_list_free(peers_list, count);
-            return;
-        }
-
-        Peer *peer = &peers_list[count];
-        peer->ip = bstring_new(IP_V4_MAX_LENGTH);
-        if (peer->ip == NULL)
-        {
-            fprintf(stderr, "ERR: could not allocate memory for peer ip");
-            peers_list_free(peers_list, count);
-            dest->ok = false;
-            return;
-        }
-
-        // todo: we should expose a prim for these kinds of opertions rather than 
-        // assuming a reader knows to cast to unsigned char and update size etc...
-        int bytes_written = snprintf((char *)peer->ip->chars, IP_V4_MAX_LENGTH, "%u.%u.%u.%u",
-                                     (unsigned char)peers_raw->chars[i],
-                                     (unsigned char)peers_raw->chars[i + 1],
-                                     (unsigned char)peers_raw->chars[i + 2],
-                                     (unsigned char)peers_raw->chars[i + 3]);
-
-        if (bytes_written < 0)
-        {
-            fprintf(stderr, "ERR: could not write to peer ip");
-            bstring_free(peer->ip);
-            peers_list_free(peers_list, count);
-            dest->ok = false;
-            return;
-        }
+    size_t filled = put_compact_peers(peers_raw->chars, peers_raw->size, IPV4, peers_list);
+    if (peers6_raw != NULL)
+        put_compact_peers(peers6_raw->chars, peers6_raw->size, IPV6, peers_list + filled);
 
-        peer->ip->size = bytes_written;
-        peer->port = (unsigned char)peers_raw->chars[i + 4] << 8 | (unsigned char)peers_raw->chars[i + 5];
-        peer->type = IPV4; // for now, we will need to handle this later.
-        count++;
-    }
-    
     dest->parsed.peers = peers_list;
     dest->parsed.peers_count = count;
     dest->ok = true;
@@ -407,7 +324,7 @@ void handle_tracker_response(Bencoded *b, Tracker_Response *res)
 {
     if (!typeis(b, DICTIONARY))
     {
-        fprintf(stderr, "ERR: expected dictionary in response");
+        log_printf(LOG_WARN, "ERR: expected dictionary in response");
         return;
     }
 
@@ -434,38 +351,86 @@ void handle_tracker_response(Bencoded *b, Tracker_Response *res)
 
     if (!peers_list_is_valid(peers))
     {
-        fprintf(stderr, "ERR: invalid length for peers string");
+        log_printf(LOG_WARN, "ERR: invalid length for peers string");
         res->ok = false;
         return;
     }
 
-    put_peers_in_tracker_res(peers, res);
+    // peers6 is optional, a malformed one is ignored rather than failing the peers that are fine.
+    Bencoded *peers6 = get_dict_key(b, "peers6");
+    if (peers6 != NULL && (peers6->type != STRING || peers6->data.string->size % COMPACT_PEER_V6_LENGTH != 0))
+        peers6 = NULL;
+
+    put_peers_in_tracker_res(peers, peers6, res);
 }
 
 void tracker_response_free(Tracker_Response *response)
 {
     bstring_free(response->data);
-    for (size_t i = 0; i < response->parsed.peers_count; i++)
-    {
-        bstring_free(response->parsed.peers[i].ip);
-    }
+    arena_free(response->arena);
     free(response->parsed.peers);
     free(response);
 }
 
+char *format_peer_address(const Peer *peer, char *buffer, size_t size)
+{
+    char ip[INET6_ADDRSTRLEN];
+    if (peer->type == IPV4)
+    {
+        inet_ntop(AF_INET, &peer->addr.v4.sin_addr, ip, sizeof(ip));
+        snprintf(buffer, size, "%s:%u", ip, ntohs(peer->addr.v4.sin_port));
+    }
+    else
+    {
+        inet_ntop(AF_INET6, &peer->addr.v6.sin6_addr, ip, sizeof(ip));
+        snprintf(buffer, size, "[%s]:%u", ip, ntohs(peer->addr.v6.sin6_port));
+    }
+    return buffer;
+}
+
 socket_t tcp_connect_peer(Peer *peer)
 {
-    if (peer->type == IPV6)
+    int family = peer->type == IPV4 ? AF_INET : AF_INET6;
+    socklen_t length = peer->type == IPV4 ? sizeof(peer->addr.v4) : sizeof(peer->addr.v6);
+    int sock = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    if (connect(sock, (struct sockaddr *)&peer->addr, length) < 0)
     {
-        fprintf(stderr, "ERR: IPV6 not supported yet\n");
+        close(sock);
         return -1;
     }
+    return sock;
+}
+
+socket_t tcp_connect_peer_nonblocking(Peer *peer)
+{
+    char address[PEER_ADDRESS_MAX_LENGTH];
+    log_printf(LOG_INFO, "Connecting to %s\n", format_peer_address(peer, address, sizeof(address)));
 
-    char *addr = bstring_to_cstr(peer->ip);
-    if (addr == NULL)
+    int family = peer->type == IPV4 ? AF_INET : AF_INET6;
+    socklen_t length = peer->type == IPV4 ? sizeof(peer->addr.v4) : sizeof(peer->addr.v6);
+    int sock = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
         return -1;
-    
-    return tcp_connect_inet_hp(addr, peer->port);
+
+    if (connect(sock, (struct sockaddr *)&peer->addr, length) < 0 && errno != EINPROGRESS)
+    {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+int tcp_connect_result(socket_t socket)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+        return errno;
+    return error;
 }
 
 
@@ -494,7 +459,7 @@ socket_t tcp_connect_inet_hp(const char *ip, int port)
     if (sock < 0)
         return -1;
 
-    fprintf(stderr, "Connecting to %s:%d\n", ip, port);
+    log_printf(LOG_INFO, "Connecting to %s:%d\n", ip, port);
 
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
@@ -542,6 +507,11 @@ int read_socket_exact(socket_t socket, char *buffer, size_t n)
             fprintf(stderr, "ERR: failed to read from socket\n");
             return -1;
         }
+        if (bytes == 0)
+        {
+            fprintf(stderr, "ERR: connection closed by peer\n");
+            return -1;
+        }
         b_read += bytes;
     }
     return b_read;
@@ -18,13 +18,25 @@
 #include "bencode.h"
 #include "bstring.h"
 #include "url.h"
+#include "arena.h"
 
 #define IP_V4_MAX_LENGTH 15 // 4 octets + 3 dots
 #define MAX_PORT_RANGE 65535 // 2^16 - 1
 #define DEFAULT_BLOCK_SIZE 16384 // 16KB
+#define COMPACT_PEER_V4_LENGTH 6 // 4 address bytes + 2 port bytes, see BEP 23
+#define COMPACT_PEER_V6_LENGTH 18 // 16 address bytes + 2 port bytes, see BEP 7
+#define PEER_ADDRESS_MAX_LENGTH (INET6_ADDRSTRLEN + 8) // "[address]:port"
+#define CLIENT_PEER_ID "00112233445566778899" // the peer id this client announces and handshakes with.
+#define CLIENT_PORT 6881 // the port this client announces.
+
+// the room an announce template keeps past its static part, for the longest query tail it writes.
+#define ANNOUNCE_TEMPLATE_TAIL 128
 
 typedef int socket_t;
 
+// a loaded torrent, see torrent.h
+typedef struct Torrent Torrent;
+
 typedef enum
 {
     IPV4,
@@ -44,10 +56,13 @@ typedef enum
     CANCEL,         // 8 cancel: cancel a request
 } PeerMessageId;
 
+// a peer address, kept in the binary form the socket calls take. it is only turned into text to be shown.
 typedef struct {
     IPType type;
-    BString *ip;
-    int port;
+    union {
+        struct sockaddr_in v4;
+        struct sockaddr_in6 v6;
+    } addr;
 } Peer;
 
 typedef struct {
@@ -56,20 +71,90 @@ typedef struct {
     size_t peers_count;
 } Tracker_Answer;
 
+// the event an announce reports, numbered as BEP 15 sends them.
+typedef enum {
+    TRACKER_EVENT_NONE,
+    TRACKER_EVENT_COMPLETED,
+    TRACKER_EVENT_STARTED,
+    TRACKER_EVENT_STOPPED
+} TrackerEvent;
+
+// what an announce reports about the transfer so far, in bytes.
+typedef struct {
+    size_t uploaded;
+    size_t downloaded;
+    size_t left;
+    TrackerEvent event;
+} AnnounceStats;
+
+// the announce url of a torrent at one tracker. everything but the transfer stats is the same
+// for every announce, so it is built once and only the tail after it is rewritten in place.
+typedef struct {
+    char *url;              // the static part followed by the tail of the latest announce.
+    size_t static_length;   // the length of the static part.
+    size_t capacity;        // the size of url, static_length + ANNOUNCE_TEMPLATE_TAIL.
+} AnnounceTemplate;
+
 typedef struct
 {
     BString *data;
     bool ok;
     Tracker_Answer parsed;
+    Arena *arena; // backs the decoded response while it is being handled.
+    StreamParser stream; // finds the end of the response as it arrives.
 } Tracker_Response;
 
 /**
- * @brief Get the tracker response from the announce URL in the torrent meta
- * @param torrent The torrent meta info
- * @return a pointer to The tracker response
+ * @brief Build the static part of the announce url of a torrent at one of its trackers: the info
+ * hash, peer id, port and compact query parameters.
+ * @param template The template
+ * @param torrent The loaded torrent
+ * @param announce The announce url of the tracker, it may already have a query
+ * @return int 0, or -1 on error
+ */
+int announce_template_init(AnnounceTemplate *template, Torrent *torrent, BString *announce);
+
+/**
+ * @brief Write the transfer stats into an announce template, without allocating.
+ * @param template The template
+ * @param stats The stats to announce
+ * @return const char* the complete url, valid until the template is filled again or freed
  */
-Tracker_Response *
-get_tracker_response(Bencoded *torrent);
+const char *announce_template_fill(AnnounceTemplate *template, const AnnounceStats *stats);
+
+/**
+ * @brief Free the memory of an announce template.
+ * @param template The template
+ * @return void
+ */
+void announce_template_free(AnnounceTemplate *template);
+
+/**
+ * @brief Create an empty tracker response to receive an announce into, see tracker_response_write.
+ * @return Tracker_Response* The response, or NULL if it could not be allocated
+ */
+Tracker_Response *tracker_response_new(void);
+
+/**
+ * @brief A curl write callback that appends to a tracker response and parses it once the whole
+ * bencoded answer arrived, setting ok and the parsed peers.
+ * @param contents The bytes that arrived
+ * @param size The size of an item, always 1
+ * @param nmemb The number of items
+ * @param userp The Tracker_Response
+ * @return size_t the number of bytes taken, less than size * nmemb to fail the transfer
+ */
+size_t tracker_response_write(void *contents, size_t size, size_t nmemb, void *userp);
+
+/**
+ * @brief Unpack compact peers, each an address and a port in network byte order (BEP 23, BEP 7).
+ * @param raw The compact peers
+ * @param size The size of raw, a trailing partial peer is ignored
+ * @param type The address family of every peer
+ * @param dest Where the peers go, room for every whole one
+ * @return size_t the number of peers
+ */
+size_t put_compact_peers(const unsigned char *raw, size_t size, IPType type, Peer *dest);
 
 /**
  * @brief Free the memory allocated for a tracker response
@@ -86,6 +171,26 @@ void tracker_response_free(Tracker_Response *response);
 */
 bool hash_bencoded(unsigned char* hash, Bencoded *bencoded);
 
+/**
+ * Hash the original bytes a bencoded value was decoded from, in a single SHA1 pass without
+ * allocating or re-encoding anything. This is also what the spec means by the info hash, the
+ * exact bytes of the info dict as they appear in the torrent file.
+ * @param hash The hash to store the result in, SHA_DIGEST_LENGTH bytes
+ * @param bencoded The decoded bencoded value to hash
+ * @param source The buffer the value was decoded from, it must still be alive and unmodified
+ * @return void
+*/
+void hash_bencoded_source(unsigned char* hash, Bencoded *bencoded, const char *source);
+
+
+/**
+ * @brief write a peer address as "ip:port", or "[ip]:port" for IPV6.
+ * @param peer The peer
+ * @param buffer The buffer to write to, room for PEER_ADDRESS_MAX_LENGTH bytes
+ * @param size The size of the buffer
+ * @return char* the buffer
+*/
+char *format_peer_address(const Peer *peer, char *buffer, size_t size);
 
 /**
  * @brief connect to a peer address and return the socket file descriptor
@@ -94,13 +199,29 @@ bool hash_bencoded(unsigned char* hash, Bencoded *bencoded);
 */
 int tcp_connect_peer(Peer *peer);
 
+/**
+ * @brief start a non-blocking connect to a peer. The connect is usually still in progress when this
+ * returns, the socket turns writable once it completes and tcp_connect_result tells how it went.
+ * @param peer The peer to connect to
+ * @return int The non-blocking socket file descriptor, if successful, -1 otherwise
+*/
+int tcp_connect_peer_nonblocking(Peer *peer);
+
+/**
+ * @brief get the outcome of a non-blocking connect once its socket turned writable.
+ * @param socket The socket the connect was started on
+ * @return int 0 if the connect succeeded, the errno it failed with otherwise
+*/
+int tcp_connect_result(socket_t socket);
+
 
 /**
  * @brief Get the info hash from a torrent meta info
  * @param torrent The torrent meta info
+ * @param source The buffer the torrent meta info was decoded from
  * @return BString* The info hash, or NULL if the info hash is not found
 */
-BString *get_info_hash(Bencoded *torrent);
+BString *get_info_hash(Bencoded *torrent, const char *source);
 
 
 /**
@@ -126,7 +247,7 @@ socket_t tcp_connect_inet_hp(const char *ip, int port);
  * @param socket The socket file descriptor to read from
  * @param buffer The buffer to store the read data
  * @param n The number of bytes to read
- * @return int The number of bytes read, or -1 if an error occurred
+ * @return int The number of bytes read, or -1 if an error occurred or the peer closed the connection first
 */
 int read_socket_exact(socket_t socket, char *buffer, size_t n);
 
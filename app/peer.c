@@ -0,0 +1,793 @@
+/**
+ * @file peer.c
+ * @brief Implementation file for the peer wire protocol messages in C.
+*/
+#include "peer.h"
+#include "log.h"
+#include "metrics.h"
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <time.h>
+
+/**
+ * @brief make room for at least n more bytes at the end of a buffer, moving the live bytes to the
+ * front first so a buffer that is read as fast as it is filled does not grow.
+ * @param buffer The buffer
+ * @param n The number of bytes to make room for
+ * @return int PEER_SUCCESS, or PEER_ERR_MEMORY if the buffer could not grow
+*/
+int peer_buffer_reserve(PeerBuffer *buffer, size_t n);
+
+/**
+ * @brief free the memory of a buffer.
+ * @param buffer The buffer
+ * @return void
+*/
+void peer_buffer_free(PeerBuffer *buffer);
+
+/**
+ * @brief make room for at least n more bytes in a ring. A full ring doubles, its bytes are moved
+ * to the front of the new one.
+ * @param ring The ring
+ * @param n The number of bytes to make room for
+ * @return int PEER_SUCCESS, or PEER_ERR_MEMORY if the ring could not grow
+*/
+int peer_ring_reserve(PeerRing *ring, size_t n);
+
+/**
+ * @brief append bytes to a ring that has room for them, wrapping around its end.
+ * @param ring The ring
+ * @param bytes The bytes
+ * @param n The number of bytes
+ * @return void
+*/
+void peer_ring_write(PeerRing *ring, const void *bytes, size_t n);
+
+/**
+ * @brief describe the first bytes queued in a ring, at most two pieces as it wraps around.
+ * @param ring The ring
+ * @param iov Filled with the pieces
+ * @param limit The most bytes to describe
+ * @return int the number of pieces filled in
+*/
+int peer_ring_iov(PeerRing *ring, struct iovec iov[2], size_t limit);
+
+/**
+ * @brief free the memory of a ring.
+ * @param ring The ring
+ * @return void
+*/
+void peer_ring_free(PeerRing *ring);
+
+/**
+ * @brief move a connection through its connect and handshake stages, see peer_advance_handshake.
+ * @param state The state of the peer
+ * @param torrent The torrent to handshake for
+ * @param events The epoll events of the socket
+ * @param now The current time, from peer_now
+ * @return int PEER_SUCCESS once the handshake is done, PEER_INCOMPLETE, or an error code less than 0
+*/
+int peer_advance_stage(Peer_State *state, Torrent *torrent, uint32_t events, double now);
+
+int peer_buffer_reserve(PeerBuffer *buffer, size_t n)
+{
+    if (buffer->start == buffer->end)
+        buffer->start = buffer->end = 0;
+
+    if (buffer->capacity - buffer->end >= n)
+        return PEER_SUCCESS;
+
+    if (buffer->start > 0)
+    {
+        memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+        buffer->end -= buffer->start;
+        buffer->start = 0;
+        if (buffer->capacity - buffer->end >= n)
+            return PEER_SUCCESS;
+    }
+
+    size_t capacity = buffer->capacity == 0 ? PEER_BUFFER_MIN_READ : buffer->capacity;
+    while (capacity - buffer->end < n)
+        capacity *= 2;
+
+    unsigned char *data = realloc(buffer->data, capacity);
+    if (data == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for peer buffer\n");
+        return PEER_ERR_MEMORY;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return PEER_SUCCESS;
+}
+
+void peer_buffer_free(PeerBuffer *buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->start = buffer->end = buffer->capacity = 0;
+}
+
+int peer_ring_reserve(PeerRing *ring, size_t n)
+{
+    size_t used = ring->tail - ring->head;
+    if (ring->capacity - used >= n)
+        return PEER_SUCCESS;
+
+    size_t capacity = ring->capacity == 0 ? PEER_BUFFER_MIN_READ : ring->capacity;
+    while (capacity - used < n)
+        capacity *= 2;
+
+    unsigned char *data = malloc(capacity);
+    if (data == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for peer buffer\n");
+        return PEER_ERR_MEMORY;
+    }
+
+    struct iovec iov[2];
+    int count = peer_ring_iov(ring, iov, used);
+    size_t at = 0;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(data + at, iov[i].iov_base, iov[i].iov_len);
+        at += iov[i].iov_len;
+    }
+    free(ring->data);
+    ring->data = data;
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->tail = used;
+    return PEER_SUCCESS;
+}
+
+void peer_ring_write(PeerRing *ring, const void *bytes, size_t n)
+{
+    size_t at = ring->tail & (ring->capacity - 1);
+    size_t first = ring->capacity - at < n ? ring->capacity - at : n;
+    memcpy(ring->data + at, bytes, first);
+    memcpy(ring->data, (const unsigned char *)bytes + first, n - first);
+    ring->tail += n;
+}
+
+int peer_ring_iov(PeerRing *ring, struct iovec iov[2], size_t limit)
+{
+    size_t used = ring->tail - ring->head;
+    size_t n = used < limit ? used : limit;
+    if (n == 0)
+        return 0;
+
+    size_t at = ring->head & (ring->capacity - 1);
+    size_t first = ring->capacity - at < n ? ring->capacity - at : n;
+    iov[0] = (struct iovec){ .iov_base = ring->data + at, .iov_len = first };
+    if (first == n)
+        return 1;
+    iov[1] = (struct iovec){ .iov_base = ring->data, .iov_len = n - first };
+    return 2;
+}
+
+void peer_ring_free(PeerRing *ring)
+{
+    free(ring->data);
+    *ring = (PeerRing){ 0 };
+}
+
+uint32_t peer_read_u32(const unsigned char *bytes)
+{
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | (uint32_t)bytes[3];
+}
+
+void peer_write_u32(unsigned char *bytes, uint32_t value)
+{
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+}
+
+int peer_message_init(PeerMessage *msg)
+{
+    msg->keep_alive = false;
+    msg->payload = bstring_view(NULL, 0);
+    if (msg->payload == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for message payload\n");
+        return PEER_ERR_MEMORY;
+    }
+    return PEER_SUCCESS;
+}
+
+void peer_message_free(PeerMessage *msg)
+{
+    bstring_free(msg->payload);
+    msg->payload = NULL;
+}
+
+int peer_queue_handshake(Peer_State *state, Torrent *torrent, const unsigned char *peer_id)
+{
+    if (peer_ring_reserve(&state->out, PEER_HANDSHAKE_LENGTH) != PEER_SUCCESS)
+        return PEER_ERR_MEMORY;
+
+    Peer_Header_BitTorrent header;
+    header.pstrlen = 19;
+    memcpy(header.proto_name, "BitTorrent protocol", 19);
+    memset(header.reserved, 0, 8);
+    memcpy(header.info_hash, torrent->info_hash, 20);
+    memcpy(header.peer_id, peer_id, 20);
+    peer_ring_write(&state->out, &header, PEER_HANDSHAKE_LENGTH);
+    return PEER_SUCCESS;
+}
+
+int peer_queue_message(Peer_State *state, PeerMessageId id, const unsigned char *payload, size_t n)
+{
+    if (peer_ring_reserve(&state->out, 5 + n) != PEER_SUCCESS)
+        return PEER_ERR_MEMORY;
+
+    unsigned char prefix[5];
+    peer_write_u32(prefix, n + 1);
+    prefix[4] = id;
+    peer_ring_write(&state->out, prefix, sizeof(prefix));
+    if (n > 0)
+        peer_ring_write(&state->out, payload, n);
+    return PEER_SUCCESS;
+}
+
+int peer_queue_request(Peer_State *state, PeerMessageId id, uint32_t index, uint32_t begin, uint32_t length)
+{
+    unsigned char payload[PEER_REQUEST_LENGTH];
+    peer_write_u32(payload, index);
+    peer_write_u32(payload + 4, begin);
+    peer_write_u32(payload + 8, length);
+    return peer_queue_message(state, id, payload, sizeof(payload));
+}
+
+int peer_queue_block(Peer_State *state, int fd, off_t offset, uint32_t index, uint32_t begin, uint32_t length)
+{
+    unsigned char header[PEER_PIECE_HEADER_LENGTH + 5];
+    peer_write_u32(header, 1 + PEER_PIECE_HEADER_LENGTH + length);
+    header[4] = PIECE;
+    peer_write_u32(header + 5, index);
+    peer_write_u32(header + 9, begin);
+    if (peer_ring_reserve(&state->out, sizeof(header)) != PEER_SUCCESS)
+        return PEER_ERR_MEMORY;
+
+    peer_ring_write(&state->out, header, sizeof(header));
+    state->upload = (PeerUpload){
+        .fd = fd,
+        .offset = offset,
+        .remaining = length,
+        .before = state->out.tail - state->out.head,
+    };
+    return PEER_SUCCESS;
+}
+
+bool peer_upload_idle(Peer_State *state)
+{
+    return state->upload.remaining == 0;
+}
+
+int peer_flush(Peer_State *state)
+{
+    PeerRing *out = &state->out;
+    PeerUpload *upload = &state->upload;
+    while (out->head < out->tail || upload->remaining > 0)
+    {
+        ssize_t bytes;
+        bool payload = upload->remaining > 0 && upload->before == 0;
+        if (payload)
+        {
+            // sendfile advances the offset itself.
+            bytes = sendfile(state->socket, upload->fd, &upload->offset, upload->remaining);
+        }
+        else
+        {
+            // every queued message goes out in one vectored write, the socket flavour of writev.
+            // with a payload queued, only the bytes ahead of it go out first.
+            struct iovec iov[2];
+            struct msghdr message = { .msg_iov = iov };
+            message.msg_iovlen = peer_ring_iov(out, iov, upload->remaining > 0 ? upload->before : SIZE_MAX);
+            bytes = sendmsg(state->socket, &message, MSG_NOSIGNAL);
+        }
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return PEER_SUCCESS;
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return PEER_ERR_IO;
+
+        if (payload)
+        {
+            upload->remaining -= bytes;
+            continue;
+        }
+        out->head += bytes;
+        if (upload->remaining > 0)
+            upload->before -= bytes;
+    }
+    return PEER_SUCCESS;
+}
+
+int peer_receive(Peer_State *state)
+{
+    PeerBuffer *in = &state->in;
+    while (true)
+    {
+        if (peer_buffer_reserve(in, PEER_BUFFER_MIN_READ) != PEER_SUCCESS)
+            return PEER_ERR_MEMORY;
+
+        ssize_t bytes = recv(state->socket, in->data + in->end, in->capacity - in->end, 0);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return PEER_SUCCESS;
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return PEER_ERR_IO;
+        in->end += bytes;
+    }
+}
+
+int peer_receive_some(Peer_State *state, bool expect_block)
+{
+    PeerBuffer *in = &state->in;
+    if (peer_buffer_reserve(in, PEER_BUFFER_MIN_READ) != PEER_SUCCESS)
+        return PEER_ERR_MEMORY;
+
+    size_t wanted = in->capacity - in->end;
+    size_t buffered = in->end - in->start;
+    if (expect_block && buffered < PEER_PIECE_PREFIX_LENGTH)
+        wanted = PEER_PIECE_PREFIX_LENGTH - buffered;
+
+    while (true)
+    {
+        ssize_t bytes = recv(state->socket, in->data + in->end, wanted, 0);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return PEER_INCOMPLETE;
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return PEER_ERR_IO;
+        in->end += bytes;
+        return PEER_SUCCESS;
+    }
+}
+
+int peer_peek_piece(Peer_State *state, uint32_t *index, uint32_t *begin, size_t *length)
+{
+    PeerBuffer *in = &state->in;
+    size_t available = in->end - in->start;
+    if (available < PEER_PIECE_PREFIX_LENGTH)
+        return PEER_INCOMPLETE;
+
+    const unsigned char *at = in->data + in->start;
+    uint32_t message_length = peer_read_u32(at);
+    // a message that is too long is left for peer_parse_message to reject.
+    if (at[4] != PIECE || message_length < 1 + PEER_PIECE_HEADER_LENGTH ||
+        message_length > PEER_MAX_MESSAGE_LENGTH || available - 4 >= message_length)
+        return PEER_INCOMPLETE;
+
+    *index = peer_read_u32(at + 5);
+    *begin = peer_read_u32(at + 9);
+    *length = message_length - 1 - PEER_PIECE_HEADER_LENGTH;
+    return PEER_SUCCESS;
+}
+
+void peer_sink_start(Peer_State *state, unsigned char *data)
+{
+    PeerBuffer *in = &state->in;
+    PeerSink *sink = &state->sink;
+    peer_peek_piece(state, &sink->index, &sink->begin, &sink->length);
+    in->start += PEER_PIECE_PREFIX_LENGTH;
+
+    // peek made sure the buffer holds less than the whole payload.
+    sink->data = data;
+    sink->received = in->end - in->start;
+    if (data != NULL)
+        memcpy(data, in->data + in->start, sink->received);
+    in->start = in->end;
+}
+
+void peer_sink_discard(Peer_State *state)
+{
+    state->sink.data = NULL;
+}
+
+int peer_sink_receive(Peer_State *state)
+{
+    PeerBuffer *in = &state->in;
+    PeerSink *sink = &state->sink;
+    while (sink->received < sink->length)
+    {
+        if (peer_buffer_reserve(in, PEER_PIECE_PREFIX_LENGTH) != PEER_SUCCESS)
+            return PEER_ERR_MEMORY;
+
+        unsigned char scratch[PEER_BUFFER_MIN_READ];
+        size_t wanted = sink->length - sink->received;
+        struct iovec iov[2] = {
+            { .iov_base = sink->data != NULL ? sink->data + sink->received : scratch, .iov_len = wanted },
+            { .iov_base = in->data + in->end, .iov_len = PEER_PIECE_PREFIX_LENGTH },
+        };
+        int count = 2;
+        // a payload being thrown away is read through a scratch buffer, a chunk at a time.
+        if (sink->data == NULL && wanted > sizeof(scratch))
+        {
+            iov[0].iov_len = sizeof(scratch);
+            count = 1;
+        }
+
+        ssize_t bytes = readv(state->socket, iov, count);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return PEER_INCOMPLETE;
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return PEER_ERR_IO;
+
+        size_t payload = (size_t)bytes < iov[0].iov_len ? (size_t)bytes : iov[0].iov_len;
+        sink->received += payload;
+        in->end += bytes - payload;
+    }
+
+    sink->length = 0;
+    return PEER_SUCCESS;
+}
+
+int peer_parse_handshake(Peer_State *state, const unsigned char *info_hash)
+{
+    PeerBuffer *in = &state->in;
+    if (in->end - in->start < PEER_HANDSHAKE_LENGTH)
+        return PEER_INCOMPLETE;
+
+    Peer_Header_BitTorrent *header = (Peer_Header_BitTorrent *)(in->data + in->start);
+    if (header->pstrlen != 19 || memcmp(header->proto_name, "BitTorrent protocol", 19) != 0)
+    {
+        log_printf(LOG_INFO, "ERR: invalid protocol name\n");
+        return PEER_ERR_PROTOCOL;
+    }
+
+    if (memcmp(header->info_hash, info_hash, SHA_DIGEST_LENGTH) != 0)
+    {
+        log_printf(LOG_INFO, "ERR: peer answered the handshake with a different info hash\n");
+        return PEER_ERR_PROTOCOL;
+    }
+
+    in->start += PEER_HANDSHAKE_LENGTH;
+    return PEER_SUCCESS;
+}
+
+int peer_parse_message(Peer_State *state, PeerMessage *msg)
+{
+    PeerBuffer *in = &state->in;
+    size_t available = in->end - in->start;
+    if (available < 4)
+        return PEER_INCOMPLETE;
+
+    uint32_t length = peer_read_u32(in->data + in->start);
+    if (length > PEER_MAX_MESSAGE_LENGTH)
+    {
+        log_printf(LOG_INFO, "ERR: peer sent a message of %u bytes\n", length);
+        return PEER_ERR_PROTOCOL;
+    }
+
+    if (available - 4 < length)
+        return PEER_INCOMPLETE;
+
+    unsigned char *body = in->data + in->start + 4;
+    in->start += 4 + length;
+
+    msg->keep_alive = length == 0;
+    if (msg->keep_alive)
+    {
+        bstring_view_init(msg->payload, NULL, 0);
+        return PEER_SUCCESS;
+    }
+
+    msg->id = body[0];
+    bstring_view_init(msg->payload, body + 1, length - 1);
+    return PEER_SUCCESS;
+}
+
+int peer_start_connect(Peer_State *state, double now)
+{
+    state->socket = tcp_connect_peer_nonblocking(state->peer_info);
+    if (state->socket < 0)
+        return PEER_ERR_IO;
+
+    state->phase = PEER_CONNECTING;
+    state->deadline = now + PEER_CONNECT_TIMEOUT;
+    return PEER_SUCCESS;
+}
+
+int peer_advance_handshake(Peer_State *state, Torrent *torrent, uint32_t events, double now)
+{
+    int result = peer_advance_stage(state, torrent, events, now);
+    if (result < 0)
+        metrics_count(METRIC_CONNECT_FAILURES, 1);
+    return result;
+}
+
+int peer_advance_stage(Peer_State *state, Torrent *torrent, uint32_t events, double now)
+{
+    if (state->phase == PEER_CONNECTING)
+    {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return PEER_INCOMPLETE;
+
+        if (tcp_connect_result(state->socket) != 0)
+            return PEER_ERR_IO;
+
+        if (peer_queue_handshake(state, torrent, (const unsigned char *)CLIENT_PEER_ID) != PEER_SUCCESS)
+            return PEER_ERR_MEMORY;
+
+        // a stage started PEER_*_TIMEOUT before its deadline.
+        metrics_count(METRIC_CONNECTS, 1);
+        metrics_record_seconds(METRIC_CONNECT_TIME, now - (state->deadline - PEER_CONNECT_TIMEOUT));
+        state->phase = PEER_HANDSHAKING;
+        state->connected = true;
+        state->deadline = now + PEER_HANDSHAKE_TIMEOUT;
+    }
+
+    if (state->phase != PEER_HANDSHAKING)
+        return state->phase == PEER_CONNECTED ? PEER_SUCCESS : PEER_ERR_IO;
+
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && peer_receive(state) != PEER_SUCCESS)
+        return PEER_ERR_IO;
+
+    if (peer_flush(state) != PEER_SUCCESS)
+        return PEER_ERR_IO;
+
+    int result = peer_parse_handshake(state, torrent->info_hash);
+    if (result != PEER_SUCCESS)
+        return result;
+
+    metrics_count(METRIC_HANDSHAKES, 1);
+    metrics_record_seconds(METRIC_HANDSHAKE_TIME, now - (state->deadline - PEER_HANDSHAKE_TIMEOUT));
+    state->phase = PEER_CONNECTED;
+    state->deadline = 0;
+    return PEER_SUCCESS;
+}
+
+bool peer_stage_expired(Peer_State *state, double now)
+{
+    return state->phase != PEER_CONNECTED && state->deadline != 0 && now > state->deadline;
+}
+
+size_t peer_connect_batch(Torrent *torrent, Peer *peers, size_t count, size_t *next, size_t want, Peer_State *states, size_t *started)
+{
+    *started = 0;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        fprintf(stderr, "ERR: failed to create event loop\n");
+        return 0;
+    }
+
+    // states[0, ready) are handshaken, states[ready, active) are in progress.
+    size_t ready = 0;
+    size_t active = 0;
+    struct epoll_event events[PEER_CONNECT_CONCURRENCY];
+
+    while (ready < want)
+    {
+        while (active < PEER_CONNECT_CONCURRENCY && *next < count)
+        {
+            Peer_State *state = &states[active];
+            if (peer_state_init(state, &peers[(*next)++], torrent->file->num_pieces) != PEER_SUCCESS)
+                continue;
+
+            if (peer_start_connect(state, peer_now()) != PEER_SUCCESS)
+            {
+                peer_state_free(state);
+                continue;
+            }
+
+            struct epoll_event event = {
+                .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                .data.fd = state->socket,
+            };
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, state->socket, &event) < 0)
+            {
+                peer_state_free(state);
+                continue;
+            }
+            active++;
+        }
+
+        if (active == ready)
+            break;
+
+        // sleep no longer than the nearest deadline.
+        double now = peer_now();
+        double wake = now + 1;
+        for (size_t i = ready; i < active; i++)
+        {
+            if (states[i].deadline < wake)
+                wake = states[i].deadline;
+        }
+        int timeout = wake > now ? (int)((wake - now) * 1000) + 1 : 0;
+
+        int n = epoll_wait(epoll_fd, events, PEER_CONNECT_CONCURRENCY, timeout);
+        if (n < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "ERR: failed to wait for peer events\n");
+            break;
+        }
+
+        now = peer_now();
+        for (int e = 0; e < n; e++)
+        {
+            size_t i = ready;
+            while (i < active && states[i].socket != events[e].data.fd)
+                i++;
+            if (i == active)
+                continue;
+
+            int result = peer_advance_handshake(&states[i], torrent, events[e].events, now);
+            if (result == PEER_SUCCESS)
+            {
+                Peer_State done = states[i];
+                states[i] = states[ready];
+                states[ready++] = done;
+            }
+            else if (result != PEER_INCOMPLETE)
+            {
+                peer_state_free(&states[i]);
+                states[i] = states[--active];
+            }
+        }
+
+        for (size_t i = ready; i < active; i++)
+        {
+            if (peer_stage_expired(&states[i], now))
+            {
+                metrics_count(METRIC_CONNECT_FAILURES, 1);
+                peer_state_free(&states[i]);
+                states[i--] = states[--active];
+            }
+        }
+    }
+
+    // the sockets leave this loop's epoll with it, the caller registers them with its own.
+    close(epoll_fd);
+    *started = active;
+    return ready;
+}
+
+int peer_state_init(Peer_State *state, Peer *peer, size_t num_pieces)
+{
+    state->peer_info = peer;
+    state->socket = -1;
+    state->connected = false;
+    state->am_choking = true;
+    state->am_interested = false;
+    state->peer_choking = true;
+    state->peer_interested = false;
+    state->phase = PEER_CONNECTING;
+    state->in = (PeerBuffer){ 0 };
+    state->out = (PeerRing){ 0 };
+    state->sink = (PeerSink){ 0 };
+    state->upload = (PeerUpload){ .fd = -1 };
+    state->deadline = 0;
+
+    if (bitfield_init(&state->pieces, num_pieces) != BITFIELD_SUCCESS)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for peer pieces\n");
+        return PEER_ERR_MEMORY;
+    }
+
+    return PEER_SUCCESS;
+}
+
+void peer_state_free(Peer_State *state)
+{
+    if (state->socket >= 0)
+    {
+        close(state->socket);
+        state->socket = -1;
+    }
+    state->connected = false;
+    state->phase = PEER_CLOSED;
+    bitfield_free(&state->pieces);
+    peer_buffer_free(&state->in);
+    peer_ring_free(&state->out);
+}
+
+int peer_state_apply(Peer_State *state, PeerMessage *msg)
+{
+    if (msg->keep_alive)
+        return PEER_SUCCESS;
+
+    BString *payload = msg->payload;
+    switch (msg->id)
+    {
+        case CHOKE:
+            state->peer_choking = true;
+            break;
+
+        case UNCHOKE:
+            state->peer_choking = false;
+            break;
+
+        case INTERESTED:
+            state->peer_interested = true;
+            break;
+
+        case NOT_INTERESTED:
+            state->peer_interested = false;
+            break;
+
+        case HAVE:
+        {
+            if (payload->size != 4)
+                return PEER_ERR_PROTOCOL;
+
+            uint32_t index = peer_read_u32(payload->chars);
+            if (index >= state->pieces.bits)
+                return PEER_ERR_PROTOCOL;
+
+            bitfield_set(&state->pieces, index);
+            break;
+        }
+
+        case BITFIELD:
+        {
+            if (payload->size != BITFIELD_BYTES(state->pieces.bits))
+                return PEER_ERR_PROTOCOL;
+
+            memcpy(state->pieces.bytes, payload->chars, payload->size);
+            // spare bits at the end must be clear, mask them in case the peer set them anyway.
+            if (state->pieces.bits % 8 != 0)
+                state->pieces.bytes[payload->size - 1] &= 0xff << (8 - state->pieces.bits % 8);
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    return PEER_SUCCESS;
+}
+
+void peer_pipeline_init(PeerPipeline *pipeline, double now)
+{
+    pipeline->depth = PEER_INITIAL_QUEUE_DEPTH;
+    pipeline->rtt = 0;
+    pipeline->rate = 0;
+    pipeline->window_start = now;
+    pipeline->window_bytes = 0;
+}
+
+void peer_pipeline_sample(PeerPipeline *pipeline, double now, double rtt, size_t bytes)
+{
+    // requests queue up behind each other at the peer, so only the fastest round trip is the link's latency.
+    if (pipeline->rtt == 0 || rtt < pipeline->rtt)
+        pipeline->rtt = rtt;
+
+    pipeline->window_bytes += bytes;
+    double elapsed = now - pipeline->window_start;
+    double window = pipeline->rtt > PEER_RATE_MIN_WINDOW ? pipeline->rtt : PEER_RATE_MIN_WINDOW;
+    if (elapsed < window)
+        return;
+
+    double rate = pipeline->window_bytes / elapsed;
+    pipeline->rate = pipeline->rate == 0 ? rate : (pipeline->rate + rate) / 2;
+    pipeline->window_start = now;
+    pipeline->window_bytes = 0;
+
+    // rounding down and adding two is rounding up plus one spare request.
+    double depth = (size_t)(PEER_QUEUE_GROWTH * pipeline->rate * pipeline->rtt / DEFAULT_BLOCK_SIZE) + 2;
+    if (depth < PEER_MIN_QUEUE_DEPTH)
+        depth = PEER_MIN_QUEUE_DEPTH;
+    if (depth > PEER_MAX_QUEUE_DEPTH)
+        depth = PEER_MAX_QUEUE_DEPTH;
+    pipeline->depth = depth;
+}
+
+double peer_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -0,0 +1,331 @@
+#ifndef PEER_H
+#define PEER_H
+
+/**
+ * @file peer.h
+ * @brief Header file for the peer wire protocol messages in C.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "bstring.h"
+#include "network.h"
+#include "torrent.h"
+
+// the largest message accepted from a peer, a PIECE message carrying a full block plus some headroom.
+#define PEER_MAX_MESSAGE_LENGTH (1 << 20)
+
+// the size of the index/begin/length header of REQUEST and CANCEL, and the index/begin header of PIECE.
+#define PEER_REQUEST_LENGTH 12
+#define PEER_PIECE_HEADER_LENGTH 8
+
+// the length prefix, id and index/begin header in front of a block payload. it is all a sink
+// reads into the input buffer behind the payload, so back to back blocks all land in place.
+#define PEER_PIECE_PREFIX_LENGTH (4 + 1 + PEER_PIECE_HEADER_LENGTH)
+
+// the bounds of the number of block requests kept in flight to a single peer.
+#define PEER_MIN_QUEUE_DEPTH 2
+#define PEER_INITIAL_QUEUE_DEPTH 4
+#define PEER_MAX_QUEUE_DEPTH 128
+
+// how much larger than the measured bandwidth-delay product the queue is allowed to grow,
+// the slack is what lets the queue grow while the link is still latency bound.
+#define PEER_QUEUE_GROWTH 1.5
+
+// the shortest window, in seconds, the download rate of a peer is measured over.
+#define PEER_RATE_MIN_WINDOW 0.02
+
+// the length of a handshake, see Peer_Header_BitTorrent.
+#define PEER_HANDSHAKE_LENGTH 68
+
+// the smallest read into a peer's input buffer.
+#define PEER_BUFFER_MIN_READ 16384
+
+// how long each stage of opening a connection may take, in seconds.
+#define PEER_CONNECT_TIMEOUT 5
+#define PEER_HANDSHAKE_TIMEOUT 10
+
+// the number of connections that may be connecting or handshaking at the same time.
+#define PEER_CONNECT_CONCURRENCY 32
+
+#define PEER_INCOMPLETE 1
+#define PEER_SUCCESS 0
+#define PEER_ERR_IO -1
+#define PEER_ERR_PROTOCOL -2
+#define PEER_ERR_MEMORY -3
+
+// a message received from a peer.
+typedef struct {
+    bool keep_alive;    // a zero length message, it has no id or payload.
+    PeerMessageId id;   // the id of the message.
+    BString *payload;   // the payload after the id, a view into the input buffer of the peer.
+} PeerMessage;
+
+// how many block requests to keep in flight to a peer, sized to its bandwidth-delay product.
+typedef struct {
+    size_t depth;           // the number of requests to keep in flight.
+    double rtt;             // the shortest round trip seen between a request and its block, in seconds. 0 until measured.
+    double rate;            // the smoothed download rate, in bytes per second. 0 until measured.
+    double window_start;    // when the current rate measurement window started.
+    size_t window_bytes;    // the bytes received in the current window.
+} PeerPipeline;
+
+/**
+ * @brief Initialize a message to parse into.
+ * @param msg The message to initialize
+ * @return int PEER_SUCCESS, or PEER_ERR_MEMORY if the payload view could not be allocated
+*/
+int peer_message_init(PeerMessage *msg);
+
+/**
+ * @brief Free the memory allocated for a message's payload view.
+ * @param msg The message to free
+ * @return void
+*/
+void peer_message_free(PeerMessage *msg);
+
+/**
+ * @brief Queue a handshake for a torrent on a peer's output buffer.
+ * @param state The state of the peer
+ * @param torrent The torrent to handshake for
+ * @param peer_id The peer id of the client
+ * @return int PEER_SUCCESS, or PEER_ERR_MEMORY if the buffer could not grow
+*/
+int peer_queue_handshake(Peer_State *state, Torrent *torrent, const unsigned char *peer_id);
+
+/**
+ * @brief Queue a length prefixed message on a peer's output buffer, peer_flush sends it.
+ * @param state The state of the peer
+ * @param id The id of the message
+ * @param payload The payload after the id, may be NULL if n is 0
+ * @param n The length of the payload
+ * @return int PEER_SUCCESS, or PEER_ERR_MEMORY if the buffer could not grow
+*/
+int peer_queue_message(Peer_State *state, PeerMessageId id, const unsigned char *payload, size_t n);
+
+/**
+ * @brief Queue a REQUEST (or CANCEL) for a block on a peer's output buffer.
+ * @param state The state of the peer
+ * @param id REQUEST or CANCEL
+ * @param index The index of the piece
+ * @param begin The offset of the block in the piece
+ * @param length The length of the block
+ * @return int PEER_SUCCESS, or PEER_ERR_MEMORY if the buffer could not grow
+*/
+int peer_queue_request(Peer_State *state, PeerMessageId id, uint32_t index, uint32_t begin, uint32_t length);
+
+/**
+ * @brief Queue a PIECE message whose payload is sent from a file by peer_flush, with sendfile.
+ * Only its header goes on the output buffer, messages queued after it follow the payload.
+ * Only one payload can be queued at a time, see peer_upload_idle.
+ * @param state The state of the peer
+ * @param fd The file to send the payload from, it must stay open until the payload is sent
+ * @param offset Where the payload is in the file
+ * @param index The index of the piece
+ * @param begin The offset of the block in the piece
+ * @param length The length of the block
+ * @return int PEER_SUCCESS, or PEER_ERR_MEMORY if the buffer could not grow
+*/
+int peer_queue_block(Peer_State *state, int fd, off_t offset, uint32_t index, uint32_t begin, uint32_t length);
+
+/**
+ * @brief Whether the payload queued with peer_queue_block is sent, so another one can be queued.
+ * @param state The state of the peer
+ * @return bool whether no payload is waiting to be sent
+*/
+bool peer_upload_idle(Peer_State *state);
+
+/**
+ * @brief Send as much of a peer's output buffer, and of the payload queued with peer_queue_block, as the non-blocking socket takes.
+ * However many messages are queued, they are sent with a single vectored write, so callers queue
+ * what they have and flush once.
+ * @param state The state of the peer
+ * @return int PEER_SUCCESS (even if some bytes are left for later), or PEER_ERR_IO if the connection failed
+*/
+int peer_flush(Peer_State *state);
+
+/**
+ * @brief Read everything the non-blocking socket has into a peer's input buffer.
+ * The socket is drained, as an edge triggered poller will not report the same bytes twice.
+ * @param state The state of the peer
+ * @return int PEER_SUCCESS, PEER_ERR_IO if the connection failed or closed, or PEER_ERR_MEMORY
+*/
+int peer_receive(Peer_State *state);
+
+/**
+ * @brief Read once from the non-blocking socket into a peer's input buffer, so the caller can look
+ * at what arrived before more is read. The caller keeps reading until PEER_INCOMPLETE.
+ * @param state The state of the peer
+ * @param expect_block Whether a block is expected next. While less than PEER_PIECE_PREFIX_LENGTH
+ * bytes are buffered only that many are read, leaving the payload behind for peer_sink_receive
+ * @return int PEER_SUCCESS if bytes were read, PEER_INCOMPLETE if the socket would block,
+ * PEER_ERR_IO if the connection failed or closed, or PEER_ERR_MEMORY
+*/
+int peer_receive_some(Peer_State *state, bool expect_block);
+
+/**
+ * @brief Look at the header of a PIECE message at the front of the input buffer whose payload has
+ * not fully arrived, without taking it off the buffer.
+ * @param state The state of the peer
+ * @param index Set to the index of the piece
+ * @param begin Set to the offset of the block in the piece
+ * @param length Set to the size of the payload
+ * @return int PEER_SUCCESS, or PEER_INCOMPLETE if the buffer does not start with such a message
+*/
+int peer_peek_piece(Peer_State *state, uint32_t *index, uint32_t *begin, size_t *length);
+
+/**
+ * @brief Take the PIECE message seen by peer_peek_piece off the input buffer and receive the rest of
+ * its payload straight into a destination with peer_sink_receive. The part of the payload that
+ * already is in the buffer is copied over.
+ * @param state The state of the peer
+ * @param data Where the payload goes, room for its full length. NULL to throw the payload away
+ * @return void
+*/
+void peer_sink_start(Peer_State *state, unsigned char *data);
+
+/**
+ * @brief Throw away the rest of the payload being received, instead of writing it to its destination.
+ * @param state The state of the peer
+ * @return void
+*/
+void peer_sink_discard(Peer_State *state);
+
+/**
+ * @brief Receive the rest of a payload into its destination. Each read also takes up to
+ * PEER_PIECE_PREFIX_LENGTH bytes of what follows into the input buffer, in the same system call.
+ * Once it returns PEER_SUCCESS the sink is idle again, its index, begin and received still describe the block.
+ * @param state The state of the peer
+ * @return int PEER_SUCCESS once the payload is complete, PEER_INCOMPLETE if the socket would block,
+ * PEER_ERR_IO if the connection failed or closed, or PEER_ERR_MEMORY
+*/
+int peer_sink_receive(Peer_State *state);
+
+/**
+ * @brief Take the peer's handshake off its input buffer once it has fully arrived.
+ * @param state The state of the peer
+ * @param info_hash The info hash the peer must answer with
+ * @return int PEER_SUCCESS, PEER_INCOMPLETE if more bytes are needed, or PEER_ERR_PROTOCOL
+*/
+int peer_parse_handshake(Peer_State *state, const unsigned char *info_hash);
+
+/**
+ * @brief Take the next complete message off a peer's input buffer. The payload of the message
+ * points into the input buffer, it is valid until the next peer_receive.
+ * @param state The state of the peer
+ * @param msg The message to fill in
+ * @return int PEER_SUCCESS, PEER_INCOMPLETE if more bytes are needed, or PEER_ERR_PROTOCOL
+*/
+int peer_parse_message(Peer_State *state, PeerMessage *msg);
+
+/**
+ * @brief Start a non-blocking connect to the peer of a state, with a PEER_CONNECT_TIMEOUT deadline.
+ * @param state The state of the peer, as left by peer_state_init
+ * @param now The current time, from peer_now
+ * @return int PEER_SUCCESS, or PEER_ERR_IO if the connect could not be started
+*/
+int peer_start_connect(Peer_State *state, double now);
+
+/**
+ * @brief Move a connection through its connect and handshake stages after its socket turned ready.
+ * The handshake gets its own PEER_HANDSHAKE_TIMEOUT deadline once the connect completes, bytes the
+ * peer sends after its handshake are left on the input buffer.
+ * @param state The state of the peer
+ * @param torrent The torrent to handshake for
+ * @param events The epoll events of the socket, 0 if nothing new was reported
+ * @param now The current time, from peer_now
+ * @return int PEER_SUCCESS once the handshake is done, PEER_INCOMPLETE, or an error code less than 0
+*/
+int peer_advance_handshake(Peer_State *state, Torrent *torrent, uint32_t events, double now);
+
+/**
+ * @brief Whether the connect or handshake stage of a connection ran past its deadline.
+ * @param state The state of the peer
+ * @param now The current time, from peer_now
+ * @return bool whether the stage timed out
+*/
+bool peer_stage_expired(Peer_State *state, double now);
+
+/**
+ * @brief Connect and handshake with many peers at once, returning as soon as `want` of them are ready.
+ * Up to PEER_CONNECT_CONCURRENCY connections are in progress at a time, and each stage has its own
+ * deadline, so dead peers cost at most PEER_CONNECT_TIMEOUT and never hold up live ones.
+ * The ready connections come first in `states`, followed by those still in progress when the batch
+ * returned. Both are handed to the caller, who drives or frees them with peer_state_free.
+ * @param torrent The torrent to handshake for
+ * @param peers The peers to connect to
+ * @param count The number of peers
+ * @param next The index of the next peer to try, advanced past every peer the batch tried
+ * @param want The number of ready connections to return with
+ * @param states Filled with the connections, room for PEER_CONNECT_CONCURRENCY
+ * @param started Set to the number of states filled in, ready or still in progress
+ * @return size_t the number of ready connections at the start of `states`
+*/
+size_t peer_connect_batch(Torrent *torrent, Peer *peers, size_t count, size_t *next, size_t want, Peer_State *states, size_t *started);
+
+/**
+ * @brief Initialize the state of a connection to a peer. The peer starts out choked and uninterested.
+ * @param state The state to initialize
+ * @param peer The peer the state belongs to
+ * @param num_pieces The number of pieces in the torrent
+ * @return int PEER_SUCCESS, or PEER_ERR_MEMORY if the piece bit set could not be allocated
+*/
+int peer_state_init(Peer_State *state, Peer *peer, size_t num_pieces);
+
+/**
+ * @brief Free the memory held by the state of a peer, its buffers included, and close its connection if it is open.
+ * @param state The state to free
+ * @return void
+*/
+void peer_state_free(Peer_State *state);
+
+/**
+ * @brief Apply the messages that change what we know about a peer (choke state, BITFIELD, HAVE).
+ * Any other message is left to the caller.
+ * @param state The state of the peer that sent the message
+ * @param msg The message
+ * @return int PEER_SUCCESS, or PEER_ERR_PROTOCOL if the message is malformed
+*/
+int peer_state_apply(Peer_State *state, PeerMessage *msg);
+
+/**
+ * @brief Initialize a request pipeline at PEER_INITIAL_QUEUE_DEPTH.
+ * @param pipeline The pipeline to initialize
+ * @param now The current time, from peer_now
+ * @return void
+*/
+void peer_pipeline_init(PeerPipeline *pipeline, double now);
+
+/**
+ * @brief Account for a block arriving and resize the queue to the measured bandwidth-delay product.
+ * @param pipeline The pipeline
+ * @param now The current time, from peer_now
+ * @param rtt The time between requesting the block and receiving it, in seconds
+ * @param bytes The size of the block
+ * @return void
+*/
+void peer_pipeline_sample(PeerPipeline *pipeline, double now, double rtt, size_t bytes);
+
+/**
+ * @brief the current time of a monotonic clock, in seconds.
+ * @return double the current time
+*/
+double peer_now(void);
+
+/**
+ * @brief decode a big endian 32 bit integer, the byte order of every integer on the wire.
+ * @param bytes The 4 bytes to decode
+ * @return uint32_t the decoded integer
+*/
+uint32_t peer_read_u32(const unsigned char *bytes);
+
+/**
+ * @brief encode a 32 bit integer in big endian byte order.
+ * @param bytes The 4 bytes to write to
+ * @param value The integer to encode
+ * @return void
+*/
+void peer_write_u32(unsigned char *bytes, uint32_t value);
+
+#endif
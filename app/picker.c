@@ -0,0 +1,150 @@
+/**
+ * @file picker.c
+ * @brief Implementation file for choosing which piece to download next, rarest first, in C.
+*/
+#include "picker.h"
+
+/**
+ * @brief swap two positions of the order, keeping the positions of their pieces in step.
+ * @param picker The picker
+ * @param a A position
+ * @param b Another position
+ * @return void
+*/
+void picker_swap(Picker *picker, size_t a, size_t b);
+
+int picker_init(Picker *picker, size_t count, size_t max_availability)
+{
+    picker->count = count;
+    picker->max_availability = max_availability;
+    picker->order = malloc((count > 0 ? count : 1) * sizeof(size_t));
+    picker->position = malloc((count > 0 ? count : 1) * sizeof(size_t));
+    picker->availability = calloc(count > 0 ? count : 1, sizeof(size_t));
+    picker->bucket = malloc((max_availability + 2) * sizeof(size_t));
+    if (picker->order == NULL || picker->position == NULL || picker->availability == NULL ||
+        picker->bucket == NULL || bitfield_init(&picker->retired, count) != BITFIELD_SUCCESS)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for piece picker\n");
+        free(picker->order);
+        free(picker->position);
+        free(picker->availability);
+        free(picker->bucket);
+        picker->order = picker->position = picker->availability = picker->bucket = NULL;
+        return PICKER_ERR_MEMORY;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        picker->order[i] = i;
+        picker->position[i] = i;
+    }
+
+    // every piece starts out in the bucket of availability 0, the others are empty.
+    picker->bucket[0] = 0;
+    for (size_t a = 1; a <= max_availability + 1; a++)
+    {
+        picker->bucket[a] = count;
+    }
+    return PICKER_SUCCESS;
+}
+
+void picker_free(Picker *picker)
+{
+    free(picker->order);
+    free(picker->position);
+    free(picker->availability);
+    free(picker->bucket);
+    picker->order = picker->position = picker->availability = picker->bucket = NULL;
+    bitfield_free(&picker->retired);
+}
+
+void picker_swap(Picker *picker, size_t a, size_t b)
+{
+    size_t piece_a = picker->order[a];
+    size_t piece_b = picker->order[b];
+    picker->order[a] = piece_b;
+    picker->order[b] = piece_a;
+    picker->position[piece_a] = b;
+    picker->position[piece_b] = a;
+}
+
+void picker_increment(Picker *picker, size_t index)
+{
+    size_t a = picker->availability[index];
+    if (a == picker->max_availability)
+        return;
+    picker->availability[index]++;
+    if (bitfield_get(&picker->retired, index))
+        return;
+
+    // the piece becomes the first of the next bucket: it trades places with the last piece of its
+    // own bucket, then the boundary moves down over it.
+    size_t last = picker->bucket[a + 1] - 1;
+    picker_swap(picker, picker->position[index], last);
+    picker->bucket[a + 1]--;
+}
+
+void picker_decrement(Picker *picker, size_t index)
+{
+    size_t a = picker->availability[index];
+    if (a == 0)
+        return;
+    picker->availability[index]--;
+    if (bitfield_get(&picker->retired, index))
+        return;
+
+    // the mirror image: the piece trades places with the first of its bucket and the boundary moves up.
+    size_t first = picker->bucket[a];
+    picker_swap(picker, picker->position[index], first);
+    picker->bucket[a]++;
+}
+
+void picker_count_peer(Picker *picker, const Bitfield *pieces, bool has)
+{
+    for (size_t i = 0; i < pieces->bits; i++)
+    {
+        if (!bitfield_get(pieces, i))
+            continue;
+        if (has)
+            picker_increment(picker, i);
+        else
+            picker_decrement(picker, i);
+    }
+}
+
+void picker_retire(Picker *picker, size_t index)
+{
+    if (bitfield_get(&picker->retired, index))
+        return;
+
+    // walk the piece down to the bucket of availability 0 one boundary at a time, then over the
+    // boundary of the retired pieces. its real availability is put back afterwards.
+    size_t availability = picker->availability[index];
+    for (size_t a = availability; a > 0; a--)
+    {
+        picker_swap(picker, picker->position[index], picker->bucket[a]);
+        picker->bucket[a]++;
+    }
+    picker_swap(picker, picker->position[index], picker->bucket[0]);
+    picker->bucket[0]++;
+    bitfield_set(&picker->retired, index);
+}
+
+long picker_rarest(Picker *picker, const Bitfield *has, const Bitfield *skip, bool *skipped)
+{
+    *skipped = false;
+    // pieces nobody has are in bucket 0, there is no use looking at them.
+    for (size_t at = picker->bucket[1]; at < picker->count; at++)
+    {
+        size_t index = picker->order[at];
+        if (!bitfield_get(has, index))
+            continue;
+        if (bitfield_get(skip, index))
+        {
+            *skipped = true;
+            continue;
+        }
+        return index;
+    }
+    return PICKER_NO_PIECE;
+}
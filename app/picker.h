@@ -0,0 +1,95 @@
+#ifndef PICKER_H
+#define PICKER_H
+
+/**
+ * @file picker.h
+ * @brief Header file for choosing which piece to download next, rarest first, in C.
+ * The pieces are kept sorted by how many connected peers have them, in one array split into a
+ * bucket per availability. A piece moves to the next bucket by swapping with the edge of its own,
+ * so keeping the order up to date as peers come, go and announce pieces is constant time, and the
+ * rarest piece is always at the front.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "bitfield.h"
+
+#define PICKER_SUCCESS 0
+#define PICKER_ERR_MEMORY -1
+
+// what picker_rarest returns when no piece is left to pick.
+#define PICKER_NO_PIECE -1
+
+typedef struct {
+    size_t count;               // the number of pieces.
+    size_t max_availability;    // the most peers that can have a piece at once.
+    size_t *order;              // the pieces, retired first, then by availability, rarest first.
+    size_t *position;           // for each piece, where it is in order.
+    size_t *availability;       // for each piece, the number of peers that have it.
+    size_t *bucket;             // for each availability, where its pieces start in order. bucket[0] is
+                                // the number of retired pieces, bucket[max_availability + 1] is count.
+    Bitfield retired;           // the pieces that are no longer picked.
+} Picker;
+
+/**
+ * @brief Initialize a picker where no peer has any piece yet.
+ * @param picker The picker
+ * @param count The number of pieces
+ * @param max_availability The most peers that can have a piece at once
+ * @return int PICKER_SUCCESS, or PICKER_ERR_MEMORY
+*/
+int picker_init(Picker *picker, size_t count, size_t max_availability);
+
+/**
+ * @brief Free the memory of a picker.
+ * @param picker The picker
+ * @return void
+*/
+void picker_free(Picker *picker);
+
+/**
+ * @brief Count one more peer as having a piece, in constant time.
+ * @param picker The picker
+ * @param index The index of the piece
+ * @return void
+*/
+void picker_increment(Picker *picker, size_t index);
+
+/**
+ * @brief Count one less peer as having a piece, in constant time.
+ * @param picker The picker
+ * @param index The index of the piece
+ * @return void
+*/
+void picker_decrement(Picker *picker, size_t index);
+
+/**
+ * @brief Count a peer's pieces in or out of the availability, e.g. when its bitfield arrives or it disconnects.
+ * @param picker The picker
+ * @param pieces The pieces the peer has
+ * @param has Whether the peer is counted in, or out
+ * @return void
+*/
+void picker_count_peer(Picker *picker, const Bitfield *pieces, bool has);
+
+/**
+ * @brief Stop picking a piece for good, e.g. once it is verified or if it is not wanted.
+ * Its availability is still counted.
+ * @param picker The picker
+ * @param index The index of the piece
+ * @return void
+*/
+void picker_retire(Picker *picker, size_t index);
+
+/**
+ * @brief Find the rarest piece a peer has, that is not retired or skipped. The rarest piece
+ * overall is found in constant time, the scan only goes on past pieces the peer lacks or that are skipped.
+ * @param picker The picker
+ * @param has The pieces the peer has
+ * @param skip The pieces to pass over, e.g. the ones already being downloaded
+ * @param skipped Set to whether the peer has a piece that was only passed over because it is skipped
+ * @return long the index of the piece, or PICKER_NO_PIECE
+*/
+long picker_rarest(Picker *picker, const Bitfield *has, const Bitfield *skip, bool *skipped);
+
+#endif
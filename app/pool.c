@@ -0,0 +1,97 @@
+/**
+ * @file pool.c
+ * @brief Implementation file for a pool of fixed size objects in C.
+ */
+
+#include "pool.h"
+
+/**
+ * @brief allocate a slab of objects and put all of them on the free list.
+ * @param pool The pool
+ * @param items The number of objects in the slab
+ * @return int POOL_SUCCESS, or POOL_ERR_MEMORY
+ */
+int pool_add_slab(Pool *pool, size_t items);
+
+void pool_init(Pool *pool, size_t item_size)
+{
+    // every object must hold the free list link and keep the next one aligned.
+    size_t align = _Alignof(max_align_t);
+    if (item_size < sizeof(PoolItem))
+        item_size = sizeof(PoolItem);
+    pool->item_size = (item_size + align - 1) / align * align;
+    pool->slabs = NULL;
+    pool->free = NULL;
+    pool->capacity = 0;
+    pool->in_use = 0;
+    pool->high_water = 0;
+}
+
+int pool_add_slab(Pool *pool, size_t items)
+{
+    PoolSlab *slab = malloc(sizeof(PoolSlab) + items * pool->item_size);
+    if (slab == NULL)
+        return POOL_ERR_MEMORY;
+
+    slab->items = items;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    // pushed back to front so objects are handed out in address order.
+    for (size_t i = items; i > 0; i--)
+    {
+        PoolItem *item = (PoolItem *)(slab->data + (i - 1) * pool->item_size);
+        item->next = pool->free;
+        pool->free = item;
+    }
+    pool->capacity += items;
+    return POOL_SUCCESS;
+}
+
+int pool_reserve(Pool *pool, size_t count)
+{
+    if (count <= pool->capacity)
+        return POOL_SUCCESS;
+    return pool_add_slab(pool, count - pool->capacity);
+}
+
+void *pool_get(Pool *pool)
+{
+    if (pool->free == NULL)
+    {
+        size_t items = pool->capacity < POOL_MIN_SLAB_ITEMS ? POOL_MIN_SLAB_ITEMS : pool->capacity;
+        if (pool_add_slab(pool, items) != POOL_SUCCESS)
+            return NULL;
+    }
+
+    PoolItem *item = pool->free;
+    pool->free = item->next;
+    pool->in_use++;
+    if (pool->in_use > pool->high_water)
+        pool->high_water = pool->in_use;
+    return item;
+}
+
+void pool_put(Pool *pool, void *item)
+{
+    PoolItem *free_item = item;
+    free_item->next = pool->free;
+    pool->free = free_item;
+    pool->in_use--;
+}
+
+void pool_free(Pool *pool)
+{
+    PoolSlab *slab = pool->slabs;
+    while (slab != NULL)
+    {
+        PoolSlab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    pool->slabs = NULL;
+    pool->free = NULL;
+    pool->capacity = 0;
+    pool->in_use = 0;
+    pool->high_water = 0;
+}
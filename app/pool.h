@@ -0,0 +1,86 @@
+/**
+ * @file pool.h
+ * @brief Header file for a pool of fixed size objects in C. Objects are carved out of large slabs and
+ * recycled through a free list, so taking one and giving it back never touches the heap once the
+ * pool has grown to its working size.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+#include <stddef.h>
+
+#define POOL_SUCCESS 0
+#define POOL_ERR_MEMORY -1
+
+// the fewest objects a slab is made of.
+#define POOL_MIN_SLAB_ITEMS 16
+
+// a slab of objects taken from the heap in one go, they are only given back when the pool is freed.
+typedef struct PoolSlab
+{
+    struct PoolSlab *next;
+    size_t items;
+    _Alignas(max_align_t) unsigned char data[];
+} PoolSlab;
+
+// a free object, the link lives in the object itself.
+typedef struct PoolItem
+{
+    struct PoolItem *next;
+} PoolItem;
+
+typedef struct
+{
+    size_t item_size;   // the size of every object, rounded up so each one is suitably aligned for any type.
+    PoolSlab *slabs;    // every slab of the pool.
+    PoolItem *free;     // the objects that are not handed out.
+    size_t capacity;    // the number of objects in all slabs.
+    size_t in_use;      // the number of objects handed out.
+    size_t high_water;  // the most objects ever handed out at once, what the pool should be reserved to.
+} Pool;
+
+/**
+ * @brief Initialize an empty pool, nothing is allocated until objects are reserved or taken.
+ *
+ * @param pool The pool to initialize
+ * @param item_size The size of every object
+ */
+void pool_init(Pool *pool, size_t item_size);
+
+/**
+ * @brief Grow a pool so at least count objects can be handed out at once without it growing again.
+ *
+ * @param pool The pool
+ * @param count The number of objects
+ * @return int POOL_SUCCESS, or POOL_ERR_MEMORY if a slab could not be allocated
+ */
+int pool_reserve(Pool *pool, size_t count);
+
+/**
+ * @brief Take an object from a pool in constant time. An exhausted pool grows by a slab as large
+ * as everything it has so far, so growing is rare and amortized. The object is not cleared.
+ *
+ * @param pool The pool
+ * @return void* The object, or NULL if the pool could not grow
+ */
+void *pool_get(Pool *pool);
+
+/**
+ * @brief Give an object back to the pool it came from, in constant time.
+ *
+ * @param pool The pool
+ * @param item The object
+ */
+void pool_put(Pool *pool, void *item);
+
+/**
+ * @brief Free every slab of a pool, objects still handed out become invalid. The pool is left empty,
+ * its high water mark too, and can be used again.
+ *
+ * @param pool The pool
+ */
+void pool_free(Pool *pool);
+
+#endif
@@ -0,0 +1,155 @@
+/**
+ * @file recheck.c
+ * @brief Implementation file for re-checking downloaded data against the piece hashes of a torrent in C.
+ * Each thread claims RECHECK_BATCH pieces at a time off a shared counter, so no thread idles while
+ * another still has a long run of pieces to go.
+*/
+#include "recheck.h"
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// the state shared by the threads of a re-check.
+typedef struct {
+    TorrentFile *file;
+    Storage *storage;
+    _Atomic size_t next;    // the first piece of the next batch to claim.
+    unsigned char *ok;      // for each piece, whether it matched. every piece is written by one thread only.
+} Recheck;
+
+/**
+ * @brief the entry point of a re-check thread, hashing batches until every piece is claimed.
+ * @param arg The Recheck
+ * @return NULL
+*/
+void *recheck_worker(void *arg);
+
+/**
+ * @brief hash a batch of consecutive pieces.
+ * @param recheck The re-check
+ * @param first The first piece of the batch
+ * @param count The number of pieces in the batch
+ * @return void
+*/
+void recheck_batch(Recheck *recheck, size_t first, size_t count);
+
+size_t torrent_recheck(TorrentFile *file, Storage *storage, Bitfield *have)
+{
+    Recheck recheck = {
+        .file = file,
+        .storage = storage,
+        .ok = calloc(file->num_pieces > 0 ? file->num_pieces : 1, 1),
+    };
+    atomic_init(&recheck.next, 0);
+    if (recheck.ok == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for recheck\n");
+        return 0;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t wanted = cores > 1 ? cores : 1;
+    if (wanted > RECHECK_MAX_THREADS)
+        wanted = RECHECK_MAX_THREADS;
+
+    // the calling thread works too, the others help it.
+    pthread_t threads[RECHECK_MAX_THREADS];
+    size_t started = 0;
+    while (started + 1 < wanted && pthread_create(&threads[started], NULL, recheck_worker, &recheck) == 0)
+    {
+        started++;
+    }
+    recheck_worker(&recheck);
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    size_t passed = 0;
+    bitfield_clear_all(have);
+    for (size_t i = 0; i < file->num_pieces; i++)
+    {
+        if (recheck.ok[i])
+        {
+            bitfield_set(have, i);
+            passed++;
+        }
+    }
+
+    free(recheck.ok);
+    return passed;
+}
+
+void *recheck_worker(void *arg)
+{
+    Recheck *recheck = arg;
+    size_t num_pieces = recheck->file->num_pieces;
+    while (true)
+    {
+        size_t first = atomic_fetch_add(&recheck->next, RECHECK_BATCH);
+        if (first >= num_pieces)
+            break;
+
+        size_t count = num_pieces - first < RECHECK_BATCH ? num_pieces - first : RECHECK_BATCH;
+        recheck_batch(recheck, first, count);
+    }
+    return NULL;
+}
+
+void recheck_batch(Recheck *recheck, size_t first, size_t count)
+{
+    TorrentFile *file = recheck->file;
+    const unsigned char *data[RECHECK_BATCH];
+    unsigned char *copies[RECHECK_BATCH];
+    size_t indexes[RECHECK_BATCH];
+    size_t full = 0;
+    size_t copied = 0;
+
+    for (size_t i = first; i < first + count; i++)
+    {
+        off_t offset = (off_t)i * file->piece_length;
+        size_t piece_size = torrent_file_piece_size(file, i);
+
+        // a piece that runs across files is hashed from a copy, there is no one mapping that holds
+        // all of it. without room for the copy the piece fails rather than being trusted.
+        const unsigned char *piece = storage_view(recheck->storage, offset, piece_size);
+        if (piece == NULL)
+        {
+            unsigned char *copy = malloc(piece_size);
+            if (copy == NULL)
+                continue;
+            storage_read(recheck->storage, offset, copy, piece_size);
+            copies[copied++] = copy;
+            piece = copy;
+        }
+
+        // only full length pieces can share the kernel, the short last piece is hashed on its own.
+        if (piece_size != file->piece_length)
+        {
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            SHA1(piece, piece_size, hash);
+            recheck->ok[i] = memcmp(hash, torrent_file_piece_hash(file, i), SHA_DIGEST_LENGTH) == 0;
+            continue;
+        }
+
+        data[full] = piece;
+        indexes[full] = i;
+        full++;
+    }
+
+    if (full > 0)
+    {
+        unsigned char digests[RECHECK_BATCH][SHA_DIGEST_LENGTH];
+        sha1_mb_hash(data, file->piece_length, full, digests);
+        for (size_t i = 0; i < full; i++)
+        {
+            recheck->ok[indexes[i]] = memcmp(digests[i], torrent_file_piece_hash(file, indexes[i]), SHA_DIGEST_LENGTH) == 0;
+        }
+    }
+
+    for (size_t i = 0; i < copied; i++)
+    {
+        free(copies[i]);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef RECHECK_H
+#define RECHECK_H
+
+/**
+ * @file recheck.h
+ * @brief Header file for re-checking downloaded data against the piece hashes of a torrent in C.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "torrent.h"
+#include "bitfield.h"
+#include "sha1_mb.h"
+#include "storage.h"
+
+// the most threads a re-check hashes on, whatever the number of cores.
+#define RECHECK_MAX_THREADS 64
+
+// the number of pieces a thread takes at a time, one per lane of the multi-buffer kernel.
+#define RECHECK_BATCH SHA1_MB_LANES
+
+/**
+ * @brief Hash every piece of the data against the torrent's piece hashes, on every core and with
+ * the fastest SHA1 the CPU supports (see sha1_mb.h). Pieces that run across files are copied out of
+ * the storage first, see storage_read.
+ * @param file The torrent file description
+ * @param storage The downloaded data, every file at the size the torrent gives it
+ * @param have Set for every piece that matches its hash, it must hold num_pieces bits
+ * @return size_t the number of pieces that match
+*/
+size_t torrent_recheck(TorrentFile *file, Storage *storage, Bitfield *have);
+
+#endif
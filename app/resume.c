@@ -0,0 +1,393 @@
+/**
+ * @file resume.c
+ * @brief Implementation file for remembering what a download has across restarts in C.
+ * The resume file is, with every number big endian:
+ * the magic, the version (4 bytes), the info hash, the number of pieces, the piece length and the
+ * number of files (8 bytes each), a stamp for each file (its size and the seconds of its
+ * modification time in 8 bytes each, the nanoseconds in 4), the bitfield of the pieces had, the
+ * number of half downloaded pieces (8 bytes) and for each its index (8 bytes) and the bitfield of
+ * its blocks, and last the SHA1 of everything before it.
+*/
+#include "resume.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include "fileio.h"
+
+// the bytes of a file stamp in the resume file.
+#define RESUME_STAMP_LENGTH 20
+
+// the bytes of the resume file before the stamps.
+#define RESUME_HEADER_LENGTH (RESUME_MAGIC_LENGTH + 4 + SHA_DIGEST_LENGTH + 3 * 8)
+
+/**
+ * @brief the number of blocks in a piece.
+ * @param file The torrent file description
+ * @param index The index of the piece
+ * @return size_t the number of blocks
+*/
+size_t resume_block_count(const TorrentFile *file, size_t index);
+
+/**
+ * @brief write a number big endian.
+ * @param out Where to write
+ * @param value The number
+ * @param bytes The size of the number, 4 or 8
+ * @return unsigned char* past what was written
+*/
+unsigned char *resume_put(unsigned char *out, uint64_t value, size_t bytes);
+
+/**
+ * @brief read a big endian number.
+ * @param in Where to read
+ * @param bytes The size of the number, 4 or 8
+ * @return uint64_t the number
+*/
+uint64_t resume_get(const unsigned char *in, size_t bytes);
+
+/**
+ * @brief parse a resume file whose checksum matched.
+ * @param data The contents, without the checksum
+ * @param size The size of the contents
+ * @param torrent The torrent the file must be of
+ * @param state The state to fill
+ * @return int RESUME_SUCCESS, RESUME_ERR_INVALID or RESUME_ERR_MEMORY
+*/
+int resume_parse(const unsigned char *data, size_t size, const Torrent *torrent, ResumeState *state);
+
+/**
+ * @brief write a buffer to a file, until all of it is written.
+ * @param fd The file
+ * @param data The buffer
+ * @param size The size of the buffer
+ * @return int 0, or -1 on error
+*/
+int resume_write_all(int fd, const unsigned char *data, size_t size);
+
+/**
+ * @brief sync the directory a file is in, so a rename into it is on disk.
+ * @param path The path of the file
+ * @return void
+*/
+void resume_sync_directory(const char *path);
+
+int resume_init(ResumeState *state, const TorrentFile *file)
+{
+    state->stamp_count = file->file_count;
+    state->stamps = calloc(file->file_count > 0 ? file->file_count : 1, sizeof(ResumeStamp));
+    state->partials = NULL;
+    state->partial_count = 0;
+    state->partial_capacity = 0;
+    if (state->stamps == NULL || bitfield_init(&state->have, file->num_pieces) != BITFIELD_SUCCESS)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for resume state\n");
+        free(state->stamps);
+        state->stamps = NULL;
+        return RESUME_ERR_MEMORY;
+    }
+    return RESUME_SUCCESS;
+}
+
+void resume_free(ResumeState *state)
+{
+    resume_clear(state);
+    free(state->partials);
+    free(state->stamps);
+    bitfield_free(&state->have);
+    state->partials = NULL;
+    state->partial_capacity = 0;
+    state->stamps = NULL;
+}
+
+void resume_clear(ResumeState *state)
+{
+    for (size_t i = 0; i < state->partial_count; i++)
+    {
+        bitfield_free(&state->partials[i].received);
+    }
+    state->partial_count = 0;
+    bitfield_clear_all(&state->have);
+    memset(state->stamps, 0, state->stamp_count * sizeof(ResumeStamp));
+}
+
+int resume_add_partial(ResumeState *state, size_t index, const Bitfield *received)
+{
+    if (state->partial_count == state->partial_capacity)
+    {
+        size_t capacity = state->partial_capacity > 0 ? state->partial_capacity * 2 : 16;
+        ResumePartial *partials = realloc(state->partials, capacity * sizeof(ResumePartial));
+        if (partials == NULL)
+        {
+            fprintf(stderr, "ERR: failed to allocate memory for resume state\n");
+            return RESUME_ERR_MEMORY;
+        }
+        state->partials = partials;
+        state->partial_capacity = capacity;
+    }
+
+    ResumePartial *partial = &state->partials[state->partial_count];
+    if (bitfield_init(&partial->received, received->bits) != BITFIELD_SUCCESS)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for resume state\n");
+        return RESUME_ERR_MEMORY;
+    }
+    memcpy(partial->received.bytes, received->bytes, BITFIELD_BYTES(received->bits));
+    partial->index = index;
+    state->partial_count++;
+    return RESUME_SUCCESS;
+}
+
+bool resume_take_partial(ResumeState *state, size_t index, Bitfield *received)
+{
+    // only the pieces in flight when the file was saved are here, a scan is cheap.
+    for (size_t i = 0; i < state->partial_count; i++)
+    {
+        if (state->partials[i].index != index)
+            continue;
+        *received = state->partials[i].received;
+        state->partials[i] = state->partials[--state->partial_count];
+        return true;
+    }
+    return false;
+}
+
+void resume_stamp(ResumeStamp *stamp, const struct stat *st)
+{
+    stamp->size = st->st_size;
+    stamp->mtime_sec = st->st_mtim.tv_sec;
+    stamp->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+bool resume_stamp_matches(const ResumeStamp *stamp, const struct stat *st)
+{
+    return stamp->size == (uint64_t)st->st_size && stamp->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+           stamp->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec;
+}
+
+size_t resume_block_count(const TorrentFile *file, size_t index)
+{
+    size_t size = torrent_file_piece_size((TorrentFile *)file, index);
+    return size / DEFAULT_BLOCK_SIZE + (size % DEFAULT_BLOCK_SIZE != 0);
+}
+
+unsigned char *resume_put(unsigned char *out, uint64_t value, size_t bytes)
+{
+    for (size_t i = bytes; i > 0; i--)
+    {
+        out[i - 1] = value & 0xff;
+        value >>= 8;
+    }
+    return out + bytes;
+}
+
+uint64_t resume_get(const unsigned char *in, size_t bytes)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++)
+    {
+        value = value << 8 | in[i];
+    }
+    return value;
+}
+
+int resume_load(const char *path, const Torrent *torrent, ResumeState *state)
+{
+    resume_clear(state);
+    // a download that never saved one is the common case, not worth a message.
+    if (access(path, F_OK) != 0)
+        return RESUME_ERR_IO;
+    FILE_CONTENT content = map_file(path);
+    if (content.content == NULL)
+        return RESUME_ERR_IO;
+
+    const unsigned char *data = (const unsigned char *)content.content;
+    unsigned char checksum[SHA_DIGEST_LENGTH];
+    int result = RESUME_ERR_INVALID;
+    if (content.size > SHA_DIGEST_LENGTH)
+    {
+        size_t size = content.size - SHA_DIGEST_LENGTH;
+        SHA1(data, size, checksum);
+        if (memcmp(checksum, data + size, SHA_DIGEST_LENGTH) == 0)
+            result = resume_parse(data, size, torrent, state);
+    }
+    unmap_file(&content);
+
+    if (result == RESUME_ERR_INVALID)
+        fprintf(stderr, "ERR: ignoring resume file at %s, it is damaged or of another torrent\n", path);
+    if (result != RESUME_SUCCESS)
+        resume_clear(state);
+    return result;
+}
+
+int resume_parse(const unsigned char *data, size_t size, const Torrent *torrent, ResumeState *state)
+{
+    const TorrentFile *file = torrent->file;
+    if (size < RESUME_HEADER_LENGTH || memcmp(data, RESUME_MAGIC, RESUME_MAGIC_LENGTH) != 0)
+        return RESUME_ERR_INVALID;
+    const unsigned char *at = data + RESUME_MAGIC_LENGTH;
+    uint64_t version = resume_get(at, 4);
+    at += 4;
+    if (version != RESUME_VERSION || memcmp(at, torrent->info_hash, SHA_DIGEST_LENGTH) != 0)
+        return RESUME_ERR_INVALID;
+    at += SHA_DIGEST_LENGTH;
+    if (resume_get(at, 8) != file->num_pieces || resume_get(at + 8, 8) != file->piece_length ||
+        resume_get(at + 16, 8) != file->file_count)
+        return RESUME_ERR_INVALID;
+    at += 24;
+
+    const unsigned char *end = data + size;
+    size_t have_size = BITFIELD_BYTES(file->num_pieces);
+    if ((size_t)(end - at) < file->file_count * RESUME_STAMP_LENGTH + have_size + 8)
+        return RESUME_ERR_INVALID;
+    for (size_t i = 0; i < file->file_count; i++)
+    {
+        ResumeStamp *stamp = &state->stamps[i];
+        stamp->size = resume_get(at, 8);
+        stamp->mtime_sec = (int64_t)resume_get(at + 8, 8);
+        stamp->mtime_nsec = (uint32_t)resume_get(at + 16, 4);
+        at += RESUME_STAMP_LENGTH;
+    }
+
+    // the spare bits of a bitfield are always 0, a file with any set is not one we wrote.
+    memcpy(state->have.bytes, at, have_size);
+    if (file->num_pieces % 8 != 0 && (at[have_size - 1] & (0xff >> file->num_pieces % 8)) != 0)
+        return RESUME_ERR_INVALID;
+    at += have_size;
+
+    uint64_t partial_count = resume_get(at, 8);
+    at += 8;
+    if (partial_count > file->num_pieces)
+        return RESUME_ERR_INVALID;
+    for (uint64_t p = 0; p < partial_count; p++)
+    {
+        if (end - at < 8)
+            return RESUME_ERR_INVALID;
+        uint64_t index = resume_get(at, 8);
+        at += 8;
+        if (index >= file->num_pieces || bitfield_get(&state->have, index))
+            return RESUME_ERR_INVALID;
+
+        size_t blocks = resume_block_count(file, index);
+        size_t blocks_size = BITFIELD_BYTES(blocks);
+        if ((size_t)(end - at) < blocks_size ||
+            (blocks % 8 != 0 && (at[blocks_size - 1] & (0xff >> blocks % 8)) != 0))
+            return RESUME_ERR_INVALID;
+        // a piece with every block in would never be requested nor hashed again.
+        Bitfield received = { .bits = blocks, .bytes = (unsigned char *)at };
+        if (bitfield_count(&received) == blocks)
+            return RESUME_ERR_INVALID;
+        if (resume_add_partial(state, index, &received) != RESUME_SUCCESS)
+            return RESUME_ERR_MEMORY;
+        at += blocks_size;
+    }
+    return at == end ? RESUME_SUCCESS : RESUME_ERR_INVALID;
+}
+
+int resume_save(const char *path, const Torrent *torrent, const ResumeState *state)
+{
+    const TorrentFile *file = torrent->file;
+    size_t size = RESUME_HEADER_LENGTH + state->stamp_count * RESUME_STAMP_LENGTH +
+                  BITFIELD_BYTES(state->have.bits) + 8 + SHA_DIGEST_LENGTH;
+    for (size_t i = 0; i < state->partial_count; i++)
+    {
+        size += 8 + BITFIELD_BYTES(state->partials[i].received.bits);
+    }
+
+    size_t path_length = strlen(path);
+    unsigned char *data = malloc(size);
+    char *temporary = malloc(path_length + sizeof(".tmp"));
+    if (data == NULL || temporary == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for resume file\n");
+        free(data);
+        free(temporary);
+        return RESUME_ERR_MEMORY;
+    }
+    memcpy(temporary, path, path_length);
+    memcpy(temporary + path_length, ".tmp", sizeof(".tmp"));
+
+    unsigned char *at = data;
+    memcpy(at, RESUME_MAGIC, RESUME_MAGIC_LENGTH);
+    at += RESUME_MAGIC_LENGTH;
+    at = resume_put(at, RESUME_VERSION, 4);
+    memcpy(at, torrent->info_hash, SHA_DIGEST_LENGTH);
+    at += SHA_DIGEST_LENGTH;
+    at = resume_put(at, file->num_pieces, 8);
+    at = resume_put(at, file->piece_length, 8);
+    at = resume_put(at, state->stamp_count, 8);
+    for (size_t i = 0; i < state->stamp_count; i++)
+    {
+        const ResumeStamp *stamp = &state->stamps[i];
+        at = resume_put(at, stamp->size, 8);
+        at = resume_put(at, (uint64_t)stamp->mtime_sec, 8);
+        at = resume_put(at, stamp->mtime_nsec, 4);
+    }
+    memcpy(at, state->have.bytes, BITFIELD_BYTES(state->have.bits));
+    at += BITFIELD_BYTES(state->have.bits);
+    at = resume_put(at, state->partial_count, 8);
+    for (size_t i = 0; i < state->partial_count; i++)
+    {
+        const ResumePartial *partial = &state->partials[i];
+        at = resume_put(at, partial->index, 8);
+        memcpy(at, partial->received.bytes, BITFIELD_BYTES(partial->received.bits));
+        at += BITFIELD_BYTES(partial->received.bits);
+    }
+    SHA1(data, at - data, at);
+
+    // the new file is complete and on disk before it takes the place of the old one, so whatever
+    // is at the path is always a whole resume file.
+    int result = RESUME_SUCCESS;
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || resume_write_all(fd, data, size) != 0 || fsync(fd) != 0)
+        result = RESUME_ERR_IO;
+    if (fd >= 0 && close(fd) != 0)
+        result = RESUME_ERR_IO;
+    if (result == RESUME_SUCCESS && rename(temporary, path) != 0)
+        result = RESUME_ERR_IO;
+
+    if (result == RESUME_SUCCESS)
+        resume_sync_directory(path);
+    else
+    {
+        fprintf(stderr, "ERR: unable to write resume file at: %s\n", path);
+        unlink(temporary);
+    }
+    free(data);
+    free(temporary);
+    return result;
+}
+
+int resume_write_all(int fd, const unsigned char *data, size_t size)
+{
+    size_t written = 0;
+    while (written < size)
+    {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+void resume_sync_directory(const char *path)
+{
+    // without it the rename may not survive a crash, which loses nothing but the newest save.
+    const char *slash = strrchr(path, '/');
+    char *directory = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : (size_t)(slash - path));
+    if (directory == NULL)
+        return;
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    free(directory);
+}
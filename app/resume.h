@@ -0,0 +1,129 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+/**
+ * @file resume.h
+ * @brief Header file for remembering what a download has across restarts in C.
+ * A resume file holds the pieces that were verified and the blocks of the pieces that were half
+ * downloaded, next to the size and modification time of every file at the moment it was saved.
+ * A file that still matches needs no hashing at all on restart, only the pieces of a file that
+ * changed since are hashed again. The resume file is replaced atomically, a crash while it is
+ * saved leaves the previous one.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "bitfield.h"
+#include "torrent.h"
+
+#define RESUME_SUCCESS 0
+#define RESUME_ERR_MEMORY -1
+#define RESUME_ERR_IO -2        // the resume file could not be read or written, e.g. there is none yet.
+#define RESUME_ERR_INVALID -3   // the resume file is damaged, or it is of another torrent.
+
+// what every resume file starts with.
+#define RESUME_MAGIC "BTRESUME"
+#define RESUME_MAGIC_LENGTH 8
+
+// the layout of the resume file, a file of another version is ignored.
+#define RESUME_VERSION 1
+
+// what a file was like when the resume file was saved.
+typedef struct {
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+} ResumeStamp;
+
+// a piece that was half downloaded, and the blocks of it that are on disk.
+typedef struct {
+    size_t index;
+    Bitfield received;  // one bit for each block of the piece.
+} ResumePartial;
+
+typedef struct {
+    Bitfield have;              // the pieces that were verified.
+    ResumeStamp *stamps;        // one for each file of the torrent.
+    size_t stamp_count;
+    ResumePartial *partials;    // the pieces that were half downloaded, in no order.
+    size_t partial_count;
+    size_t partial_capacity;
+} ResumeState;
+
+/**
+ * @brief Create an empty state for a torrent, no piece had and every stamp 0.
+ * @param state The state
+ * @param file The torrent file description
+ * @return int RESUME_SUCCESS, or RESUME_ERR_MEMORY
+*/
+int resume_init(ResumeState *state, const TorrentFile *file);
+
+/**
+ * @brief Free a state.
+ * @param state The state
+ * @return void
+*/
+void resume_free(ResumeState *state);
+
+/**
+ * @brief Forget every piece and stamp of a state, leaving it as resume_init made it.
+ * @param state The state
+ * @return void
+*/
+void resume_clear(ResumeState *state);
+
+/**
+ * @brief Remember the blocks received of a piece that is half downloaded. They are copied.
+ * @param state The state
+ * @param index The index of the piece
+ * @param received The blocks of the piece that are on disk, one bit for each
+ * @return int RESUME_SUCCESS, or RESUME_ERR_MEMORY
+*/
+int resume_add_partial(ResumeState *state, size_t index, const Bitfield *received);
+
+/**
+ * @brief Take the blocks remembered of a piece, they are forgotten by the state.
+ * @param state The state
+ * @param index The index of the piece
+ * @param received Set to the blocks, to be freed with bitfield_free
+ * @return bool true, or false if the piece was not half downloaded
+*/
+bool resume_take_partial(ResumeState *state, size_t index, Bitfield *received);
+
+/**
+ * @brief Stamp a file with its size and modification time.
+ * @param stamp The stamp
+ * @param st The file, from stat
+ * @return void
+*/
+void resume_stamp(ResumeStamp *stamp, const struct stat *st);
+
+/**
+ * @brief Tell whether a file is the same size and was not modified since it was stamped.
+ * @param stamp The stamp
+ * @param st The file, from stat
+ * @return bool true if the file matches the stamp
+*/
+bool resume_stamp_matches(const ResumeStamp *stamp, const struct stat *st);
+
+/**
+ * @brief Read a resume file, keyed by the info hash of the torrent it is for.
+ * @param path The path of the resume file
+ * @param torrent The torrent
+ * @param state The state, from resume_init. it is left empty unless this succeeds
+ * @return int RESUME_SUCCESS, RESUME_ERR_IO if there is none, RESUME_ERR_INVALID or RESUME_ERR_MEMORY
+*/
+int resume_load(const char *path, const Torrent *torrent, ResumeState *state);
+
+/**
+ * @brief Write a resume file, replacing the one at the path only once the new one is on disk.
+ * @param path The path of the resume file
+ * @param torrent The torrent
+ * @param state The state to save
+ * @return int RESUME_SUCCESS, RESUME_ERR_IO or RESUME_ERR_MEMORY
+*/
+int resume_save(const char *path, const Torrent *torrent, const ResumeState *state);
+
+#endif
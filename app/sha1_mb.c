@@ -0,0 +1,225 @@
+/**
+ * @file sha1_mb.c
+ * @brief Implementation file for hashing many equally sized buffers with SHA1 at once in C.
+ * The vector kernel is written with gcc vector extensions and compiled for AVX2 through a target
+ * attribute, so the rest of the program still runs on CPUs without it.
+*/
+#include "sha1_mb.h"
+#include <string.h>
+#include <cpuid.h>
+#include <pthread.h>
+
+// eight 32 bit lanes, one per buffer.
+typedef uint32_t Sha1Lanes __attribute__((vector_size(32)));
+
+#define SHA1_BLOCK_SIZE 64
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// the backend is picked once, by whichever thread hashes first, see sha1_mb_select.
+static Sha1MbBackend sha1_mb_selected;
+static pthread_once_t sha1_mb_selected_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief pick the fastest backend the CPU supports, for pthread_once.
+ * @return void
+*/
+void sha1_mb_select(void);
+
+/**
+ * @brief whether the CPU has the SHA extensions, CPUID leaf 7 EBX bit 29.
+ * @return bool whether SHA-NI is available
+*/
+bool sha1_mb_cpu_has_sha(void);
+
+/**
+ * @brief hash buffers with the AVX2 kernel, SHA1_MB_LANES at a time.
+ * @param data The buffers to hash
+ * @param size The size of every buffer
+ * @param count The number of buffers
+ * @param digests Filled with the SHA1 of each buffer
+ * @return void
+*/
+void sha1_mb_hash_avx2(const unsigned char *const *data, size_t size, size_t count, unsigned char (*digests)[SHA_DIGEST_LENGTH]);
+
+/**
+ * @brief run the SHA1 compression function on one 64 byte block of every lane.
+ * @param state The state of every lane
+ * @param blocks For each lane, the block to compress
+ * @return void
+*/
+void sha1_mb_avx2_compress(Sha1Lanes state[5], const unsigned char *const blocks[SHA1_MB_LANES]);
+
+bool sha1_mb_cpu_has_sha(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ebx >> 29) & 1;
+}
+
+void sha1_mb_select(void)
+{
+    __builtin_cpu_init();
+    // a single SHA-NI stream already outruns eight AVX2 lanes.
+    if (!sha1_mb_cpu_has_sha() && __builtin_cpu_supports("avx2"))
+        sha1_mb_selected = SHA1_MB_AVX2;
+    else
+        sha1_mb_selected = SHA1_MB_OPENSSL;
+}
+
+Sha1MbBackend sha1_mb_backend(void)
+{
+    pthread_once(&sha1_mb_selected_once, sha1_mb_select);
+    return sha1_mb_selected;
+}
+
+const char *sha1_mb_backend_name(Sha1MbBackend backend)
+{
+    switch (backend)
+    {
+        case SHA1_MB_AVX2:
+            return "avx2 x8";
+        case SHA1_MB_OPENSSL:
+        default:
+            return sha1_mb_cpu_has_sha() ? "openssl (sha-ni)" : "openssl";
+    }
+}
+
+void sha1_mb_hash(const unsigned char *const *data, size_t size, size_t count, unsigned char (*digests)[SHA_DIGEST_LENGTH])
+{
+    if (sha1_mb_backend() == SHA1_MB_AVX2)
+    {
+        sha1_mb_hash_avx2(data, size, count, digests);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        SHA1(data[i], size, digests[i]);
+    }
+}
+
+__attribute__((target("avx2")))
+void sha1_mb_avx2_compress(Sha1Lanes state[5], const unsigned char *const blocks[SHA1_MB_LANES])
+{
+    Sha1Lanes w[16];
+    for (size_t i = 0; i < 16; i++)
+    {
+        uint32_t words[SHA1_MB_LANES];
+        for (size_t lane = 0; lane < SHA1_MB_LANES; lane++)
+        {
+            uint32_t word;
+            memcpy(&word, blocks[lane] + 4 * i, sizeof(word));
+            words[lane] = __builtin_bswap32(word);
+        }
+        memcpy(&w[i], words, sizeof(words));
+    }
+
+    Sha1Lanes a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+// one round, the message schedule is kept as a rolling window of the last 16 words.
+#define SHA1_ROUND(t, f, k)                                                                   \
+    do {                                                                                      \
+        if ((t) >= 16)                                                                        \
+            w[(t) & 15] = ROL(w[((t) - 3) & 15] ^ w[((t) - 8) & 15] ^ w[((t) - 14) & 15] ^ w[(t) & 15], 1); \
+        Sha1Lanes temp = ROL(a, 5) + (f) + e + (k) + w[(t) & 15];                              \
+        e = d;                                                                                \
+        d = c;                                                                                \
+        c = ROL(b, 30);                                                                       \
+        b = a;                                                                                \
+        a = temp;                                                                             \
+    } while (0)
+
+    _Pragma("GCC unroll 20")
+    for (size_t t = 0; t < 20; t++)
+        SHA1_ROUND(t, (b & c) | (~b & d), 0x5a827999u);
+    _Pragma("GCC unroll 20")
+    for (size_t t = 20; t < 40; t++)
+        SHA1_ROUND(t, b ^ c ^ d, 0x6ed9eba1u);
+    _Pragma("GCC unroll 20")
+    for (size_t t = 40; t < 60; t++)
+        SHA1_ROUND(t, (b & c) | (b & d) | (c & d), 0x8f1bbcdcu);
+    _Pragma("GCC unroll 20")
+    for (size_t t = 60; t < 80; t++)
+        SHA1_ROUND(t, b ^ c ^ d, 0xca62c1d6u);
+
+#undef SHA1_ROUND
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+__attribute__((target("avx2")))
+void sha1_mb_hash_avx2(const unsigned char *const *data, size_t size, size_t count, unsigned char (*digests)[SHA_DIGEST_LENGTH])
+{
+    size_t full_blocks = size / SHA1_BLOCK_SIZE;
+    size_t remainder = size % SHA1_BLOCK_SIZE;
+    // the padding is a 0x80 byte and the 64 bit length, which may spill into a second block.
+    size_t tail_blocks = remainder + 9 > SHA1_BLOCK_SIZE ? 2 : 1;
+    uint64_t length_bits = (uint64_t)size * 8;
+
+    for (size_t group = 0; group < count; group += SHA1_MB_LANES)
+    {
+        size_t lanes = count - group < SHA1_MB_LANES ? count - group : SHA1_MB_LANES;
+
+        // a short group fills its spare lanes with the first buffer, their digests are thrown away.
+        const unsigned char *lane_data[SHA1_MB_LANES];
+        for (size_t lane = 0; lane < SHA1_MB_LANES; lane++)
+        {
+            lane_data[lane] = data[group + (lane < lanes ? lane : 0)];
+        }
+
+        Sha1Lanes state[5] = {
+            { 0x67452301u, 0x67452301u, 0x67452301u, 0x67452301u, 0x67452301u, 0x67452301u, 0x67452301u, 0x67452301u },
+            { 0xefcdab89u, 0xefcdab89u, 0xefcdab89u, 0xefcdab89u, 0xefcdab89u, 0xefcdab89u, 0xefcdab89u, 0xefcdab89u },
+            { 0x98badcfeu, 0x98badcfeu, 0x98badcfeu, 0x98badcfeu, 0x98badcfeu, 0x98badcfeu, 0x98badcfeu, 0x98badcfeu },
+            { 0x10325476u, 0x10325476u, 0x10325476u, 0x10325476u, 0x10325476u, 0x10325476u, 0x10325476u, 0x10325476u },
+            { 0xc3d2e1f0u, 0xc3d2e1f0u, 0xc3d2e1f0u, 0xc3d2e1f0u, 0xc3d2e1f0u, 0xc3d2e1f0u, 0xc3d2e1f0u, 0xc3d2e1f0u },
+        };
+
+        const unsigned char *blocks[SHA1_MB_LANES];
+        for (size_t block = 0; block < full_blocks; block++)
+        {
+            for (size_t lane = 0; lane < SHA1_MB_LANES; lane++)
+            {
+                blocks[lane] = lane_data[lane] + block * SHA1_BLOCK_SIZE;
+            }
+            sha1_mb_avx2_compress(state, blocks);
+        }
+
+        unsigned char tails[SHA1_MB_LANES][2 * SHA1_BLOCK_SIZE];
+        for (size_t lane = 0; lane < SHA1_MB_LANES; lane++)
+        {
+            unsigned char *tail = tails[lane];
+            memset(tail, 0, sizeof(tails[lane]));
+            memcpy(tail, lane_data[lane] + full_blocks * SHA1_BLOCK_SIZE, remainder);
+            tail[remainder] = 0x80;
+            for (size_t i = 0; i < 8; i++)
+            {
+                tail[tail_blocks * SHA1_BLOCK_SIZE - 1 - i] = length_bits >> (8 * i);
+            }
+        }
+
+        for (size_t block = 0; block < tail_blocks; block++)
+        {
+            for (size_t lane = 0; lane < SHA1_MB_LANES; lane++)
+            {
+                blocks[lane] = tails[lane] + block * SHA1_BLOCK_SIZE;
+            }
+            sha1_mb_avx2_compress(state, blocks);
+        }
+
+        for (size_t lane = 0; lane < lanes; lane++)
+        {
+            for (size_t i = 0; i < 5; i++)
+            {
+                uint32_t word = __builtin_bswap32(state[i][lane]);
+                memcpy(digests[group + lane] + 4 * i, &word, sizeof(word));
+            }
+        }
+    }
+}
@@ -0,0 +1,49 @@
+/**
+ * @file sha1_mb.h
+ * @brief Header file for hashing many equally sized buffers with SHA1 at once in C.
+ * On CPUs with AVX2 (and without the SHA extensions, which OpenSSL already uses) eight buffers are
+ * hashed side by side, one per 32 bit lane of a vector register. Everywhere else each buffer is
+ * hashed with OpenSSL's SHA1. The choice is made at runtime.
+*/
+
+#ifndef SHA1_MB_H
+#define SHA1_MB_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <openssl/sha.h>
+
+// the number of buffers the vector kernel hashes side by side.
+#define SHA1_MB_LANES 8
+
+// the implementation sha1_mb_hash runs on.
+typedef enum {
+    SHA1_MB_OPENSSL,    // one buffer at a time with OpenSSL, which uses the SHA extensions when the CPU has them.
+    SHA1_MB_AVX2        // SHA1_MB_LANES buffers at a time in AVX2 registers.
+} Sha1MbBackend;
+
+/**
+ * @brief The implementation picked for this CPU, detected on first use by whichever thread gets there first.
+ * @return Sha1MbBackend the implementation
+*/
+Sha1MbBackend sha1_mb_backend(void);
+
+/**
+ * @brief A printable name for an implementation.
+ * @param backend The implementation
+ * @return const char* the name
+*/
+const char *sha1_mb_backend_name(Sha1MbBackend backend);
+
+/**
+ * @brief Hash a number of buffers that are all the same size.
+ * @param data The buffers to hash
+ * @param size The size of every buffer
+ * @param count The number of buffers
+ * @param digests Filled with the SHA1 of each buffer, room for count digests
+ * @return void
+*/
+void sha1_mb_hash(const unsigned char *const *data, size_t size, size_t count, unsigned char (*digests)[SHA_DIGEST_LENGTH]);
+
+#endif
@@ -0,0 +1,620 @@
+/**
+ * @file storage.c
+ * @brief Implementation file for writing downloaded blocks straight to their place in the output file in C.
+ * There is no liburing dependency, the ring is set up and driven with the raw system calls.
+*/
+// for fallocate.
+#define _GNU_SOURCE
+#include "storage.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/**
+ * @brief set up an io_uring for the storage, leaving its fd below 0 if the kernel has none.
+ * @param ring The ring to set up
+ * @return void
+*/
+void storage_ring_init(StorageRing *ring);
+
+/**
+ * @brief unmap and close a ring.
+ * @param ring The ring
+ * @return void
+*/
+void storage_ring_free(StorageRing *ring);
+
+/**
+ * @brief write data at an offset with pwrite, until all of it is written.
+ * @param fd The file
+ * @param offset Where in the file to write
+ * @param data The data to write
+ * @param length The number of bytes to write
+ * @return int STORAGE_SUCCESS, or STORAGE_ERR_IO
+*/
+int storage_pwrite(int fd, off_t offset, const unsigned char *data, size_t length);
+
+/**
+ * @brief unmap the view of a file, if any.
+ * @param file The file
+ * @return void
+*/
+void storage_unmap(StorageFile *file);
+
+/**
+ * @brief preallocate a file to a size and map it again.
+ * @param file The file, its fd open
+ * @param size The new size
+ * @return int STORAGE_SUCCESS, or STORAGE_ERR_IO
+*/
+int storage_file_resize(StorageFile *file, off_t size);
+
+/**
+ * @brief allocate a storage of closed files, with a ring.
+ * @param file_count The number of files
+ * @param layout Where each file lies, NULL for a single file
+ * @return Storage* the storage, or NULL
+*/
+Storage *storage_new(size_t file_count, const TorrentFile *layout);
+
+/**
+ * @brief find the file the contents at an offset start in.
+ * @param storage The storage
+ * @param offset The offset
+ * @param length The number of bytes
+ * @param file_offset Set to the offset in the file
+ * @param in_file Set to how many of the bytes lie in the file
+ * @return StorageFile* the file
+*/
+StorageFile *storage_find(Storage *storage, off_t offset, size_t length, off_t *file_offset, size_t *in_file);
+
+/**
+ * @brief queue a write that lies within one file, or write it if there is no ring.
+ * @param storage The storage
+ * @param fd The file
+ * @param offset Where in the file to write
+ * @param data The data to write
+ * @param length The number of bytes to write
+ * @return int STORAGE_SUCCESS, or STORAGE_ERR_IO
+*/
+int storage_queue(Storage *storage, int fd, off_t offset, const unsigned char *data, size_t length);
+
+/**
+ * @brief submit the queued writes to the ring and wait for all of them, see storage_flush.
+ * @param storage The storage
+ * @return int STORAGE_SUCCESS, or STORAGE_ERR_IO if any write failed
+*/
+int storage_submit(Storage *storage);
+
+/**
+ * @brief build the path of a file of a multi-file torrent below its directory.
+ * @param root The directory
+ * @param entry The file
+ * @return char* the path, to be freed, or NULL
+*/
+char *storage_file_path(const char *root, const TorrentFileEntry *entry);
+
+/**
+ * @brief create every directory on the way to a file.
+ * @param path The path of the file, it is changed while this runs and restored
+ * @param from Where in the path to start, the directories before it exist
+ * @return int 0, or -1 on error
+*/
+int storage_make_parents(char *path, size_t from);
+
+/**
+ * @brief raise the limit of open files, if need be and the hard limit allows, to keep every file open.
+ * @param count The number of files about to be opened
+ * @return void
+*/
+void storage_raise_file_limit(size_t count);
+
+void storage_ring_init(StorageRing *ring)
+{
+    memset(ring, 0, sizeof(StorageRing));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, STORAGE_RING_ENTRIES, &params);
+    if (ring->fd < 0)
+        return;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // newer kernels put both rings behind a single mapping.
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_map_size > ring->sq_map_size)
+            ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+    {
+        close(ring->fd);
+        ring->fd = -1;
+        return;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_map = ring->sq_map;
+    }
+    else
+    {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED)
+        {
+            munmap(ring->sq_map, ring->sq_map_size);
+            close(ring->fd);
+            ring->fd = -1;
+            return;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_map != ring->sq_map)
+            munmap(ring->cq_map, ring->cq_map_size);
+        munmap(ring->sq_map, ring->sq_map_size);
+        close(ring->fd);
+        ring->fd = -1;
+        return;
+    }
+
+    unsigned char *sq = ring->sq_map;
+    unsigned char *cq = ring->cq_map;
+    ring->sq_head = (_Atomic uint32_t *)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic uint32_t *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+    ring->cq_head = (_Atomic uint32_t *)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic uint32_t *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+}
+
+void storage_ring_free(StorageRing *ring)
+{
+    if (ring->fd < 0)
+        return;
+
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+int storage_pwrite(int fd, off_t offset, const unsigned char *data, size_t length)
+{
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t n = pwrite(fd, data + written, length - written, offset + written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERR: failed to write to output at offset %lld\n", (long long)(offset + written));
+            return STORAGE_ERR_IO;
+        }
+        written += n;
+    }
+    return STORAGE_SUCCESS;
+}
+
+void storage_unmap(StorageFile *file)
+{
+    if (file->view != NULL)
+        munmap(file->view, file->size);
+    file->view = NULL;
+}
+
+Storage *storage_new(size_t file_count, const TorrentFile *layout)
+{
+    Storage *storage = malloc(sizeof(Storage));
+    StorageFile *files = calloc(file_count, sizeof(StorageFile));
+    if (storage == NULL || files == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for storage\n");
+        free(storage);
+        free(files);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < file_count; i++)
+    {
+        files[i].fd = -1;
+    }
+    storage->files = files;
+    storage->file_count = file_count;
+    storage->layout = layout;
+    storage->queued_count = 0;
+    storage_ring_init(&storage->ring);
+    return storage;
+}
+
+Storage *storage_open(const char *path, off_t size, bool keep)
+{
+    Storage *storage = storage_new(1, NULL);
+    if (storage == NULL)
+        return NULL;
+
+    StorageFile *file = &storage->files[0];
+    file->fd = open(path, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC) | O_CLOEXEC, 0644);
+    if (file->fd < 0)
+    {
+        fprintf(stderr, "ERR: unable to open output file at: %s\n", path);
+        storage_close(storage);
+        return NULL;
+    }
+
+    if (storage_resize(storage, size) != STORAGE_SUCCESS)
+    {
+        storage_close(storage);
+        return NULL;
+    }
+    return storage;
+}
+
+Storage *storage_open_files(const char *root, const TorrentFile *layout, bool keep)
+{
+    if (mkdir(root, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "ERR: unable to create output directory at: %s\n", root);
+        return NULL;
+    }
+
+    Storage *storage = storage_new(layout->file_count, layout);
+    if (storage == NULL)
+        return NULL;
+    storage_raise_file_limit(layout->file_count);
+
+    size_t root_length = strlen(root);
+    for (size_t i = 0; i < layout->file_count; i++)
+    {
+        const TorrentFileEntry *entry = &layout->files[i];
+        char *path = storage_file_path(root, entry);
+        if (path == NULL)
+        {
+            storage_close(storage);
+            return NULL;
+        }
+
+        StorageFile *file = &storage->files[i];
+        if (storage_make_parents(path, root_length + 1) == 0)
+            file->fd = open(path, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC) | O_CLOEXEC, 0644);
+        if (file->fd < 0)
+        {
+            fprintf(stderr, "ERR: unable to open output file at: %s\n", path);
+            free(path);
+            storage_close(storage);
+            return NULL;
+        }
+        free(path);
+
+        if (storage_file_resize(file, entry->length) != STORAGE_SUCCESS)
+        {
+            storage_close(storage);
+            return NULL;
+        }
+    }
+    return storage;
+}
+
+int storage_stat_files(const char *root, const TorrentFile *layout, struct stat *stats)
+{
+    if (layout == NULL)
+        return stat(root, &stats[0]) == 0 ? STORAGE_SUCCESS : STORAGE_ERR_IO;
+
+    for (size_t i = 0; i < layout->file_count; i++)
+    {
+        char *path = storage_file_path(root, &layout->files[i]);
+        if (path == NULL)
+            return STORAGE_ERR_IO;
+        int result = stat(path, &stats[i]);
+        free(path);
+        if (result != 0)
+            return STORAGE_ERR_IO;
+    }
+    return STORAGE_SUCCESS;
+}
+
+char *storage_file_path(const char *root, const TorrentFileEntry *entry)
+{
+    size_t size = strlen(root) + 1 + strlen(entry->path) + 1;
+    char *path = malloc(size);
+    if (path == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for storage\n");
+        return NULL;
+    }
+    snprintf(path, size, "%s/%s", root, entry->path);
+    return path;
+}
+
+int storage_make_parents(char *path, size_t from)
+{
+    for (char *at = strchr(path + from, '/'); at != NULL; at = strchr(at + 1, '/'))
+    {
+        *at = '\0';
+        int result = mkdir(path, 0755);
+        *at = '/';
+        if (result != 0 && errno != EEXIST)
+            return -1;
+    }
+    return 0;
+}
+
+void storage_raise_file_limit(size_t count)
+{
+    // the files stay open for the whole download, on top of the sockets and what is open already.
+    struct rlimit limit;
+    rlim_t wanted = count + 256;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur >= wanted)
+        return;
+    limit.rlim_cur = wanted < limit.rlim_max ? wanted : limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+int storage_resize(Storage *storage, off_t size)
+{
+    if (storage_flush(storage) != STORAGE_SUCCESS)
+        return STORAGE_ERR_IO;
+    return storage_file_resize(&storage->files[0], size);
+}
+
+int storage_file_resize(StorageFile *file, off_t size)
+{
+    storage_unmap(file);
+    file->size = 0;
+
+    // reserving the blocks up front keeps the file from fragmenting as pieces land in any order.
+    // fallocate only grows a file, a smaller size still needs ftruncate. ftruncate stamps the file
+    // as modified even when the size stays the same, which a file kept from an earlier run must not be.
+    struct stat st;
+    bool sized = fstat(file->fd, &st) == 0 && st.st_size == size;
+    if (!sized && (ftruncate(file->fd, size) != 0 ||
+        (size > 0 && fallocate(file->fd, 0, 0, size) != 0 && errno != EOPNOTSUPP)))
+    {
+        fprintf(stderr, "ERR: unable to preallocate output file to %lld bytes\n", (long long)size);
+        return STORAGE_ERR_IO;
+    }
+
+    if (size > 0)
+    {
+        void *view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+        if (view == MAP_FAILED)
+        {
+            fprintf(stderr, "ERR: unable to map output file\n");
+            return STORAGE_ERR_IO;
+        }
+        file->view = view;
+    }
+    file->size = size;
+    return STORAGE_SUCCESS;
+}
+
+StorageFile *storage_find(Storage *storage, off_t offset, size_t length, off_t *file_offset, size_t *in_file)
+{
+    if (storage->layout == NULL)
+    {
+        *file_offset = offset;
+        *in_file = length;
+        return &storage->files[0];
+    }
+
+    FileSpan span = torrent_file_span(storage->layout, offset, length);
+    *file_offset = span.offset;
+    *in_file = span.length;
+    return &storage->files[span.file];
+}
+
+int storage_write(Storage *storage, off_t offset, const unsigned char *data, size_t length)
+{
+    // a block that runs across files is split at the boundary, each part queued on its own.
+    while (length > 0)
+    {
+        off_t file_offset;
+        size_t in_file;
+        StorageFile *file = storage_find(storage, offset, length, &file_offset, &in_file);
+        if (storage_queue(storage, file->fd, file_offset, data, in_file) != STORAGE_SUCCESS)
+            return STORAGE_ERR_IO;
+        offset += in_file;
+        data += in_file;
+        length -= in_file;
+    }
+    return STORAGE_SUCCESS;
+}
+
+int storage_queue(Storage *storage, int fd, off_t offset, const unsigned char *data, size_t length)
+{
+    StorageRing *ring = &storage->ring;
+    if (storage->queued_count == STORAGE_RING_ENTRIES && storage_flush(storage) != STORAGE_SUCCESS)
+        return STORAGE_ERR_IO;
+
+    // checked after the flush, a failing ring is given up on for good.
+    if (ring->fd < 0)
+    {
+        uint64_t start = metrics_enabled ? metrics_now_ns() : 0;
+        int result = storage_pwrite(fd, offset, data, length);
+        if (metrics_enabled)
+        {
+            metrics_record(METRIC_DISK_WRITE_TIME, metrics_now_ns() - start);
+            metrics_count(METRIC_DISK_BYTES, length);
+        }
+        return result;
+    }
+
+    size_t slot = storage->queued_count++;
+    storage->queued[slot] = (StorageWrite){ .fd = fd, .data = data, .length = length, .offset = offset };
+
+    // only this thread produces, the kernel just needs to see the entry before the new tail.
+    uint32_t tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    uint32_t index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = slot;
+    ring->sq_array[index] = index;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    return STORAGE_SUCCESS;
+}
+
+int storage_flush(Storage *storage)
+{
+    if (storage->queued_count == 0 || !metrics_enabled)
+        return storage_submit(storage);
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < storage->queued_count; i++)
+        bytes += storage->queued[i].length;
+    uint64_t start = metrics_now_ns();
+    int result = storage_submit(storage);
+    metrics_record(METRIC_DISK_WRITE_TIME, metrics_now_ns() - start);
+    metrics_count(METRIC_DISK_BYTES, bytes);
+    return result;
+}
+
+int storage_submit(Storage *storage)
+{
+    StorageRing *ring = &storage->ring;
+    size_t count = storage->queued_count;
+    if (count == 0)
+        return STORAGE_SUCCESS;
+    storage->queued_count = 0;
+
+    size_t submitted = 0;
+    size_t completed = 0;
+    int result = STORAGE_SUCCESS;
+    while (completed < count)
+    {
+        long n = syscall(__NR_io_uring_enter, ring->fd, count - submitted, count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            // the ring is broken: give it up and write everything by hand, writing a block that
+            // did make it twice does no harm.
+            storage_ring_free(ring);
+            for (size_t i = 0; i < count; i++)
+            {
+                StorageWrite *write = &storage->queued[i];
+                if (storage_pwrite(write->fd, write->offset, write->data, write->length) != STORAGE_SUCCESS)
+                    result = STORAGE_ERR_IO;
+            }
+            return result;
+        }
+        submitted += n;
+
+        uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            StorageWrite *write = &storage->queued[cqe->user_data];
+            // a short write, or a kernel without IORING_OP_WRITE, has the rest written by hand.
+            size_t done = cqe->res > 0 ? (size_t)cqe->res : 0;
+            if (done < write->length &&
+                storage_pwrite(write->fd, write->offset + done, write->data + done, write->length - done) != STORAGE_SUCCESS)
+                result = STORAGE_ERR_IO;
+            head++;
+            completed++;
+        }
+        atomic_store_explicit(ring->cq_head, head, memory_order_release);
+    }
+    return result;
+}
+
+int storage_sync(Storage *storage)
+{
+    // the writes through a region are in the shared mapping, fsync writes the page cache out with them.
+    int result = storage_flush(storage);
+    uint64_t start = metrics_enabled ? metrics_now_ns() : 0;
+    for (size_t i = 0; i < storage->file_count; i++)
+    {
+        if (fsync(storage->files[i].fd) != 0)
+        {
+            fprintf(stderr, "ERR: unable to sync output file\n");
+            result = STORAGE_ERR_IO;
+        }
+    }
+    if (metrics_enabled)
+        metrics_record(METRIC_DISK_WRITE_TIME, metrics_now_ns() - start);
+    return result;
+}
+
+int storage_stat(Storage *storage, struct stat *stats)
+{
+    for (size_t i = 0; i < storage->file_count; i++)
+    {
+        if (fstat(storage->files[i].fd, &stats[i]) != 0)
+            return STORAGE_ERR_IO;
+    }
+    return STORAGE_SUCCESS;
+}
+
+const unsigned char *storage_view(Storage *storage, off_t offset, size_t length)
+{
+    return storage_region(storage, offset, length);
+}
+
+unsigned char *storage_region(Storage *storage, off_t offset, size_t length)
+{
+    off_t file_offset;
+    size_t in_file;
+    StorageFile *file = storage_find(storage, offset, length, &file_offset, &in_file);
+    return in_file == length ? file->view + file_offset : NULL;
+}
+
+void storage_read(Storage *storage, off_t offset, unsigned char *data, size_t length)
+{
+    while (length > 0)
+    {
+        off_t file_offset;
+        size_t in_file;
+        StorageFile *file = storage_find(storage, offset, length, &file_offset, &in_file);
+        memcpy(data, file->view + file_offset, in_file);
+        offset += in_file;
+        data += in_file;
+        length -= in_file;
+    }
+}
+
+bool storage_locate(Storage *storage, off_t offset, size_t length, int *fd, off_t *file_offset)
+{
+    size_t in_file;
+    StorageFile *file = storage_find(storage, offset, length, file_offset, &in_file);
+    *fd = file->fd;
+    return in_file == length;
+}
+
+void storage_close(Storage *storage)
+{
+    storage_flush(storage);
+    for (size_t i = 0; i < storage->file_count; i++)
+    {
+        storage_unmap(&storage->files[i]);
+        if (storage->files[i].fd >= 0)
+            close(storage->files[i].fd);
+    }
+    storage_ring_free(&storage->ring);
+    free(storage->files);
+    free(storage);
+}
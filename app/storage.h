@@ -0,0 +1,195 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+/**
+ * @file storage.h
+ * @brief Header file for writing downloaded blocks straight to their place in the output file in C.
+ * Writes are batched through io_uring where the kernel supports it, and fall back to pwrite
+ * otherwise. The file is also mapped shared, so finished pieces can be hashed from the page cache and
+ * blocks can be received from a socket straight into their place.
+ * The files of a multi-file torrent are laid end to end as one range of offsets. A write that runs
+ * across files is split at the boundaries, and a view or region is only handed out within one file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "torrent.h"
+
+#define STORAGE_SUCCESS 0
+#define STORAGE_ERR_IO -1
+
+// the number of writes that can be queued before they have to be submitted, a power of two.
+#define STORAGE_RING_ENTRIES 64
+
+// a write queued on the ring, the data must stay alive until storage_flush.
+typedef struct {
+    int fd;
+    const unsigned char *data;
+    size_t length;
+    off_t offset;
+} StorageWrite;
+
+// an io_uring submission and completion queue pair, mapped from the kernel.
+typedef struct {
+    int fd;                         // the ring, less than 0 if io_uring is not available.
+    void *sq_map;                   // the submission ring mapping.
+    size_t sq_map_size;
+    void *cq_map;                   // the completion ring mapping, the same as sq_map on newer kernels.
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;      // the submission queue entries.
+    size_t sqes_size;
+    _Atomic uint32_t *sq_head;
+    _Atomic uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t *sq_array;
+    _Atomic uint32_t *cq_head;
+    _Atomic uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+} StorageRing;
+
+// one file of the storage.
+typedef struct {
+    int fd;
+    off_t size;                     // the size the file was preallocated to.
+    unsigned char *view;            // a shared mapping of the whole file, NULL while it is empty.
+} StorageFile;
+
+typedef struct {
+    StorageFile *files;             // the files, one for each file of the layout.
+    size_t file_count;
+    const TorrentFile *layout;      // where each file lies in the range of offsets, NULL for a single file.
+    StorageRing ring;
+    StorageWrite queued[STORAGE_RING_ENTRIES]; // the writes queued on the ring, indexed by their user data.
+    size_t queued_count;
+} Storage;
+
+/**
+ * @brief Create or truncate an output file and preallocate it, see storage_resize.
+ * @param path The path of the file
+ * @param size The size of the file
+ * @param keep Whether to keep what the file holds rather than truncate it, e.g. to resume a download
+ * @return Storage* A pointer to the new storage, or NULL on error
+*/
+Storage *storage_open(const char *path, off_t size, bool keep);
+
+/**
+ * @brief Preallocate the output file to a new size with fallocate (or ftruncate on file systems
+ * without it) and map it again. Queued writes are flushed first. A file that is already of the
+ * size is only mapped again, so its modification time is left alone.
+ * @param storage The storage
+ * @param size The new size of the file
+ * @return int STORAGE_SUCCESS, or STORAGE_ERR_IO
+*/
+int storage_resize(Storage *storage, off_t size);
+
+/**
+ * @brief Create or truncate every file of a multi-file torrent below a directory, creating the
+ * directories on the way, and preallocate each to its size.
+ * @param root The directory, it is created if it does not exist
+ * @param layout The files of the torrent, it must outlive the storage
+ * @param keep Whether to keep what the files hold rather than truncate them, e.g. to resume a download
+ * @return Storage* A pointer to the new storage, or NULL on error
+*/
+Storage *storage_open_files(const char *root, const TorrentFile *layout, bool keep);
+
+/**
+ * @brief Look up the size and modification time of every file storage_open or storage_open_files
+ * would open, without opening or creating any of them.
+ * @param root The path of the file, or the directory of a multi-file torrent
+ * @param layout The files of the torrent, NULL for a single file
+ * @param stats Set for each file, room for one per file of the layout
+ * @return int STORAGE_SUCCESS, or STORAGE_ERR_IO if a file does not exist
+*/
+int storage_stat_files(const char *root, const TorrentFile *layout, struct stat *stats);
+
+/**
+ * @brief Write data at an offset of the file. With io_uring the write is only queued, the data
+ * must stay alive and unchanged until the next storage_flush. Without it the data is written here.
+ * Data that runs across files is written to each in turn.
+ * @param storage The storage
+ * @param offset Where in the file to write
+ * @param data The data to write
+ * @param length The number of bytes to write
+ * @return int STORAGE_SUCCESS, or STORAGE_ERR_IO
+*/
+int storage_write(Storage *storage, off_t offset, const unsigned char *data, size_t length);
+
+/**
+ * @brief Submit every queued write in a single system call and wait for all of them to complete.
+ * @param storage The storage
+ * @return int STORAGE_SUCCESS, or STORAGE_ERR_IO if any of the writes failed
+*/
+int storage_flush(Storage *storage);
+
+/**
+ * @brief Flush whatever is queued and write everything out to the disk, the writes through a
+ * region included.
+ * @param storage The storage
+ * @return int STORAGE_SUCCESS, or STORAGE_ERR_IO
+*/
+int storage_sync(Storage *storage);
+
+/**
+ * @brief Look up the size and modification time of every open file.
+ * @param storage The storage
+ * @param stats Set for each file, room for file_count of them
+ * @return int STORAGE_SUCCESS, or STORAGE_ERR_IO
+*/
+int storage_stat(Storage *storage, struct stat *stats);
+
+/**
+ * @brief The contents of the file at an offset, through the mapping. What was written with storage_write is
+ * only visible once it is flushed.
+ * @param storage The storage
+ * @param offset The offset, within the size of the file
+ * @param length The number of bytes wanted
+ * @return const unsigned char* the contents at the offset, NULL if they run across files, see storage_read
+*/
+const unsigned char *storage_view(Storage *storage, off_t offset, size_t length);
+
+/**
+ * @brief The contents of the file at an offset, writable. Writing through it bypasses the queue,
+ * e.g. to receive a block from a socket straight into the page cache.
+ * @param storage The storage
+ * @param offset The offset, within the size of the file
+ * @param length The number of bytes wanted
+ * @return unsigned char* the contents at the offset, NULL if they run across files
+*/
+unsigned char *storage_region(Storage *storage, off_t offset, size_t length);
+
+/**
+ * @brief Copy the contents at an offset out of the mapping, whichever files they lie in. What was
+ * written with storage_write is only visible once it is flushed.
+ * @param storage The storage
+ * @param offset The offset, within the size of the file
+ * @param data Where to copy to
+ * @param length The number of bytes to copy
+ * @return void
+*/
+void storage_read(Storage *storage, off_t offset, unsigned char *data, size_t length);
+
+/**
+ * @brief Find the file and the offset in it that the contents at an offset are in, e.g. to send
+ * them with sendfile.
+ * @param storage The storage
+ * @param offset The offset, within the size of the file
+ * @param length The number of bytes wanted
+ * @param fd Set to the file
+ * @param file_offset Set to the offset in the file
+ * @return bool true, or false if the contents run across files
+*/
+bool storage_locate(Storage *storage, off_t offset, size_t length, int *fd, off_t *file_offset);
+
+/**
+ * @brief Flush whatever is queued and close the file.
+ * @param storage The storage to close
+ * @return void
+*/
+void storage_close(Storage *storage);
+
+#endif
@@ -1,16 +1,24 @@
 #include "torrent.h"
 
-#define REMAINDER_OR_FULL(total_size, part_size) total_size % part_size == 0 ? part_size : total_size % part_size
+#define REMAINDER_OR_FULL(total_size, part_size) ((total_size) % (part_size) == 0 ? (part_size) : (total_size) % (part_size))
 
 /**
- * @brief Create a new torrent file object from a bencoded dictionary
- * @param info_dict - the bencoded dictionary
- * @return TorrentFile* A pointer to the newly created TorrentFile object or null
- */
-TorrentFile *torrent_file_from_bcoded(Bencoded *info_dict);
+ * @brief attach the announce url and every tracker of the announce-list to the torrent object
+ * @param torrent - the torrent object with its meta info decoded
+ * @return a pointer to the torrent object or null
+*/
+Torrent *torrent_attach_announce(Torrent *torrent);
+
+/**
+ * @brief attach the raw and url escaped info hash to the torrent object
+ * @param torrent - the torrent object with its meta info decoded
+ * @return a pointer to the torrent object or null
+*/
+Torrent *torrent_attach_info_hash(Torrent *torrent);
 
 /**
- * @brief attach the file length to the torrent file object
+ * @brief attach the file length and the files to the torrent file object, from length in a single
+ * file torrent or the files list in a multi-file one
  * @param file - the torrent file object
  * @param info_dict - the bencoded dictionary
  * @return a pointer to the torrent file object or null
@@ -42,31 +50,36 @@ TorrentFile *torrent_file_attach_piece_length(TorrentFile *file, Bencoded *info_
 TorrentFile *torrent_file_attach_pieces(TorrentFile *file, Bencoded *info_dict);
 
 /**
- * @brief initialize the blocks for a piece
- * @param piece - the piece to initialize blocks for
- * @return a pointer to the blocks or null
+ * @brief attach the files of a multi-file torrent, with their offsets, to the torrent file object
+ * @param file - the torrent file object
+ * @param files - the files list of the info dict
+ * @return a pointer to the torrent file object or null
 */
-Block *piece_init_blocks(Piece *piece);
+TorrentFile *torrent_file_attach_files(TorrentFile *file, Bencoded *files);
 
 /**
- * @brief Free the memory allocated for a Piece object
- * @return void
+ * @brief join the components of a path from a files list with '/', refusing any that could leave
+ * the torrent's directory
+ * @param path - the path list of a file
+ * @return the joined path, or null
 */
-void piece_free(Piece *piece);
+char *torrent_file_join_path(Bencoded *path);
 
 /**
- * @brief Free the memory allocated for a Block object
+ * @brief free the files of a torrent file object
+ * @param file - the torrent file object
  * @return void
 */
-void block_free(Block *block);
+void torrent_file_free_files(TorrentFile *file);
 
 /**
- * @brief print the piece object
+ * @brief print the geometry of a piece
  * @param fd - the file descriptor to print to
- * @param piece - the piece object
+ * @param file - the torrent file object
+ * @param index - the index of the piece
  * @return void
 */
-void print_piece(FILE *fd, Piece *piece);
+void print_piece(FILE *fd, TorrentFile *file, size_t index);
 
 /**
  * @brief print the block object
@@ -77,36 +90,177 @@ void print_piece(FILE *fd, Piece *piece);
 void print_block(FILE *fd, Block *block);
 
 
-TorrentFile *torrent_file_new(char *torrent, size_t size)
+Torrent *torrent_new(const char *source, size_t size)
 {
-    Bencoded *bencoded = get_bencoded();
-    if (bencoded == NULL)
+    Torrent *torrent = malloc(sizeof(Torrent));
+    if (torrent == NULL)
     {
-        fprintf(stderr, "ERR: failed to parse torrent file\n");
+        fprintf(stderr, "ERR: failed to allocate memory for torrent\n");
         return NULL;
     }
 
-    if (decode_bencode(bencoded, (const char *)torrent, size) != PARSER_SUCCESS)
+    torrent->source = source;
+    torrent->source_size = size;
+    torrent->escaped_info_hash = NULL;
+    torrent->file = NULL;
+    torrent->trackers = NULL;
+    torrent->tracker_count = 0;
+    torrent->mapping = (FILE_CONTENT){0};
+
+    // the tree borrows its strings from the source, which the caller keeps alive for us.
+    if (decode_bencode_borrowed(&torrent->meta, source, size, NULL) != PARSER_SUCCESS)
     {
         fprintf(stderr, "ERR: failed to parse torrent file\n");
-        free_bencoded(bencoded);
+        free(torrent);
         return NULL;
     }
 
-    Bencoded *info_dict = get_dict_key(bencoded, "info");
-    if (info_dict == NULL || info_dict->type != DICTIONARY)
-    
+    if (torrent->meta.type != DICTIONARY)
     {
-        fprintf(stderr, "ERR: info key is expected to be a dict.");
+        fprintf(stderr, "ERR: parse error, expected dictionary, but recevied something else\n");
+        torrent_free(torrent);
         return NULL;
     }
 
-    TorrentFile *file = torrent_file_from_bcoded(info_dict);
+    torrent->info = get_dict_key(&torrent->meta, "info");
+    if (torrent->info == NULL || torrent->info->type != DICTIONARY)
+    {
+        fprintf(stderr, "ERR: info key is expected to be a dict.\n");
+        torrent_free(torrent);
+        return NULL;
+    }
 
-    return file;
+    if (torrent_attach_announce(torrent) == NULL || torrent_attach_info_hash(torrent) == NULL)
+    {
+        torrent_free(torrent);
+        return NULL;
+    }
+
+    torrent->file = torrent_file_new(torrent->info);
+    if (torrent->file == NULL)
+    {
+        torrent_free(torrent);
+        return NULL;
+    }
+
+    return torrent;
+}
+
+Torrent *torrent_open(const char *path)
+{
+    FILE_CONTENT mapping = map_file(path);
+    if (mapping.content == NULL || mapping.size == 0)
+    {
+        fprintf(stderr, "ERR: failed to read file contents\n");
+        fprintf(stderr, "torrent path %s\n", path);
+        unmap_file(&mapping);
+        return NULL;
+    }
+
+    Torrent *torrent = torrent_new(mapping.content, mapping.size);
+    if (torrent == NULL)
+    {
+        unmap_file(&mapping);
+        return NULL;
+    }
+
+    torrent->mapping = mapping;
+    return torrent;
+}
+
+Torrent *torrent_attach_announce(Torrent *torrent)
+{
+    Bencoded *announce = get_dict_key(&torrent->meta, "announce");
+    if (announce != NULL && announce->type != STRING)
+        announce = NULL;
+
+    // announce-list is a list of tiers, each a list of urls. anything else in it is skipped.
+    Bencoded *tiers = get_dict_key(&torrent->meta, "announce-list");
+    size_t count = announce != NULL ? 1 : 0;
+    if (tiers != NULL && tiers->type == LIST)
+    {
+        for (size_t t = 0; t < tiers->data.list.size; t++)
+        {
+            Bencoded *tier = &tiers->data.list.elements[t];
+            if (tier->type == LIST)
+                count += tier->data.list.size;
+        }
+    }
+    else
+    {
+        tiers = NULL;
+    }
+
+    torrent->trackers = malloc((count > 0 ? count : 1) * sizeof(TorrentTracker));
+    if (torrent->trackers == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for trackers\n");
+        return NULL;
+    }
+
+    for (size_t t = 0; tiers != NULL && t < tiers->data.list.size; t++)
+    {
+        Bencoded *tier = &tiers->data.list.elements[t];
+        for (size_t i = 0; tier->type == LIST && i < tier->data.list.size; i++)
+        {
+            Bencoded *url = &tier->data.list.elements[i];
+            if (url->type == STRING && url->data.string->size > 0)
+                torrent->trackers[torrent->tracker_count++] = (TorrentTracker){ url->data.string, t };
+        }
+    }
+
+    // the announce url only counts on its own when announce-list does not already name it.
+    if (announce != NULL)
+    {
+        bool listed = false;
+        for (size_t i = 0; i < torrent->tracker_count && !listed; i++)
+            listed = bstring_cmp(torrent->trackers[i].url, announce->data.string) == 0;
+        size_t tier = tiers != NULL ? tiers->data.list.size : 0;
+        if (!listed)
+            torrent->trackers[torrent->tracker_count++] = (TorrentTracker){ announce->data.string, tier };
+    }
+
+    if (torrent->tracker_count == 0)
+    {
+        fprintf(stderr, "ERR: announce key is expected to be a string.\n");
+        return NULL;
+    }
+
+    torrent->announce = announce != NULL ? announce->data.string : torrent->trackers[0].url;
+    return torrent;
 }
 
-TorrentFile *torrent_file_from_bcoded(Bencoded *info_dict)
+Torrent *torrent_attach_info_hash(Torrent *torrent)
+{
+    hash_bencoded_source(torrent->info_hash, torrent->info, torrent->source);
+
+    torrent->escaped_info_hash = curl_easy_escape(NULL, (char *)torrent->info_hash, SHA_DIGEST_LENGTH);
+    if (torrent->escaped_info_hash == NULL)
+    {
+        fprintf(stderr, "ERR: failed to escape hash\n");
+        return NULL;
+    }
+
+    return torrent;
+}
+
+void torrent_free(Torrent *torrent)
+{
+    if (torrent->file != NULL)
+    {
+        torrent_file_free(torrent->file);
+    }
+    if (torrent->escaped_info_hash != NULL)
+    {
+        curl_free(torrent->escaped_info_hash);
+    }
+    free(torrent->trackers);
+    free_bencoded_inner(torrent->meta);
+    unmap_file(&torrent->mapping);
+    free(torrent);
+}
+
+TorrentFile *torrent_file_new(Bencoded *info_dict)
 {
     TorrentFile *file = malloc(sizeof(TorrentFile));
     if (file == NULL)
@@ -125,6 +279,7 @@ TorrentFile *torrent_file_from_bcoded(Bencoded *info_dict)
     if (torrent_file_attach_name(file, info_dict) == NULL)
     {
         fprintf(stderr, "ERR: failed to attach name to torrent file\n");
+        torrent_file_free_files(file);
         free(file);
         return NULL;
     }
@@ -133,6 +288,8 @@ TorrentFile *torrent_file_from_bcoded(Bencoded *info_dict)
     if (torrent_file_attach_piece_length(file, info_dict) == NULL)
     {
         fprintf(stderr, "ERR: failed to attach piece length to torrent file\n");
+        torrent_file_free_files(file);
+        free(file->name);
         free(file);
         return NULL;
     }
@@ -140,6 +297,8 @@ TorrentFile *torrent_file_from_bcoded(Bencoded *info_dict)
     if (torrent_file_attach_pieces(file, info_dict) == NULL)
     {
         fprintf(stderr, "ERR: failed to attach pieces to torrent file\n");
+        torrent_file_free_files(file);
+        free(file->name);
         free(file);
         return NULL;
     }
@@ -151,8 +310,16 @@ TorrentFile *torrent_file_from_bcoded(Bencoded *info_dict)
 
 TorrentFile *torrent_file_attach_file_size(TorrentFile *file, Bencoded *info_dict)
 {
+    file->files = NULL;
+    file->file_count = 0;
+    file->multi_file = false;
+
+    Bencoded *files = get_dict_key(info_dict, "files");
+    if (files != NULL)
+        return torrent_file_attach_files(file, files);
+
     Bencoded *length = get_dict_key(info_dict, "length");
-    if (length == NULL || length->type != INTEGER)
+    if (length == NULL || length->type != INTEGER || length->data.integer < 0)
     {
         fprintf(stderr, "ERR: length key not found in info dict.");
         return NULL;
@@ -160,9 +327,141 @@ TorrentFile *torrent_file_attach_file_size(TorrentFile *file, Bencoded *info_dic
 
     file->file_size = length->data.integer;
 
+    // the only file is the output itself, it has no path of its own.
+    file->files = malloc(sizeof(TorrentFileEntry));
+    if (file->files == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for files\n");
+        return NULL;
+    }
+    file->files[0] = (TorrentFileEntry){ .path = NULL, .length = file->file_size, .offset = 0 };
+    file->file_count = 1;
+    return file;
+}
+
+TorrentFile *torrent_file_attach_files(TorrentFile *file, Bencoded *files)
+{
+    if (files->type != LIST || files->data.list.size == 0)
+    {
+        fprintf(stderr, "ERR: files key inside info expected to be a non empty list.\n");
+        return NULL;
+    }
+
+    size_t count = files->data.list.size;
+    file->files = calloc(count, sizeof(TorrentFileEntry));
+    if (file->files == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for files\n");
+        return NULL;
+    }
+    file->multi_file = true;
+
+    // the offsets are the running sum of the lengths, so the file of any byte is a binary search away.
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        Bencoded *entry = &files->data.list.elements[i];
+        Bencoded *length = entry->type == DICTIONARY ? get_dict_key(entry, "length") : NULL;
+        Bencoded *path = entry->type == DICTIONARY ? get_dict_key(entry, "path") : NULL;
+        if (length == NULL || length->type != INTEGER || length->data.integer < 0 ||
+            (size_t)length->data.integer > SIZE_MAX - offset || path == NULL)
+        {
+            fprintf(stderr, "ERR: file %zu of the files list is not valid.\n", i);
+            torrent_file_free_files(file);
+            return NULL;
+        }
+
+        TorrentFileEntry *target = &file->files[file->file_count];
+        target->path = torrent_file_join_path(path);
+        if (target->path == NULL)
+        {
+            fprintf(stderr, "ERR: file %zu of the files list has an unsafe path.\n", i);
+            torrent_file_free_files(file);
+            return NULL;
+        }
+        target->length = length->data.integer;
+        target->offset = offset;
+        offset += target->length;
+        file->file_count++;
+    }
+    file->file_size = offset;
     return file;
 }
 
+char *torrent_file_join_path(Bencoded *path)
+{
+    if (path->type != LIST || path->data.list.size == 0)
+        return NULL;
+
+    size_t size = 0;
+    for (size_t i = 0; i < path->data.list.size; i++)
+    {
+        Bencoded *component = &path->data.list.elements[i];
+        if (component->type != STRING)
+            return NULL;
+
+        // an empty, relative or absolute component, or one with a separator in it, could put the
+        // file anywhere on disk.
+        BString *name = component->data.string;
+        if (name->size == 0 || memchr(name->chars, '/', name->size) != NULL || memchr(name->chars, '\0', name->size) != NULL ||
+            (name->size == 1 && name->chars[0] == '.') || (name->size == 2 && memcmp(name->chars, "..", 2) == 0))
+            return NULL;
+        size += name->size + 1;
+    }
+
+    char *joined = malloc(size);
+    if (joined == NULL)
+        return NULL;
+
+    char *at = joined;
+    for (size_t i = 0; i < path->data.list.size; i++)
+    {
+        BString *name = path->data.list.elements[i].data.string;
+        if (i > 0)
+            *at++ = '/';
+        memcpy(at, name->chars, name->size);
+        at += name->size;
+    }
+    *at = '\0';
+    return joined;
+}
+
+void torrent_file_free_files(TorrentFile *file)
+{
+    for (size_t i = 0; i < file->file_count; i++)
+    {
+        free(file->files[i].path);
+    }
+    free(file->files);
+    file->files = NULL;
+    file->file_count = 0;
+}
+
+size_t torrent_file_find(const TorrentFile *file, size_t offset)
+{
+    // the last file that starts at or before the offset. empty files share their offset with the
+    // next file, which comes after them, so they are never the one found.
+    size_t low = 0;
+    size_t high = file->file_count;
+    while (high - low > 1)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (file->files[middle].offset <= offset)
+            low = middle;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+FileSpan torrent_file_span(const TorrentFile *file, size_t offset, size_t length)
+{
+    size_t index = torrent_file_find(file, offset);
+    const TorrentFileEntry *entry = &file->files[index];
+    size_t in_file = entry->offset + entry->length - offset;
+    return (FileSpan){ .file = index, .offset = offset - entry->offset, .length = length < in_file ? length : in_file };
+}
+
 TorrentFile *torrent_file_attach_name(TorrentFile *file, Bencoded *info_dict)
 {
     Bencoded *name = get_dict_key(info_dict, "name");
@@ -192,6 +491,12 @@ TorrentFile *torrent_file_attach_piece_length(TorrentFile *file, Bencoded *info_
         return NULL;
     }
 
+    if (piece_length->data.integer <= 0)
+    {
+        fprintf(stderr, "ERR: piece length must be positive.");
+        return NULL;
+    }
+
     file->piece_length = piece_length->data.integer;
     return file;
 }
@@ -215,99 +520,119 @@ TorrentFile *torrent_file_attach_pieces(TorrentFile *file, Bencoded *info_dict)
 
     file->num_pieces = pieces_hashes->data.string->size / SHA_DIGEST_LENGTH;
 
-    file->pieces = malloc(sizeof(Piece) * file->num_pieces);
-    if (file->pieces == NULL)
+    // every other piece property is computed from the index, so the table is nothing but the hashes.
+    size_t expected = file->file_size / file->piece_length + (file->file_size % file->piece_length != 0);
+    if (file->num_pieces != expected)
     {
-        fprintf(stderr, "ERR: failed to allocate memory for pieces");
+        fprintf(stderr, "ERR: expected %zu piece hashes but found %zu.\n", expected, file->num_pieces);
         return NULL;
     }
 
-    for (int i = 0; i < file->num_pieces - 1; i++)
-    {
-        Piece *piece = &file->pieces[i];
-        piece->index = i;
-        // need to figure out how large this exact piece will be, accounting for the last piece
-        piece->size = file->piece_length;
-        // this is the beginning of the hash tht corresponds to this piece
-        const unsigned char *hash = pieces_hashes->data.string->chars + (i * SHA_DIGEST_LENGTH);
-        // copy in the hash.
-        memcpy(piece->hash, hash, SHA_DIGEST_LENGTH);
-        // piece_init_blocks will allocate memory for the blocks and break these pieces into blocks.
-        if (piece_init_blocks(piece) == NULL)
-        {
-            fprintf(stderr, "ERR: failed to initialize blocks for piece %d\n", i);
-            return NULL;
-        }
-    }
-
-    // the last piece is a special case, it may not be the same size as the other pieces.
-    Piece *last_piece = &file->pieces[file->num_pieces - 1];
-    last_piece->index = file->num_pieces - 1;
-    last_piece->size = REMAINDER_OR_FULL(file->file_size, file->piece_length);
-    const unsigned char *hash = pieces_hashes->data.string->chars + ((file->num_pieces - 1) * SHA_DIGEST_LENGTH);
-    memcpy(last_piece->hash, hash, SHA_DIGEST_LENGTH);
+    file->piece_hashes = pieces_hashes->data.string->chars;
+    return file;
+}
 
-    if (piece_init_blocks(last_piece) == NULL)
+size_t torrent_file_piece_size(TorrentFile *file, size_t index)
+{
+    if (index == file->num_pieces - 1)
     {
-        fprintf(stderr, "ERR: failed to initialize blocks for last piece\n");
-        return NULL;
+        // the last piece is a special case, it may not be the same size as the other pieces.
+        return REMAINDER_OR_FULL(file->file_size, file->piece_length);
     }
+    return file->piece_length;
+}
 
-    return file;
+const unsigned char *torrent_file_piece_hash(TorrentFile *file, size_t index)
+{
+    return file->piece_hashes + index * SHA_DIGEST_LENGTH;
 }
 
-Block *piece_init_blocks(Piece *piece)
+Piece *piece_new(TorrentFile *file, size_t index)
 {
-    piece->block_count = piece->size % DEFAULT_BLOCK_SIZE == 0 
-        ? piece->size / DEFAULT_BLOCK_SIZE 
-        : (piece->size / DEFAULT_BLOCK_SIZE) + 1;
+    Piece *piece = malloc(sizeof(Piece));
+    if (piece == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for piece\n");
+        return NULL;
+    }
 
+    piece->index = index;
+    piece->size = torrent_file_piece_size(file, index);
+    piece->hash = torrent_file_piece_hash(file, index);
+    piece->block_count = piece->size / DEFAULT_BLOCK_SIZE + (piece->size % DEFAULT_BLOCK_SIZE != 0);
     piece->blocks_received = 0;
+    piece->holders = 0;
 
-    piece->blocks = malloc(sizeof(Block) * piece->block_count);
-    if (piece->blocks == NULL)
+    if (bitfield_init(&piece->requested, piece->block_count) != BITFIELD_SUCCESS)
     {
         fprintf(stderr, "ERR: failed to allocate memory for blocks\n");
+        free(piece);
         return NULL;
     }
 
-    for (int i = 0; i < piece->block_count - 1; i++)
+    if (bitfield_init(&piece->received, piece->block_count) != BITFIELD_SUCCESS)
     {
-        Block *block = &piece->blocks[i];
-        block->offset = i * DEFAULT_BLOCK_SIZE;
-        block->size = DEFAULT_BLOCK_SIZE;
+        fprintf(stderr, "ERR: failed to allocate memory for blocks\n");
+        bitfield_free(&piece->requested);
+        free(piece);
+        return NULL;
     }
 
-    Block *last_block = &piece->blocks[piece->block_count - 1];
-    last_block->size = REMAINDER_OR_FULL(piece->size, DEFAULT_BLOCK_SIZE);
-    last_block->offset = (piece->block_count - 1) * DEFAULT_BLOCK_SIZE;
-    return piece->blocks;
+    return piece;
+}
+
+size_t piece_footprint(TorrentFile *file)
+{
+    // the first piece is as large as any.
+    size_t blocks = file->piece_length / DEFAULT_BLOCK_SIZE + (file->piece_length % DEFAULT_BLOCK_SIZE != 0);
+    return sizeof(Piece) + 2 * BITFIELD_BYTES(blocks);
+}
+
+Piece *piece_place(void *memory, TorrentFile *file, size_t index)
+{
+    Piece *piece = memory;
+    piece->index = index;
+    piece->size = torrent_file_piece_size(file, index);
+    piece->hash = torrent_file_piece_hash(file, index);
+    piece->block_count = piece->size / DEFAULT_BLOCK_SIZE + (piece->size % DEFAULT_BLOCK_SIZE != 0);
+    piece->blocks_received = 0;
+    piece->holders = 0;
+
+    unsigned char *bits = (unsigned char *)(piece + 1);
+    bitfield_wrap(&piece->requested, piece->block_count, bits);
+    bitfield_wrap(&piece->received, piece->block_count, bits + BITFIELD_BYTES(piece->block_count));
+    return piece;
+}
+
+Block piece_block(Piece *piece, size_t index)
+{
+    Block block;
+    block.offset = index * DEFAULT_BLOCK_SIZE;
+    block.size = index == piece->block_count - 1
+        ? REMAINDER_OR_FULL(piece->size, DEFAULT_BLOCK_SIZE)
+        : DEFAULT_BLOCK_SIZE;
+    block.data = NULL;
+    return block;
 }
 
 void torrent_file_free(TorrentFile *file)
 {
-    for (int i = 0; i < file->num_pieces; i++)
-    {
-        piece_free(&file->pieces[i]);
-    }
-    free(file->pieces);
+    torrent_file_free_files(file);
     free(file->name);
     free(file);
 }
 
 void piece_free(Piece *piece)
 {
-    for (int i = 0; i < piece->block_count; i++)
-    {
-        block_free(&piece->blocks[i]);
-    }
-
-    free(piece->blocks);
+    bitfield_free(&piece->requested);
+    bitfield_free(&piece->received);
+    free(piece);
 }
 
 void block_free(Block *block)
 {
     free(block->data);
+    block->data = NULL;
 }
 
 void print_torrent_file(FILE *fd, TorrentFile *file)
@@ -317,25 +642,34 @@ void print_torrent_file(FILE *fd, TorrentFile *file)
     fprintf(fd, "Piece Length: %li\n", file->piece_length);
     fprintf(fd, "Number of Pieces: %li\n", file->num_pieces);
     fprintf(fd, "Pieces:\n\n");
-    for (int i = 0; i < file->num_pieces; i++)
+    for (size_t i = 0; i < file->num_pieces; i++)
     {
-        print_piece(fd, &file->pieces[i]);
+        print_piece(fd, file, i);
         fprintf(fd, "\n");
     }
 }
 
-void print_piece(FILE *fd, Piece *piece)
+void print_piece(FILE *fd, TorrentFile *file, size_t index)
 {
+    Piece *piece = piece_new(file, index);
+    if (piece == NULL)
+    {
+        return;
+    }
+
     fprintf(fd, "Piece Index: %li\n", piece->index);
     fprintf(fd, "Piece Size: %li\n", piece->size);
     fprintf(fd, "Piece Hash: TBD\n");
     fprintf(fd, "Number of Blocks: %li\n", piece->block_count);
     fprintf(fd, "Blocks:\n\n");
-    for (int i = 0; i < piece->block_count; i++)
+    for (size_t i = 0; i < piece->block_count; i++)
     {
-        fprintf(fd, "Block %d\n", i);
-        print_block(fd, &piece->blocks[i]); 
+        Block block = piece_block(piece, i);
+        fprintf(fd, "Block %zu\n", i);
+        print_block(fd, &block);
     }
+
+    piece_free(piece);
 }
 
 void print_block(FILE *fd, Block *block)
@@ -345,7 +679,7 @@ void print_block(FILE *fd, Block *block)
 }
 
 
-Peer_Header_BitTorrent *handshake(socket_t socket, unsigned char *info_hash, unsigned char *peer_id)
+Peer_Header_BitTorrent *handshake(socket_t socket, Torrent *torrent, unsigned char *peer_id)
 {
     Peer_Header_BitTorrent *header = malloc(sizeof(Peer_Header_BitTorrent));
     if (header == NULL)
@@ -357,7 +691,7 @@ Peer_Header_BitTorrent *handshake(socket_t socket, unsigned char *info_hash, uns
     header->pstrlen = 19;
     memcpy(header->proto_name, "BitTorrent protocol", 19);
     memset(header->reserved, 0, 8);
-    memcpy(header->info_hash, info_hash, 20);
+    memcpy(header->info_hash, torrent->info_hash, 20);
     memcpy(header->peer_id, peer_id, 20);
 
     if (send(socket, (unsigned char *)header, sizeof(Peer_Header_BitTorrent), 0) < 0)
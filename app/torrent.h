@@ -9,47 +9,149 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <openssl/sha.h>
+#include <sys/types.h>
 #include <sys/socket.h>
 #include "bencode.h"
 #include "bstring.h"
 #include "url.h"
 #include "network.h"
+#include "fileio.h"
+#include "bitfield.h"
 
 // 16KB || 2^14 - see https://wiki.theory.org/BitTorrentSpecification
 #define DEFAULT_BLOCK_SIZE 16384 
 
+// where a connection to a peer is in its life.
+typedef enum {
+    PEER_CONNECTING,    // the non-blocking connect has not completed yet.
+    PEER_HANDSHAKING,   // connected, waiting for the peer's handshake.
+    PEER_CONNECTED,     // the handshake is done, messages can flow.
+    PEER_CLOSED         // the connection failed or is done.
+} PeerPhase;
+
+// bytes waiting to be parsed or sent. the live bytes are data[start, end).
+typedef struct {
+    unsigned char *data;
+    size_t start;
+    size_t end;
+    size_t capacity;
+} PeerBuffer;
+
+// bytes queued to be sent. the ring wraps around rather than moving bytes to the front, so a
+// partial send never costs a copy, and the queued bytes are sent with one vectored write. head and
+// tail only ever grow, their difference is the number of bytes queued.
+typedef struct {
+    unsigned char *data;
+    size_t capacity;    // a power of two, 0 until the first message is queued.
+    size_t head;        // the next byte to send, modulo capacity.
+    size_t tail;        // where the next queued byte goes, modulo capacity.
+} PeerRing;
+
+// the payload of a PIECE message being received straight into its destination, past the input buffer.
+typedef struct {
+    unsigned char *data;    // where the payload goes, NULL to throw it away.
+    uint32_t index;         // the index of the piece, from the message.
+    uint32_t begin;         // the offset of the block in the piece, from the message.
+    size_t length;          // the size of the payload, 0 while no payload is being received.
+    size_t received;        // how much of the payload has arrived.
+} PeerSink;
+
+// a block being sent to a peer. its header goes out through the output buffer, its payload
+// straight from the file to the socket with sendfile, without passing through user space.
+typedef struct {
+    int fd;                 // the file the payload is sent from.
+    off_t offset;           // where the rest of the payload is in the file.
+    size_t remaining;       // the bytes of the payload left to send, 0 while no block is being sent.
+    size_t before;          // the bytes of the output buffer that go out ahead of the payload.
+} PeerUpload;
+
 typedef struct {
     Peer *peer_info; // the ip port etc...
+    socket_t socket; // the connection to the peer, -1 if not connected.
     bool connected;
     bool am_choking;
     bool am_interested;
     bool peer_choking;
     bool peer_interested;
+    Bitfield pieces; // the pieces the peer has, from its BITFIELD and HAVE messages.
+    PeerPhase phase; // where the connection is in its life.
+    PeerBuffer in;   // received bytes that are not parsed yet.
+    PeerRing out;    // queued messages that are not sent yet.
+    PeerSink sink;   // the block payload being received past the input buffer, if any.
+    PeerUpload upload; // the block payload being sent past the output buffer, if any.
+    double deadline; // when the current connect or handshake stage times out, from peer_now. 0 once connected.
 } Peer_State;
 
+// a block of a piece. the geometry of every block follows from the piece size, so blocks are computed
+// on demand (see piece_block) rather than stored.
 typedef struct {
     size_t size;         // the number of bytes in this block. should default to 16KB, exept for the last block.
     size_t offset;       // the offset of this block in the piece.
-    unsigned char *data; // the data in this block.
+    unsigned char *data; // the data in this block, if it is buffered at all.
 } Block;
 
+// the download state of a piece. only pieces that are in flight have one, so memory scales with
+// what is being downloaded rather than with the size of the torrent.
 typedef struct {
     size_t index;    // the index of this piece.
     size_t size;    // the acutal size of this this piece.
-    unsigned char hash[20]; // the hash of this piece.
+    const unsigned char *hash; // the hash of this piece, a view into the piece table.
     size_t block_count;     // the number of blocks in this piece.
     size_t blocks_received; // the total number of blocks received.
-    Block *blocks;          // the blocks in this piece. Will maintain a sorted order.
+    Bitfield requested;     // the blocks that have been requested from a peer.
+    Bitfield received;      // the blocks that have been received.
+    size_t holders;         // the number of downloaders sharing this state, more than one while peers race for the last blocks.
 } Piece;
 
+// a file of a torrent, at its place in the bytes the pieces cover.
+typedef struct {
+    char *path;     // the path below the torrent's directory, components joined by '/'. NULL in a single file torrent.
+    size_t length;  // the size of the file.
+    size_t offset;  // where the file starts, the sum of the lengths of the files before it.
+} TorrentFileEntry;
+
+// a stretch of bytes that lies within a single file.
+typedef struct {
+    size_t file;    // the index of the file.
+    size_t offset;  // where the stretch starts in the file.
+    size_t length;  // the size of the stretch.
+} FileSpan;
+
+// the piece table of a torrent. everything about a piece except its hash can be computed from its index.
+// the pieces run across the files back to back, as if they were one file of file_size bytes.
 typedef struct {
     size_t num_pieces; // the number of pieces in the file.
-    size_t file_size; // the size of the file.
+    size_t file_size; // the size of the file, the sum of the sizes of every file in a multi-file torrent.
+    TorrentFileEntry *files; // the files, in torrent order. a single file torrent has one.
+    size_t file_count; // the number of files.
+    bool multi_file; // whether the info dict has a files list, the files then go in a directory.
     size_t piece_length; // the length of each piece. all except the last piece are guarranteed to be this length.
     char *name; // the name of the file.
-    Piece *pieces; // the pieces in the file.
+    const unsigned char *piece_hashes; // num_pieces * SHA_DIGEST_LENGTH contiguous hashes, a view into the info dict.
 } TorrentFile;
 
+// a tracker of a torrent, from its announce-list (BEP 12) or its announce url.
+typedef struct {
+    BString *url;   // the announce url, a view into meta.
+    size_t tier;    // the tier the tracker is listed in, 0 is the first.
+} TorrentTracker;
+
+// a loaded torrent and everything derived from it. all of it is computed once when the torrent is
+// loaded so the tracker, handshake and download paths never have to re-derive it.
+struct Torrent {
+    const char *source;      // the buffer the torrent was decoded from, borrowed by meta.
+    size_t source_size;      // the size of the source buffer.
+    Bencoded meta;           // the decoded torrent meta info.
+    Bencoded *info;          // the info dict inside meta.
+    BString *announce;       // the announce url, a view into meta. the first tracker of announce-list if there is no announce key.
+    TorrentTracker *trackers; // every tracker of the torrent, by tier, announce-list first.
+    size_t tracker_count;    // the number of trackers.
+    unsigned char info_hash[SHA_DIGEST_LENGTH]; // the raw info hash.
+    char *escaped_info_hash; // the info hash url escaped for tracker announces.
+    TorrentFile *file;       // the file described by the info dict.
+    FILE_CONTENT mapping;    // the loaded .torrent file when the torrent owns its source, empty otherwise.
+};
+
 typedef struct {
     size_t connected_peers; // the number of connected peers.
     size_t total_peers; // the total number of peers.
@@ -69,18 +171,121 @@ typedef struct __attribute((packed)) {
 /**
  * @brief perform the handshake with a peer, sending the handshake message and receiving the response.
  * @param socket The socket file descriptor to send the handshake message to
- * @param info_hash The info hash of the torrent
+ * @param torrent The torrent to handshake for
  * @param peer_id The peer id of the client
  * @return a pointer to the Peer_Header_BitTorrent struct, or NULL if an error occurred
 */
-Peer_Header_BitTorrent *handshake(socket_t socket, unsigned char *info_hash, unsigned char *peer_id);
+Peer_Header_BitTorrent *handshake(socket_t socket, Torrent *torrent, unsigned char *peer_id);
 
 /**
- * @brief Create a new torrent file object
- * @param torrent - the berncoded torrent file array.
+ * @brief Load a torrent from its bencoded meta info, decoding it and deriving the info hash,
+ * escaped info hash, announce url and file description once.
+ * @param source - the bencoded torrent file. it is borrowed and must outlive the Torrent.
+ * @param size - the size of the source buffer.
+ * @return Torrent* A pointer to the newly created Torrent object or null
+ */
+Torrent *torrent_new(const char *source, size_t size);
+
+/**
+ * @brief Load a torrent straight from a .torrent file. The file is memory mapped and the torrent
+ * owns the mapping, so the decoded tree (and e.g. the pieces string) points into the page cache.
+ * @param path - the path of the .torrent file.
+ * @return Torrent* A pointer to the newly created Torrent object or null
+ */
+Torrent *torrent_open(const char *path);
+
+/**
+ * @brief Free the memory allocated for a Torrent object. A borrowed source buffer is left alone,
+ * one loaded by torrent_open is unmapped.
+ * @return void
+*/
+void torrent_free(Torrent *torrent);
+
+/**
+ * @brief Create a new torrent file object from a decoded info dict.
+ * @param info_dict - the decoded info dict. the piece hashes are borrowed from it, so it must outlive the TorrentFile.
  * @return TorrentFile* A pointer to the newly created TorrentFile object or null
  */
-TorrentFile *torrent_file_new(char *torrent, size_t size);
+TorrentFile *torrent_file_new(Bencoded *info_dict);
+
+/**
+ * @brief get the size of a piece, every piece is piece_length long except possibly the last.
+ * @param file - the torrent file object
+ * @param index - the index of the piece
+ * @return the size of the piece in bytes
+*/
+size_t torrent_file_piece_size(TorrentFile *file, size_t index);
+
+/**
+ * @brief get the SHA1 hash of a piece
+ * @param file - the torrent file object
+ * @param index - the index of the piece
+ * @return a pointer to the SHA_DIGEST_LENGTH byte hash
+*/
+const unsigned char *torrent_file_piece_hash(TorrentFile *file, size_t index);
+
+/**
+ * @brief find the file a byte of the torrent lies in, in O(log files) with a binary search over the offsets.
+ * @param file - the torrent file object
+ * @param offset - the offset of the byte, index * piece_length + begin for a byte of a piece
+ * @return the index of the file, never one that is empty
+*/
+size_t torrent_file_find(const TorrentFile *file, size_t offset);
+
+/**
+ * @brief get the part of a stretch of bytes of the torrent that lies in the file its first byte
+ * is in. A stretch that runs across files is covered by calling again past the span returned.
+ * @param file - the torrent file object
+ * @param offset - the offset of the stretch, index * piece_length + begin for a block
+ * @param length - the size of the stretch, it must end within file_size
+ * @return the span, its length up to the end of the file
+*/
+FileSpan torrent_file_span(const TorrentFile *file, size_t offset, size_t length);
+
+/**
+ * @brief Create the download state for a piece
+ * @param file - the torrent file object
+ * @param index - the index of the piece
+ * @return Piece* A pointer to the newly created Piece object or null
+*/
+Piece *piece_new(TorrentFile *file, size_t index);
+
+/**
+ * @brief The memory piece_place needs for any piece of a torrent, the state of a piece and its block bitfields.
+ * @param file - the torrent file object
+ * @return size_t the number of bytes
+*/
+size_t piece_footprint(TorrentFile *file);
+
+/**
+ * @brief Create the download state for a piece in memory the caller owns, e.g. an object from a Pool.
+ * The block bitfields live in the same memory, so the piece is released with it rather than with piece_free.
+ * @param memory - piece_footprint(file) bytes, suitably aligned for any type
+ * @param file - the torrent file object
+ * @param index - the index of the piece
+ * @return Piece* the piece, at the start of memory
+*/
+Piece *piece_place(void *memory, TorrentFile *file, size_t index);
+
+/**
+ * @brief compute the geometry of a block in a piece. the returned block has no data.
+ * @param piece - the piece
+ * @param index - the index of the block in the piece
+ * @return the block
+*/
+Block piece_block(Piece *piece, size_t index);
+
+/**
+ * @brief Free the memory allocated for a Piece object
+ * @return void
+*/
+void piece_free(Piece *piece);
+
+/**
+ * @brief Free the data buffered in a Block
+ * @return void
+*/
+void block_free(Block *block);
 
 
 /**
@@ -0,0 +1,432 @@
+/**
+ * @file udp_tracker.c
+ * @brief Implementation file for announcing to and scraping udp:// trackers (BEP 15) in C.
+*/
+// for memrchr.
+#define _GNU_SOURCE
+#include "udp_tracker.h"
+#include "torrent.h"
+#include "peer.h"
+#include "log.h"
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/random.h>
+
+// the actions of a request, and of the answer to it.
+#define UDP_TRACKER_ACTION_CONNECT 0
+#define UDP_TRACKER_ACTION_ANNOUNCE 1
+#define UDP_TRACKER_ACTION_SCRAPE 2
+#define UDP_TRACKER_ACTION_ERROR 3
+
+// the size of an answer before its peers or scrapes.
+#define UDP_TRACKER_CONNECT_ANSWER 16
+#define UDP_TRACKER_ANNOUNCE_ANSWER 20
+#define UDP_TRACKER_SCRAPE_ANSWER 8
+
+// the size of an announce request, and of an answer to a scrape for every info hash.
+#define UDP_TRACKER_ANNOUNCE_REQUEST 98
+#define UDP_TRACKER_SCRAPE_ENTRY 12
+
+/**
+ * @brief draw a random number, for transaction ids and keys.
+ * @return uint32_t the number
+*/
+uint32_t udp_tracker_random(void);
+
+/**
+ * @brief write an unsigned 64 bit integer in network byte order.
+ * @param bytes Where to write it, 8 bytes
+ * @param value The integer
+ * @return void
+*/
+void udp_tracker_write_u64(unsigned char *bytes, uint64_t value);
+
+/**
+ * @brief send the request for the goal of the tracker with a fresh transaction id, or a connect
+ * first when there is no valid connection id.
+ * @param tracker The tracker, its goal set
+ * @param now The current time, from peer_now
+ * @return int UDP_TRACKER_PENDING, or UDP_TRACKER_ERR_SOCKET
+*/
+int udp_tracker_begin(UdpTracker *tracker, double now);
+
+/**
+ * @brief send the request in flight, the first time or again.
+ * @param tracker The tracker
+ * @param now The current time, from peer_now
+ * @return int UDP_TRACKER_PENDING, or UDP_TRACKER_ERR_SOCKET
+*/
+int udp_tracker_send(UdpTracker *tracker, double now);
+
+/**
+ * @brief handle one answer from the tracker.
+ * @param tracker The tracker
+ * @param answer The answer
+ * @param size The size of the answer
+ * @param now The current time, from peer_now
+ * @return int UDP_TRACKER_PENDING if more is to come or the answer was not ours, UDP_TRACKER_SUCCESS once done, or an error
+*/
+int udp_tracker_handle(UdpTracker *tracker, const unsigned char *answer, size_t size, double now);
+
+/**
+ * @brief take the peers of an answer to an announce into the response.
+ * @param tracker The tracker
+ * @param answer The answer
+ * @param size The size of the answer
+ * @return int UDP_TRACKER_SUCCESS, or UDP_TRACKER_ERR_MEMORY
+*/
+int udp_tracker_take_peers(UdpTracker *tracker, const unsigned char *answer, size_t size);
+
+/**
+ * @brief finish the request in flight and leave the tracker idle.
+ * @param tracker The tracker
+ * @param result The outcome
+ * @return int the outcome
+*/
+int udp_tracker_finish(UdpTracker *tracker, int result);
+
+bool udp_tracker_is_udp(const char *url, size_t size)
+{
+    return size >= 6 && memcmp(url, "udp://", 6) == 0;
+}
+
+int udp_tracker_open(UdpTracker *tracker, const char *url, size_t size)
+{
+    memset(tracker, 0, sizeof(UdpTracker));
+    tracker->socket = -1;
+    if (!udp_tracker_is_udp(url, size))
+        return UDP_TRACKER_ERR_ADDRESS;
+
+    // the authority runs up to the path, an IPV6 host is in brackets so its colons are not the port's.
+    const char *host = url + 6;
+    const char *end = url + size;
+    const char *path = memchr(host, '/', end - host);
+    if (path != NULL)
+        end = path;
+
+    const char *host_end;
+    const char *port;
+    if (host < end && *host == '[')
+    {
+        host++;
+        host_end = memchr(host, ']', end - host);
+        if (host_end == NULL || host_end + 1 >= end || host_end[1] != ':')
+            return UDP_TRACKER_ERR_ADDRESS;
+        port = host_end + 2;
+    }
+    else
+    {
+        host_end = memrchr(host, ':', end - host);
+        if (host_end == NULL)
+            return UDP_TRACKER_ERR_ADDRESS;
+        port = host_end + 1;
+    }
+
+    char host_name[256];
+    char port_name[8];
+    if (host_end == host || (size_t)(host_end - host) >= sizeof(host_name) || port == end ||
+        (size_t)(end - port) >= sizeof(port_name))
+        return UDP_TRACKER_ERR_ADDRESS;
+    memcpy(host_name, host, host_end - host);
+    host_name[host_end - host] = '\0';
+    memcpy(port_name, port, end - port);
+    port_name[end - port] = '\0';
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    struct addrinfo *addresses;
+    if (getaddrinfo(host_name, port_name, &hints, &addresses) != 0)
+    {
+        log_printf(LOG_WARN, "ERR: failed to resolve udp tracker %s\n", host_name);
+        return UDP_TRACKER_ERR_ADDRESS;
+    }
+
+    // a connected socket only receives from the tracker, and learns of an unreachable one from ICMP.
+    for (struct addrinfo *address = addresses; address != NULL; address = address->ai_next)
+    {
+        socket_t sock = socket(address->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+            continue;
+        if (connect(sock, address->ai_addr, address->ai_addrlen) < 0)
+        {
+            close(sock);
+            continue;
+        }
+        tracker->socket = sock;
+        tracker->type = address->ai_family == AF_INET6 ? IPV6 : IPV4;
+        break;
+    }
+    freeaddrinfo(addresses);
+
+    if (tracker->socket < 0)
+    {
+        log_printf(LOG_WARN, "ERR: failed to open a socket to udp tracker %s\n", host_name);
+        return UDP_TRACKER_ERR_SOCKET;
+    }
+    tracker->key = udp_tracker_random();
+    return UDP_TRACKER_SUCCESS;
+}
+
+void udp_tracker_close(UdpTracker *tracker)
+{
+    if (tracker->socket >= 0)
+        close(tracker->socket);
+    tracker->socket = -1;
+    tracker->stage = UDP_TRACKER_IDLE;
+}
+
+uint32_t udp_tracker_random(void)
+{
+    uint32_t value;
+    if (getrandom(&value, sizeof(value), 0) != sizeof(value))
+        value = (uint32_t)rand();
+    return value;
+}
+
+void udp_tracker_write_u64(unsigned char *bytes, uint64_t value)
+{
+    peer_write_u32(bytes, (uint32_t)(value >> 32));
+    peer_write_u32(bytes + 4, (uint32_t)value);
+}
+
+int udp_tracker_announce(UdpTracker *tracker, Torrent *torrent, const AnnounceStats *stats, Tracker_Response *response, double now)
+{
+    tracker->goal = UDP_TRACKER_ANNOUNCING;
+    tracker->torrent = torrent;
+    tracker->stats = *stats;
+    tracker->response = response;
+    tracker->retries = 0;
+    return udp_tracker_begin(tracker, now);
+}
+
+int udp_tracker_scrape(UdpTracker *tracker, const unsigned char *hashes, size_t count, UdpScrape *scrapes, double now)
+{
+    tracker->goal = UDP_TRACKER_SCRAPING;
+    tracker->hashes = hashes;
+    tracker->hash_count = count;
+    tracker->scraped = 0;
+    tracker->scrapes = scrapes;
+    tracker->retries = 0;
+    if (count == 0)
+        return UDP_TRACKER_SUCCESS;
+    return udp_tracker_begin(tracker, now);
+}
+
+int udp_tracker_begin(UdpTracker *tracker, double now)
+{
+    unsigned char *request = tracker->request;
+    tracker->transaction_id = udp_tracker_random();
+
+    if (tracker->connection_expires <= now)
+    {
+        tracker->stage = UDP_TRACKER_CONNECTING;
+        udp_tracker_write_u64(request, UDP_TRACKER_PROTOCOL_ID);
+        peer_write_u32(request + 8, UDP_TRACKER_ACTION_CONNECT);
+        memcpy(request + 12, &tracker->transaction_id, 4);
+        tracker->request_size = 16;
+        return udp_tracker_send(tracker, now);
+    }
+
+    // the connection id goes back exactly as it came, it is opaque to the client.
+    tracker->stage = tracker->goal;
+    memcpy(request, &tracker->connection_id, 8);
+    memcpy(request + 12, &tracker->transaction_id, 4);
+    if (tracker->stage == UDP_TRACKER_ANNOUNCING)
+    {
+        const AnnounceStats *stats = &tracker->stats;
+        peer_write_u32(request + 8, UDP_TRACKER_ACTION_ANNOUNCE);
+        memcpy(request + 16, tracker->torrent->info_hash, SHA_DIGEST_LENGTH);
+        memcpy(request + 36, CLIENT_PEER_ID, 20);
+        udp_tracker_write_u64(request + 56, stats->downloaded);
+        udp_tracker_write_u64(request + 64, stats->left);
+        udp_tracker_write_u64(request + 72, stats->uploaded);
+        peer_write_u32(request + 80, stats->event);
+        peer_write_u32(request + 84, 0);             // the address the request came from
+        peer_write_u32(request + 88, tracker->key);
+        peer_write_u32(request + 92, UINT32_MAX);    // -1, as many peers as the tracker likes
+        request[96] = CLIENT_PORT >> 8;
+        request[97] = CLIENT_PORT & 0xff;
+        tracker->request_size = UDP_TRACKER_ANNOUNCE_REQUEST;
+    }
+    else
+    {
+        size_t batch = tracker->hash_count - tracker->scraped;
+        if (batch > UDP_TRACKER_SCRAPE_BATCH)
+            batch = UDP_TRACKER_SCRAPE_BATCH;
+        peer_write_u32(request + 8, UDP_TRACKER_ACTION_SCRAPE);
+        memcpy(request + 16, tracker->hashes + tracker->scraped * SHA_DIGEST_LENGTH, batch * SHA_DIGEST_LENGTH);
+        tracker->request_size = 16 + batch * SHA_DIGEST_LENGTH;
+    }
+    return udp_tracker_send(tracker, now);
+}
+
+int udp_tracker_send(UdpTracker *tracker, double now)
+{
+    tracker->deadline = now + (double)(UDP_TRACKER_BASE_TIMEOUT << tracker->retries);
+    ssize_t sent = send(tracker->socket, tracker->request, tracker->request_size, MSG_NOSIGNAL);
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return udp_tracker_finish(tracker, UDP_TRACKER_ERR_SOCKET);
+    // a datagram that did not fit in the send buffer is as good as lost, the retransmit covers it.
+    return UDP_TRACKER_PENDING;
+}
+
+int udp_tracker_advance(UdpTracker *tracker, double now)
+{
+    if (tracker->stage == UDP_TRACKER_IDLE)
+        return UDP_TRACKER_SUCCESS;
+
+    unsigned char answer[UDP_TRACKER_MAX_ANSWER];
+    for (;;)
+    {
+        ssize_t received = recv(tracker->socket, answer, sizeof(answer), 0);
+        if (received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            return udp_tracker_finish(tracker, UDP_TRACKER_ERR_SOCKET);
+        }
+
+        int result = udp_tracker_handle(tracker, answer, received, now);
+        if (result != UDP_TRACKER_PENDING)
+            return result;
+    }
+
+    if (now < tracker->deadline)
+        return UDP_TRACKER_PENDING;
+    if (tracker->retries == UDP_TRACKER_MAX_RETRIES)
+        return udp_tracker_finish(tracker, UDP_TRACKER_ERR_TIMEOUT);
+
+    // a connection id that expired while its request went unanswered has to be fetched again.
+    tracker->retries++;
+    if (tracker->stage != UDP_TRACKER_CONNECTING && tracker->connection_expires <= now)
+        return udp_tracker_begin(tracker, now);
+    return udp_tracker_send(tracker, now);
+}
+
+int udp_tracker_handle(UdpTracker *tracker, const unsigned char *answer, size_t size, double now)
+{
+    // answers to an earlier request, or that are not answers at all, are dropped.
+    if (size < 8 || memcmp(answer + 4, &tracker->transaction_id, 4) != 0)
+        return UDP_TRACKER_PENDING;
+
+    uint32_t action = peer_read_u32(answer);
+    if (action == UDP_TRACKER_ACTION_ERROR)
+    {
+        log_printf(LOG_WARN, "Failure Reason: %.*s\n", (int)(size - 8), (const char *)answer + 8);
+        return udp_tracker_finish(tracker, UDP_TRACKER_ERR_REJECTED);
+    }
+
+    switch (tracker->stage)
+    {
+    case UDP_TRACKER_CONNECTING:
+        if (action != UDP_TRACKER_ACTION_CONNECT || size < UDP_TRACKER_CONNECT_ANSWER)
+            return UDP_TRACKER_PENDING;
+        memcpy(&tracker->connection_id, answer + 8, 8);
+        tracker->connection_expires = now + UDP_TRACKER_CONNECTION_TTL;
+        tracker->retries = 0;
+        return udp_tracker_begin(tracker, now);
+
+    case UDP_TRACKER_ANNOUNCING:
+        if (action != UDP_TRACKER_ACTION_ANNOUNCE || size < UDP_TRACKER_ANNOUNCE_ANSWER)
+            return UDP_TRACKER_PENDING;
+        return udp_tracker_finish(tracker, udp_tracker_take_peers(tracker, answer, size));
+
+    case UDP_TRACKER_SCRAPING:
+    {
+        if (action != UDP_TRACKER_ACTION_SCRAPE || size < UDP_TRACKER_SCRAPE_ANSWER)
+            return UDP_TRACKER_PENDING;
+
+        // a tracker may leave out the torrents it does not know past the last one it does.
+        size_t batch = (tracker->request_size - 16) / SHA_DIGEST_LENGTH;
+        size_t answered = (size - UDP_TRACKER_SCRAPE_ANSWER) / UDP_TRACKER_SCRAPE_ENTRY;
+        for (size_t i = 0; i < batch; i++)
+        {
+            UdpScrape *scrape = &tracker->scrapes[tracker->scraped + i];
+            const unsigned char *entry = answer + UDP_TRACKER_SCRAPE_ANSWER + i * UDP_TRACKER_SCRAPE_ENTRY;
+            scrape->seeders = i < answered ? peer_read_u32(entry) : 0;
+            scrape->completed = i < answered ? peer_read_u32(entry + 4) : 0;
+            scrape->leechers = i < answered ? peer_read_u32(entry + 8) : 0;
+        }
+        tracker->scraped += batch;
+        if (tracker->scraped == tracker->hash_count)
+            return udp_tracker_finish(tracker, UDP_TRACKER_SUCCESS);
+        tracker->retries = 0;
+        return udp_tracker_begin(tracker, now);
+    }
+
+    default:
+        return UDP_TRACKER_PENDING;
+    }
+}
+
+int udp_tracker_take_peers(UdpTracker *tracker, const unsigned char *answer, size_t size)
+{
+    // the peers are compact, of the address family the tracker was reached over. a cut off answer
+    // keeps the peers that made it whole.
+    Tracker_Response *response = tracker->response;
+    IPType type = tracker->type;
+    size_t length = type == IPV4 ? COMPACT_PEER_V4_LENGTH : COMPACT_PEER_V6_LENGTH;
+    size_t count = (size - UDP_TRACKER_ANNOUNCE_ANSWER) / length;
+
+    Peer *peers = malloc(sizeof(Peer) * (count > 0 ? count : 1));
+    if (peers == NULL)
+    {
+        fprintf(stderr, "ERR: could not allocate memory for peers list\n");
+        return UDP_TRACKER_ERR_MEMORY;
+    }
+
+    free(response->parsed.peers);
+    response->parsed.interval = (int)peer_read_u32(answer + 8);
+    response->parsed.peers = peers;
+    response->parsed.peers_count = put_compact_peers(answer + UDP_TRACKER_ANNOUNCE_ANSWER, count * length, type, peers);
+    response->ok = true;
+    return UDP_TRACKER_SUCCESS;
+}
+
+int udp_tracker_finish(UdpTracker *tracker, int result)
+{
+    tracker->stage = UDP_TRACKER_IDLE;
+    return result;
+}
+
+int udp_tracker_wait(UdpTracker *tracker)
+{
+    for (;;)
+    {
+        double now = peer_now();
+        int result = udp_tracker_advance(tracker, now);
+        if (result != UDP_TRACKER_PENDING)
+            return result;
+
+        struct pollfd fd = {.fd = tracker->socket, .events = POLLIN};
+        poll(&fd, 1, (int)((tracker->deadline - now) * 1000) + 1);
+    }
+}
+
+const char *udp_tracker_strerror(int result)
+{
+    switch (result)
+    {
+    case UDP_TRACKER_SUCCESS:
+        return "no error";
+    case UDP_TRACKER_PENDING:
+        return "in progress";
+    case UDP_TRACKER_ERR_MEMORY:
+        return "out of memory";
+    case UDP_TRACKER_ERR_ADDRESS:
+        return "bad tracker address";
+    case UDP_TRACKER_ERR_SOCKET:
+        return "tracker unreachable";
+    case UDP_TRACKER_ERR_TIMEOUT:
+        return "timed out";
+    case UDP_TRACKER_ERR_REJECTED:
+        return "rejected by tracker";
+    default:
+        return "unknown error";
+    }
+}
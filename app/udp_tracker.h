@@ -0,0 +1,154 @@
+#ifndef UDP_TRACKER_H
+#define UDP_TRACKER_H
+
+/**
+ * @file udp_tracker.h
+ * @brief Header file for announcing to and scraping udp:// trackers (BEP 15) in C.
+ * A request is one datagram and its answer another, with no connection to set up beyond a
+ * connection id that is fetched once and reused for a minute. Every exchange is driven by
+ * udp_tracker_advance from a non-blocking socket, so any number of trackers can be asked from one
+ * loop, and a request that goes unanswered is sent again after 15 * 2^n seconds as the spec asks.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "network.h"
+
+#define UDP_TRACKER_SUCCESS 0
+#define UDP_TRACKER_PENDING 1
+#define UDP_TRACKER_ERR_MEMORY -1
+#define UDP_TRACKER_ERR_ADDRESS -2  // the url is not a udp tracker, or its host does not resolve.
+#define UDP_TRACKER_ERR_SOCKET -3   // the tracker could not be sent to or received from.
+#define UDP_TRACKER_ERR_TIMEOUT -4  // no answer came after every retransmit.
+#define UDP_TRACKER_ERR_REJECTED -5 // the tracker answered with an error.
+
+// the magic constant a connect request starts with.
+#define UDP_TRACKER_PROTOCOL_ID 0x41727101980ULL
+
+// how long a connection id may be used after it was received, in seconds.
+#define UDP_TRACKER_CONNECTION_TTL 60
+
+// how long to wait on the first answer to a request, in seconds. it doubles with every retransmit.
+#define UDP_TRACKER_BASE_TIMEOUT 15
+
+// how many times a request is sent again before giving up. BEP 15 allows 8, which is over an hour.
+#define UDP_TRACKER_MAX_RETRIES 2
+
+// the most info hashes a single scrape request carries, so it fits in one unfragmented datagram.
+#define UDP_TRACKER_SCRAPE_BATCH 74
+
+// the largest request, a scrape of a full batch.
+#define UDP_TRACKER_MAX_REQUEST (16 + UDP_TRACKER_SCRAPE_BATCH * SHA_DIGEST_LENGTH)
+
+// the largest answer read, anything past it is cut off. it fits about 1300 IPV4 peers.
+#define UDP_TRACKER_MAX_ANSWER 8192
+
+typedef enum {
+    UDP_TRACKER_IDLE,        // nothing in flight.
+    UDP_TRACKER_CONNECTING,  // waiting on a connection id.
+    UDP_TRACKER_ANNOUNCING,  // waiting on the answer to an announce.
+    UDP_TRACKER_SCRAPING     // waiting on the answer to a batch of a scrape.
+} UdpTrackerStage;
+
+// what a tracker knows about one torrent, from a scrape.
+typedef struct {
+    uint32_t seeders;
+    uint32_t completed;     // the number of times the torrent was downloaded in full.
+    uint32_t leechers;
+} UdpScrape;
+
+typedef struct {
+    socket_t socket;            // connected to the tracker and non-blocking, -1 if not open.
+    IPType type;                // the address family the tracker was reached over, and of the peers it answers with.
+    uint64_t connection_id;     // in network byte order, as it was received.
+    double connection_expires;  // when the connection id stops being valid, 0 without one. from peer_now.
+    UdpTrackerStage stage;      // what is in flight.
+    UdpTrackerStage goal;       // what a connect in flight is for, an announce or a scrape.
+    uint32_t transaction_id;    // of the request in flight, as it was sent.
+    uint32_t key;               // sent with every announce, so the tracker knows us across addresses.
+    unsigned retries;           // how many times the request in flight was sent again.
+    double deadline;            // when the request in flight is sent again, from peer_now.
+    unsigned char request[UDP_TRACKER_MAX_REQUEST]; // the request in flight, for retransmits.
+    size_t request_size;
+    Torrent *torrent;           // the torrent an announce is for.
+    AnnounceStats stats;        // what the announce reports.
+    Tracker_Response *response; // where an announce puts its answer.
+    const unsigned char *hashes; // the info hashes to scrape, SHA_DIGEST_LENGTH bytes each.
+    size_t hash_count;
+    size_t scraped;             // how many of them are scraped so far, batches go out one after another.
+    UdpScrape *scrapes;         // where a scrape puts its answer, one for each info hash.
+} UdpTracker;
+
+/**
+ * @brief Resolve a udp:// tracker url and open a socket to it. Nothing is sent yet.
+ * @param tracker The tracker
+ * @param url The url, e.g. "udp://tracker.example.org:6969/announce"
+ * @param size The size of the url
+ * @return int UDP_TRACKER_SUCCESS, UDP_TRACKER_ERR_ADDRESS or UDP_TRACKER_ERR_SOCKET
+*/
+int udp_tracker_open(UdpTracker *tracker, const char *url, size_t size);
+
+/**
+ * @brief Close the socket of a tracker, dropping whatever is in flight.
+ * @param tracker The tracker
+ * @return void
+*/
+void udp_tracker_close(UdpTracker *tracker);
+
+/**
+ * @brief Tell whether a url is one of a udp tracker.
+ * @param url The url
+ * @param size The size of the url
+ * @return bool true if the url starts with udp://
+*/
+bool udp_tracker_is_udp(const char *url, size_t size);
+
+/**
+ * @brief Start an announce, see udp_tracker_advance to see it through.
+ * @param tracker The tracker, idle
+ * @param torrent The torrent to announce
+ * @param stats What to report about the transfer
+ * @param response Where the answer goes, from tracker_response_new. ok is set once it arrived
+ * @param now The current time, from peer_now
+ * @return int UDP_TRACKER_PENDING, or UDP_TRACKER_ERR_SOCKET
+*/
+int udp_tracker_announce(UdpTracker *tracker, Torrent *torrent, const AnnounceStats *stats, Tracker_Response *response, double now);
+
+/**
+ * @brief Start a scrape of any number of torrents, sent UDP_TRACKER_SCRAPE_BATCH info hashes at a time.
+ * See udp_tracker_advance to see it through.
+ * @param tracker The tracker, idle
+ * @param hashes The info hashes, SHA_DIGEST_LENGTH bytes each. they must outlive the scrape
+ * @param count The number of info hashes
+ * @param scrapes Where the answer goes, one for each info hash
+ * @param now The current time, from peer_now
+ * @return int UDP_TRACKER_PENDING, or UDP_TRACKER_ERR_SOCKET
+*/
+int udp_tracker_scrape(UdpTracker *tracker, const unsigned char *hashes, size_t count, UdpScrape *scrapes, double now);
+
+/**
+ * @brief Move the request in flight along: take every answer that arrived and send again what
+ * timed out. Call it when the socket turns readable or the deadline passed.
+ * @param tracker The tracker
+ * @param now The current time, from peer_now
+ * @return int UDP_TRACKER_PENDING while in flight, UDP_TRACKER_SUCCESS once done, or an error.
+ * The tracker is idle again unless it is pending
+*/
+int udp_tracker_advance(UdpTracker *tracker, double now);
+
+/**
+ * @brief Block until the request in flight is done.
+ * @param tracker The tracker
+ * @return int UDP_TRACKER_SUCCESS, or an error
+*/
+int udp_tracker_wait(UdpTracker *tracker);
+
+/**
+ * @brief Describe the outcome of a request.
+ * @param result What udp_tracker_advance returned
+ * @return const char* the description
+*/
+const char *udp_tracker_strerror(int result);
+
+#endif
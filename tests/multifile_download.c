@@ -0,0 +1,512 @@
+/**
+ * @file multifile_download.c
+ * @brief Download a multi-file torrent whose files end in the middle of blocks, from a seeder on the loopback interface.
+ * Almost every block runs across two files, so it is received through the input buffer and written in
+ * parts rather than straight into place, and the seeder answers requests back to back so each read
+ * finds more of them. The tracker and the seeder run on threads of this program, the client is the
+ * built binary, run as a child. Every file it writes must hold exactly the bytes of the torrent, and
+ * a recheck of them must pass until a byte of one file is changed.
+ * The client is built as your_bittorrent.sh builds it, into /tmp/bittorrent here:
+ *
+ *   gcc tests/multifile_download.c -o /tmp/multifile_download -lcrypto -lpthread
+ *   /tmp/multifile_download /tmp/bittorrent
+*/
+// for nftw.
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <ftw.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+
+// the bytes of the torrent, spread over its files.
+#define TEST_TOTAL_LENGTH 1000000
+
+// the length of every file but the last, chosen so that files end in the middle of blocks.
+#define TEST_FILE_LENGTH 7001
+
+// the piece length of the torrent, four blocks.
+#define TEST_PIECE_LENGTH 65536
+
+// the largest block the client may request.
+#define TEST_MAX_BLOCK 16384
+
+// the message ids the seeder sends and answers.
+#define TEST_BITFIELD 5
+#define TEST_UNCHOKE 1
+#define TEST_REQUEST 6
+#define TEST_PIECE 7
+
+// the seconds the client is given to download the torrent.
+#define TEST_TIMEOUT "60"
+
+// the file a byte is changed in before the last recheck, its first bytes end a piece that runs across files.
+#define TEST_DAMAGED_FILE "f0009.bin"
+
+// what the seeder serves and the tracker points at.
+typedef struct {
+    unsigned char *data;
+    unsigned char info_hash[SHA_DIGEST_LENGTH];
+    int tracker_fd;
+    int seeder_fd;
+    uint16_t seeder_port;
+} TestSwarm;
+
+/**
+ * @brief append bytes to a growing buffer, exiting if it cannot grow.
+ * @param buffer The buffer
+ * @param length Its length, advanced
+ * @param bytes What to append
+ * @param size The number of bytes
+ * @return void
+*/
+void test_append(char **buffer, size_t *length, const void *bytes, size_t size);
+
+/**
+ * @brief the bencoded info dictionary of the torrent.
+ * @param data The bytes of the torrent
+ * @param length Set to the length of the dictionary
+ * @return char* the dictionary, to be freed
+*/
+char *test_info_dictionary(const unsigned char *data, size_t *length);
+
+/**
+ * @brief listen on an ephemeral port of the loopback interface.
+ * @param port Set to the port
+ * @return int the listening socket, exits on failure
+*/
+int test_listen(uint16_t *port);
+
+/**
+ * @brief read exactly a number of bytes.
+ * @param fd The socket
+ * @param buffer Where the bytes go
+ * @param size The number of bytes
+ * @return bool false if the connection ended first
+*/
+bool test_read(int fd, void *buffer, size_t size);
+
+/**
+ * @brief write exactly a number of bytes.
+ * @param fd The socket
+ * @param buffer The bytes
+ * @param size The number of bytes
+ * @return bool false if the connection ended first
+*/
+bool test_write(int fd, const void *buffer, size_t size);
+
+/**
+ * @brief answer every announce with the seeder as the only peer.
+ * @param arg The swarm
+ * @return void* NULL, it runs until the program exits
+*/
+void *test_tracker(void *arg);
+
+/**
+ * @brief accept connections from the client, each served on its own thread.
+ * @param arg The swarm
+ * @return void* NULL, it runs until the program exits
+*/
+void *test_seeder(void *arg);
+
+/**
+ * @brief handshake with the client, then answer its requests until it disconnects.
+ * @param arg The swarm and the socket, to be freed
+ * @return void* NULL
+*/
+void *test_serve_peer(void *arg);
+
+/**
+ * @brief run the client as a child and wait for it, giving it TEST_TIMEOUT seconds.
+ * @param client The client binary
+ * @param arguments The command and its arguments, with a NULL after the last
+ * @return int the exit status of the client, -1 if it could not be run or did not exit
+*/
+int test_run(const char *client, const char *const *arguments);
+
+/**
+ * @brief change the first byte of a file.
+ * @param path The path of the file
+ * @return bool whether the byte was changed
+*/
+bool test_damage(const char *path);
+
+/**
+ * @brief compare the files the client wrote with the bytes of the torrent.
+ * @param root The directory the torrent was downloaded to
+ * @param data The bytes of the torrent
+ * @return int the number of files that differ
+*/
+int test_compare_files(const char *root, const unsigned char *data);
+
+/**
+ * @brief remove a file or directory, for nftw.
+ * @param path The path
+ * @param stats Unused
+ * @param type Unused
+ * @param walk Unused
+ * @return int the result of remove
+*/
+int test_remove(const char *path, const struct stat *stats, int type, struct FTW *walk);
+
+void test_append(char **buffer, size_t *length, const void *bytes, size_t size)
+{
+    char *grown = realloc(*buffer, *length + size);
+    if (grown == NULL)
+    {
+        fprintf(stderr, "ERR: failed to allocate memory for the torrent\n");
+        exit(1);
+    }
+    memcpy(grown + *length, bytes, size);
+    *buffer = grown;
+    *length += size;
+}
+
+char *test_info_dictionary(const unsigned char *data, size_t *length)
+{
+    char *info = NULL;
+    char text[64];
+    *length = 0;
+    test_append(&info, length, "d5:filesl", 9);
+    for (size_t offset = 0, index = 0; offset < TEST_TOTAL_LENGTH; offset += TEST_FILE_LENGTH, index++)
+    {
+        size_t size = TEST_TOTAL_LENGTH - offset < TEST_FILE_LENGTH ? TEST_TOTAL_LENGTH - offset : TEST_FILE_LENGTH;
+        int n = snprintf(text, sizeof(text), "d6:lengthi%zue4:pathl9:f%04zu.binee", size, index);
+        test_append(&info, length, text, n);
+    }
+    int n = snprintf(text, sizeof(text), "e4:name3:odd12:piece lengthi%de6:pieces%zu:",
+                     TEST_PIECE_LENGTH, (size_t)(TEST_TOTAL_LENGTH + TEST_PIECE_LENGTH - 1) / TEST_PIECE_LENGTH * SHA_DIGEST_LENGTH);
+    test_append(&info, length, text, n);
+    for (size_t offset = 0; offset < TEST_TOTAL_LENGTH; offset += TEST_PIECE_LENGTH)
+    {
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        size_t size = TEST_TOTAL_LENGTH - offset < TEST_PIECE_LENGTH ? TEST_TOTAL_LENGTH - offset : TEST_PIECE_LENGTH;
+        SHA1(data + offset, size, hash);
+        test_append(&info, length, hash, sizeof(hash));
+    }
+    test_append(&info, length, "e", 1);
+    return info;
+}
+
+int test_listen(uint16_t *port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t size = sizeof(address);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&address, size) != 0 || listen(fd, 16) != 0 ||
+        getsockname(fd, (struct sockaddr *)&address, &size) != 0)
+    {
+        fprintf(stderr, "ERR: failed to listen on the loopback interface\n");
+        exit(1);
+    }
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+bool test_read(int fd, void *buffer, size_t size)
+{
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t n = recv(fd, (char *)buffer + done, size - done, 0);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+bool test_write(int fd, const void *buffer, size_t size)
+{
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t n = send(fd, (const char *)buffer + done, size - done, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+void *test_tracker(void *arg)
+{
+    TestSwarm *swarm = arg;
+    int client;
+    while ((client = accept(swarm->tracker_fd, NULL, NULL)) >= 0)
+    {
+        // the request is read up to the blank line that ends its headers, whatever it asks.
+        char request[4096];
+        size_t length = 0;
+        while (length < sizeof(request) - 1)
+        {
+            ssize_t n = recv(client, request + length, sizeof(request) - 1 - length, 0);
+            if (n <= 0)
+                break;
+            length += n;
+            request[length] = '\0';
+            if (strstr(request, "\r\n\r\n") != NULL)
+                break;
+        }
+
+        char body[] = "d8:intervali60e5:peers6:\x7f\0\0\x01??e";
+        body[sizeof(body) - 4] = swarm->seeder_port >> 8;
+        body[sizeof(body) - 3] = swarm->seeder_port & 0xff;
+        char header[64];
+        int n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Length: %zu\r\n\r\n", sizeof(body) - 1);
+        if (test_write(client, header, n))
+            test_write(client, body, sizeof(body) - 1);
+        close(client);
+    }
+    return NULL;
+}
+
+void *test_seeder(void *arg)
+{
+    TestSwarm *swarm = arg;
+    int client;
+    while ((client = accept(swarm->seeder_fd, NULL, NULL)) >= 0)
+    {
+        void **peer = malloc(2 * sizeof(void *));
+        pthread_t thread;
+        if (peer == NULL)
+        {
+            close(client);
+            continue;
+        }
+        peer[0] = swarm;
+        peer[1] = (void *)(intptr_t)client;
+        if (pthread_create(&thread, NULL, test_serve_peer, peer) != 0)
+        {
+            close(client);
+            free(peer);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+void *test_serve_peer(void *arg)
+{
+    void **peer = arg;
+    TestSwarm *swarm = peer[0];
+    int fd = (int)(intptr_t)peer[1];
+    free(peer);
+
+    unsigned char handshake[68];
+    if (!test_read(fd, handshake, sizeof(handshake)) || memcmp(handshake + 28, swarm->info_hash, SHA_DIGEST_LENGTH) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    memcpy(handshake + 48, "-TS0001-multifile---", 20);
+    memset(handshake + 20, 0, 8);
+
+    // the seeder has every piece: the bitfield is all ones but for the bits past the last piece.
+    size_t pieces = (TEST_TOTAL_LENGTH + TEST_PIECE_LENGTH - 1) / TEST_PIECE_LENGTH;
+    unsigned char greeting[5 + (pieces + 7) / 8 + 5];
+    size_t bitfield_length = (pieces + 7) / 8;
+    greeting[0] = 0, greeting[1] = 0, greeting[2] = 0, greeting[3] = bitfield_length + 1, greeting[4] = TEST_BITFIELD;
+    memset(greeting + 5, 0, bitfield_length);
+    for (size_t i = 0; i < pieces; i++)
+        greeting[5 + i / 8] |= 0x80 >> (i % 8);
+    memcpy(greeting + 5 + bitfield_length, (unsigned char[]){ 0, 0, 0, 1, TEST_UNCHOKE }, 5);
+    if (!test_write(fd, handshake, sizeof(handshake)) || !test_write(fd, greeting, sizeof(greeting)))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    unsigned char *message = malloc(13 + TEST_MAX_BLOCK);
+    unsigned char header[4];
+    while (message != NULL && test_read(fd, header, sizeof(header)))
+    {
+        uint32_t length = (uint32_t)header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+        if (length > 13 + TEST_MAX_BLOCK || !test_read(fd, message, length))
+            break;
+        if (length != 13 || message[0] != TEST_REQUEST)
+            continue;
+
+        uint32_t index = (uint32_t)message[1] << 24 | message[2] << 16 | message[3] << 8 | message[4];
+        uint32_t begin = (uint32_t)message[5] << 24 | message[6] << 16 | message[7] << 8 | message[8];
+        uint32_t size = (uint32_t)message[9] << 24 | message[10] << 16 | message[11] << 8 | message[12];
+        size_t offset = (size_t)index * TEST_PIECE_LENGTH + begin;
+        if (size > TEST_MAX_BLOCK || offset + size > TEST_TOTAL_LENGTH)
+            break;
+
+        // the answer reuses the request: its index and begin stay where they are.
+        uint32_t answer = 9 + size;
+        unsigned char prefix[5] = { answer >> 24, answer >> 16, answer >> 8, answer, TEST_PIECE };
+        memcpy(message + 9, swarm->data + offset, size);
+        if (!test_write(fd, prefix, sizeof(prefix)) || !test_write(fd, message + 1, 8 + size))
+            break;
+    }
+    free(message);
+    close(fd);
+    return NULL;
+}
+
+int test_run(const char *client, const char *const *arguments)
+{
+    const char *argv[8] = { "timeout", TEST_TIMEOUT, client };
+    size_t argc = 3;
+    while (*arguments != NULL && argc + 1 < sizeof(argv) / sizeof(argv[0]))
+    {
+        argv[argc++] = *arguments++;
+    }
+    argv[argc] = NULL;
+
+    pid_t child = fork();
+    if (child == 0)
+    {
+        execvp(argv[0], (char *const *)argv);
+        _exit(127);
+    }
+    int status;
+    if (child < 0 || waitpid(child, &status, 0) != child)
+    {
+        fprintf(stderr, "ERR: failed to run %s\n", client);
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+bool test_damage(const char *path)
+{
+    FILE *file = fopen(path, "r+b");
+    if (file == NULL)
+        return false;
+    int byte = fgetc(file);
+    bool damaged = byte != EOF && fseek(file, 0, SEEK_SET) == 0 && fputc(byte ^ 0xff, file) != EOF;
+    return fclose(file) == 0 && damaged;
+}
+
+int test_compare_files(const char *root, const unsigned char *data)
+{
+    int failures = 0;
+    unsigned char *contents = malloc(TEST_FILE_LENGTH);
+    for (size_t offset = 0, index = 0; contents != NULL && offset < TEST_TOTAL_LENGTH; offset += TEST_FILE_LENGTH, index++)
+    {
+        size_t size = TEST_TOTAL_LENGTH - offset < TEST_FILE_LENGTH ? TEST_TOTAL_LENGTH - offset : TEST_FILE_LENGTH;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/f%04zu.bin", root, index);
+        FILE *file = fopen(path, "rb");
+        bool same = file != NULL && fread(contents, 1, size, file) == size && fgetc(file) == EOF &&
+                    memcmp(contents, data + offset, size) == 0;
+        if (file != NULL)
+            fclose(file);
+        if (!same)
+        {
+            fprintf(stderr, "ERR: %s does not hold bytes %zu to %zu of the torrent\n", path, offset, offset + size);
+            failures++;
+        }
+    }
+    free(contents);
+    return contents == NULL ? 1 : failures;
+}
+
+int test_remove(const char *path, const struct stat *stats, int type, struct FTW *walk)
+{
+    (void)stats, (void)type, (void)walk;
+    return remove(path);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: multifile_download <bittorrent binary>\n");
+        return 1;
+    }
+
+    TestSwarm swarm;
+    swarm.data = malloc(TEST_TOTAL_LENGTH);
+    if (swarm.data == NULL)
+        return 1;
+    uint64_t state = 0x9e3779b97f4a7c15;
+    for (size_t i = 0; i < TEST_TOTAL_LENGTH; i++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        swarm.data[i] = state >> 56;
+    }
+
+    uint16_t tracker_port;
+    swarm.tracker_fd = test_listen(&tracker_port);
+    swarm.seeder_fd = test_listen(&swarm.seeder_port);
+
+    size_t info_length;
+    char *info = test_info_dictionary(swarm.data, &info_length);
+    SHA1((unsigned char *)info, info_length, swarm.info_hash);
+
+    char directory[] = "/tmp/multifile_download.XXXXXX";
+    if (mkdtemp(directory) == NULL)
+    {
+        fprintf(stderr, "ERR: failed to create a directory for the test\n");
+        return 1;
+    }
+    char torrent_path[sizeof(directory) + 16], output_path[sizeof(directory) + 16];
+    snprintf(torrent_path, sizeof(torrent_path), "%s/odd.torrent", directory);
+    snprintf(output_path, sizeof(output_path), "%s/odd", directory);
+
+    char announce[64];
+    int announce_length = snprintf(announce, sizeof(announce), "http://127.0.0.1:%u/announce", tracker_port);
+    FILE *torrent = fopen(torrent_path, "wb");
+    if (torrent == NULL)
+    {
+        fprintf(stderr, "ERR: failed to write the torrent\n");
+        return 1;
+    }
+    fprintf(torrent, "d8:announce%d:%s4:info", announce_length, announce);
+    fwrite(info, 1, info_length, torrent);
+    fputc('e', torrent);
+    fclose(torrent);
+    free(info);
+
+    pthread_t tracker, seeder;
+    if (pthread_create(&tracker, NULL, test_tracker, &swarm) != 0 || pthread_create(&seeder, NULL, test_seeder, &swarm) != 0)
+    {
+        fprintf(stderr, "ERR: failed to start the swarm\n");
+        return 1;
+    }
+
+    int failures = 0;
+    const char *download[] = { "download", "-o", output_path, torrent_path, NULL };
+    if (test_run(argv[1], download) != 0)
+    {
+        fprintf(stderr, "ERR: the download failed\n");
+        failures++;
+    }
+    failures += test_compare_files(output_path, swarm.data);
+
+    // the pieces that run across files are hashed from a copy, a changed byte in one must be found.
+    const char *recheck[] = { "recheck", torrent_path, output_path, NULL };
+    if (test_run(argv[1], recheck) != 0)
+    {
+        fprintf(stderr, "ERR: the recheck of the download failed\n");
+        failures++;
+    }
+    char damaged_path[sizeof(output_path) + sizeof(TEST_DAMAGED_FILE)];
+    snprintf(damaged_path, sizeof(damaged_path), "%s/%s", output_path, TEST_DAMAGED_FILE);
+    if (!test_damage(damaged_path) || test_run(argv[1], recheck) != 1)
+    {
+        fprintf(stderr, "ERR: the recheck passed with %s changed\n", damaged_path);
+        failures++;
+    }
+    // what failed is kept to look at.
+    if (failures > 0)
+    {
+        printf("FAIL: %d failures, files in %s\n", failures, directory);
+        return 1;
+    }
+    nftw(directory, test_remove, 16, FTW_DEPTH | FTW_PHYS);
+    printf("PASS\n");
+    return 0;
+}